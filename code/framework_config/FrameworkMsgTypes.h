@@ -19,14 +19,17 @@ extern "C" {
 #include <bluetooth/bluetooth.h>
 
 #include "Framework.h"
+#include "msg_trace.h"
 
 /******************************************************************************/
 /* Project Specific Message Types                                             */
 /******************************************************************************/
 typedef struct JsonMsg {
 	FwkMsgHeader_t header;
+	MSG_TRACE_FIELD
 	size_t size; /** number of bytes */
 	size_t length; /** of the data */
+	int64_t timestamp; /** timeServiceUptimeMs() when queued for the cloud */
 	char topic[128];
 	char buffer[];
 } JsonMsg_t;
@@ -38,6 +41,7 @@ typedef struct Ad {
 
 typedef struct AdvMsg {
 	FwkMsgHeader_t header;
+	MSG_TRACE_FIELD
 	bt_addr_le_t addr;
 	int8_t rssi;
 	uint8_t type;
@@ -47,6 +51,7 @@ CHECK_FWK_MSG_SIZE(AdvMsg_t);
 
 typedef struct BL654SensorMsg {
 	FwkMsgHeader_t header;
+	MSG_TRACE_FIELD
 	float temperatureC; /* xx.xxC format */
 	float humidityPercent; /* xx.xx% format */
 	float pressurePa; /* x.xPa format */
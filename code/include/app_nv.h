@@ -0,0 +1,64 @@
+/**
+ * @file app_nv.h
+ * @brief Small records kept in flash across resets (NVS).
+ *
+ * Each user of the storage owns an ID.  Records are written whole; NVS
+ * spreads the writes across the sectors of the partition.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __APP_NV_H__
+#define __APP_NV_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+/* IDs must not be reused for a different record (0 is reserved) */
+enum app_nv_id {
+	APP_NV_ID_RESERVED = 0,
+	APP_NV_ID_COAP_BLOCK_RESUME,
+	APP_NV_ID_FOTA_STAGE,
+	APP_NV_ID_DNS_CACHE,
+	/* One per enum cloud_credential, in order */
+	APP_NV_ID_CLOUD_CA,
+	APP_NV_ID_CLOUD_CERT,
+	APP_NV_ID_CLOUD_KEY,
+	APP_NV_ID_CLOUD_PSK,
+	APP_NV_ID_CLOUD_PSK_ID,
+};
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+int appNvInit(void);
+
+/**
+ * @retval Length of the record, -ENOENT if it doesn't exist or a negative
+ * error code.  A record longer than len is truncated.
+ */
+int appNvRead(enum app_nv_id id, void *data, size_t len);
+
+/**
+ * @brief Writing the same contents again doesn't use flash.
+ */
+int appNvWrite(enum app_nv_id id, const void *data, size_t len);
+
+int appNvDelete(enum app_nv_id id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __APP_NV_H__ */
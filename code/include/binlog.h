@@ -0,0 +1,116 @@
+/**
+ * @file binlog.h
+ * @brief Deferred binary logging for hot paths.
+ *
+ * Records hold a pointer to the format string and the raw (integer)
+ * arguments.  Formatting is deferred to a low priority thread, the shell,
+ * or the host (using the format address and the ELF file).
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __BINLOG_H__
+#define __BINLOG_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+#ifdef CONFIG_BINLOG
+
+struct binlog_record {
+	uint32_t timestamp; /* hardware cycles */
+	const char *fmt;
+	uint8_t nargs;
+	uint32_t args[CONFIG_BINLOG_MAX_ARGS];
+};
+
+/* Arguments are stored as 32-bit words.  Strings must be static (literals or
+ * string tables) because only the pointer is stored.
+ */
+#define BINLOG_ARG(x) ((uint32_t)(uintptr_t)(x))
+#define BINLOG_STR(s) BINLOG_ARG(s)
+
+#define BINLOG_NARGS(...)                                                      \
+	(sizeof((uint32_t[]){ 0, ##__VA_ARGS__ }) / sizeof(uint32_t) - 1)
+
+#define BINLOG(_fmt, ...)                                                      \
+	binlogWrite(_fmt, BINLOG_NARGS(__VA_ARGS__),                           \
+		    (const uint32_t[]){ 0, ##__VA_ARGS__ } + 1)
+
+/* Hot path debug messages go to the binary log when it is enabled. */
+#define BINLOG_DBG(_fmt, ...) BINLOG(_fmt, ##__VA_ARGS__)
+
+struct binlog_stats {
+	uint32_t writes;
+	uint32_t dropped;
+	uint32_t truncated;
+	/* Cost of binlogWrite in hardware cycles */
+	uint32_t min_cycles;
+	uint32_t max_cycles;
+	uint64_t total_cycles;
+};
+
+/* Called for each record read from the ring */
+typedef void (*binlog_reader_t)(const struct binlog_record *record,
+				void *context);
+
+#else
+
+#define BINLOG_STR(s) (s)
+#define BINLOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+#endif /* CONFIG_BINLOG */
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+#ifdef CONFIG_BINLOG
+/**
+ * @brief Add a record to the ring.  Safe to call from any context.
+ * The oldest records are overwritten when the ring is full.
+ *
+ * @param fmt printf style format string (must be static)
+ * @param nargs number of arguments
+ * @param args argument words
+ */
+void binlogWrite(const char *fmt, size_t nargs, const uint32_t *args);
+
+/**
+ * @brief Read records that have not been consumed yet.
+ * Must not be called from an ISR.
+ *
+ * @param reader called for each record
+ * @param context passed to reader
+ * @param max maximum number of records to read (0 for all)
+ *
+ * @retval number of records read
+ */
+size_t binlogRead(binlog_reader_t reader, void *context, size_t max);
+
+/**
+ * @brief Format a record into a string.
+ *
+ * @retval number of characters written (excluding terminator)
+ */
+int binlogFormat(const struct binlog_record *record, char *buf, size_t size);
+
+void binlogGetStats(struct binlog_stats *stats);
+void binlogResetStats(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BINLOG_H__ */
@@ -0,0 +1,49 @@
+/**
+ * @file cell_notify.h
+ * @brief Rate limited updates of the BLE cellular service.
+ *
+ * Modem values are stored and marked dirty instead of being written to the
+ * cellular service (and notified) right away.  Dirty values are written
+ * together, at most once per CONFIG_CELL_NOTIFY_MIN_INTERVAL_MS.  RSSI and
+ * SINR are only marked dirty when they change by at least their threshold
+ * since the value last written.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __CELL_NOTIFY_H__
+#define __CELL_NOTIFY_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mdm_hl7800_apn;
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+void cellNotifyInit(void);
+
+void cellNotifySetNetworkState(uint8_t state);
+void cellNotifySetStartupState(uint8_t state);
+void cellNotifySetSleepState(uint8_t state);
+void cellNotifySetApn(struct mdm_hl7800_apn *apn);
+void cellNotifySetRssi(int rssi);
+void cellNotifySetSinr(int sinr);
+void cellNotifySetRat(uint8_t rat);
+void cellNotifySetBands(const char *bands);
+void cellNotifySetActiveBands(const char *bands);
+void cellNotifySetFwVersion(const char *version);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CELL_NOTIFY_H__ */
@@ -0,0 +1,98 @@
+/**
+ * @file cloud.h
+ * @brief Cloud pipeline shared by the MQTT (AWS) and CoAP (LwM2M) builds.
+ *
+ * The cloud thread takes messages from the cloud queue, groups them into
+ * batches and publishes them with the selected transport.  A batch that
+ * can't be sent is kept and sent again after reconnecting (store and
+ * forward); new messages wait in the cloud queue meanwhile.  Messages
+ * carrying JSON (JsonMsg_t) are published to their topic and
+ * FMC_AWS_KEEP_ALIVE sends a keep-alive.
+ *
+ * When the time service is synced, the time each JSON object was queued is
+ * added to it as "ts" (milliseconds since 1970, UTC).  All messages of a
+ * batch are converted with the same time model.  Producers leave
+ * CLOUD_TIMESTAMP_SIZE bytes free in the buffer for it.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __CLOUD_H__
+#define __CLOUD_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include "cloud_transport.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+/* "ts":<13 digits>, and a terminator */
+#define CLOUD_TIMESTAMP_SIZE 24
+
+/* Certificates and keys for MQTT, a pre-shared key for CoAP */
+enum cloud_credential {
+	CLOUD_CREDENTIAL_CA = 0,
+	CLOUD_CREDENTIAL_CERT,
+	CLOUD_CREDENTIAL_KEY,
+	CLOUD_CREDENTIAL_PSK,
+	CLOUD_CREDENTIAL_PSK_ID,
+	CLOUD_CREDENTIAL_COUNT
+};
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+void cloudInit(void);
+
+/**
+ * @brief Start connecting with the given configuration.  The configuration
+ * must remain valid until cloudStop().  With CONFIG_CLOUD_AUTOSTART this is
+ * called when LTE is first ready, with CONFIG_CLOUD_HOST and the saved
+ * credentials.
+ *
+ * @retval 0, -EALREADY if running or a negative error code from the transport
+ */
+int cloudStart(const struct cloud_transport_config *cfg);
+
+/**
+ * @brief Disconnect.  Queued messages are kept.  Returns once the cloud
+ * thread has stopped using the transport (unless called from that thread).
+ */
+void cloudStop(void);
+
+#ifdef CONFIG_CLOUD_AUTOSTART
+/**
+ * @brief Save a credential used when connecting at boot.  PEM data must
+ * include its terminating NUL.
+ */
+int cloudSaveCredential(enum cloud_credential which, const void *data,
+			size_t len);
+#endif
+
+/**
+ * @brief Subscribe now (if connected) and after each reconnect.
+ */
+int cloudSubscribe(const char *topic);
+
+void cloudRegisterRxCallback(cloud_rx_callback_t callback);
+
+bool cloudIsConnected(void);
+
+/**
+ * @brief Called when the LTE connection is ready.  A reconnect that is
+ * waiting for its backoff delay is attempted right away.
+ */
+void cloudOnLteReady(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CLOUD_H__ */
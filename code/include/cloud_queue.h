@@ -0,0 +1,63 @@
+/**
+ * @file cloud_queue.h
+ * @brief Queue of messages waiting to be sent to the cloud.
+ *
+ * Producers are told when the queue is full instead of the framework
+ * asserting.  Advertisements are low priority; they are rejected once the
+ * queue reaches CONFIG_CLOUD_PURGE_THRESHOLD, are evicted to make room for
+ * other messages when the queue is full, and are taken after the normal
+ * priority messages.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __CLOUD_QUEUE_H__
+#define __CLOUD_QUEUE_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+
+#include "Framework.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+#define CLOUD_QUEUE_PUT_TIMEOUT K_MSEC(CONFIG_CLOUD_QUEUE_PUT_TIMEOUT_MS)
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Add a message to the cloud queue.
+ *
+ * @param pMsg message allocated from the message pool.  It is freed if it
+ * can't be queued.
+ * @param timeout how long a normal priority message can wait for space.
+ * Low priority messages never wait.
+ *
+ * @retval 0 on success, -ENOBUFS if the message was shed or the queue stayed
+ * full for the timeout.
+ */
+int cloudQueuePut(FwkMsg_t *pMsg, k_timeout_t timeout);
+
+/**
+ * @brief Take the next message from the cloud queue.
+ *
+ * @retval 0 on success, -EAGAIN if the queue was empty for the timeout.
+ */
+int cloudQueueGet(FwkMsg_t **ppMsg, k_timeout_t timeout);
+
+uint32_t cloudQueueDepth(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CLOUD_QUEUE_H__ */
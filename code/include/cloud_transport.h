@@ -0,0 +1,109 @@
+/**
+ * @file cloud_transport.h
+ * @brief Interface between the cloud pipeline and a protocol (MQTT, CoAP).
+ *
+ * The pipeline (cloud.h) owns queuing, batching, retries and metrics.  A
+ * transport only moves bytes: it connects, publishes a batch of messages,
+ * subscribes and delivers received messages through a callback.  All
+ * functions are called from the cloud thread.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __CLOUD_TRANSPORT_H__
+#define __CLOUD_TRANSPORT_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+/* The strings and buffers must remain valid while the pipeline runs.
+ * Without credentials (ca or psk NULL) the transport connects without
+ * security; this is intended for testing against a local server.
+ */
+struct cloud_transport_config {
+	const char *host;
+	uint16_t port;
+	const char *client_id;
+
+	/* Certificate authentication (MQTT/TLS) */
+	const uint8_t *ca;
+	size_t ca_len;
+	const uint8_t *cert;
+	size_t cert_len;
+	const uint8_t *key;
+	size_t key_len;
+
+	/* Pre-shared key (CoAP/DTLS) */
+	const uint8_t *psk;
+	size_t psk_len;
+	const char *psk_id;
+};
+
+/* For MQTT the topic is the topic.  For CoAP it is the URI path. */
+struct cloud_publish {
+	const char *topic;
+	const uint8_t *data;
+	size_t len;
+};
+
+typedef void (*cloud_rx_callback_t)(const char *topic, const uint8_t *data,
+				    size_t len);
+
+/* Functions return 0 on success or a negative errno. */
+struct cloud_transport {
+	const char *name;
+
+	int (*init)(const struct cloud_transport_config *cfg,
+		    cloud_rx_callback_t rx);
+	int (*connect)(void);
+	void (*disconnect)(void);
+
+	/**
+	 * Send the messages in order and return once all were acknowledged.
+	 * On error the pipeline reconnects and sends the batch again.
+	 */
+	int (*publish)(const struct cloud_publish *items, size_t count);
+
+	int (*subscribe)(const char *topic);
+
+	/**
+	 * Process received data for up to timeout_ms (0 doesn't wait).  A
+	 * negative return means the connection was lost.
+	 */
+	int (*poll)(int timeout_ms);
+
+	int (*keep_alive)(void);
+
+	/**
+	 * Optional.  Called with true when the pipeline has nothing to send
+	 * and with false when it has data again, so the transport can release
+	 * the radio (for example, with release assistance).
+	 */
+	void (*sleep_hint)(bool idle);
+};
+
+#ifdef CONFIG_CLOUD_TRANSPORT_MQTT
+extern const struct cloud_transport cloudMqttTransport;
+#endif
+
+#ifdef CONFIG_CLOUD_TRANSPORT_COAP
+extern const struct cloud_transport cloudCoapTransport;
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CLOUD_TRANSPORT_H__ */
@@ -0,0 +1,96 @@
+/**
+ * @file coap_block.h
+ * @brief Windowed CoAP block-wise (Block2) downloads.
+ *
+ * Several block requests are kept in flight instead of one per round trip.
+ * The window grows by one block per window of blocks received and is halved
+ * when a request times out (AIMD).  Each block is retransmitted on its own
+ * timer, derived from the measured round-trip time.  Blocks that arrive out
+ * of order are held until they can be written in order.
+ *
+ * The offset of the last block written is saved in flash periodically, so a
+ * download interrupted by a lost connection or reset continues from there.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __COAP_BLOCK_H__
+#define __COAP_BLOCK_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+/**
+ * Called in order for each block.  After a resume the first call may repeat
+ * blocks that were written after the last saved offset.  A non-zero return
+ * stops the download.
+ *
+ * When flush is set the data (and everything before it) must be in flash
+ * when the function returns, because the offset is saved next.  A flush
+ * before the offset is saved on failure has no data (len 0).
+ */
+typedef int (*coap_block_write_t)(void *ctx, size_t offset,
+				  const uint8_t *data, size_t len, bool flush);
+
+struct coap_block_download {
+	const char *host;
+	uint16_t port;
+	/* URI path, segments separated by '/' */
+	const char *path;
+	/* Use DTLS with the credentials in CONFIG_COAP_BLOCK_SEC_TAG */
+	bool secure;
+	/* Maximum number of blocks in flight (0 uses
+	 * CONFIG_COAP_BLOCK_WINDOW_MAX).  1 is stop-and-wait.
+	 */
+	uint8_t window;
+	coap_block_write_t write;
+	void *ctx;
+};
+
+struct coap_block_stats {
+	size_t start_offset;
+	size_t size;
+	uint32_t blocks;
+	uint32_t retransmits;
+	uint32_t duration_ms;
+	uint32_t srtt_ms;
+};
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Download a resource.  Blocks the calling thread.
+ *
+ * @param stats optional, filled in on success and failure
+ *
+ * @retval 0 when the whole resource was written.  -ESTALE if the resource
+ * changed (ETag) since the saved offset; the resume state is discarded and
+ * the download should be started again.  Other negative values leave the
+ * resume state so that calling again continues the download.
+ */
+int coapBlockDownload(const struct coap_block_download *d,
+		      struct coap_block_stats *stats);
+
+/**
+ * @brief Discard the saved offset so the next download starts at 0.
+ */
+void coapBlockForget(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __COAP_BLOCK_H__ */
@@ -0,0 +1,78 @@
+/**
+ * @file conn_scheduler.h
+ * @brief Schedules cloud keep-alives around the radio's sleep state.
+ *
+ * In PSM/eDRX the modem sleeps between transfers.  A keep-alive sent on a
+ * fixed period wakes the radio on its own, so the scheduler instead sends it
+ * when the radio is already awake for other traffic, as long as a
+ * configurable fraction of the interval has elapsed.  The interval is
+ * stretched to just below the network's NAT timeout.  The time the radio is
+ * awake is reported each hour.
+ *
+ * Sleep states are only reported with CONFIG_MODEM_HL7800_LOW_POWER_MODE.
+ * Without it the modem never sleeps: keep-alives aren't piggybacked and the
+ * radio is counted as on while the cloud is connected.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __CONN_SCHEDULER_H__
+#define __CONN_SCHEDULER_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+void connSchedulerInit(void);
+
+/**
+ * @brief Called by the LTE module when the modem sleep state changes.
+ *
+ * @param state enum mdm_hl7800_sleep_state
+ */
+void connSchedulerOnSleepState(uint8_t state);
+
+/**
+ * @brief Called by the cloud transport when the connection is made or lost.
+ * Keep-alives are only scheduled while connected.
+ */
+void connSchedulerSetConnected(bool connected);
+
+/**
+ * @brief Called by the cloud transport each time it sends or receives.  Any
+ * traffic resets the keep-alive interval.
+ */
+void connSchedulerOnActivity(void);
+
+/**
+ * @brief Producers that can wait (batched publishes) use this to transmit
+ * while the radio is already awake.  Always false when the modem doesn't
+ * sleep.
+ */
+bool connSchedulerRadioAwake(void);
+
+/**
+ * @retval Keep-alive interval (seconds)
+ */
+uint32_t connSchedulerKeepAliveIntervalS(void);
+
+/**
+ * @retval Time (ms) that the radio was awake during the last full hour
+ */
+uint32_t connSchedulerRadioOnMsLastHour(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CONN_SCHEDULER_H__ */
@@ -0,0 +1,174 @@
+/**
+ * @file crypto_backend.h
+ * @brief Streaming hash and AEAD operations with selectable backends.
+ *
+ * A backend provides SHA-256 and AES-GCM.  The software backend (mbedTLS) is
+ * always registered.  An accelerated backend is registered with
+ * cryptoRegisterBackend() and is used by default when its priority is higher.
+ * Operations are streamed so that large images can be processed in chunks.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __CRYPTO_BACKEND_H__
+#define __CRYPTO_BACKEND_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+#define CRYPTO_SHA256_SIZE 32
+#define CRYPTO_GCM_BLOCK_SIZE 16
+
+enum crypto_gcm_mode { CRYPTO_GCM_ENCRYPT = 0, CRYPTO_GCM_DECRYPT };
+
+/* Backend state is kept in the context (8-byte aligned, as mbedTLS contexts
+ * need), so contexts aren't allocated.  A backend may still allocate inside
+ * an operation: the software GCM key schedule (mbedtls_gcm_setkey) uses
+ * mbedtls_calloc, which is freed by cryptoGcmFinish()/cryptoGcmAbort().
+ */
+struct crypto_sha256 {
+	const struct crypto_backend *backend;
+	uint64_t state[(CONFIG_CRYPTO_SHA256_CTX_SIZE + sizeof(uint64_t) - 1) /
+		       sizeof(uint64_t)];
+};
+
+struct crypto_gcm {
+	const struct crypto_backend *backend;
+	uint64_t state[(CONFIG_CRYPTO_GCM_CTX_SIZE + sizeof(uint64_t) - 1) /
+		       sizeof(uint64_t)];
+};
+
+/* Functions return 0 on success or a negative errno. */
+struct crypto_backend {
+	const char *name;
+	/* The default backend is the registered one with the highest value */
+	int priority;
+
+	int (*sha256_start)(void *state);
+	int (*sha256_update)(void *state, const uint8_t *data, size_t len);
+	int (*sha256_finish)(void *state, uint8_t *digest);
+	void (*sha256_free)(void *state);
+	/* Size of a SHA-256 state that is plain memory and can be saved and
+	 * restored (0 if it can't, for example when held by hardware).
+	 */
+	size_t sha256_portable_size;
+
+	int (*gcm_start)(void *state, enum crypto_gcm_mode mode,
+			 const uint8_t *key, size_t key_len, const uint8_t *iv,
+			 size_t iv_len, const uint8_t *aad, size_t aad_len);
+	int (*gcm_update)(void *state, const uint8_t *in, uint8_t *out,
+			  size_t len);
+	int (*gcm_finish)(void *state, uint8_t *tag, size_t tag_len);
+	void (*gcm_free)(void *state);
+};
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Register the software backend.
+ */
+void cryptoInit(void);
+
+/**
+ * @brief Register the mbedTLS software backend (called by cryptoInit).
+ */
+int cryptoSwRegister(void);
+
+/**
+ * @retval 0 on success, -ENOMEM if the table is full, -EINVAL if the state
+ * of the backend doesn't fit in the contexts.
+ */
+int cryptoRegisterBackend(const struct crypto_backend *backend,
+			  size_t sha256_state_size, size_t gcm_state_size);
+
+/**
+ * @param name of the backend or NULL for the default
+ */
+const struct crypto_backend *cryptoGetBackend(const char *name);
+
+size_t cryptoBackendCount(void);
+const struct crypto_backend *cryptoBackendAt(size_t index);
+
+/**
+ * @param backend NULL for the default backend
+ */
+int cryptoSha256Start(struct crypto_sha256 *ctx,
+		      const struct crypto_backend *backend);
+int cryptoSha256Update(struct crypto_sha256 *ctx, const void *data,
+		       size_t len);
+
+/**
+ * @brief Write the digest and free the context.
+ */
+int cryptoSha256Finish(struct crypto_sha256 *ctx, uint8_t *digest);
+
+/**
+ * @brief Copy the intermediate state of a hash so it can be continued
+ * later, for example after a reset.
+ *
+ * @retval Size of the state, -ENOTSUP if the backend doesn't allow it or
+ * -ENOMEM if the buffer is too small.
+ */
+int cryptoSha256Save(const struct crypto_sha256 *ctx, void *buf,
+		     size_t size);
+
+/**
+ * @brief Continue a hash from a state saved with the same backend.
+ */
+int cryptoSha256Restore(struct crypto_sha256 *ctx,
+			const struct crypto_backend *backend, const void *buf,
+			size_t size);
+
+/**
+ * @brief Start an AES-GCM operation.  The additional data is passed in one
+ * piece.
+ *
+ * @param key_len in bytes (16 or 32)
+ */
+int cryptoGcmStart(struct crypto_gcm *ctx, const struct crypto_backend *backend,
+		   enum crypto_gcm_mode mode, const uint8_t *key,
+		   size_t key_len, const uint8_t *iv, size_t iv_len,
+		   const uint8_t *aad, size_t aad_len);
+
+/**
+ * @brief Encrypt or decrypt a chunk.  Every chunk except the last must be a
+ * multiple of CRYPTO_GCM_BLOCK_SIZE.  @p in and @p out may be the same.
+ */
+int cryptoGcmUpdate(struct crypto_gcm *ctx, const void *in, void *out,
+		    size_t len);
+
+/**
+ * @brief Write the tag and free the context.  When decrypting, compare the
+ * tag with the received one (cryptoTagEqual) before using the plaintext.
+ */
+int cryptoGcmFinish(struct crypto_gcm *ctx, uint8_t *tag, size_t tag_len);
+
+/**
+ * @brief Free a context without finishing (for example, after an error).
+ */
+void cryptoSha256Abort(struct crypto_sha256 *ctx);
+void cryptoGcmAbort(struct crypto_gcm *ctx);
+
+/**
+ * @brief Constant time comparison
+ */
+bool cryptoTagEqual(const uint8_t *a, const uint8_t *b, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CRYPTO_BACKEND_H__ */
@@ -0,0 +1,67 @@
+/**
+ * @file delta_update.h
+ * @brief Apply a delta (patch) to the running app image.
+ *
+ * Patches are made with tools/delta/mkdelta.py against the signed image
+ * that is running (identified by APP_VERSION_STRING and the SHA-256 of the
+ * primary slot).  The patch is applied as it is received: the new image is
+ * built from the primary slot and the patch and written to the secondary
+ * slot.  RAM use is fixed (one read buffer) regardless of the image size.
+ * The new image is checked against the SHA-256 in the patch before it can
+ * be tested with MCUboot.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __DELTA_UPDATE_H__
+#define __DELTA_UPDATE_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Erase the secondary slot and prepare for a patch.
+ *
+ * @retval 0 on success, -EBUSY if a patch is being applied.
+ */
+int deltaUpdateStart(void);
+
+/**
+ * @brief Apply the next part of the patch.  Parts may be any size.
+ *
+ * @retval 0 on success.  -EBADMSG if the patch is invalid, -ENOENT if it was
+ * made for a different image.  After an error the update must be started
+ * again.
+ */
+int deltaUpdateWrite(const uint8_t *data, size_t len);
+
+/**
+ * @brief Called after the last part.
+ *
+ * @retval 0 if the new image is complete and its SHA-256 matches the patch.
+ */
+int deltaUpdateFinish(void);
+
+void deltaUpdateAbort(void);
+
+/**
+ * @retval Number of patch bytes applied so far.
+ */
+size_t deltaUpdateOffset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DELTA_UPDATE_H__ */
@@ -0,0 +1,68 @@
+/**
+ * @file dns_cache.h
+ * @brief IPv4 address cache in front of the DNS resolver.
+ *
+ * An answer is reused for CONFIG_DNS_CACHE_TTL_S, so a reconnect doesn't
+ * wait for a lookup over LTE.  When a lookup fails (for example, it times
+ * out after CONFIG_NET_SOCKETS_DNS_TIMEOUT) the last good answer is used,
+ * even if it has expired.  With CONFIG_APP_NV the answers are kept across
+ * resets.  Hosts added with dnsCacheAddHost() are resolved in the
+ * background each time LTE becomes ready.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __DNS_CACHE_H__
+#define __DNS_CACHE_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+struct in_addr;
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Load the saved answers.  Call after appNvInit().
+ */
+void dnsCacheInit(void);
+
+/**
+ * @param host name to resolve
+ * @param socktype SOCK_STREAM or SOCK_DGRAM
+ * @param addr the address
+ *
+ * @retval 0 or -EHOSTUNREACH when there is no answer, not even a stale one
+ */
+int dnsCacheResolve(const char *host, int socktype, struct in_addr *addr);
+
+/**
+ * @brief Resolve host each time LTE becomes ready.
+ *
+ * @retval 0, -ENOMEM if the cache is full or -ENAMETOOLONG
+ */
+int dnsCacheAddHost(const char *host);
+
+/**
+ * @brief Called when LTE is ready.  Hosts without a fresh answer are
+ * resolved by a background thread.
+ */
+void dnsCachePrefetch(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DNS_CACHE_H__ */
@@ -0,0 +1,93 @@
+/**
+ * @file fota_stage.h
+ * @brief Staging of firmware images with an incremental SHA-256.
+ *
+ * A transfer (BLE, CoAP or mcumgr) passes each chunk to fotaStageWrite().
+ * The chunk is written by the caller's write function and then added to the
+ * hash, so a failed write leaves the hash matching what is in flash.  The
+ * upload_mgmt.h image target stages through here.  The offset and
+ * intermediate hash state are saved periodically, so an interrupted transfer
+ * continues from the last checkpoint without reading back and hashing what
+ * was already written.  The digest is available as soon as the last chunk is
+ * written.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __FOTA_STAGE_H__
+#define __FOTA_STAGE_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "crypto_backend.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+/**
+ * Writes a chunk of the image.  When flush is set the data (and everything
+ * before it) must be in flash when the function returns, because a
+ * checkpoint is saved next.
+ */
+typedef int (*fota_stage_write_t)(void *ctx, size_t offset,
+				  const uint8_t *data, size_t len, bool flush);
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+void fotaStageInit(void);
+
+/**
+ * @brief Start staging an image or continue an interrupted one.
+ *
+ * @param name identifies the image (for example, the file name)
+ * @param size of the whole image
+ * @param offset set to where the transfer must continue (0 for a new image)
+ *
+ * @retval 0 on success, -EBUSY if another image is being staged.
+ */
+int fotaStageOpen(const char *name, size_t size, fota_stage_write_t write,
+		  void *ctx, size_t *offset);
+
+/**
+ * @brief Hash and write the next chunk.  Chunks must be written in order.
+ */
+int fotaStageWrite(const uint8_t *data, size_t len);
+
+/**
+ * @brief Stop staging.  The checkpoint is kept unless forget is set.
+ */
+void fotaStageClose(bool forget);
+
+/**
+ * @brief Where fotaStageOpen() would continue the image from, without
+ * opening it.  If the image is open this is its last checkpoint.  The hash
+ * state isn't checked, so the open may still start over.
+ *
+ * @retval offset of the checkpoint, 0 if there is nothing to continue.
+ */
+size_t fotaStageCheckpoint(const char *name, size_t size);
+
+/**
+ * @brief Digest of a staged image.  Available after the last byte of the
+ * image was written, until another image is opened.
+ *
+ * @retval 0 on success, -ENOENT if the image isn't completely staged.
+ */
+int fotaStageDigest(const char *name, uint8_t digest[CRYPTO_SHA256_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FOTA_STAGE_H__ */
@@ -0,0 +1,76 @@
+/**
+ * @file led_compositor.h
+ * @brief Drives all LEDs and their blink patterns from one timer.
+ *
+ * Pattern times are rounded up to CONFIG_LED_COMPOSITOR_TICK_MS and every
+ * transition falls on a multiple of it, so LEDs that change at about the
+ * same time do so in one wakeup.  The timer is only started for the next
+ * transition and is stopped while no LED blinks.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __LED_COMPOSITOR_H__
+#define __LED_COMPOSITOR_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+#define LED_REPEAT_FOREVER UINT32_MAX
+
+enum led_polarity { LED_POLARITY_ACTIVE_HIGH = 0, LED_POLARITY_ACTIVE_LOW };
+
+struct led_compositor_config {
+	uint32_t index;
+	const char *dev_name;
+	uint32_t pin;
+	enum led_polarity polarity;
+};
+
+struct led_pattern {
+	uint32_t on_ms;
+	uint32_t off_ms;
+	/* Number of on/off cycles, then the LED stays off */
+	uint32_t repeat_count;
+};
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @retval 0 or a negative error code if a GPIO couldn't be configured
+ */
+int ledInit(const struct led_compositor_config *config, size_t count);
+
+void ledOn(uint32_t index);
+
+void ledOff(uint32_t index);
+
+/**
+ * @brief Blink until the pattern ends or another function sets the LED.
+ */
+void ledBlink(uint32_t index, const struct led_pattern *pattern);
+
+/**
+ * @brief With false, all LEDs are off and the timer is stopped.  The LEDs'
+ * states are still kept and shown again when enabled.
+ */
+void ledSetEnabled(bool enabled);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LED_COMPOSITOR_H__ */
@@ -12,7 +12,9 @@
 /******************************************************************************/
 /* Includes                                                                   */
 /******************************************************************************/
-#include "laird_led.h"
+#include <devicetree.h>
+
+#include "led_compositor.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,7 +44,7 @@ enum led_index {
 	RED_LED3,
 	GREEN_LED4, /* not recommended for use - reserved for bootloader */
 };
-BUILD_ASSERT(CONFIG_NUMBER_OF_LEDS > GREEN_LED4, "LED object too small");
+BUILD_ASSERT(CONFIG_LED_COMPOSITOR_COUNT > GREEN_LED4, "LED object too small");
 
 #ifdef __cplusplus
 }
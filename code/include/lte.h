@@ -9,6 +9,13 @@
 #ifndef __LTE_H__
 #define __LTE_H__
 
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <time.h>
+#include <sys/slist.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -40,14 +47,65 @@ struct lte_status {
 /* Callback function for LTE events */
 typedef void (*lte_event_function_t)(enum lte_event event);
 
+/* Modem queries that need an AT command */
+enum lte_query_type {
+	LTE_QUERY_SIGNAL_QUALITY = BIT(0),
+	LTE_QUERY_LOCAL_TIME = BIT(1),
+};
+
+#define LTE_QUERY_ALL (LTE_QUERY_SIGNAL_QUALITY | LTE_QUERY_LOCAL_TIME)
+
+struct lte_query_result {
+	/* Queries (lte_query_type) that failed */
+	uint32_t failed;
+	int rssi;
+	int sinr;
+	struct tm local_time;
+	int32_t local_offset;
+};
+
+struct lte_query;
+
+/* Called from the system work queue.  The result is only valid during the
+ * call.  The query may be submitted again from the callback.
+ */
+typedef void (*lte_query_callback_t)(struct lte_query *query,
+				     const struct lte_query_result *result);
+
+/* Owned by the caller and must stay valid until the callback. */
+struct lte_query {
+	sys_snode_t node;
+	bool pending;
+	uint32_t queries;
+	lte_query_callback_t callback;
+	void *context;
+};
+
 /******************************************************************************/
 /* Global Function Prototypes                                                 */
 /******************************************************************************/
 void lteRegisterEventCallback(lte_event_function_t callback);
 int lteInit(void);
 bool lteIsReady(void);
+
+/**
+ * @brief Status with the last known signal quality.  The signal quality is
+ * refreshed in the background.
+ */
 struct lte_status *lteGetStatus(void);
 
+/**
+ * @brief Query the modem without blocking.
+ *
+ * Queries run one after another on the AT channel.  A query that is already
+ * waiting or running isn't sent again: every request for it gets the same
+ * result.
+ *
+ * @retval 0 on success, -EINVAL if the query is invalid, -EALREADY if it was
+ * already submitted.
+ */
+int lteQuerySubmit(struct lte_query *query);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,59 @@
+/**
+ * @file lte_power.h
+ * @brief PSM and eDRX settings derived from the reporting interval.
+ *
+ * When the device reports less often than CONFIG_LTE_POWER_PSM_MIN_INTERVAL_S
+ * the modem uses PSM: the periodic TAU timer (T3412) is set above the
+ * longest time between transmissions (reports and keep-alives) and the
+ * active timer (T3324) keeps the modem reachable for a short time after
+ * each transmission.  Otherwise PSM is off and eDRX is used with the
+ * longest cycle that meets the downlink latency limit.
+ *
+ * The time spent awake and asleep is used to estimate the charge used per
+ * day.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __LTE_POWER_H__
+#define __LTE_POWER_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+void ltePowerInit(void);
+
+/**
+ * @brief Called by the LTE module when the modem is ready for AT commands.
+ * The settings are sent to the modem if they changed.
+ */
+void ltePowerOnReady(void);
+
+/**
+ * @brief Called by the LTE module when the modem sleep state changes.
+ *
+ * @param state enum mdm_hl7800_sleep_state
+ */
+void ltePowerOnSleepState(uint8_t state);
+
+/**
+ * @brief Change the reporting interval the settings are derived from.  The
+ * new settings are sent right away if the modem is ready.
+ */
+void ltePowerSetReportInterval(uint32_t seconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LTE_POWER_H__ */
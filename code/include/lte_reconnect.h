@@ -0,0 +1,76 @@
+/**
+ * @file lte_reconnect.h
+ * @brief Recovery of the LTE data connection after it goes down.
+ *
+ * When the network interface goes down but the modem is still registered
+ * (a short coverage gap), the PDP context is re-activated without a full
+ * registration.  Otherwise the modem searches on its own and is reset if
+ * it hasn't recovered after CONFIG_LTE_RECONNECT_RESET_AFTER_S.  Attempts
+ * are spaced with exponential backoff and jitter so a fleet that loses the
+ * same cell doesn't retry in lock step.  The time to recover is recorded in
+ * the lte_recover_ms histogram.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __LTE_RECONNECT_H__
+#define __LTE_RECONNECT_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <kernel.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Initialize recovery.
+ *
+ * @param workQ queue the attempts run on.  They reset the modem and wait
+ * for AT commands, so this must not be the system work queue.
+ */
+void lteReconnectInit(struct k_work_q *workQ);
+
+/**
+ * @brief Called by the LTE module when the network registration changes.
+ *
+ * @param state enum mdm_hl7800_network_state
+ */
+void lteReconnectOnNetworkState(uint8_t state);
+
+/**
+ * @brief Called by the LTE module when the network interface goes down.
+ */
+void lteReconnectOnDown(void);
+
+/**
+ * @brief Called by the LTE module when the network interface is ready.
+ */
+void lteReconnectOnUp(void);
+
+/**
+ * @brief Delay before a retry: exponential backoff with equal jitter.
+ *
+ * @param attempt number of earlier attempts
+ * @param minMs delay of the first attempt
+ * @param maxMs largest delay
+ *
+ * @retval Random delay between half and all of minMs * 2^attempt (at most
+ * maxMs).
+ */
+uint32_t lteReconnectBackoffMs(uint32_t attempt, uint32_t minMs,
+			       uint32_t maxMs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LTE_RECONNECT_H__ */
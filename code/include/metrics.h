@@ -0,0 +1,161 @@
+/**
+ * @file metrics.h
+ * @brief Runtime metrics (counters, gauges and latency histograms).
+ *
+ * Metrics are statically allocated by the module that owns them.  The
+ * define macros place each one in an iterable linker section (metrics.ld)
+ * so every metric that is built is reported without a runtime registry.
+ * Recording is a few atomic operations so it can stay enabled in production
+ * builds.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+enum metric_type {
+	METRIC_TYPE_COUNTER = 0,
+	METRIC_TYPE_GAUGE,
+	METRIC_TYPE_HISTOGRAM,
+};
+
+enum metrics_errors {
+	METRICS_ERR_NONE = 0,
+	METRICS_ERR_NO_SPACE = -2,
+};
+
+struct metric {
+	const char *name;
+	uint8_t type;
+	/* Histogram only: number of bounds (there is one more bucket) */
+	uint8_t bound_count;
+	const uint32_t *bounds;
+	atomic_t *buckets;
+	/* Counter/gauge value or histogram sample count */
+	atomic_t value;
+	/* Gauge high-water mark or largest histogram sample */
+	atomic_t max;
+	/* Histogram sum of samples */
+	atomic_t sum;
+};
+
+/* Upper bounds (inclusive) of the default latency buckets in milliseconds */
+#define METRIC_LATENCY_MS_BOUNDS                                               \
+	10, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000
+
+#define METRIC_SECTION(_var)                                                   \
+	__aligned(__alignof(struct metric))                                    \
+		__in_section(_metric, static, _var) __used
+
+#define METRIC_COUNTER_DEFINE(_var, _name)                                     \
+	static struct metric _var METRIC_SECTION(_var) = {                     \
+		.name = _name, .type = METRIC_TYPE_COUNTER                     \
+	}
+
+#define METRIC_GAUGE_DEFINE(_var, _name)                                       \
+	static struct metric _var METRIC_SECTION(_var) = {                     \
+		.name = _name, .type = METRIC_TYPE_GAUGE                       \
+	}
+
+#define METRIC_HISTOGRAM_DEFINE(_var, _name, ...)                              \
+	static const uint32_t _var##_bounds[] = { __VA_ARGS__ };               \
+	static atomic_t _var##_buckets[ARRAY_SIZE(_var##_bounds) + 1];         \
+	static struct metric _var METRIC_SECTION(_var) = {                     \
+		.name = _name,                                                 \
+		.type = METRIC_TYPE_HISTOGRAM,                                 \
+		.bound_count = ARRAY_SIZE(_var##_bounds),                      \
+		.bounds = _var##_bounds,                                       \
+		.buckets = _var##_buckets                                      \
+	}
+
+/* Metrics whose names are only known at runtime.  Entries are skipped until
+ * the owner sets the name (which must be written last).
+ */
+#define METRIC_ARRAY_DEFINE(_var, _count)                                      \
+	static struct metric _var[_count] METRIC_SECTION(_var)
+
+typedef void (*metrics_visitor_t)(const struct metric *m, void *context);
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Register the mcumgr group (if enabled).
+ */
+void metricsInit(void);
+
+static inline void metricsIncrement(struct metric *m)
+{
+	atomic_inc(&m->value);
+}
+
+static inline void metricsAdd(struct metric *m, uint32_t value)
+{
+	atomic_add(&m->value, (atomic_val_t)value);
+}
+
+/**
+ * @brief Set a gauge and update its high-water mark.
+ */
+void metricsGaugeSet(struct metric *m, uint32_t value);
+
+/**
+ * @brief Adjust a gauge and update its high-water mark.
+ */
+void metricsGaugeAdd(struct metric *m, int32_t delta);
+
+/**
+ * @brief Add a sample to a histogram.
+ */
+void metricsHistogramRecord(struct metric *m, uint32_t value);
+
+/**
+ * @brief Visit each metric.
+ */
+void metricsForEach(metrics_visitor_t visitor, void *context);
+
+/**
+ * @brief Clear all metrics.
+ */
+void metricsReset(void);
+
+/**
+ * @brief Encode metrics in the compact binary format.
+ * All values are little endian.
+ *
+ * Each metric: type (1), name length (1), name, then
+ *   counter: value (4)
+ *   gauge: value (4), max (4)
+ *   histogram: count (4), sum (4), max (4), bound count N (1),
+ *              N bounds (4 each), N + 1 bucket counts (4 each)
+ *
+ * @param buf destination
+ * @param size of buf
+ * @param start index of first metric to encode (used for paging)
+ * @param next set to index of first metric that didn't fit
+ *
+ * @retval number of bytes written
+ */
+size_t metricsEncode(uint8_t *buf, size_t size, size_t start, size_t *next);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,87 @@
+/**
+ * @file modem_fw_stream.h
+ * @brief Stream a modem firmware image to the modem while it downloads.
+ *
+ * The image isn't staged in the file system.  Chunks are put in a ring
+ * buffer as they arrive and a thread sends them to the modem with
+ * XMODEM-1K, so the download and the UART transfer overlap.  The producer
+ * waits when the ring buffer is full.  The last packet is held until the
+ * SHA-256 of the whole image matches, so the modem never receives a
+ * complete image that wasn't verified.
+ *
+ * The modem driver provides the port (the UART in update mode).
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __MODEM_FW_STREAM_H__
+#define __MODEM_FW_STREAM_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+/* Functions return 0 on success or a negative errno. */
+struct modem_fw_port {
+	/* Put the modem in update mode for an image of size bytes */
+	int (*start)(size_t size);
+	int (*send)(const uint8_t *data, size_t len);
+	/* Wait for one byte from the modem (-EAGAIN on timeout) */
+	int (*receive)(uint8_t *byte, k_timeout_t timeout);
+	/* Leave update mode; ok is false if the transfer was cancelled */
+	void (*finish)(bool ok);
+};
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+void modemFwStreamSetPort(const struct modem_fw_port *port);
+
+/**
+ * @brief Start a transfer.
+ *
+ * @param size of the image
+ * @param sha256 expected digest of the image (NULL to skip the check)
+ *
+ * @retval 0 on success, -EBUSY if a transfer is in progress, -ENODEV if no
+ * port is set.
+ */
+int modemFwStreamStart(size_t size, const uint8_t *sha256);
+
+/**
+ * @brief Add the next chunk of the image.  Waits up to timeout for room in
+ * the ring buffer.
+ *
+ * @retval 0 on success, -EAGAIN on timeout (the transfer is cancelled) or
+ * the error that stopped the transfer.
+ */
+int modemFwStreamWrite(const uint8_t *data, size_t len, k_timeout_t timeout);
+
+/**
+ * @brief Wait for the transfer to finish after the last chunk.
+ */
+int modemFwStreamFinish(k_timeout_t timeout);
+
+/**
+ * @brief Cancel the transfer.  The modem discards the partial image.  Called
+ * by the producer (the thread that calls modemFwStreamWrite()), which also
+ * owns the hash.
+ */
+void modemFwStreamAbort(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MODEM_FW_STREAM_H__ */
@@ -0,0 +1,90 @@
+/**
+ * @file msg_pool.h
+ * @brief Size class allocator for framework messages.
+ *
+ * Fixed size classes (slabs) are used for control, sensor and advertisement
+ * messages so they can't fragment each other.  Large JSON messages come from
+ * a separate arena.  Allocation failures return NULL (and are counted)
+ * instead of asserting.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __MSG_POOL_H__
+#define __MSG_POOL_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+enum msg_pool_class {
+	MSG_POOL_CLASS_SMALL = 0,
+	MSG_POOL_CLASS_SENSOR,
+	MSG_POOL_CLASS_ADV,
+	MSG_POOL_CLASS_JSON,
+	MSG_POOL_CLASS_COUNT
+};
+
+struct msg_pool_stats {
+	/* Blocks (slabs) or bytes (JSON arena) in use */
+	uint32_t used;
+	uint32_t high_water;
+	uint32_t capacity;
+	uint32_t allocations;
+	uint32_t failures;
+};
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Initialize the size classes and register their metrics.
+ */
+void MsgPool_Initialize(void);
+
+/**
+ * @brief Allocate a message.  If the best fitting slab is full, the next
+ * larger slab is tried.  Messages larger than the largest slab come from the
+ * JSON arena.
+ *
+ * @retval pointer to message or NULL if there isn't any space
+ */
+void *MsgPool_Take(size_t size);
+
+/**
+ * @brief Free a message.  A pointer that doesn't belong to the message pool
+ * is a framework assertion.
+ */
+void MsgPool_Free(void *pBuffer);
+
+/**
+ * @retval true if the class has less than threshold percent free.
+ */
+bool MsgPool_IsLow(enum msg_pool_class c, uint32_t threshold);
+
+void MsgPool_GetStats(enum msg_pool_class c, struct msg_pool_stats *stats);
+
+#ifdef CONFIG_MSG_TRACE
+/**
+ * @brief Uptime (ms) at which a message was taken from the pool.
+ *
+ * @retval 0 or -EINVAL if the message isn't from the pool
+ */
+int MsgPool_GetCreated(const void *pBuffer, uint32_t *created);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MSG_POOL_H__ */
@@ -0,0 +1,87 @@
+/**
+ * @file msg_trace.h
+ * @brief Latency tracing of framework messages.
+ *
+ * Message types that contain MSG_TRACE_FIELD are stamped when they are
+ * created, each time a receiver takes them from its queue, and when they are
+ * transmitted to the cloud.  Messages from the message pool are created when
+ * they are taken unless the producer uses MSG_TRACE_CREATE (the pool clears
+ * the message so an unstamped trace reads as zero).  The creation to
+ * transmit latency is aggregated into a histogram per message code.  When
+ * CONFIG_MSG_TRACE is disabled the field and the stamps compile to nothing.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __MSG_TRACE_H__
+#define __MSG_TRACE_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+
+#include "Framework.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+#ifdef CONFIG_MSG_TRACE
+
+struct msg_trace {
+	uint32_t created; /* uptime (ms) */
+	uint8_t hop_count;
+	FwkId_t hop_id[CONFIG_MSG_TRACE_MAX_HOPS];
+	/* Time since creation (ms), saturates at UINT16_MAX */
+	uint16_t hop_offset[CONFIG_MSG_TRACE_MAX_HOPS];
+};
+
+#define MSG_TRACE_FIELD struct msg_trace trace;
+
+#define MSG_TRACE_CREATE(_p) msgTraceCreate(&(_p)->trace)
+#define MSG_TRACE_HOP(_p, _id) msgTraceHop(&(_p)->trace, _id)
+#define MSG_TRACE_TRANSMIT(_p)                                                 \
+	msgTraceTransmit(&(_p)->trace, (_p)->header.msgCode)
+
+/* For generic framework messages; ignored if the code isn't traced */
+#define MSG_TRACE_HOP_MSG(_p, _id) msgTraceHopMsg((FwkMsg_t *)(_p), _id)
+#define MSG_TRACE_TRANSMIT_MSG(_p) msgTraceTransmitMsg((FwkMsg_t *)(_p))
+
+#else
+
+#define MSG_TRACE_FIELD
+#define MSG_TRACE_CREATE(_p)
+#define MSG_TRACE_HOP(_p, _id)
+#define MSG_TRACE_TRANSMIT(_p)
+#define MSG_TRACE_HOP_MSG(_p, _id)
+#define MSG_TRACE_TRANSMIT_MSG(_p)
+
+#endif /* CONFIG_MSG_TRACE */
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+#ifdef CONFIG_MSG_TRACE
+void msgTraceCreate(struct msg_trace *trace);
+void msgTraceHop(struct msg_trace *trace, FwkId_t id);
+
+/**
+ * @brief Record the latency of the message and keep it if it is the slowest
+ * of its code.
+ */
+void msgTraceTransmit(struct msg_trace *trace, FwkMsgCode_t code);
+
+void msgTraceHopMsg(FwkMsg_t *pMsg, FwkId_t id);
+void msgTraceTransmitMsg(FwkMsg_t *pMsg);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MSG_TRACE_H__ */
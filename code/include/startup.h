@@ -0,0 +1,67 @@
+/**
+ * @file startup.h
+ * @brief Boot milestones and initialization deferred off the LTE path.
+ *
+ * main() initializes what LTE needs first.  Subsystems that aren't needed
+ * to attach (DIS, mcumgr) are deferred with startupDefer() and run on a
+ * low-priority thread once LTE is ready, or after
+ * CONFIG_STARTUP_DEFER_TIMEOUT_MS without it.  The time from boot to each
+ * milestone is kept in a boot_*_ms gauge.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __STARTUP_H__
+#define __STARTUP_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+enum startup_milestone {
+	STARTUP_LTE_READY = 0,
+	STARTUP_FIRST_SENSOR_SAMPLE,
+	/* All deferred tasks have run */
+	STARTUP_DEFERRED_DONE,
+	STARTUP_MILESTONE_COUNT
+};
+
+typedef void (*startup_task_t)(void);
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Record the time of a milestone.  Only the first call for each
+ * milestone counts.
+ */
+void startupMark(enum startup_milestone milestone);
+
+/**
+ * @brief Run task on the startup thread.  Tasks run in the order they were
+ * added.
+ *
+ * @retval 0 or -ENOMEM
+ */
+int startupDefer(const char *name, startup_task_t task);
+
+/**
+ * @brief Called by main() when the critical path has been initialized.
+ * The deferred tasks start when LTE is ready.
+ */
+void startupRunDeferred(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __STARTUP_H__ */
@@ -0,0 +1,54 @@
+/**
+ * @file thread_profiler.h
+ * @brief Sampling CPU profiler and stack usage of all threads.
+ *
+ * While running, a timer interrupt records the thread it interrupted about
+ * every CONFIG_THREAD_PROFILER_SAMPLE_MS.  The delay between samples is
+ * randomized so periodic threads aren't always missed or always hit.  The
+ * counts are moved into a ring of CONFIG_THREAD_PROFILER_WINDOWS windows of
+ * CONFIG_THREAD_PROFILER_WINDOW_S each, which gives each thread's share of
+ * the CPU in the last window and over the whole ring.  Stack usage is the
+ * high-water mark of the initialized stacks (CONFIG_INIT_STACKS).
+ *
+ * Group CONFIG_THREAD_PROFILER_MGMT_GROUP_ID
+ *   stat (0) read -> {"rc", "run", "win": window (s), "n": windows filled,
+ *                     "load": CPU load in the last window (per mille),
+ *                     "threads": [{"name", "last", "avg" (per mille),
+ *                                  "size", "used" (stack bytes)}]}
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __THREAD_PROFILER_H__
+#define __THREAD_PROFILER_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+void threadProfilerInit(void);
+
+/**
+ * @brief Clear the windows and start sampling.
+ */
+void threadProfilerStart(void);
+
+/**
+ * @brief Stop sampling.  The windows are kept.
+ */
+void threadProfilerStop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __THREAD_PROFILER_H__ */
@@ -0,0 +1,86 @@
+/**
+ * @file time_service.h
+ * @brief Wall clock time from network time, corrected for clock drift.
+ *
+ * Timestamps are taken with timeServiceUptimeMs(), which is monotonic, and
+ * converted to wall clock time with timeServiceToEpochMs() when they are
+ * needed (for example, when a batch is published).  Conversion doesn't
+ * query the modem, and all timestamps of a batch use the same model.
+ *
+ * The time is read from the modem (network time) and, with
+ * CONFIG_TIME_SERVICE_SNTP, from an SNTP server, every
+ * CONFIG_TIME_SERVICE_SYNC_INTERVAL_S.  The difference between SNTP time and
+ * the local clock since the first SNTP sync gives the drift of the local
+ * clock, which the conversion corrects.  The modem's time, with a resolution
+ * of a second, only corrects the offset.  The Qrtc epoch is set at each
+ * sync.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __TIME_SERVICE_H__
+#define __TIME_SERVICE_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Called when LTE is ready.  Syncs if the time was never set or a
+ * sync is due.
+ */
+void timeServiceOnLteReady(void);
+
+/**
+ * @brief Sync now (when LTE is ready).
+ */
+void timeServiceSync(void);
+
+bool timeServiceIsSynced(void);
+
+/**
+ * @retval Milliseconds since boot; the time base of timestamps.
+ */
+static inline int64_t timeServiceUptimeMs(void)
+{
+	return k_uptime_get();
+}
+
+/**
+ * @brief Convert a timestamp from timeServiceUptimeMs() to wall clock time.
+ *
+ * @param uptimeMs timestamp
+ * @param epochMs milliseconds since 1970 (UTC)
+ *
+ * @retval 0 or -EAGAIN if the time hasn't been synced
+ */
+int timeServiceToEpochMs(int64_t uptimeMs, uint64_t *epochMs);
+
+/**
+ * @brief Current wall clock time.
+ *
+ * @retval 0 or -EAGAIN if the time hasn't been synced
+ */
+int timeServiceEpochMs(uint64_t *epochMs);
+
+/**
+ * @retval Estimated drift of the local clock in parts per billion (positive
+ * when it is slow), 0 until it has been measured.
+ */
+int32_t timeServiceDriftPpb(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TIME_SERVICE_H__ */
@@ -0,0 +1,109 @@
+/**
+ * @file tls_session.h
+ * @brief Application managed TLS connections with session resumption.
+ *
+ * The socket TLS layer creates a new mbedTLS context for each connection
+ * and can't resume sessions.  This module runs mbedTLS over a plain TCP
+ * socket and keeps the last session (ID and ticket) so that a reconnect to
+ * the same host uses an abbreviated handshake.  The session is optionally
+ * kept in retained RAM so it survives a soft reset.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __TLS_SESSION_H__
+#define __TLS_SESSION_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <sys/types.h>
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+enum tls_session_errors {
+	TLS_SESSION_ERR_NONE = 0,
+	TLS_SESSION_ERR_CREDENTIALS = -1,
+	TLS_SESSION_ERR_SETUP = -2,
+	TLS_SESSION_ERR_HANDSHAKE = -3,
+};
+
+/* Credentials are PEM (including the terminator) or DER. */
+struct tls_session_config {
+	const char *hostname;
+	const uint8_t *ca;
+	size_t ca_len;
+	const uint8_t *cert;
+	size_t cert_len;
+	const uint8_t *key;
+	size_t key_len;
+};
+
+struct tls_conn {
+	int sock;
+	mbedtls_ssl_context ssl;
+	mbedtls_ssl_config conf;
+	mbedtls_ctr_drbg_context drbg;
+	mbedtls_x509_crt ca;
+	mbedtls_x509_crt cert;
+	mbedtls_pk_context key;
+	/* Bytes on the wire during the handshake */
+	uint32_t tx_bytes;
+	uint32_t rx_bytes;
+	uint32_t handshake_ms;
+	bool resumed;
+};
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Register metrics and restore the retained session (if any).
+ */
+void tlsSessionInit(void);
+
+/**
+ * @brief Perform the TLS handshake on a connected TCP socket.  The cached
+ * session is offered if it was saved for the same host.
+ *
+ * @retval TLS_SESSION_ERR_NONE or a negative error
+ */
+int tlsSessionOpen(struct tls_conn *c, int sock,
+		   const struct tls_session_config *cfg);
+
+ssize_t tlsSessionSend(struct tls_conn *c, const void *data, size_t len);
+ssize_t tlsSessionRecv(struct tls_conn *c, void *data, size_t len);
+
+/**
+ * @brief Check if tlsSessionRecv would return without waiting.
+ */
+bool tlsSessionReadable(struct tls_conn *c);
+
+/**
+ * @brief Send close_notify and free the connection.  The cached session is
+ * kept.  The socket is not closed.
+ */
+void tlsSessionClose(struct tls_conn *c);
+
+/**
+ * @brief Discard the cached session (for example, when credentials change).
+ */
+void tlsSessionForget(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TLS_SESSION_H__ */
@@ -0,0 +1,73 @@
+/**
+ * @file upload_mgmt.h
+ * @brief Pipelined uploads over mcumgr (SMP).
+ *
+ * The image and file system upload commands write each chunk to flash before
+ * responding, so a client can only have one request outstanding and uploads
+ * are limited by the connection latency.  This group responds as soon as a
+ * chunk is queued and a thread writes the queue to flash.  Clients keep
+ * several write requests in flight and use the offset in each response to
+ * detect lost requests.
+ *
+ * Group CONFIG_UPLOAD_MGMT_GROUP_ID
+ *   write (0) {"tgt": target, "off": offset, "data": bytes,
+ *              "len": image size, "sha": SHA-256 (first chunk only)}
+ *             -> {"rc", "off": next offset expected, "done": bytes written}
+ *   state (1) read -> {"rc", "tgt", "len", "off", "done", "err", "ok"}
+ *
+ * A write at offset 0 starts a new upload.  A write at any other offset that
+ * isn't the next one expected is dropped and the response offset tells the
+ * client where to continue.  An image upload that was interrupted continues
+ * from its last fota_stage.h checkpoint when it is started again with the
+ * same "len" and "sha": the first chunk is dropped and the response offset
+ * is the checkpoint.  When every buffer is waiting for flash the write
+ * fails with MGMT_ERR_EBUSY; the client waits and resends from the last
+ * offset acknowledged.
+ *
+ * A write is acknowledged when its chunk is queued, before it reaches flash.
+ * "done" in the responses and the state command tell when it was written.
+ * The standard img_mgmt upload command is unchanged: it still responds
+ * after each chunk is written.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __UPLOAD_MGMT_H__
+#define __UPLOAD_MGMT_H__
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Global Constants, Macros and Type Definitions                              */
+/******************************************************************************/
+enum upload_target {
+	/* Full signed image written to the secondary slot */
+	UPLOAD_TARGET_IMAGE = 0,
+	/* Patch for delta_update.h */
+	UPLOAD_TARGET_DELTA,
+	/* HL7800 firmware for modem_fw_stream.h */
+	UPLOAD_TARGET_MODEM,
+	UPLOAD_TARGET_COUNT
+};
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Register the mcumgr group.
+ */
+void uploadMgmtInit(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __UPLOAD_MGMT_H__ */
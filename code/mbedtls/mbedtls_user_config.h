@@ -0,0 +1,34 @@
+/**
+ * @file mbedtls_user_config.h
+ * @brief Application additions to the mbedTLS configuration.
+ *
+ * Included at the end of the mbedTLS configuration selected by Kconfig.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef __MBEDTLS_USER_CONFIG_H__
+#define __MBEDTLS_USER_CONFIG_H__
+
+/* Allows tls_session to resume using a ticket when the server doesn't keep
+ * a session cache.
+ */
+#define MBEDTLS_SSL_SESSION_TICKETS
+
+#define MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+
+#ifdef CONFIG_TLS_LEAN_PROFILE
+/* Only the suites used by AWS IoT (ECDHE) and the LwM2M server (PSK) */
+#define MBEDTLS_SSL_CIPHERSUITES                                               \
+	MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,                       \
+		MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,                 \
+		MBEDTLS_TLS_PSK_WITH_AES_128_CCM_8,                            \
+		MBEDTLS_TLS_PSK_WITH_AES_128_CBC_SHA256
+
+/* MBEDTLS_SSL_MAX_CONTENT_LEN sizes both buffers unless these are set. */
+#define MBEDTLS_SSL_IN_CONTENT_LEN CONFIG_TLS_IN_CONTENT_LEN
+#define MBEDTLS_SSL_OUT_CONTENT_LEN CONFIG_TLS_OUT_CONTENT_LEN
+#endif
+
+#endif /* __MBEDTLS_USER_CONFIG_H__ */
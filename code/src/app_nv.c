@@ -0,0 +1,106 @@
+/**
+ * @file app_nv.c
+ * @brief Small records kept in flash across resets (NVS).
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(app_nv);
+
+#define APP_NV_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define APP_NV_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define APP_NV_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define APP_NV_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <device.h>
+#include <drivers/flash.h>
+#include <storage/flash_map.h>
+#include <fs/nvs.h>
+
+#include "app_nv.h"
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static struct nvs_fs fs;
+static bool mounted;
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+int appNvInit(void)
+{
+	const struct flash_area *fa;
+	struct flash_pages_info info;
+	const struct device *dev;
+	int rc;
+
+	rc = flash_area_open(FLASH_AREA_ID(storage), &fa);
+	if (rc < 0) {
+		APP_NV_LOG_ERR("Storage partition not found (%d)", rc);
+		return rc;
+	}
+
+	dev = device_get_binding(fa->fa_dev_name);
+	rc = (dev == NULL) ? -ENODEV :
+			     flash_get_page_info_by_offs(dev, fa->fa_off,
+							 &info);
+	if (rc == 0) {
+		fs.offset = fa->fa_off;
+		fs.sector_size = info.size;
+		fs.sector_count = fa->fa_size / info.size;
+		rc = nvs_init(&fs, fa->fa_dev_name);
+	}
+	flash_area_close(fa);
+
+	if (rc < 0) {
+		APP_NV_LOG_ERR("Unable to mount NVS (%d)", rc);
+	} else {
+		mounted = true;
+	}
+	return rc;
+}
+
+int appNvRead(enum app_nv_id id, void *data, size_t len)
+{
+	ssize_t n;
+
+	if (!mounted) {
+		return -ENODEV;
+	}
+
+	n = nvs_read(&fs, id, data, len);
+	if (n < 0) {
+		return (int)n;
+	}
+	return (int)MIN((size_t)n, len);
+}
+
+int appNvWrite(enum app_nv_id id, const void *data, size_t len)
+{
+	ssize_t n;
+
+	if (!mounted) {
+		return -ENODEV;
+	}
+
+	/* 0 is returned when the contents are unchanged */
+	n = nvs_write(&fs, id, data, len);
+	return (n < 0) ? (int)n : 0;
+}
+
+int appNvDelete(enum app_nv_id id)
+{
+	if (!mounted) {
+		return -ENODEV;
+	}
+	return nvs_delete(&fs, id);
+}
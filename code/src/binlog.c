@@ -0,0 +1,344 @@
+/**
+ * @file binlog.c
+ * @brief Deferred binary logging for hot paths.
+ *
+ * The ring is lock-free for producers.  Each writer reserves a slot by
+ * incrementing the head index and publishes the slot by writing its sequence
+ * number last.  The reader uses the sequence number to detect records that
+ * are incomplete or were overwritten while being copied.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(binlog);
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <stdio.h>
+#include <shell/shell.h>
+
+#include "binlog.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define RING_MASK (CONFIG_BINLOG_RING_SIZE - 1)
+BUILD_ASSERT((CONFIG_BINLOG_RING_SIZE & RING_MASK) == 0,
+	     "Ring size must be a power of 2");
+
+#define FORMAT_BUFFER_SIZE 128
+
+struct slot {
+	/* 0 while being written, otherwise index + 1 */
+	atomic_t seq;
+	struct binlog_record record;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void updateCycleStats(uint32_t cycles);
+
+#ifdef CONFIG_BINLOG_FORMAT_THREAD
+static void formatThread(void *arg1, void *arg2, void *arg3);
+static void printRecord(const struct binlog_record *record, void *context);
+#endif
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static struct slot ring[CONFIG_BINLOG_RING_SIZE];
+static atomic_t head;
+static uint32_t tail;
+/* Serializes readers (format thread and shell); writers never take it */
+K_MUTEX_DEFINE(readLock);
+
+static atomic_t writes;
+static atomic_t dropped;
+static atomic_t truncated;
+static atomic_t minCycles = ATOMIC_INIT(-1);
+static atomic_t maxCycles;
+static uint64_t totalCycles;
+
+#ifdef CONFIG_BINLOG_FORMAT_THREAD
+K_THREAD_DEFINE(binlog_format, CONFIG_BINLOG_FORMAT_THREAD_STACK_SIZE,
+		formatThread, NULL, NULL, NULL,
+		K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
+#endif
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void binlogWrite(const char *fmt, size_t nargs, const uint32_t *args)
+{
+	uint32_t start = k_cycle_get_32();
+	uint32_t index = (uint32_t)atomic_inc(&head);
+	struct slot *s = &ring[index & RING_MASK];
+	size_t i;
+
+	atomic_set(&s->seq, 0);
+	compiler_barrier();
+
+	if (nargs > CONFIG_BINLOG_MAX_ARGS) {
+		nargs = CONFIG_BINLOG_MAX_ARGS;
+		atomic_inc(&truncated);
+	}
+
+	s->record.timestamp = start;
+	s->record.fmt = fmt;
+	s->record.nargs = (uint8_t)nargs;
+	for (i = 0; i < nargs; i++) {
+		s->record.args[i] = args[i];
+	}
+
+	compiler_barrier();
+	atomic_set(&s->seq, index + 1);
+	atomic_inc(&writes);
+
+	updateCycleStats(k_cycle_get_32() - start);
+}
+
+size_t binlogRead(binlog_reader_t reader, void *context, size_t max)
+{
+	struct binlog_record copy;
+	struct slot *s;
+	uint32_t h;
+	uint32_t seq;
+	size_t count = 0;
+
+	k_mutex_lock(&readLock, K_FOREVER);
+	while (max == 0 || count < max) {
+		h = (uint32_t)atomic_get(&head);
+		if (h - tail > CONFIG_BINLOG_RING_SIZE) {
+			/* Writers lapped the reader */
+			atomic_add(&dropped, h - tail - CONFIG_BINLOG_RING_SIZE);
+			tail = h - CONFIG_BINLOG_RING_SIZE;
+		}
+		if (tail == h) {
+			break;
+		}
+
+		s = &ring[tail & RING_MASK];
+		seq = (uint32_t)atomic_get(&s->seq);
+		if (seq == 0 || (int32_t)(seq - (tail + 1)) < 0) {
+			/* Write in progress; try again later */
+			break;
+		}
+		compiler_barrier();
+		memcpy(&copy, &s->record, sizeof(copy));
+		compiler_barrier();
+
+		if (seq != tail + 1 || atomic_get(&s->seq) != seq) {
+			/* Overwritten before or during the copy */
+			atomic_inc(&dropped);
+		} else {
+			reader(&copy, context);
+			count += 1;
+		}
+		tail += 1;
+	}
+	k_mutex_unlock(&readLock);
+
+	return count;
+}
+
+int binlogFormat(const struct binlog_record *record, char *buf, size_t size)
+{
+	/* At least as many as the formatter is passed */
+	uint32_t a[MAX(CONFIG_BINLOG_MAX_ARGS, 4) + 1] = { 0 };
+	int n;
+
+	memcpy(a, record->args, record->nargs * sizeof(uint32_t));
+
+	n = snprintk(buf, size, "[%08x] ", record->timestamp);
+	if (n < 0 || n >= size) {
+		return n;
+	}
+
+	/* Unused arguments are ignored by the formatter. */
+#if CONFIG_BINLOG_MAX_ARGS <= 4
+	return n + snprintk(buf + n, size - n, record->fmt, a[0], a[1], a[2],
+			    a[3]);
+#else
+	return n + snprintk(buf + n, size - n, record->fmt, a[0], a[1], a[2],
+			    a[3], a[4], a[5]);
+#endif
+}
+
+void binlogGetStats(struct binlog_stats *stats)
+{
+	unsigned int key = irq_lock();
+
+	stats->writes = (uint32_t)atomic_get(&writes);
+	stats->dropped = (uint32_t)atomic_get(&dropped);
+	stats->truncated = (uint32_t)atomic_get(&truncated);
+	stats->min_cycles = (uint32_t)atomic_get(&minCycles);
+	stats->max_cycles = (uint32_t)atomic_get(&maxCycles);
+	stats->total_cycles = totalCycles;
+
+	irq_unlock(key);
+}
+
+void binlogResetStats(void)
+{
+	unsigned int key = irq_lock();
+
+	atomic_clear(&writes);
+	atomic_clear(&dropped);
+	atomic_clear(&truncated);
+	atomic_set(&minCycles, -1);
+	atomic_clear(&maxCycles);
+	totalCycles = 0;
+
+	irq_unlock(key);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void updateCycleStats(uint32_t cycles)
+{
+	atomic_val_t old;
+	unsigned int key;
+
+	do {
+		old = atomic_get(&minCycles);
+	} while ((uint32_t)old > cycles &&
+		 !atomic_cas(&minCycles, old, (atomic_val_t)cycles));
+
+	do {
+		old = atomic_get(&maxCycles);
+	} while ((uint32_t)old < cycles &&
+		 !atomic_cas(&maxCycles, old, (atomic_val_t)cycles));
+
+	/* 64-bit add isn't atomic on the M4 */
+	key = irq_lock();
+	totalCycles += cycles;
+	irq_unlock(key);
+}
+
+#ifdef CONFIG_BINLOG_FORMAT_THREAD
+static void formatThread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	while (true) {
+		binlogRead(printRecord, NULL, 0);
+		k_sleep(K_MSEC(CONFIG_BINLOG_FORMAT_THREAD_PERIOD_MS));
+	}
+}
+
+static void printRecord(const struct binlog_record *record, void *context)
+{
+	char buf[FORMAT_BUFFER_SIZE];
+
+	ARG_UNUSED(context);
+
+	binlogFormat(record, buf, sizeof(buf));
+	printk("%s\n", buf);
+}
+#endif
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_BINLOG_SHELL
+static void shellPrintRecord(const struct binlog_record *record,
+			     void *context)
+{
+	char buf[FORMAT_BUFFER_SIZE];
+
+	binlogFormat(record, buf, sizeof(buf));
+	shell_print((const struct shell *)context, "%s", buf);
+}
+
+static void shellPrintRaw(const struct binlog_record *record, void *context)
+{
+	const struct shell *shell = (const struct shell *)context;
+	char buf[FORMAT_BUFFER_SIZE];
+	int n;
+	size_t i;
+
+	/* The host resolves the format address using zephyr.elf */
+	n = snprintk(buf, sizeof(buf), "%08x %08x %u",
+		     record->timestamp, (uint32_t)(uintptr_t)record->fmt,
+		     record->nargs);
+	for (i = 0; i < record->nargs && n > 0 && n < sizeof(buf); i++) {
+		n += snprintk(buf + n, sizeof(buf) - n, " %08x",
+			      record->args[i]);
+	}
+	shell_print(shell, "%s", buf);
+}
+
+static int shell_binlog_dump(const struct shell *shell, size_t argc,
+			     char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	binlogRead(shellPrintRecord, (void *)shell, 0);
+	return 0;
+}
+
+static int shell_binlog_raw(const struct shell *shell, size_t argc,
+			    char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(shell, "cycles/s %u", sys_clock_hw_cycles_per_sec());
+	binlogRead(shellPrintRaw, (void *)shell, 0);
+	return 0;
+}
+
+static int shell_binlog_stats(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	struct binlog_stats s;
+	uint32_t avg;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	binlogGetStats(&s);
+	avg = (s.writes > 0) ? (uint32_t)(s.total_cycles / s.writes) : 0;
+
+	shell_print(shell, "writes %u dropped %u truncated %u", s.writes,
+		    s.dropped, s.truncated);
+	shell_print(shell, "cycles per write min %u avg %u max %u (%u ns avg)",
+		    (s.writes > 0) ? s.min_cycles : 0, avg, s.max_cycles,
+		    (uint32_t)k_cyc_to_ns_floor64(avg));
+	return 0;
+}
+
+static int shell_binlog_reset(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	ARG_UNUSED(shell);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	binlogResetStats();
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	binlog_cmds,
+	SHELL_CMD(dump, NULL, "Format and print pending records",
+		  shell_binlog_dump),
+	SHELL_CMD(raw, NULL, "Print pending records for host decoding",
+		  shell_binlog_raw),
+	SHELL_CMD(stats, NULL, "Write count and cycle cost per write",
+		  shell_binlog_stats),
+	SHELL_CMD(reset, NULL, "Reset statistics", shell_binlog_reset),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(binlog, &binlog_cmds, "Binary log commands", NULL);
+#endif /* CONFIG_BINLOG_SHELL */
@@ -0,0 +1,314 @@
+/**
+ * @file cell_notify.c
+ * @brief Rate limited updates of the BLE cellular service.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(cell_notify);
+
+#define CELL_NOTIFY_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define CELL_NOTIFY_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define CELL_NOTIFY_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define CELL_NOTIFY_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <stdlib.h>
+#include <drivers/modem/hl7800.h>
+
+#include "ble_cellular_service.h"
+#include "metrics.h"
+#include "cell_notify.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+enum field {
+	FIELD_NETWORK_STATE = 0,
+	FIELD_STARTUP_STATE,
+	FIELD_SLEEP_STATE,
+	FIELD_APN,
+	FIELD_RSSI,
+	FIELD_SINR,
+	FIELD_RAT,
+	FIELD_BANDS,
+	FIELD_ACTIVE_BANDS,
+	FIELD_FW_VERSION,
+	FIELD_COUNT
+};
+
+#define STRING_SIZE CONFIG_LTE_EVENT_STRING_SIZE
+
+/* Link layer packet overhead (preamble, access address, header and CRC) and
+ * the L2CAP and ATT headers of a notification.
+ */
+#define LL_OVERHEAD 10
+#define ATT_OVERHEAD 7
+/* The peer answers each packet with an empty one after the inter frame
+ * space.
+ */
+#define LL_EXCHANGE_US (150 + 80 + 150)
+#define US_PER_BYTE_1M 8
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void markDirty(enum field f);
+static void setString(char *dest, const char *src, enum field f);
+static bool changed(int value, int sent, bool valid, int threshold);
+static void flushWorkHandler(struct k_work *item);
+static void notify(enum field f);
+static uint32_t airtimeUs(size_t len);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_MUTEX_DEFINE(cellNotifyLock);
+static struct k_delayed_work flushWork;
+static atomic_t dirty;
+static atomic_t scheduled;
+static int64_t lastFlush;
+
+static uint8_t networkState;
+static uint8_t startupState;
+static uint8_t sleepState;
+static uint8_t rat;
+static struct mdm_hl7800_apn *apn;
+static int rssi;
+static int sinr;
+static int rssiSent;
+static int sinrSent;
+static bool rssiValid;
+static bool sinrValid;
+static char bands[STRING_SIZE];
+static char activeBands[STRING_SIZE];
+static char fwVersion[STRING_SIZE];
+
+METRIC_COUNTER_DEFINE(notifications, "cell_notify_sent");
+METRIC_COUNTER_DEFINE(coalesced, "cell_notify_coalesced");
+METRIC_COUNTER_DEFINE(suppressed, "cell_notify_suppressed");
+METRIC_COUNTER_DEFINE(airtime, "cell_notify_airtime_us");
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void cellNotifyInit(void)
+{
+	k_delayed_work_init(&flushWork, flushWorkHandler);
+}
+
+void cellNotifySetNetworkState(uint8_t state)
+{
+	k_mutex_lock(&cellNotifyLock, K_FOREVER);
+	networkState = state;
+	markDirty(FIELD_NETWORK_STATE);
+	k_mutex_unlock(&cellNotifyLock);
+}
+
+void cellNotifySetStartupState(uint8_t state)
+{
+	k_mutex_lock(&cellNotifyLock, K_FOREVER);
+	startupState = state;
+	markDirty(FIELD_STARTUP_STATE);
+	k_mutex_unlock(&cellNotifyLock);
+}
+
+void cellNotifySetSleepState(uint8_t state)
+{
+	k_mutex_lock(&cellNotifyLock, K_FOREVER);
+	sleepState = state;
+	markDirty(FIELD_SLEEP_STATE);
+	k_mutex_unlock(&cellNotifyLock);
+}
+
+void cellNotifySetApn(struct mdm_hl7800_apn *value)
+{
+	k_mutex_lock(&cellNotifyLock, K_FOREVER);
+	apn = value;
+	markDirty(FIELD_APN);
+	k_mutex_unlock(&cellNotifyLock);
+}
+
+void cellNotifySetRssi(int value)
+{
+	k_mutex_lock(&cellNotifyLock, K_FOREVER);
+	rssi = value;
+	if (changed(rssi, rssiSent, rssiValid,
+		    CONFIG_CELL_NOTIFY_RSSI_THRESHOLD)) {
+		markDirty(FIELD_RSSI);
+	}
+	k_mutex_unlock(&cellNotifyLock);
+}
+
+void cellNotifySetSinr(int value)
+{
+	k_mutex_lock(&cellNotifyLock, K_FOREVER);
+	sinr = value;
+	if (changed(sinr, sinrSent, sinrValid,
+		    CONFIG_CELL_NOTIFY_SINR_THRESHOLD)) {
+		markDirty(FIELD_SINR);
+	}
+	k_mutex_unlock(&cellNotifyLock);
+}
+
+void cellNotifySetRat(uint8_t value)
+{
+	k_mutex_lock(&cellNotifyLock, K_FOREVER);
+	rat = value;
+	markDirty(FIELD_RAT);
+	k_mutex_unlock(&cellNotifyLock);
+}
+
+void cellNotifySetBands(const char *value)
+{
+	setString(bands, value, FIELD_BANDS);
+}
+
+void cellNotifySetActiveBands(const char *value)
+{
+	setString(activeBands, value, FIELD_ACTIVE_BANDS);
+}
+
+void cellNotifySetFwVersion(const char *value)
+{
+	setString(fwVersion, value, FIELD_FW_VERSION);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+/* Called with the lock */
+static void markDirty(enum field f)
+{
+	int64_t delay;
+
+	if (atomic_test_and_set_bit(&dirty, f)) {
+		/* The pending notification will carry the new value */
+		metricsIncrement(&coalesced);
+		return;
+	}
+
+	if (atomic_cas(&scheduled, 0, 1)) {
+		delay = lastFlush + CONFIG_CELL_NOTIFY_MIN_INTERVAL_MS -
+			k_uptime_get();
+		k_delayed_work_submit(&flushWork, K_MSEC(MAX(delay, 0)));
+	}
+}
+
+static void setString(char *dest, const char *src, enum field f)
+{
+	k_mutex_lock(&cellNotifyLock, K_FOREVER);
+	if (strncmp(dest, src, STRING_SIZE - 1) != 0) {
+		strncpy(dest, src, STRING_SIZE - 1);
+		dest[STRING_SIZE - 1] = '\0';
+		markDirty(f);
+	}
+	k_mutex_unlock(&cellNotifyLock);
+}
+
+static bool changed(int value, int sent, bool valid, int threshold)
+{
+	if (!valid || abs(value - sent) >= MAX(threshold, 1)) {
+		return true;
+	}
+	if (value != sent) {
+		metricsIncrement(&suppressed);
+	}
+	return false;
+}
+
+static void flushWorkHandler(struct k_work *item)
+{
+	atomic_val_t fields;
+	int f;
+
+	ARG_UNUSED(item);
+
+	k_mutex_lock(&cellNotifyLock, K_FOREVER);
+	lastFlush = k_uptime_get();
+	atomic_clear(&scheduled);
+	fields = atomic_clear(&dirty);
+	for (f = 0; f < FIELD_COUNT; f++) {
+		if (fields & BIT(f)) {
+			notify((enum field)f);
+		}
+	}
+	k_mutex_unlock(&cellNotifyLock);
+}
+
+/* Called with the lock */
+static void notify(enum field f)
+{
+	size_t len;
+
+	switch (f) {
+	case FIELD_NETWORK_STATE:
+		cell_svc_set_network_state(networkState);
+		len = sizeof(networkState);
+		break;
+	case FIELD_STARTUP_STATE:
+		cell_svc_set_startup_state(startupState);
+		len = sizeof(startupState);
+		break;
+	case FIELD_SLEEP_STATE:
+		cell_svc_set_sleep_state(sleepState);
+		len = sizeof(sleepState);
+		break;
+	case FIELD_APN:
+		cell_svc_set_apn(apn);
+		len = strlen(apn->value);
+		break;
+	case FIELD_RSSI:
+		cell_svc_set_rssi(rssi);
+		rssiSent = rssi;
+		rssiValid = true;
+		len = sizeof(int32_t);
+		break;
+	case FIELD_SINR:
+		cell_svc_set_sinr(sinr);
+		sinrSent = sinr;
+		sinrValid = true;
+		len = sizeof(int32_t);
+		break;
+	case FIELD_RAT:
+		cell_svc_set_rat(rat);
+		len = sizeof(rat);
+		break;
+	case FIELD_BANDS:
+		cell_svc_set_bands(bands);
+		len = strlen(bands);
+		break;
+	case FIELD_ACTIVE_BANDS:
+		cell_svc_set_active_bands(activeBands);
+		len = strlen(activeBands);
+		break;
+	case FIELD_FW_VERSION:
+		cell_svc_set_fw_ver(fwVersion);
+		len = strlen(fwVersion);
+		break;
+	default:
+		return;
+	}
+
+	metricsIncrement(&notifications);
+	metricsAdd(&airtime, airtimeUs(len));
+}
+
+/* Estimated LE 1M airtime of a notification of len bytes */
+static uint32_t airtimeUs(size_t len)
+{
+	size_t payload = len + ATT_OVERHEAD;
+	size_t packets = (payload + CONFIG_CELL_NOTIFY_LL_PAYLOAD_SIZE - 1) /
+			 CONFIG_CELL_NOTIFY_LL_PAYLOAD_SIZE;
+
+	return ((payload + (packets * LL_OVERHEAD)) * US_PER_BYTE_1M) +
+	       (packets * LL_EXCHANGE_US);
+}
@@ -0,0 +1,679 @@
+/**
+ * @file cloud.c
+ * @brief Cloud pipeline shared by the MQTT (AWS) and CoAP (LwM2M) builds.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(cloud);
+
+#define CLOUD_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define CLOUD_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define CLOUD_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define CLOUD_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <shell/shell.h>
+
+#include "FrameworkIncludes.h"
+#include "lte.h"
+#include "lte_reconnect.h"
+#include "msg_pool.h"
+#include "cloud_queue.h"
+#include "conn_scheduler.h"
+#include "metrics.h"
+#include "dns_cache.h"
+#include "time_service.h"
+#include "cloud.h"
+#ifdef CONFIG_CLOUD_AUTOSTART
+#include "app_nv.h"
+#endif
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define METRIC_BATCH_SIZE_BOUNDS 1, 2, 4, 8, 16, 32
+
+#ifdef CONFIG_CLOUD_TRANSPORT_MQTT
+#define TRANSPORT (&cloudMqttTransport)
+#else
+#define TRANSPORT (&cloudCoapTransport)
+#endif
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void cloudThread(void *arg1, void *arg2, void *arg3);
+static bool connectTransport(void);
+static void disconnectTransport(void);
+static void subscribeAll(void);
+static void fillBatch(void);
+static void addToBatch(FwkMsg_t *pMsg);
+static void stampBatch(void);
+static bool addTimestamp(JsonMsg_t *pJson, uint64_t epochMs);
+static void flushBatch(void);
+static void freeBatch(void);
+static void setIdle(bool idle);
+static void onRx(const char *topic, const uint8_t *data, size_t len);
+#ifdef CONFIG_CLOUD_AUTOSTART
+static void autoStartHandler(struct k_work *work);
+static int loadCredential(enum cloud_credential which, uint8_t *buf,
+			  size_t size);
+#endif
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_THREAD_DEFINE(cloud_thread, CONFIG_CLOUD_THREAD_STACK_SIZE, cloudThread,
+		NULL, NULL, NULL, CONFIG_CLOUD_THREAD_PRIORITY, 0, 0);
+
+K_SEM_DEFINE(startSem, 0, 1);
+K_SEM_DEFINE(cloudLteReadySem, 0, 1);
+/* Given when the thread leaves its run loop */
+K_SEM_DEFINE(parkedSem, 0, 1);
+
+/* Serializes cloudStart() and cloudStop() */
+K_MUTEX_DEFINE(controlLock);
+/* Stopped, but the thread may not have left its run loop yet */
+static bool stopping;
+
+static atomic_t running;
+static atomic_t subscribePending;
+static bool connected;
+static bool idle = true;
+static uint32_t reconnectAttempts;
+
+/* Messages taken from the cloud queue that haven't been acknowledged */
+static FwkMsg_t *batch[CONFIG_CLOUD_BATCH_MAX];
+static size_t batchCount;
+static uint32_t batchAttempts;
+
+K_MUTEX_DEFINE(topicLock);
+static const char *topics[CONFIG_CLOUD_MAX_SUBSCRIPTIONS];
+static size_t topicCount;
+
+static cloud_rx_callback_t rxCallback;
+
+#ifdef CONFIG_CLOUD_AUTOSTART
+/* Runs on the system work queue; the cloud thread only waits for startSem,
+ * so a cloudStop() waiting for it to park can't block the autostart.
+ */
+static struct k_work autoStartWork;
+static atomic_t autoStarted;
+static struct cloud_transport_config autoConfig;
+#ifdef CONFIG_CLOUD_TRANSPORT_MQTT
+static uint8_t ca[CONFIG_CLOUD_CREDENTIAL_SIZE];
+static uint8_t cert[CONFIG_CLOUD_CREDENTIAL_SIZE];
+static uint8_t key[CONFIG_CLOUD_CREDENTIAL_SIZE];
+#else
+static uint8_t psk[CONFIG_CLOUD_CREDENTIAL_SIZE];
+static char pskId[CONFIG_CLOUD_CREDENTIAL_SIZE];
+#endif
+#endif
+
+METRIC_COUNTER_DEFINE(published, "cloud_published");
+METRIC_COUNTER_DEFINE(publishFailures, "cloud_publish_failures");
+METRIC_COUNTER_DEFINE(dropped, "cloud_dropped");
+METRIC_COUNTER_DEFINE(unsupported, "cloud_unsupported");
+METRIC_COUNTER_DEFINE(unstamped, "cloud_unstamped");
+METRIC_COUNTER_DEFINE(received, "cloud_received");
+METRIC_COUNTER_DEFINE(connectFailures, "cloud_connect_failures");
+METRIC_GAUGE_DEFINE(storeDepth, "cloud_store_depth");
+METRIC_HISTOGRAM_DEFINE(batchSize, "cloud_batch_size",
+			METRIC_BATCH_SIZE_BOUNDS);
+METRIC_HISTOGRAM_DEFINE(connectTime, "cloud_connect_ms",
+			METRIC_LATENCY_MS_BOUNDS);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void cloudInit(void)
+{
+#ifdef CONFIG_CLOUD_AUTOSTART
+	k_work_init(&autoStartWork, autoStartHandler);
+#endif
+}
+
+int cloudStart(const struct cloud_transport_config *cfg)
+{
+	int rc = 0;
+
+	k_mutex_lock(&controlLock, K_FOREVER);
+	if (atomic_get(&running)) {
+		rc = -EALREADY;
+	} else if (stopping && k_current_get() == cloud_thread) {
+		/* Can't wait for itself to leave the run loop */
+		rc = -EBUSY;
+	} else if (stopping) {
+		/* The transport can't be initialized while the thread uses it */
+		k_sem_take(&parkedSem, K_FOREVER);
+		stopping = false;
+	}
+
+	if (rc == 0) {
+		rc = TRANSPORT->init(cfg, onRx);
+	}
+	if (rc == 0) {
+		/* Resolved in the background when LTE becomes ready */
+		dnsCacheAddHost(cfg->host);
+		atomic_set(&running, 1);
+		k_sem_give(&startSem);
+	}
+	k_mutex_unlock(&controlLock);
+
+	return rc;
+}
+
+void cloudStop(void)
+{
+	k_mutex_lock(&controlLock, K_FOREVER);
+	if (atomic_cas(&running, 1, 0)) {
+		stopping = true;
+		/* Cut a reconnect delay short */
+		k_sem_give(&cloudLteReadySem);
+		if (k_current_get() != cloud_thread) {
+			k_sem_take(&parkedSem, K_FOREVER);
+			stopping = false;
+		}
+	}
+	k_mutex_unlock(&controlLock);
+}
+
+#ifdef CONFIG_CLOUD_AUTOSTART
+int cloudSaveCredential(enum cloud_credential which, const void *data,
+			size_t len)
+{
+	if (which >= CLOUD_CREDENTIAL_COUNT ||
+	    len > CONFIG_CLOUD_CREDENTIAL_SIZE - 1) {
+		return -EINVAL;
+	}
+
+	return appNvWrite(APP_NV_ID_CLOUD_CA + which, data, len);
+}
+#endif
+
+int cloudSubscribe(const char *topic)
+{
+	int rc = 0;
+
+	k_mutex_lock(&topicLock, K_FOREVER);
+	if (topicCount < ARRAY_SIZE(topics)) {
+		topics[topicCount++] = topic;
+		atomic_set(&subscribePending, 1);
+	} else {
+		rc = -ENOMEM;
+	}
+	k_mutex_unlock(&topicLock);
+
+	return rc;
+}
+
+void cloudRegisterRxCallback(cloud_rx_callback_t callback)
+{
+	rxCallback = callback;
+}
+
+bool cloudIsConnected(void)
+{
+	return connected;
+}
+
+void cloudOnLteReady(void)
+{
+	k_sem_give(&cloudLteReadySem);
+#ifdef CONFIG_CLOUD_AUTOSTART
+	/* The client ID defaults to the IMEI, which is known by then */
+	if (atomic_set(&autoStarted, 1) == 0) {
+		k_work_submit(&autoStartWork);
+	}
+#endif
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void cloudThread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	while (true) {
+		k_sem_take(&startSem, K_FOREVER);
+		CLOUD_LOG_INF("Starting %s transport", TRANSPORT->name);
+
+		while (atomic_get(&running)) {
+			if (!connected && !connectTransport()) {
+				continue;
+			}
+			if (atomic_cas(&subscribePending, 1, 0)) {
+				subscribeAll();
+			}
+
+			fillBatch();
+			if (batchCount > 0) {
+				flushBatch();
+			}
+
+			if (connected && TRANSPORT->poll(0) < 0) {
+				CLOUD_LOG_WRN("Connection lost");
+				disconnectTransport();
+			}
+		}
+
+		disconnectTransport();
+		CLOUD_LOG_INF("Stopped");
+		k_sem_give(&parkedSem);
+	}
+}
+
+#ifdef CONFIG_CLOUD_AUTOSTART
+static void autoStartHandler(struct k_work *work)
+{
+	int rc;
+
+	ARG_UNUSED(work);
+
+	if (strlen(CONFIG_CLOUD_HOST) == 0) {
+		CLOUD_LOG_WRN("No host configured; waiting for cloudStart()");
+		return;
+	}
+
+	autoConfig.host = CONFIG_CLOUD_HOST;
+	autoConfig.port = CONFIG_CLOUD_PORT;
+	autoConfig.client_id = (strlen(CONFIG_CLOUD_CLIENT_ID) != 0) ?
+				       CONFIG_CLOUD_CLIENT_ID :
+				       lteGetStatus()->IMEI;
+
+#ifdef CONFIG_CLOUD_TRANSPORT_MQTT
+	rc = loadCredential(CLOUD_CREDENTIAL_CA, ca, sizeof(ca));
+	autoConfig.ca = ca;
+	autoConfig.ca_len = rc;
+	if (rc > 0) {
+		rc = loadCredential(CLOUD_CREDENTIAL_CERT, cert, sizeof(cert));
+		autoConfig.cert = cert;
+		autoConfig.cert_len = rc;
+	}
+	if (rc > 0) {
+		rc = loadCredential(CLOUD_CREDENTIAL_KEY, key, sizeof(key));
+		autoConfig.key = key;
+		autoConfig.key_len = rc;
+	}
+#else
+	rc = loadCredential(CLOUD_CREDENTIAL_PSK, psk, sizeof(psk));
+	autoConfig.psk = psk;
+	autoConfig.psk_len = rc;
+	if (rc > 0) {
+		/* Read one less so the ID stays terminated */
+		rc = loadCredential(CLOUD_CREDENTIAL_PSK_ID, (uint8_t *)pskId,
+				    sizeof(pskId) - 1);
+		autoConfig.psk_id = pskId;
+	}
+#endif
+	/* Never connect without security outside of testing */
+	if (rc <= 0) {
+		CLOUD_LOG_ERR("Credentials not provisioned; not connecting");
+		return;
+	}
+
+	rc = cloudStart(&autoConfig);
+	if (rc != 0 && rc != -EALREADY) {
+		CLOUD_LOG_ERR("Unable to start (%d)", rc);
+	}
+}
+
+static int loadCredential(enum cloud_credential which, uint8_t *buf,
+			  size_t size)
+{
+	int rc = appNvRead(APP_NV_ID_CLOUD_CA + which, buf, size);
+
+	if (rc <= 0) {
+		CLOUD_LOG_ERR("No credential %u (%d)", which, rc);
+	}
+	return rc;
+}
+#endif
+
+static bool connectTransport(void)
+{
+	int64_t start;
+	uint32_t delay;
+	int rc;
+
+	if (!lteIsReady()) {
+		k_sem_take(&cloudLteReadySem, K_SECONDS(1));
+		return false;
+	}
+
+	start = k_uptime_get();
+	rc = TRANSPORT->connect();
+	if (rc != 0) {
+		delay = lteReconnectBackoffMs(reconnectAttempts++,
+					      CONFIG_CLOUD_RECONNECT_MIN_MS,
+					      CONFIG_CLOUD_RECONNECT_MAX_MS);
+		CLOUD_LOG_ERR("Connect (%d); retry in %u ms", rc, delay);
+		metricsIncrement(&connectFailures);
+		/* Don't wait out the delay once LTE is back */
+		if (k_sem_take(&cloudLteReadySem, K_MSEC(delay)) == 0) {
+			reconnectAttempts = 0;
+		}
+		return false;
+	}
+
+	metricsHistogramRecord(&connectTime, (uint32_t)k_uptime_delta(&start));
+	reconnectAttempts = 0;
+	k_sem_reset(&cloudLteReadySem);
+	connected = true;
+	connSchedulerSetConnected(true);
+	atomic_set(&subscribePending, 1);
+	CLOUD_LOG_INF("Connected");
+	return true;
+}
+
+static void disconnectTransport(void)
+{
+	if (connected) {
+		TRANSPORT->disconnect();
+		connected = false;
+		connSchedulerSetConnected(false);
+	}
+}
+
+static void subscribeAll(void)
+{
+	size_t i;
+
+	k_mutex_lock(&topicLock, K_FOREVER);
+	for (i = 0; i < topicCount; i++) {
+		if (TRANSPORT->subscribe(topics[i]) != 0) {
+			CLOUD_LOG_ERR("Unable to subscribe to %s",
+				      log_strdup(topics[i]));
+		}
+	}
+	k_mutex_unlock(&topicLock);
+}
+
+/* Wait for the first message, then collect more for the batch window.  When
+ * the radio is already awake the queue is only drained so that the batch goes
+ * out in the same window.
+ */
+static void fillBatch(void)
+{
+	FwkMsg_t *pMsg;
+	int64_t deadline;
+	int64_t remaining;
+
+	if (batchCount > 0) {
+		/* Unsent batch from before the reconnect */
+		return;
+	}
+
+	if (cloudQueueGet(&pMsg, K_MSEC(CONFIG_CLOUD_POLL_INTERVAL_MS)) != 0) {
+		setIdle(true);
+		return;
+	}
+	setIdle(false);
+	addToBatch(pMsg);
+
+	deadline = k_uptime_get() + CONFIG_CLOUD_BATCH_WINDOW_MS;
+	while (batchCount < ARRAY_SIZE(batch)) {
+		remaining = connSchedulerRadioAwake() ?
+				    0 :
+				    MAX(deadline - k_uptime_get(), 0);
+		if (cloudQueueGet(&pMsg, K_MSEC(remaining)) != 0) {
+			break;
+		}
+		addToBatch(pMsg);
+	}
+
+	stampBatch();
+	metricsGaugeSet(&storeDepth, batchCount);
+}
+
+static void addToBatch(FwkMsg_t *pMsg)
+{
+	switch (pMsg->header.msgCode) {
+	case FMC_SENSOR_PUBLISH:
+	case FMC_GATEWAY_OUT:
+	case FMC_SENSOR_SHADOW_INIT:
+		batch[batchCount++] = pMsg;
+		break;
+
+	case FMC_AWS_KEEP_ALIVE:
+		if (connected && TRANSPORT->keep_alive() == 0) {
+			connSchedulerOnActivity();
+		}
+		MsgPool_Free(pMsg);
+		break;
+
+	default:
+		metricsIncrement(&unsupported);
+		MsgPool_Free(pMsg);
+		break;
+	}
+}
+
+/* Called once per batch; a batch sent again keeps its timestamps. */
+static void stampBatch(void)
+{
+	JsonMsg_t *pJson;
+	uint64_t epochMs;
+	size_t i;
+
+	for (i = 0; i < batchCount; i++) {
+		pJson = (JsonMsg_t *)batch[i];
+		if (timeServiceToEpochMs(pJson->timestamp, &epochMs) != 0 ||
+		    !addTimestamp(pJson, epochMs)) {
+			metricsIncrement(&unstamped);
+		}
+	}
+}
+
+/* Insert "ts" as the first member of the JSON object */
+static bool addTimestamp(JsonMsg_t *pJson, uint64_t epochMs)
+{
+	char field[CLOUD_TIMESTAMP_SIZE];
+	bool empty;
+	int n;
+
+	if (pJson->length < 2 || pJson->buffer[0] != '{') {
+		return false;
+	}
+
+	empty = (pJson->buffer[1] == '}');
+	n = snprintf(field, sizeof(field), "\"ts\":%llu%s",
+		     (unsigned long long)epochMs, empty ? "" : ",");
+	/* Keep room for the terminator some producers add */
+	if (n <= 0 || (size_t)n >= sizeof(field) ||
+	    pJson->length + n >= pJson->size) {
+		return false;
+	}
+
+	memmove(&pJson->buffer[1 + n], &pJson->buffer[1], pJson->length);
+	memcpy(&pJson->buffer[1], field, n);
+	pJson->length += n;
+	return true;
+}
+
+static void flushBatch(void)
+{
+	struct cloud_publish items[CONFIG_CLOUD_BATCH_MAX];
+	JsonMsg_t *pJson;
+	size_t i;
+	int rc;
+
+	for (i = 0; i < batchCount; i++) {
+		pJson = (JsonMsg_t *)batch[i];
+		items[i].topic = pJson->topic;
+		items[i].data = (const uint8_t *)pJson->buffer;
+		items[i].len = pJson->length;
+	}
+
+	rc = TRANSPORT->publish(items, batchCount);
+	if (rc == 0) {
+		for (i = 0; i < batchCount; i++) {
+			MSG_TRACE_TRANSMIT_MSG(batch[i]);
+		}
+		metricsAdd(&published, batchCount);
+		metricsHistogramRecord(&batchSize, batchCount);
+		connSchedulerOnActivity();
+		freeBatch();
+		return;
+	}
+
+	CLOUD_LOG_ERR("Publish of %u messages (%d)", batchCount, rc);
+	metricsIncrement(&publishFailures);
+	batchAttempts += 1;
+	if (batchAttempts >= CONFIG_CLOUD_PUBLISH_ATTEMPTS) {
+		/* Don't let one message the server rejects block the queue */
+		metricsAdd(&dropped, batchCount);
+		freeBatch();
+	}
+	disconnectTransport();
+}
+
+static void freeBatch(void)
+{
+	size_t i;
+
+	for (i = 0; i < batchCount; i++) {
+		MsgPool_Free(batch[i]);
+	}
+	batchCount = 0;
+	batchAttempts = 0;
+	metricsGaugeSet(&storeDepth, 0);
+}
+
+static void setIdle(bool isIdle)
+{
+	if (idle != isIdle) {
+		idle = isIdle;
+		if (TRANSPORT->sleep_hint != NULL) {
+			TRANSPORT->sleep_hint(isIdle);
+		}
+	}
+}
+
+static void onRx(const char *topic, const uint8_t *data, size_t len)
+{
+	metricsIncrement(&received);
+	connSchedulerOnActivity();
+	if (rxCallback != NULL) {
+		rxCallback(topic, data, len);
+	}
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+#define SHELL_MAX_HOST_SIZE 64
+#define SHELL_MAX_TOPIC_SIZE 64
+
+/* Connect without security to a local test server */
+static int shell_cloud_start(const struct shell *shell, size_t argc,
+			     char **argv)
+{
+	static char host[SHELL_MAX_HOST_SIZE];
+	static struct cloud_transport_config cfg;
+	int rc;
+
+	strncpy(host, argv[1], sizeof(host) - 1);
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.host = host;
+	cfg.port = strtoul(argv[2], NULL, 0);
+	cfg.client_id = "pinnacle_100_test";
+
+	rc = cloudStart(&cfg);
+	if (rc != 0) {
+		shell_error(shell, "Unable to start (%d)", rc);
+	}
+	return rc;
+}
+
+static int shell_cloud_stop(const struct shell *shell, size_t argc,
+			    char **argv)
+{
+	ARG_UNUSED(shell);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	cloudStop();
+	return 0;
+}
+
+static int shell_cloud_status(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(shell, "%s %s, %u unsent, %u queued", TRANSPORT->name,
+		    connected ? "connected" : "disconnected", batchCount,
+		    cloudQueueDepth());
+	return 0;
+}
+
+static int shell_cloud_publish(const struct shell *shell, size_t argc,
+			       char **argv)
+{
+	size_t length = strlen(argv[2]);
+	size_t size = length + CLOUD_TIMESTAMP_SIZE;
+	JsonMsg_t *pMsg = (JsonMsg_t *)MsgPool_Take(sizeof(JsonMsg_t) + size);
+
+	if (pMsg == NULL) {
+		shell_error(shell, "No buffer");
+		return -ENOMEM;
+	}
+
+	memset(pMsg, 0, sizeof(JsonMsg_t));
+	pMsg->header.msgCode = FMC_GATEWAY_OUT;
+	pMsg->header.rxId = FWK_ID_CLOUD;
+	pMsg->header.txId = FWK_ID_RESERVED;
+	MSG_TRACE_CREATE(pMsg);
+	strncpy(pMsg->topic, argv[1], sizeof(pMsg->topic) - 1);
+	memcpy(pMsg->buffer, argv[2], length);
+	pMsg->size = size;
+	pMsg->length = length;
+
+	return cloudQueuePut((FwkMsg_t *)pMsg, CLOUD_QUEUE_PUT_TIMEOUT);
+}
+
+static int shell_cloud_subscribe(const struct shell *shell, size_t argc,
+				 char **argv)
+{
+	static char topic[CONFIG_CLOUD_MAX_SUBSCRIPTIONS][SHELL_MAX_TOPIC_SIZE];
+	static size_t count;
+
+	if (count >= ARRAY_SIZE(topic)) {
+		shell_error(shell, "Too many subscriptions");
+		return -ENOMEM;
+	}
+	strncpy(topic[count], argv[1], SHELL_MAX_TOPIC_SIZE - 1);
+	return cloudSubscribe(topic[count++]);
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	cloud_cmds,
+	SHELL_CMD_ARG(start, NULL,
+		      "Connect without security to a test server <host> <port>",
+		      shell_cloud_start, 3, 0),
+	SHELL_CMD(stop, NULL, "Disconnect", shell_cloud_stop),
+	SHELL_CMD(status, NULL, "Print the connection state", shell_cloud_status),
+	SHELL_CMD_ARG(publish, NULL, "Queue a message <topic> <text>",
+		      shell_cloud_publish, 3, 0),
+	SHELL_CMD_ARG(subscribe, NULL, "Subscribe <topic>",
+		      shell_cloud_subscribe, 2, 0),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(cloud, &cloud_cmds, "Cloud pipeline commands", NULL);
+#endif /* CONFIG_SHELL */
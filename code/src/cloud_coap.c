@@ -0,0 +1,410 @@
+/**
+ * @file cloud_coap.c
+ * @brief CoAP cloud transport (NB-IoT).
+ *
+ * Messages are sent as confirmable POST requests to the topic (used as the
+ * URI path) over DTLS with a pre-shared key.  Subscriptions are CoAP
+ * observations.  Retransmission follows RFC 7252 with one outstanding
+ * request.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(cloud_coap);
+
+#define COAP_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define COAP_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define COAP_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define COAP_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <random/rand32.h>
+#include <net/socket.h>
+#include <net/coap.h>
+#include <net/tls_credentials.h>
+
+#include "dns_cache.h"
+#include "cloud_transport.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define COAP_VERSION 1
+#define COAP_TOKEN_SIZE 8
+#define COAP_MAX_OPTIONS 16
+#define COAP_PATH_DELIMITER '/'
+
+struct observation {
+	const char *path;
+	uint8_t token[COAP_TOKEN_SIZE];
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int coapInit(const struct cloud_transport_config *cfg,
+		    cloud_rx_callback_t rx);
+static int coapConnect(void);
+static void coapDisconnect(void);
+static int coapPublish(const struct cloud_publish *items, size_t count);
+static int coapSubscribe(const char *topic);
+static int coapPoll(int timeout_ms);
+static int coapKeepAlive(void);
+
+static int initRequest(struct coap_packet *request, uint8_t method,
+		       const uint8_t *token, bool observe, const char *path);
+static int exchange(struct coap_packet *request);
+static int receive(int timeout_ms, uint16_t waitId, int *code);
+static void handleNotification(struct coap_packet *response);
+static void sendEmptyAck(uint16_t id);
+
+/******************************************************************************/
+/* Global Data Definitions                                                    */
+/******************************************************************************/
+const struct cloud_transport cloudCoapTransport = {
+	.name = "coap",
+	.init = coapInit,
+	.connect = coapConnect,
+	.disconnect = coapDisconnect,
+	.publish = coapPublish,
+	.subscribe = coapSubscribe,
+	.poll = coapPoll,
+	.keep_alive = coapKeepAlive,
+	.sleep_hint = NULL,
+};
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static const struct cloud_transport_config *config;
+static cloud_rx_callback_t rxCallback;
+
+static int sock = -1;
+static uint8_t txBuffer[CONFIG_CLOUD_COAP_BUFFER_SIZE];
+static uint8_t rxBuffer[CONFIG_CLOUD_COAP_BUFFER_SIZE];
+
+static struct observation observations[CONFIG_CLOUD_MAX_SUBSCRIPTIONS];
+static size_t observationCount;
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int coapInit(const struct cloud_transport_config *cfg,
+		    cloud_rx_callback_t rx)
+{
+	int rc = 0;
+
+	config = cfg;
+	rxCallback = rx;
+
+	if (cfg->psk != NULL) {
+		/* Replace the credentials from a previous start */
+		tls_credential_delete(CONFIG_CLOUD_COAP_SEC_TAG,
+				      TLS_CREDENTIAL_PSK);
+		tls_credential_delete(CONFIG_CLOUD_COAP_SEC_TAG,
+				      TLS_CREDENTIAL_PSK_ID);
+		rc = tls_credential_add(CONFIG_CLOUD_COAP_SEC_TAG,
+					TLS_CREDENTIAL_PSK, cfg->psk,
+					cfg->psk_len);
+		if (rc == 0) {
+			rc = tls_credential_add(CONFIG_CLOUD_COAP_SEC_TAG,
+						TLS_CREDENTIAL_PSK_ID,
+						cfg->psk_id,
+						strlen(cfg->psk_id));
+		}
+	}
+
+	return rc;
+}
+
+static int coapConnect(void)
+{
+	const sec_tag_t tags[] = { CONFIG_CLOUD_COAP_SEC_TAG };
+	struct sockaddr_in server;
+	bool secure = (config->psk != NULL);
+	int rc;
+
+	memset(&server, 0, sizeof(server));
+	rc = dnsCacheResolve(config->host, SOCK_DGRAM, &server.sin_addr);
+	if (rc != 0) {
+		return rc;
+	}
+	server.sin_family = AF_INET;
+	server.sin_port = htons(config->port);
+
+	sock = socket(AF_INET, SOCK_DGRAM,
+		      secure ? IPPROTO_DTLS_1_2 : IPPROTO_UDP);
+	if (sock < 0) {
+		return -errno;
+	}
+
+	if (secure) {
+		rc = setsockopt(sock, SOL_TLS, TLS_SEC_TAG_LIST, tags,
+				sizeof(tags));
+		if (rc == 0) {
+			rc = setsockopt(sock, SOL_TLS, TLS_HOSTNAME,
+					config->host, strlen(config->host));
+		}
+		if (rc < 0) {
+			rc = -errno;
+			coapDisconnect();
+			return rc;
+		}
+	}
+
+	/* Performs the DTLS handshake */
+	if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		rc = -errno;
+		coapDisconnect();
+		return rc;
+	}
+
+	/* Observations don't survive a new DTLS session */
+	observationCount = 0;
+	return 0;
+}
+
+static void coapDisconnect(void)
+{
+	if (sock >= 0) {
+		close(sock);
+		sock = -1;
+	}
+}
+
+static int coapPublish(const struct cloud_publish *items, size_t count)
+{
+	struct coap_packet request;
+	size_t i;
+	int rc;
+
+	for (i = 0; i < count; i++) {
+		rc = initRequest(&request, COAP_METHOD_POST, coap_next_token(),
+				 false, items[i].topic);
+		if (rc == 0) {
+			rc = coap_append_option_int(
+				&request, COAP_OPTION_CONTENT_FORMAT,
+				COAP_CONTENT_FORMAT_APP_JSON);
+		}
+		if (rc == 0) {
+			rc = coap_packet_append_payload_marker(&request);
+		}
+		if (rc == 0) {
+			rc = coap_packet_append_payload(
+				&request, (uint8_t *)items[i].data,
+				items[i].len);
+		}
+		if (rc == 0) {
+			rc = exchange(&request);
+		}
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int coapSubscribe(const char *topic)
+{
+	struct observation *o;
+	struct coap_packet request;
+	int rc;
+
+	if (observationCount >= ARRAY_SIZE(observations)) {
+		return -ENOMEM;
+	}
+	o = &observations[observationCount];
+	o->path = topic;
+	memcpy(o->token, coap_next_token(), COAP_TOKEN_SIZE);
+
+	rc = initRequest(&request, COAP_METHOD_GET, o->token, true, topic);
+	if (rc == 0) {
+		rc = exchange(&request);
+	}
+	if (rc == 0) {
+		observationCount += 1;
+	}
+	return rc;
+}
+
+static int coapPoll(int timeout_ms)
+{
+	int code;
+	int rc = receive(timeout_ms, 0, &code);
+
+	return (rc == -EAGAIN) ? 0 : rc;
+}
+
+/* An empty confirmable message (CoAP ping) refreshes the NAT binding. */
+static int coapKeepAlive(void)
+{
+	struct coap_packet request;
+	int rc;
+
+	rc = coap_packet_init(&request, txBuffer, sizeof(txBuffer),
+			      COAP_VERSION, COAP_TYPE_CON, 0, NULL, 0,
+			      coap_next_id());
+	if (rc == 0) {
+		rc = exchange(&request);
+	}
+	/* A server answers a ping with a reset */
+	return (rc == -ECONNRESET) ? 0 : rc;
+}
+
+/* Options must be appended in ascending order, so Observe precedes the
+ * Uri-Path options.  The path may contain several segments separated by '/'.
+ */
+static int initRequest(struct coap_packet *request, uint8_t method,
+		       const uint8_t *token, bool observe, const char *path)
+{
+	const char *segment;
+	const char *end;
+	int rc;
+
+	rc = coap_packet_init(request, txBuffer, sizeof(txBuffer),
+			      COAP_VERSION, COAP_TYPE_CON, COAP_TOKEN_SIZE,
+			      token, method, coap_next_id());
+	if (rc == 0 && observe) {
+		rc = coap_append_option_int(request, COAP_OPTION_OBSERVE, 0);
+	}
+
+	for (segment = path; rc == 0 && segment != NULL && *segment != '\0';
+	     segment = (*end != '\0') ? end + 1 : end) {
+		end = strchr(segment, COAP_PATH_DELIMITER);
+		if (end == NULL) {
+			end = segment + strlen(segment);
+		}
+		if (end > segment) {
+			rc = coap_packet_append_option(
+				request, COAP_OPTION_URI_PATH,
+				(const uint8_t *)segment, end - segment);
+		}
+	}
+
+	return rc;
+}
+
+/* Send a confirmable request and wait for the acknowledgement, retransmitting
+ * with exponential backoff.
+ */
+static int exchange(struct coap_packet *request)
+{
+	uint16_t id = coap_header_get_id(request);
+	uint32_t timeout =
+		CONFIG_CLOUD_COAP_ACK_TIMEOUT_MS +
+		(sys_rand32_get() % (CONFIG_CLOUD_COAP_ACK_TIMEOUT_MS / 2));
+	uint32_t attempt;
+	int code;
+	int rc;
+
+	for (attempt = 0; attempt <= CONFIG_CLOUD_COAP_MAX_RETRANSMIT;
+	     attempt++) {
+		if (send(sock, request->data, request->offset, 0) < 0) {
+			return -errno;
+		}
+
+		rc = receive(timeout, id, &code);
+		if (rc != -EAGAIN) {
+			break;
+		}
+		timeout *= 2;
+	}
+
+	if (rc == 0 && code >= COAP_RESPONSE_CODE_BAD_REQUEST) {
+		COAP_LOG_ERR("Response %u.%02u", code >> 5, code & 0x1F);
+		rc = -EIO;
+	}
+	return (rc == -EAGAIN) ? -ETIMEDOUT : rc;
+}
+
+/* Process datagrams until the response to waitId arrives (0 processes what
+ * arrives within the timeout).
+ */
+static int receive(int timeout_ms, uint16_t waitId, int *code)
+{
+	struct coap_option options[COAP_MAX_OPTIONS];
+	struct pollfd fds = { .fd = sock, .events = POLLIN };
+	struct coap_packet response;
+	int64_t deadline = k_uptime_get() + timeout_ms;
+	int64_t remaining = timeout_ms;
+	uint8_t type;
+	ssize_t n;
+	int rc;
+
+	do {
+		rc = poll(&fds, 1, (int)remaining);
+		if (rc < 0) {
+			return -errno;
+		}
+		if (rc == 0) {
+			return -EAGAIN;
+		}
+
+		n = recv(sock, rxBuffer, sizeof(rxBuffer), 0);
+		if (n < 0) {
+			return -errno;
+		}
+		if (coap_packet_parse(&response, rxBuffer, n, options,
+				      ARRAY_SIZE(options)) < 0) {
+			continue;
+		}
+
+		type = coap_header_get_type(&response);
+		if (waitId != 0 && coap_header_get_id(&response) == waitId &&
+		    (type == COAP_TYPE_ACK || type == COAP_TYPE_RESET)) {
+			*code = coap_header_get_code(&response);
+			return (type == COAP_TYPE_RESET) ? -ECONNRESET : 0;
+		}
+
+		handleNotification(&response);
+		remaining = deadline - k_uptime_get();
+	} while (remaining > 0);
+
+	return -EAGAIN;
+}
+
+static void handleNotification(struct coap_packet *response)
+{
+	uint8_t token[COAP_TOKEN_SIZE];
+	const uint8_t *payload;
+	uint16_t len;
+	size_t i;
+
+	if (coap_header_get_type(response) == COAP_TYPE_CON) {
+		sendEmptyAck(coap_header_get_id(response));
+	}
+
+	if (coap_header_get_token(response, token) != COAP_TOKEN_SIZE) {
+		return;
+	}
+	for (i = 0; i < observationCount; i++) {
+		if (memcmp(token, observations[i].token, COAP_TOKEN_SIZE) ==
+		    0) {
+			payload = coap_packet_get_payload(response, &len);
+			if (payload != NULL && rxCallback != NULL) {
+				rxCallback(observations[i].path, payload, len);
+			}
+			return;
+		}
+	}
+}
+
+static void sendEmptyAck(uint16_t id)
+{
+	struct coap_packet ack;
+	uint8_t buffer[4];
+
+	if (coap_packet_init(&ack, buffer, sizeof(buffer), COAP_VERSION,
+			     COAP_TYPE_ACK, 0, NULL, 0, id) == 0) {
+		send(sock, ack.data, ack.offset, 0);
+	}
+}
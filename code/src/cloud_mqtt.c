@@ -0,0 +1,530 @@
+/**
+ * @file cloud_mqtt.c
+ * @brief MQTT cloud transport (AWS IoT).
+ *
+ * The MQTT library uses a custom transport so that the TLS session is managed
+ * by tls_session and can be resumed when reconnecting.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(cloud_mqtt);
+
+#define MQTT_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define MQTT_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define MQTT_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define MQTT_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <net/socket.h>
+#include <net/mqtt.h>
+
+#include "tls_session.h"
+#include "dns_cache.h"
+#include "cloud_transport.h"
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int mqttInit(const struct cloud_transport_config *cfg,
+		    cloud_rx_callback_t rx);
+static int mqttConnect(void);
+static void mqttDisconnect(void);
+static int mqttPublish(const struct cloud_publish *items, size_t count);
+static int mqttSubscribe(const char *topic);
+static int mqttPoll(int timeout_ms);
+static int mqttKeepAlive(void);
+
+static int resolveBroker(void);
+static void eventHandler(struct mqtt_client *c, const struct mqtt_evt *evt);
+static void receivePublish(const struct mqtt_publish_param *p);
+static int readPayload(uint8_t *buf, uint32_t len);
+static int waitForAcks(void);
+static int processInput(int timeout_ms);
+static bool readable(void);
+static uint16_t nextMessageId(void);
+static void expectAck(uint16_t id);
+static void onAck(uint16_t id);
+static void clearAcks(void);
+
+/******************************************************************************/
+/* Global Data Definitions                                                    */
+/******************************************************************************/
+const struct cloud_transport cloudMqttTransport = {
+	.name = "mqtt",
+	.init = mqttInit,
+	.connect = mqttConnect,
+	.disconnect = mqttDisconnect,
+	.publish = mqttPublish,
+	.subscribe = mqttSubscribe,
+	.poll = mqttPoll,
+	.keep_alive = mqttKeepAlive,
+	.sleep_hint = NULL,
+};
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static const struct cloud_transport_config *config;
+static cloud_rx_callback_t rxCallback;
+
+static struct mqtt_client client;
+static struct sockaddr_storage broker;
+static uint8_t rxBuffer[CONFIG_CLOUD_MQTT_BUFFER_SIZE];
+static uint8_t txBuffer[CONFIG_CLOUD_MQTT_BUFFER_SIZE];
+
+static int sock = -1;
+static bool secure;
+static struct tls_conn tls;
+
+static bool mqttConnected;
+/* CONNACK, PUBACK and SUBACK that haven't been received */
+static size_t outstanding;
+/* Message IDs of the PUBACKs and SUBACK counted in outstanding */
+static uint16_t pendingIds[CONFIG_CLOUD_BATCH_MAX];
+static size_t pendingCount;
+static uint16_t messageId;
+
+static char rxTopic[CONFIG_CLOUD_MQTT_TOPIC_SIZE];
+static uint8_t rxPayload[CONFIG_CLOUD_MQTT_PAYLOAD_SIZE];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+/* Custom transport used by the MQTT library */
+int mqtt_client_custom_transport_connect(struct mqtt_client *c)
+{
+	struct tls_session_config tlsConfig;
+	int rc;
+
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		return -errno;
+	}
+
+	if (connect(sock, (struct sockaddr *)c->broker,
+		    sizeof(struct sockaddr_in)) < 0) {
+		rc = -errno;
+		close(sock);
+		sock = -1;
+		return rc;
+	}
+
+	secure = (config->ca != NULL);
+	if (secure) {
+		tlsConfig.hostname = config->host;
+		tlsConfig.ca = config->ca;
+		tlsConfig.ca_len = config->ca_len;
+		tlsConfig.cert = config->cert;
+		tlsConfig.cert_len = config->cert_len;
+		tlsConfig.key = config->key;
+		tlsConfig.key_len = config->key_len;
+		if (tlsSessionOpen(&tls, sock, &tlsConfig) != 0) {
+			close(sock);
+			sock = -1;
+			return -ECONNREFUSED;
+		}
+	}
+
+	return 0;
+}
+
+int mqtt_client_custom_transport_write(struct mqtt_client *c,
+				       const uint8_t *data, uint32_t datalen)
+{
+	ssize_t n;
+
+	ARG_UNUSED(c);
+
+	while (datalen > 0) {
+		n = secure ? tlsSessionSend(&tls, data, datalen) :
+			     send(sock, data, datalen, 0);
+		if (n < 0) {
+			return -EIO;
+		}
+		data += n;
+		datalen -= n;
+	}
+
+	return 0;
+}
+
+int mqtt_client_custom_transport_write_msg(struct mqtt_client *c,
+					   const struct msghdr *message)
+{
+	size_t i;
+	int rc;
+
+	for (i = 0; i < message->msg_iovlen; i++) {
+		rc = mqtt_client_custom_transport_write(
+			c, message->msg_iov[i].iov_base,
+			message->msg_iov[i].iov_len);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+int mqtt_client_custom_transport_read(struct mqtt_client *c, uint8_t *data,
+				      uint32_t buflen, bool shall_block)
+{
+	ssize_t n;
+
+	ARG_UNUSED(c);
+
+	if (!shall_block && !readable()) {
+		return -EAGAIN;
+	}
+
+	n = secure ? tlsSessionRecv(&tls, data, buflen) :
+		     recv(sock, data, buflen, 0);
+	return (n < 0) ? -EIO : n;
+}
+
+int mqtt_client_custom_transport_disconnect(struct mqtt_client *c)
+{
+	ARG_UNUSED(c);
+
+	if (secure) {
+		tlsSessionClose(&tls);
+	}
+	if (sock >= 0) {
+		close(sock);
+		sock = -1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int mqttInit(const struct cloud_transport_config *cfg,
+		    cloud_rx_callback_t rx)
+{
+	config = cfg;
+	rxCallback = rx;
+	return 0;
+}
+
+static int mqttConnect(void)
+{
+	int rc;
+
+	rc = resolveBroker();
+	if (rc != 0) {
+		return rc;
+	}
+
+	mqtt_client_init(&client);
+	client.broker = &broker;
+	client.evt_cb = eventHandler;
+	client.client_id.utf8 = (uint8_t *)config->client_id;
+	client.client_id.size = strlen(config->client_id);
+	client.protocol_version = MQTT_VERSION_3_1_1;
+	client.rx_buf = rxBuffer;
+	client.rx_buf_size = sizeof(rxBuffer);
+	client.tx_buf = txBuffer;
+	client.tx_buf_size = sizeof(txBuffer);
+	client.transport.type = MQTT_TRANSPORT_CUSTOM;
+
+	mqttConnected = false;
+	clearAcks();
+	outstanding = 1;
+	rc = mqtt_connect(&client);
+	if (rc != 0) {
+		return rc;
+	}
+
+	rc = waitForAcks();
+	if (rc == 0 && !mqttConnected) {
+		rc = -ECONNREFUSED;
+	}
+	if (rc != 0) {
+		mqtt_abort(&client);
+	}
+	return rc;
+}
+
+static void mqttDisconnect(void)
+{
+	if (mqtt_disconnect(&client) != 0) {
+		mqtt_abort(&client);
+	}
+	mqttConnected = false;
+}
+
+/* QoS 1 messages are sent back to back and then the PUBACKs are collected,
+ * so the whole batch takes one round trip.
+ */
+static int mqttPublish(const struct cloud_publish *items, size_t count)
+{
+	struct mqtt_publish_param param;
+	size_t i;
+	int rc;
+
+	for (i = 0; i < count; i++) {
+		memset(&param, 0, sizeof(param));
+		param.message.topic.topic.utf8 = (uint8_t *)items[i].topic;
+		param.message.topic.topic.size = strlen(items[i].topic);
+		param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
+		param.message.payload.data = (uint8_t *)items[i].data;
+		param.message.payload.len = items[i].len;
+		param.message_id = nextMessageId();
+
+		rc = mqtt_publish(&client, &param);
+		if (rc != 0) {
+			clearAcks();
+			return rc;
+		}
+		expectAck(param.message_id);
+	}
+
+	return waitForAcks();
+}
+
+static int mqttSubscribe(const char *topic)
+{
+	struct mqtt_topic t = {
+		.topic = { .utf8 = (uint8_t *)topic, .size = strlen(topic) },
+		.qos = MQTT_QOS_1_AT_LEAST_ONCE
+	};
+	const struct mqtt_subscription_list list = {
+		.list = &t, .list_count = 1, .message_id = nextMessageId()
+	};
+	int rc;
+
+	rc = mqtt_subscribe(&client, &list);
+	if (rc == 0) {
+		expectAck(list.message_id);
+		rc = waitForAcks();
+	}
+	return rc;
+}
+
+static int mqttPoll(int timeout_ms)
+{
+	int rc = processInput(timeout_ms);
+
+	/* Only pings if the keep-alive scheduler didn't */
+	if (rc == 0) {
+		rc = mqtt_live(&client);
+		if (rc == -EAGAIN) {
+			rc = 0;
+		}
+	}
+	return mqttConnected ? rc : -ENOTCONN;
+}
+
+static int mqttKeepAlive(void)
+{
+	return mqtt_ping(&client);
+}
+
+static int resolveBroker(void)
+{
+	struct in_addr addr;
+	int rc;
+
+	rc = dnsCacheResolve(config->host, SOCK_STREAM, &addr);
+	if (rc != 0) {
+		return rc;
+	}
+
+	memset(&broker, 0, sizeof(broker));
+	net_sin((struct sockaddr *)&broker)->sin_family = AF_INET;
+	net_sin((struct sockaddr *)&broker)->sin_addr = addr;
+	net_sin((struct sockaddr *)&broker)->sin_port = htons(config->port);
+
+	return 0;
+}
+
+static void eventHandler(struct mqtt_client *c, const struct mqtt_evt *evt)
+{
+	ARG_UNUSED(c);
+
+	switch (evt->type) {
+	case MQTT_EVT_CONNACK:
+		mqttConnected = (evt->result == 0);
+		if (!mqttConnected) {
+			MQTT_LOG_ERR("Connection refused (%d)", evt->result);
+		}
+		clearAcks();
+		break;
+
+	case MQTT_EVT_DISCONNECT:
+		mqttConnected = false;
+		break;
+
+	case MQTT_EVT_PUBACK:
+		onAck(evt->param.puback.message_id);
+		break;
+
+	case MQTT_EVT_SUBACK:
+		onAck(evt->param.suback.message_id);
+		break;
+
+	case MQTT_EVT_PUBLISH:
+		receivePublish(&evt->param.publish);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void receivePublish(const struct mqtt_publish_param *p)
+{
+	const struct mqtt_puback_param ack = { .message_id = p->message_id };
+	uint32_t len = p->message.payload.len;
+	uint32_t copied = MIN(len, sizeof(rxPayload));
+	uint8_t discard[32];
+	uint32_t chunk;
+	int rc;
+
+	memset(rxTopic, 0, sizeof(rxTopic));
+	memcpy(rxTopic, p->message.topic.topic.utf8,
+	       MIN(p->message.topic.topic.size, sizeof(rxTopic) - 1));
+
+	rc = readPayload(rxPayload, copied);
+	/* The rest must be read even though it doesn't fit */
+	for (len -= copied; rc == 0 && len > 0; len -= chunk) {
+		chunk = MIN(len, sizeof(discard));
+		rc = readPayload(discard, chunk);
+	}
+	if (rc != 0) {
+		return;
+	}
+
+	if (p->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE) {
+		mqtt_publish_qos1_ack(&client, &ack);
+	}
+
+	if (p->message.payload.len > copied) {
+		MQTT_LOG_WRN("Received %u bytes; truncated",
+			     p->message.payload.len);
+	}
+	if (rxCallback != NULL) {
+		rxCallback(rxTopic, rxPayload, copied);
+	}
+}
+
+static int readPayload(uint8_t *buf, uint32_t len)
+{
+	int n;
+
+	while (len > 0) {
+		n = mqtt_read_publish_payload_blocking(&client, buf, len);
+		if (n <= 0) {
+			return (n == 0) ? -EIO : n;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int waitForAcks(void)
+{
+	int64_t deadline = k_uptime_get() + CONFIG_CLOUD_MQTT_TIMEOUT_MS;
+	int64_t remaining;
+	int rc;
+
+	while (outstanding > 0) {
+		remaining = deadline - k_uptime_get();
+		if (remaining <= 0) {
+			clearAcks();
+			return -ETIMEDOUT;
+		}
+		rc = processInput((int)remaining);
+		if (rc < 0) {
+			clearAcks();
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int processInput(int timeout_ms)
+{
+	struct pollfd fds = { .fd = sock, .events = POLLIN };
+	int rc;
+
+	if (sock < 0) {
+		return -ENOTCONN;
+	}
+
+	if (!(secure && tlsSessionReadable(&tls))) {
+		rc = poll(&fds, 1, timeout_ms);
+		if (rc <= 0) {
+			return (rc == 0) ? 0 : -errno;
+		}
+		if (fds.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			return -ENOTCONN;
+		}
+	}
+
+	return mqtt_input(&client);
+}
+
+static bool readable(void)
+{
+	struct pollfd fds = { .fd = sock, .events = POLLIN };
+
+	if (secure) {
+		return tlsSessionReadable(&tls);
+	}
+	return (poll(&fds, 1, 0) > 0) && (fds.revents & POLLIN);
+}
+
+static uint16_t nextMessageId(void)
+{
+	/* 0 isn't a valid message ID */
+	messageId += 1;
+	if (messageId == 0) {
+		messageId = 1;
+	}
+	return messageId;
+}
+
+static void expectAck(uint16_t id)
+{
+	if (pendingCount < ARRAY_SIZE(pendingIds)) {
+		pendingIds[pendingCount++] = id;
+		outstanding += 1;
+	}
+}
+
+/* An ack that doesn't match a request in flight (for example, a late one
+ * from a batch that timed out) isn't counted.
+ */
+static void onAck(uint16_t id)
+{
+	size_t i;
+
+	for (i = 0; i < pendingCount; i++) {
+		if (pendingIds[i] == id) {
+			pendingIds[i] = pendingIds[--pendingCount];
+			outstanding -= 1;
+			return;
+		}
+	}
+	MQTT_LOG_WRN("Unexpected ack %u", id);
+}
+
+static void clearAcks(void)
+{
+	pendingCount = 0;
+	outstanding = 0;
+}
@@ -0,0 +1,322 @@
+/**
+ * @file cloud_queue.c
+ * @brief Queue of messages waiting to be sent to the cloud.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(cloud_queue);
+
+#define CLOUD_QUEUE_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define CLOUD_QUEUE_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define CLOUD_QUEUE_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define CLOUD_QUEUE_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <stdlib.h>
+#include <shell/shell.h>
+
+#include "FrameworkIncludes.h"
+#include "msg_pool.h"
+#include "metrics.h"
+#include "cloud_queue.h"
+#include "startup.h"
+#include "time_service.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+/* Normal and low priority messages are kept apart so an advertisement can be
+ * evicted with one get instead of rebuilding the queue.  Normal priority
+ * messages are taken first.
+ */
+struct queue {
+	struct k_msgq *normal;
+	struct k_msgq *low;
+	/* Given for each message queued */
+	struct k_sem *ready;
+	/* Serializes the space check with the put; never held while waiting */
+	struct k_mutex *lock;
+	struct metric *depth;
+	struct metric *shed;
+	struct metric *rejected;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int put(const struct queue *q, FwkMsg_t *pMsg, k_timeout_t timeout);
+static int get(const struct queue *q, FwkMsg_t **ppMsg, k_timeout_t timeout);
+static uint32_t depthOf(const struct queue *q);
+static bool isLowPriority(const FwkMsg_t *pMsg);
+static void evictLowPriority(const struct queue *q);
+static void updateDepth(const struct queue *q);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_MSGQ_DEFINE(cloudQ, FWK_QUEUE_ENTRY_SIZE, CONFIG_CLOUD_QUEUE_SIZE,
+	      FWK_QUEUE_ALIGNMENT);
+K_MSGQ_DEFINE(cloudLowQ, FWK_QUEUE_ENTRY_SIZE, CONFIG_CLOUD_QUEUE_SIZE,
+	      FWK_QUEUE_ALIGNMENT);
+K_SEM_DEFINE(cloudQReady, 0, 2 * CONFIG_CLOUD_QUEUE_SIZE);
+K_MUTEX_DEFINE(putLock);
+
+METRIC_GAUGE_DEFINE(depth, "cloud_queue_depth");
+METRIC_COUNTER_DEFINE(shed, "cloud_queue_shed");
+METRIC_COUNTER_DEFINE(rejected, "cloud_queue_rejected");
+
+static const struct queue cloudQueue = {
+	.normal = &cloudQ,
+	.low = &cloudLowQ,
+	.ready = &cloudQReady,
+	.lock = &putLock,
+	.depth = &depth,
+	.shed = &shed,
+	.rejected = &rejected,
+};
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+int cloudQueuePut(FwkMsg_t *pMsg, k_timeout_t timeout)
+{
+	switch (pMsg->header.msgCode) {
+	case FMC_SENSOR_PUBLISH:
+		startupMark(STARTUP_FIRST_SENSOR_SAMPLE);
+		/* fallthrough */
+	case FMC_GATEWAY_OUT:
+	case FMC_SENSOR_SHADOW_INIT:
+		/* Converted to wall clock time when it is published */
+		((JsonMsg_t *)pMsg)->timestamp = timeServiceUptimeMs();
+		break;
+
+	default:
+		break;
+	}
+
+	return put(&cloudQueue, pMsg, timeout);
+}
+
+int cloudQueueGet(FwkMsg_t **ppMsg, k_timeout_t timeout)
+{
+	if (get(&cloudQueue, ppMsg, timeout) != 0) {
+		return -EAGAIN;
+	}
+
+	MSG_TRACE_HOP_MSG(*ppMsg, FWK_ID_CLOUD);
+	return 0;
+}
+
+uint32_t cloudQueueDepth(void)
+{
+	return depthOf(&cloudQueue);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int put(const struct queue *q, FwkMsg_t *pMsg, k_timeout_t timeout)
+{
+	int rc;
+
+	k_mutex_lock(q->lock, K_FOREVER);
+	if (isLowPriority(pMsg)) {
+		rc = -ENOBUFS;
+		if (depthOf(q) < CONFIG_CLOUD_PURGE_THRESHOLD) {
+			rc = k_msgq_put(q->low, &pMsg, K_NO_WAIT);
+		}
+		k_mutex_unlock(q->lock);
+		if (rc != 0) {
+			metricsIncrement(q->shed);
+			MsgPool_Free(pMsg);
+			return -ENOBUFS;
+		}
+	} else {
+		if (depthOf(q) >= CONFIG_CLOUD_QUEUE_SIZE) {
+			evictLowPriority(q);
+		}
+		rc = k_msgq_put(q->normal, &pMsg, K_NO_WAIT);
+		k_mutex_unlock(q->lock);
+		if (rc != 0) {
+			/* Only normal priority messages are left to wait for */
+			rc = k_msgq_put(q->normal, &pMsg, timeout);
+		}
+		if (rc != 0) {
+			CLOUD_QUEUE_LOG_WRN(
+				"Cloud queue full; dropping message %u",
+				pMsg->header.msgCode);
+			metricsIncrement(q->rejected);
+			MsgPool_Free(pMsg);
+			return -ENOBUFS;
+		}
+	}
+
+	k_sem_give(q->ready);
+	updateDepth(q);
+	return 0;
+}
+
+static int get(const struct queue *q, FwkMsg_t **ppMsg, k_timeout_t timeout)
+{
+	int rc;
+
+	if (k_sem_take(q->ready, timeout) != 0) {
+		return -EAGAIN;
+	}
+
+	rc = k_msgq_get(q->normal, ppMsg, K_NO_WAIT);
+	if (rc != 0) {
+		/* Empty if the advertisement was evicted after it was
+		 * signaled; the caller sees a timeout.
+		 */
+		rc = k_msgq_get(q->low, ppMsg, K_NO_WAIT);
+	}
+
+	updateDepth(q);
+	return (rc == 0) ? 0 : -EAGAIN;
+}
+
+static uint32_t depthOf(const struct queue *q)
+{
+	return k_msgq_num_used_get(q->normal) + k_msgq_num_used_get(q->low);
+}
+
+static bool isLowPriority(const FwkMsg_t *pMsg)
+{
+	return pMsg->header.msgCode == FMC_ADV;
+}
+
+/* Remove the oldest low priority message.  The caller must hold the lock. */
+static void evictLowPriority(const struct queue *q)
+{
+	FwkMsg_t *pMsg;
+
+	if (k_msgq_get(q->low, &pMsg, K_NO_WAIT) == 0) {
+		/* Its signal is normally still pending */
+		k_sem_take(q->ready, K_NO_WAIT);
+		metricsIncrement(q->shed);
+		MsgPool_Free(pMsg);
+	}
+}
+
+static void updateDepth(const struct queue *q)
+{
+	metricsGaugeSet(q->depth, depthOf(q));
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+/* The flood test uses its own queue so it can't drop queued telemetry */
+K_MSGQ_DEFINE(testQ, FWK_QUEUE_ENTRY_SIZE, CONFIG_CLOUD_QUEUE_SIZE,
+	      FWK_QUEUE_ALIGNMENT);
+K_MSGQ_DEFINE(testLowQ, FWK_QUEUE_ENTRY_SIZE, CONFIG_CLOUD_QUEUE_SIZE,
+	      FWK_QUEUE_ALIGNMENT);
+K_SEM_DEFINE(testQReady, 0, 2 * CONFIG_CLOUD_QUEUE_SIZE);
+K_MUTEX_DEFINE(testLock);
+
+/* Not exported (kept out of the metric section) */
+static struct metric testDepth = { .type = METRIC_TYPE_GAUGE };
+static struct metric testShed = { .type = METRIC_TYPE_COUNTER };
+static struct metric testRejected = { .type = METRIC_TYPE_COUNTER };
+
+static const struct queue testQueue = {
+	.normal = &testQ,
+	.low = &testLowQ,
+	.ready = &testQReady,
+	.lock = &testLock,
+	.depth = &testDepth,
+	.shed = &testShed,
+	.rejected = &testRejected,
+};
+
+/* Fill a test queue with advertisements, check that a normal priority
+ * message still gets in, then drain the queue and check that every buffer
+ * was returned to the pool.
+ */
+static int shell_cloudq_flood(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	struct msg_pool_stats before;
+	struct msg_pool_stats after;
+	uint32_t count = CONFIG_CLOUD_QUEUE_SIZE * 4;
+	uint32_t accepted = 0;
+	uint32_t dropped = 0;
+	uint32_t noBuffer = 0;
+	uint32_t drained = 0;
+	FwkMsg_t *pMsg;
+	uint32_t i;
+	int rc;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 0);
+	}
+
+	MsgPool_GetStats(MSG_POOL_CLASS_ADV, &before);
+
+	for (i = 0; i < count; i++) {
+		pMsg = MsgPool_Take(sizeof(AdvMsg_t));
+		if (pMsg == NULL) {
+			noBuffer += 1;
+			continue;
+		}
+		memset(pMsg, 0, sizeof(AdvMsg_t));
+		pMsg->header.msgCode = FMC_ADV;
+		pMsg->header.rxId = FWK_ID_CLOUD;
+		pMsg->header.txId = FWK_ID_RESERVED;
+		if (put(&testQueue, pMsg, K_NO_WAIT) == 0) {
+			accepted += 1;
+		} else {
+			dropped += 1;
+		}
+	}
+
+	pMsg = MsgPool_Take(sizeof(FwkMsg_t));
+	if (pMsg != NULL) {
+		memset(pMsg, 0, sizeof(FwkMsg_t));
+		pMsg->header.msgCode = FMC_AWS_KEEP_ALIVE;
+		pMsg->header.rxId = FWK_ID_CLOUD;
+		pMsg->header.txId = FWK_ID_RESERVED;
+		rc = put(&testQueue, pMsg, K_NO_WAIT);
+		shell_print(shell, "Normal priority message %s",
+			    (rc == 0) ? "queued" : "rejected");
+	}
+
+	while (get(&testQueue, &pMsg, K_NO_WAIT) == 0) {
+		MsgPool_Free(pMsg);
+		drained += 1;
+	}
+
+	MsgPool_GetStats(MSG_POOL_CLASS_ADV, &after);
+
+	shell_print(shell,
+		    "Sent %u accepted %u shed %u no buffer %u drained %u",
+		    count, accepted, dropped, noBuffer, drained);
+	if (after.used == before.used && depthOf(&testQueue) == 0) {
+		shell_print(shell, "Recovered");
+	} else {
+		shell_error(shell, "Pool used %u (was %u) queue depth %u",
+			    after.used, before.used, depthOf(&testQueue));
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	cloudq_cmds,
+	SHELL_CMD_ARG(flood, NULL,
+		      "Flood a test queue with advertisements and check "
+		      "that it recovers [count]",
+		      shell_cloudq_flood, 1, 1),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(cloudq, &cloudq_cmds, "Cloud queue commands", NULL);
+#endif /* CONFIG_SHELL */
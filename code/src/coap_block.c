@@ -0,0 +1,952 @@
+/**
+ * @file coap_block.c
+ * @brief Windowed CoAP block-wise (Block2) downloads.
+ *
+ * Requests are confirmable GETs with the Block2 option.  Each request in
+ * flight has a slot indexed by block number modulo the maximum window; the
+ * slot holds the block until all earlier blocks are written.  The first
+ * request is sent alone so the server can choose a smaller block size.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(coap_block);
+
+#define COAP_BLOCK_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define COAP_BLOCK_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define COAP_BLOCK_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define COAP_BLOCK_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <stdlib.h>
+#include <shell/shell.h>
+#include <sys/crc.h>
+#include <net/socket.h>
+#include <net/coap.h>
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+#include <random/rand32.h>
+#endif
+
+#include "metrics.h"
+#include "app_nv.h"
+#include "dns_cache.h"
+#include "coap_block.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define COAP_VERSION 1
+#define TOKEN_SIZE 8
+#define ETAG_MAX_SIZE 8
+#define MAX_OPTIONS 16
+#define PATH_DELIMITER '/'
+
+#define COAP_OPTION_ETAG 4
+
+/* Room for the header, token and options of a response */
+#define RX_BUFFER_SIZE (CONFIG_COAP_BLOCK_SIZE + 64)
+
+#define MIN_BLOCK_SIZE 16
+#define BLOCK_SZX(size) (__builtin_ctz(size) - 4)
+#define BLOCK_SIZE(szx) (MIN_BLOCK_SIZE << (szx))
+
+#define BLOCK2_NUM(v) ((v) >> 4)
+#define BLOCK2_MORE(v) (((v) >> 3) & 1)
+#define BLOCK2_SZX(v) ((v)&0x7)
+#define BLOCK2_VALUE(num, szx) (((num) << 4) | (szx))
+
+#define MIN_RTO_MS 1000
+#define MAX_RTO_MS 60000
+
+#define RESPONSE_IS_SUCCESS(code) (((code) >> 5) == 2)
+
+BUILD_ASSERT((CONFIG_COAP_BLOCK_SIZE & (CONFIG_COAP_BLOCK_SIZE - 1)) == 0,
+	     "Block size must be a power of 2");
+
+enum slot_state { SLOT_FREE = 0, SLOT_SENT, SLOT_DONE, SLOT_FAILED };
+
+struct slot {
+	enum slot_state state;
+	uint32_t block;
+	uint16_t id;
+	uint8_t token[TOKEN_SIZE];
+	uint8_t retries;
+	uint8_t code;
+	int64_t sent;
+	int64_t deadline;
+	bool more;
+	uint16_t len;
+	uint8_t data[CONFIG_COAP_BLOCK_SIZE];
+};
+
+/* Saved in flash */
+struct resume_state {
+	uint32_t uri_crc;
+	uint32_t offset;
+	uint8_t etag_len;
+	uint8_t etag[ETAG_MAX_SIZE];
+};
+
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+struct delayed_response {
+	int64_t release;
+	uint16_t len;
+	uint8_t data[RX_BUFFER_SIZE];
+};
+#endif
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int run(void);
+static int openSocket(void);
+static int fillWindow(void);
+static int sendRequest(struct slot *s);
+static int receive(int timeout_ms);
+static int handleResponse(struct coap_packet *response);
+static int acceptBlock(struct slot *s, struct coap_packet *response);
+static int checkEtag(struct coap_packet *response);
+static int writeBlocks(void);
+static int checkTimeouts(void);
+static int nextTimeout(void);
+static void updateRtt(uint32_t sample);
+static void endBlock(uint32_t last);
+static struct slot *findSlotById(uint16_t id);
+static struct slot *findSlotByToken(const uint8_t *token);
+static void sendEmptyAck(uint16_t id);
+static uint32_t uriCrc(void);
+static void loadResumeState(void);
+static void saveResumeState(void);
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+static bool injectFault(size_t len);
+static size_t releaseDelayed(int *timeout_ms);
+#endif
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_MUTEX_DEFINE(downloadLock);
+
+/* State of the download in progress (protected by downloadLock) */
+static const struct coap_block_download *dl;
+static int sock = -1;
+static struct slot slots[CONFIG_COAP_BLOCK_WINDOW_MAX];
+static uint8_t rxBuffer[RX_BUFFER_SIZE];
+static uint8_t txBuffer[128];
+
+static uint8_t szx;
+static bool negotiated;
+static bool complete;
+static uint32_t nextRequest;
+static uint32_t nextWrite;
+static uint32_t lastBlock;
+static bool lastKnown;
+static size_t offset;
+static uint32_t inflight;
+static uint32_t sinceCheckpoint;
+
+/* Congestion control */
+static uint32_t window;
+static uint32_t windowMax;
+static uint32_t acked;
+static uint32_t recoverBlock;
+static uint32_t srtt;
+static uint32_t rttvar;
+static uint32_t rto;
+
+static struct resume_state resume;
+static struct coap_block_stats stats;
+
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+/* Set by the shell for one download */
+static uint32_t faultLossPercent;
+static uint32_t faultDelayMs;
+static uint32_t faultDrops;
+static struct delayed_response delayed[CONFIG_COAP_BLOCK_WINDOW_MAX];
+#endif
+
+METRIC_COUNTER_DEFINE(retransmits, "coap_block_retransmits");
+METRIC_COUNTER_DEFINE(blocks, "coap_block_blocks");
+METRIC_GAUGE_DEFINE(windowSize, "coap_block_window");
+METRIC_HISTOGRAM_DEFINE(rttHistogram, "coap_block_rtt_ms",
+			METRIC_LATENCY_MS_BOUNDS);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+int coapBlockDownload(const struct coap_block_download *d,
+		      struct coap_block_stats *result)
+{
+	uint32_t size = CONFIG_COAP_BLOCK_SIZE;
+	int64_t start = k_uptime_get();
+	int rc;
+
+	k_mutex_lock(&downloadLock, K_FOREVER);
+
+	dl = d;
+	memset(slots, 0, sizeof(slots));
+	memset(&stats, 0, sizeof(stats));
+	negotiated = false;
+	complete = false;
+	lastKnown = false;
+	inflight = 0;
+	sinceCheckpoint = 0;
+
+	windowMax = (d->window == 0) ?
+			    CONFIG_COAP_BLOCK_WINDOW_MAX :
+			    MIN(d->window, CONFIG_COAP_BLOCK_WINDOW_MAX);
+	window = MIN(CONFIG_COAP_BLOCK_WINDOW_INITIAL, windowMax);
+	acked = 0;
+	srtt = 0;
+	rttvar = 0;
+	rto = CONFIG_COAP_BLOCK_ACK_TIMEOUT_MS;
+
+	loadResumeState();
+	offset = resume.offset;
+	/* The server may have chosen a smaller size before the reset */
+	while ((offset % size) != 0) {
+		size /= 2;
+	}
+	szx = BLOCK_SZX(size);
+	nextWrite = offset / size;
+	nextRequest = nextWrite;
+	recoverBlock = nextWrite;
+	stats.start_offset = offset;
+	if (offset != 0) {
+		COAP_BLOCK_LOG_INF("Resuming at %u", (uint32_t)offset);
+	}
+
+	rc = openSocket();
+	if (rc == 0) {
+		rc = run();
+	}
+	if (sock >= 0) {
+		close(sock);
+		sock = -1;
+	}
+
+	if (rc == 0 || rc == -ESTALE) {
+		coapBlockForget();
+	} else if (dl->write(dl->ctx, offset, NULL, 0, true) == 0) {
+		saveResumeState();
+	}
+
+	stats.size = offset;
+	stats.duration_ms = (uint32_t)(k_uptime_get() - start);
+	stats.srtt_ms = srtt;
+	if (result != NULL) {
+		*result = stats;
+	}
+
+	k_mutex_unlock(&downloadLock);
+	return rc;
+}
+
+void coapBlockForget(void)
+{
+	memset(&resume, 0, sizeof(resume));
+	appNvDelete(APP_NV_ID_COAP_BLOCK_RESUME);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int run(void)
+{
+	int rc = 0;
+
+	while (rc == 0 && !complete) {
+		rc = fillWindow();
+		if (rc == 0) {
+			rc = receive(nextTimeout());
+		}
+		if (rc == 0) {
+			rc = writeBlocks();
+		}
+		if (rc == 0) {
+			rc = checkTimeouts();
+		}
+	}
+
+	return rc;
+}
+
+static int openSocket(void)
+{
+	const sec_tag_t tags[] = { CONFIG_COAP_BLOCK_SEC_TAG };
+	struct sockaddr_in server;
+	int rc;
+
+	memset(&server, 0, sizeof(server));
+	rc = dnsCacheResolve(dl->host, SOCK_DGRAM, &server.sin_addr);
+	if (rc != 0) {
+		return rc;
+	}
+	server.sin_family = AF_INET;
+	server.sin_port = htons(dl->port);
+
+	sock = socket(AF_INET, SOCK_DGRAM,
+		      dl->secure ? IPPROTO_DTLS_1_2 : IPPROTO_UDP);
+	if (sock < 0) {
+		return -errno;
+	}
+
+	if (dl->secure && setsockopt(sock, SOL_TLS, TLS_SEC_TAG_LIST, tags,
+				     sizeof(tags)) < 0) {
+		return -errno;
+	}
+
+	if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+/* Until the first response arrives only one request is in flight. */
+static int fillWindow(void)
+{
+	uint32_t limit = negotiated ? window : 1;
+	struct slot *s;
+	int rc;
+
+	while (inflight < limit &&
+	       nextRequest < nextWrite + CONFIG_COAP_BLOCK_WINDOW_MAX &&
+	       (!lastKnown || nextRequest <= lastBlock)) {
+		s = &slots[nextRequest % CONFIG_COAP_BLOCK_WINDOW_MAX];
+		if (s->state != SLOT_FREE) {
+			break;
+		}
+		s->state = SLOT_SENT;
+		s->block = nextRequest++;
+		s->id = coap_next_id();
+		memcpy(s->token, coap_next_token(), TOKEN_SIZE);
+		s->retries = 0;
+		inflight += 1;
+
+		rc = sendRequest(s);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/* A retransmission uses the same message ID and token. */
+static int sendRequest(struct slot *s)
+{
+	struct coap_packet request;
+	const char *segment;
+	const char *end;
+	int rc;
+
+	rc = coap_packet_init(&request, txBuffer, sizeof(txBuffer),
+			      COAP_VERSION, COAP_TYPE_CON, TOKEN_SIZE, s->token,
+			      COAP_METHOD_GET, s->id);
+
+	for (segment = dl->path; rc == 0 && *segment != '\0';
+	     segment = (*end != '\0') ? end + 1 : end) {
+		end = strchr(segment, PATH_DELIMITER);
+		if (end == NULL) {
+			end = segment + strlen(segment);
+		}
+		if (end > segment) {
+			rc = coap_packet_append_option(
+				&request, COAP_OPTION_URI_PATH,
+				(const uint8_t *)segment, end - segment);
+		}
+	}
+	if (rc == 0) {
+		rc = coap_append_option_int(&request, COAP_OPTION_BLOCK2,
+					    BLOCK2_VALUE(s->block, szx));
+	}
+	if (rc != 0) {
+		return rc;
+	}
+
+	if (send(sock, request.data, request.offset, 0) < 0) {
+		return -errno;
+	}
+
+	s->sent = k_uptime_get();
+	s->deadline = s->sent + MIN((int64_t)rto << s->retries, MAX_RTO_MS);
+	return 0;
+}
+
+static int receive(int timeout_ms)
+{
+	struct coap_option options[MAX_OPTIONS];
+	struct pollfd fds = { .fd = sock, .events = POLLIN };
+	struct coap_packet response;
+	ssize_t n = 0;
+	int rc;
+
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+	n = releaseDelayed(&timeout_ms);
+#endif
+	if (n == 0) {
+		rc = poll(&fds, 1, timeout_ms);
+		if (rc < 0) {
+			return -errno;
+		}
+		if (rc == 0) {
+			return 0;
+		}
+
+		n = recv(sock, rxBuffer, sizeof(rxBuffer), 0);
+		if (n < 0) {
+			return -errno;
+		}
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+		if (injectFault(n)) {
+			return 0;
+		}
+#endif
+	}
+	if (coap_packet_parse(&response, rxBuffer, n, options,
+			      ARRAY_SIZE(options)) < 0) {
+		return 0;
+	}
+
+	return handleResponse(&response);
+}
+
+static int handleResponse(struct coap_packet *response)
+{
+	uint8_t token[TOKEN_SIZE];
+	uint8_t type = coap_header_get_type(response);
+	uint8_t code = coap_header_get_code(response);
+	struct slot *s;
+
+	if (type == COAP_TYPE_RESET) {
+		return (findSlotById(coap_header_get_id(response)) != NULL) ?
+			       -ECONNRESET :
+			       0;
+	}
+
+	if (type == COAP_TYPE_ACK && code == 0) {
+		/* The response will be sent separately */
+		s = findSlotById(coap_header_get_id(response));
+		if (s != NULL) {
+			s->deadline = k_uptime_get() +
+				      2 * ((int64_t)rto << s->retries);
+		}
+		return 0;
+	}
+
+	if (type == COAP_TYPE_CON) {
+		sendEmptyAck(coap_header_get_id(response));
+	}
+
+	if (coap_header_get_token(response, token) != TOKEN_SIZE) {
+		return 0;
+	}
+	s = findSlotByToken(token);
+	if (s == NULL) {
+		/* Duplicate or cancelled */
+		return 0;
+	}
+
+	inflight -= 1;
+	if (s->retries == 0) {
+		/* Karn: retransmitted requests give ambiguous samples */
+		updateRtt((uint32_t)(k_uptime_get() - s->sent));
+	}
+
+	if (!RESPONSE_IS_SUCCESS(code)) {
+		if (lastKnown && s->block > lastBlock) {
+			s->state = SLOT_FREE;
+		} else {
+			/* May be past the end; fails once it is next to
+			 * write
+			 */
+			s->state = SLOT_FAILED;
+			s->code = code;
+		}
+		return 0;
+	}
+
+	/* Additive increase: one block per window of blocks received */
+	acked += 1;
+	if (acked >= window) {
+		acked = 0;
+		window = MIN(window + 1, windowMax);
+		metricsGaugeSet(&windowSize, window);
+	}
+
+	return acceptBlock(s, response);
+}
+
+static int acceptBlock(struct slot *s, struct coap_packet *response)
+{
+	struct coap_option option;
+	const uint8_t *payload;
+	uint16_t len;
+	uint32_t value;
+	struct slot *moved;
+	int rc;
+
+	payload = coap_packet_get_payload(response, &len);
+	if (payload == NULL) {
+		len = 0;
+	}
+
+	rc = checkEtag(response);
+	if (rc != 0) {
+		return rc;
+	}
+
+	if (coap_find_options(response, COAP_OPTION_BLOCK2, &option, 1) != 1) {
+		/* The whole resource fit in one response */
+		if (s->block != 0) {
+			return -EPROTO;
+		}
+		value = BLOCK2_VALUE(0, szx);
+	} else {
+		value = coap_option_value_to_int(&option);
+	}
+
+	if (!negotiated && BLOCK2_SZX(value) < szx) {
+		/* Only the first request is in flight; renumber it */
+		szx = BLOCK2_SZX(value);
+		if (BLOCK2_NUM(value) * BLOCK_SIZE(szx) != offset) {
+			return -EPROTO;
+		}
+		nextWrite = BLOCK2_NUM(value);
+		nextRequest = nextWrite + 1;
+		recoverBlock = nextWrite;
+		moved = &slots[nextWrite % CONFIG_COAP_BLOCK_WINDOW_MAX];
+		if (moved != s) {
+			*moved = *s;
+			s->state = SLOT_FREE;
+			s = moved;
+		}
+		s->block = nextWrite;
+	}
+	if (BLOCK2_SZX(value) != szx || BLOCK2_NUM(value) != s->block) {
+		return -EPROTO;
+	}
+	if (len > BLOCK_SIZE(szx) ||
+	    (BLOCK2_MORE(value) && len != BLOCK_SIZE(szx))) {
+		return -EPROTO;
+	}
+
+	if (!negotiated &&
+	    coap_find_options(response, COAP_OPTION_SIZE2, &option, 1) == 1) {
+		if (coap_option_value_to_int(&option) > 0) {
+			endBlock((coap_option_value_to_int(&option) - 1) /
+				 BLOCK_SIZE(szx));
+		}
+	}
+	negotiated = true;
+
+	memcpy(s->data, payload, len);
+	s->len = len;
+	s->more = BLOCK2_MORE(value);
+	s->state = SLOT_DONE;
+	if (!s->more) {
+		endBlock(s->block);
+	}
+	return 0;
+}
+
+/* The ETag identifies the version of the resource.  A resumed download must
+ * continue with the version it started with.
+ */
+static int checkEtag(struct coap_packet *response)
+{
+	struct coap_option option;
+
+	if (coap_find_options(response, COAP_OPTION_ETAG, &option, 1) != 1 ||
+	    option.len > ETAG_MAX_SIZE) {
+		return 0;
+	}
+
+	if (resume.etag_len == 0) {
+		resume.etag_len = option.len;
+		memcpy(resume.etag, option.value, option.len);
+		return 0;
+	}
+
+	if (resume.etag_len != option.len ||
+	    memcmp(resume.etag, option.value, option.len) != 0) {
+		COAP_BLOCK_LOG_WRN("Resource changed");
+		return -ESTALE;
+	}
+	return 0;
+}
+
+static int writeBlocks(void)
+{
+	bool checkpoint;
+	struct slot *s;
+	int rc;
+
+	while (!complete) {
+		s = &slots[nextWrite % CONFIG_COAP_BLOCK_WINDOW_MAX];
+		if (s->block != nextWrite) {
+			break;
+		}
+		if (s->state == SLOT_FAILED) {
+			COAP_BLOCK_LOG_ERR("Block %u: %u.%02u", s->block,
+					   s->code >> 5, s->code & 0x1F);
+			return -EIO;
+		}
+		if (s->state != SLOT_DONE) {
+			break;
+		}
+
+		checkpoint = s->more && (sinceCheckpoint + 1 >=
+					 CONFIG_COAP_BLOCK_CHECKPOINT_BLOCKS);
+		rc = dl->write(dl->ctx, offset, s->data, s->len,
+			       checkpoint || !s->more);
+		if (rc != 0) {
+			return rc;
+		}
+		offset += s->len;
+		nextWrite += 1;
+		stats.blocks += 1;
+		metricsIncrement(&blocks);
+		s->state = SLOT_FREE;
+		sinceCheckpoint += 1;
+
+		if (!s->more) {
+			complete = true;
+		} else if (checkpoint) {
+			sinceCheckpoint = 0;
+			saveResumeState();
+		}
+	}
+
+	return 0;
+}
+
+/* Multiplicative decrease at most once per window (a burst of losses is one
+ * congestion event).
+ */
+static int checkTimeouts(void)
+{
+	int64_t now = k_uptime_get();
+	size_t i;
+	int rc;
+
+	for (i = 0; i < ARRAY_SIZE(slots); i++) {
+		if (slots[i].state != SLOT_SENT || slots[i].deadline > now) {
+			continue;
+		}
+		if (slots[i].retries >= CONFIG_COAP_BLOCK_MAX_RETRANSMIT) {
+			COAP_BLOCK_LOG_ERR("Block %u timed out",
+					   slots[i].block);
+			return -ETIMEDOUT;
+		}
+
+		if (slots[i].block >= recoverBlock) {
+			window = MAX(window / 2, 1);
+			acked = 0;
+			recoverBlock = nextRequest;
+			metricsGaugeSet(&windowSize, window);
+		}
+
+		slots[i].retries += 1;
+		stats.retransmits += 1;
+		metricsIncrement(&retransmits);
+		rc = sendRequest(&slots[i]);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int nextTimeout(void)
+{
+	int64_t deadline = INT64_MAX;
+	int64_t remaining;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(slots); i++) {
+		if (slots[i].state == SLOT_SENT) {
+			deadline = MIN(deadline, slots[i].deadline);
+		}
+	}
+
+	if (deadline == INT64_MAX) {
+		/* Nothing in flight; blocks are waiting to be written */
+		return 0;
+	}
+	remaining = deadline - k_uptime_get();
+	return (int)MIN(MAX(remaining, 0), MAX_RTO_MS);
+}
+
+/* RFC 6298 */
+static void updateRtt(uint32_t sample)
+{
+	uint32_t delta;
+
+	metricsHistogramRecord(&rttHistogram, sample);
+
+	if (srtt == 0) {
+		srtt = sample;
+		rttvar = sample / 2;
+	} else {
+		delta = (srtt > sample) ? (srtt - sample) : (sample - srtt);
+		rttvar = (3 * rttvar + delta) / 4;
+		srtt = (7 * srtt + sample) / 8;
+	}
+	rto = MIN(MAX(srtt + 4 * rttvar, MIN_RTO_MS), MAX_RTO_MS);
+}
+
+/* Requests past the end are cancelled. */
+static void endBlock(uint32_t last)
+{
+	size_t i;
+
+	if (lastKnown && last >= lastBlock) {
+		return;
+	}
+	lastBlock = last;
+	lastKnown = true;
+
+	for (i = 0; i < ARRAY_SIZE(slots); i++) {
+		if (slots[i].state != SLOT_FREE && slots[i].block > last) {
+			if (slots[i].state == SLOT_SENT) {
+				inflight -= 1;
+			}
+			slots[i].state = SLOT_FREE;
+		}
+	}
+}
+
+static struct slot *findSlotById(uint16_t id)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(slots); i++) {
+		if (slots[i].state == SLOT_SENT && slots[i].id == id) {
+			return &slots[i];
+		}
+	}
+	return NULL;
+}
+
+static struct slot *findSlotByToken(const uint8_t *token)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(slots); i++) {
+		if (slots[i].state == SLOT_SENT &&
+		    memcmp(slots[i].token, token, TOKEN_SIZE) == 0) {
+			return &slots[i];
+		}
+	}
+	return NULL;
+}
+
+static void sendEmptyAck(uint16_t id)
+{
+	struct coap_packet ack;
+	uint8_t buffer[4];
+
+	if (coap_packet_init(&ack, buffer, sizeof(buffer), COAP_VERSION,
+			     COAP_TYPE_ACK, 0, NULL, 0, id) == 0) {
+		send(sock, ack.data, ack.offset, 0);
+	}
+}
+
+static uint32_t uriCrc(void)
+{
+	uint32_t crc = crc32_ieee((const uint8_t *)dl->host, strlen(dl->host));
+
+	return crc32_ieee_update(crc, (const uint8_t *)dl->path,
+				 strlen(dl->path));
+}
+
+static void loadResumeState(void)
+{
+	uint32_t crc = uriCrc();
+	int rc;
+
+	rc = appNvRead(APP_NV_ID_COAP_BLOCK_RESUME, &resume, sizeof(resume));
+	if (rc == sizeof(resume) && resume.uri_crc == crc &&
+	    (resume.offset % MIN_BLOCK_SIZE) != 0) {
+		/* No block size divides it; restarting beats a bad szx */
+		COAP_BLOCK_LOG_WRN("Invalid resume offset %u",
+				   (uint32_t)resume.offset);
+		rc = -EINVAL;
+	}
+	if (rc != sizeof(resume) || resume.uri_crc != crc ||
+	    resume.etag_len > ETAG_MAX_SIZE) {
+		memset(&resume, 0, sizeof(resume));
+		resume.uri_crc = crc;
+	}
+}
+
+/* The caller flushed the data up to offset. */
+static void saveResumeState(void)
+{
+	int rc;
+
+	if (offset == resume.offset && offset == 0) {
+		return;
+	}
+	resume.offset = offset;
+	rc = appNvWrite(APP_NV_ID_COAP_BLOCK_RESUME, &resume, sizeof(resume));
+	if (rc < 0) {
+		COAP_BLOCK_LOG_WRN("Unable to save offset (%d)", rc);
+	}
+}
+
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+/* Drop or hold back the response in rxBuffer.  Returns true if it isn't to
+ * be handled now.
+ */
+static bool injectFault(size_t len)
+{
+	size_t i;
+
+	if ((sys_rand32_get() % 100) < faultLossPercent) {
+		faultDrops += 1;
+		return true;
+	}
+	if (faultDelayMs == 0) {
+		return false;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(delayed); i++) {
+		if (delayed[i].len == 0) {
+			delayed[i].release = k_uptime_get() + faultDelayMs;
+			delayed[i].len = len;
+			memcpy(delayed[i].data, rxBuffer, len);
+			return true;
+		}
+	}
+	/* Like a full queue on a congested link */
+	faultDrops += 1;
+	return true;
+}
+
+/* Move the oldest held response to rxBuffer once it is due.  Until then the
+ * poll timeout is shortened so it isn't held too long.
+ */
+static size_t releaseDelayed(int *timeout_ms)
+{
+	struct delayed_response *first = NULL;
+	int64_t now = k_uptime_get();
+	size_t len;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(delayed); i++) {
+		if (delayed[i].len != 0 &&
+		    (first == NULL || delayed[i].release < first->release)) {
+			first = &delayed[i];
+		}
+	}
+	if (first == NULL) {
+		return 0;
+	}
+	if (first->release > now) {
+		*timeout_ms = (int)MIN(*timeout_ms, first->release - now);
+		return 0;
+	}
+
+	len = first->len;
+	memcpy(rxBuffer, first->data, len);
+	first->len = 0;
+	return len;
+}
+#endif /* CONFIG_COAP_BLOCK_FAULT_INJECTION */
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_COAP_BLOCK_SHELL
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+#define GET_HELP                                                               \
+	"Download without security <host> <port> <path> [window] "             \
+	"[loss %] [delay ms]"
+#define GET_OPTIONAL_ARGS 3
+#else
+#define GET_HELP "Download without security <host> <port> <path> [window]"
+#define GET_OPTIONAL_ARGS 1
+#endif
+
+static int crcWrite(void *ctx, size_t offset, const uint8_t *data, size_t len,
+		    bool flush)
+{
+	uint32_t *crc = ctx;
+
+	ARG_UNUSED(flush);
+
+	if (len == 0) {
+		return 0;
+	}
+	*crc = (offset == 0) ? crc32_ieee(data, len) :
+			       crc32_ieee_update(*crc, data, len);
+	return 0;
+}
+
+/* Download to a CRC so stop-and-wait (window 1) can be compared with a
+ * windowed download.  The resume state is discarded first.  With fault
+ * injection a fraction of the responses can be lost and the rest delayed,
+ * which exercises the retransmissions and the window back-off.
+ */
+static int shell_coap_block_get(const struct shell *shell, size_t argc,
+				char **argv)
+{
+	struct coap_block_download d = { 0 };
+	struct coap_block_stats s;
+	uint32_t crc = 0;
+	int rc;
+
+	d.host = argv[1];
+	d.port = strtoul(argv[2], NULL, 0);
+	d.path = argv[3];
+	d.window = (argc > 4) ? strtoul(argv[4], NULL, 0) : 0;
+	d.write = crcWrite;
+	d.ctx = &crc;
+
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+	faultLossPercent = (argc > 5) ? strtoul(argv[5], NULL, 0) : 0;
+	faultDelayMs = (argc > 6) ? strtoul(argv[6], NULL, 0) : 0;
+	faultDrops = 0;
+	memset(delayed, 0, sizeof(delayed));
+#endif
+
+	coapBlockForget();
+	rc = coapBlockDownload(&d, &s);
+	shell_print(shell,
+		    "%d: %u bytes in %u ms (%u blocks, %u retransmits, "
+		    "srtt %u ms) crc 0x%08x",
+		    rc, (uint32_t)s.size, s.duration_ms, s.blocks,
+		    s.retransmits, s.srtt_ms, crc);
+#ifdef CONFIG_COAP_BLOCK_FAULT_INJECTION
+	shell_print(shell, "%u responses dropped, window now %u", faultDrops,
+		    window);
+	faultLossPercent = 0;
+	faultDelayMs = 0;
+#endif
+	if (s.duration_ms > 0) {
+		shell_print(shell, "%u bytes/s",
+			    (uint32_t)(((uint64_t)s.size * MSEC_PER_SEC) /
+				       s.duration_ms));
+	}
+	return rc;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	coap_block_cmds,
+	SHELL_CMD_ARG(get, NULL, GET_HELP, shell_coap_block_get, 4,
+		      GET_OPTIONAL_ARGS),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(coapdl, &coap_block_cmds, "CoAP block-wise downloads",
+		   NULL);
+#endif /* CONFIG_COAP_BLOCK_SHELL */
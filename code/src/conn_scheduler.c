@@ -0,0 +1,311 @@
+/**
+ * @file conn_scheduler.c
+ * @brief Schedules cloud keep-alives around the radio's sleep state.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(conn_scheduler);
+
+#define CONN_SCHED_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define CONN_SCHED_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define CONN_SCHED_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define CONN_SCHED_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <shell/shell.h>
+#include <drivers/modem/hl7800.h>
+
+#include "FrameworkIncludes.h"
+#include "msg_pool.h"
+#include "cloud_queue.h"
+#include "metrics.h"
+#include "conn_scheduler.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define MS_PER_HOUR (60 * 60 * MSEC_PER_SEC)
+
+#define KEEP_ALIVE_RETRY_DELAY K_SECONDS(10)
+
+/* Send before the NAT mapping expires */
+#define NAT_INTERVAL_S                                                         \
+	(CONFIG_CONN_SCHED_NAT_TIMEOUT_S - CONFIG_CONN_SCHED_NAT_MARGIN_S)
+
+/* The broker disconnects after 1.5 keep-alive periods without traffic. */
+#ifdef CONFIG_MQTT_KEEPALIVE
+#define KEEP_ALIVE_INTERVAL_S MIN(NAT_INTERVAL_S, CONFIG_MQTT_KEEPALIVE)
+#else
+#define KEEP_ALIVE_INTERVAL_S NAT_INTERVAL_S
+#endif
+
+#define KEEP_ALIVE_INTERVAL_MS ((int64_t)KEEP_ALIVE_INTERVAL_S * MSEC_PER_SEC)
+
+#ifdef CONFIG_MODEM_HL7800_LOW_POWER_MODE
+#define PIGGYBACK_MS                                                           \
+	((KEEP_ALIVE_INTERVAL_MS * CONFIG_CONN_SCHED_PIGGYBACK_PERCENT) / 100)
+#endif
+
+BUILD_ASSERT(CONFIG_CONN_SCHED_NAT_TIMEOUT_S > CONFIG_CONN_SCHED_NAT_MARGIN_S,
+	     "NAT margin must be less than the NAT timeout");
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void keepAliveWorkHandler(struct k_work *item);
+static void piggybackWorkHandler(struct k_work *item);
+static void hourWorkHandler(struct k_work *item);
+static void sendKeepAlive(bool piggyback);
+static void scheduleKeepAlive(void);
+static void setAwake(bool isAwake, int64_t now);
+static uint64_t radioOnMs(int64_t now);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static struct k_delayed_work keepAliveWork;
+static struct k_work piggybackWork;
+static struct k_delayed_work hourWork;
+
+/* Protects the fields below (updated from the modem driver and work queue) */
+K_MUTEX_DEFINE(schedLock);
+static bool connected;
+static bool awake;
+static int64_t awakeSince;
+static uint64_t awakeTotalMs;
+static uint64_t awakeTotalAtHour;
+static uint32_t lastHourMs;
+static int64_t lastActivity;
+
+METRIC_GAUGE_DEFINE(radioOnPerHour, "radio_on_ms_per_hour");
+METRIC_COUNTER_DEFINE(keepAlives, "keep_alive_sent");
+#ifdef CONFIG_MODEM_HL7800_LOW_POWER_MODE
+METRIC_COUNTER_DEFINE(radioWakeups, "radio_wakeups");
+METRIC_COUNTER_DEFINE(keepAlivesPiggybacked, "keep_alive_piggybacked");
+#endif
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void connSchedulerInit(void)
+{
+	k_delayed_work_init(&keepAliveWork, keepAliveWorkHandler);
+	k_work_init(&piggybackWork, piggybackWorkHandler);
+	k_delayed_work_init(&hourWork, hourWorkHandler);
+	k_delayed_work_submit(&hourWork, K_MSEC(MS_PER_HOUR));
+
+	CONN_SCHED_LOG_INF("Keep-alive interval %u s", KEEP_ALIVE_INTERVAL_S);
+}
+
+void connSchedulerOnSleepState(uint8_t state)
+{
+#ifdef CONFIG_MODEM_HL7800_LOW_POWER_MODE
+	int64_t now = k_uptime_get();
+	bool piggyback = false;
+
+	k_mutex_lock(&schedLock, K_FOREVER);
+	if (state == HL7800_SLEEP_STATE_AWAKE && !awake) {
+		metricsIncrement(&radioWakeups);
+		piggyback = connected && (now - lastActivity >= PIGGYBACK_MS);
+	}
+	setAwake(state == HL7800_SLEEP_STATE_AWAKE, now);
+	k_mutex_unlock(&schedLock);
+
+	/* Allocating and queuing isn't done in the caller's (modem) context */
+	if (piggyback) {
+		k_work_submit(&piggybackWork);
+	}
+#else
+	ARG_UNUSED(state);
+#endif
+}
+
+void connSchedulerSetConnected(bool isConnected)
+{
+	k_mutex_lock(&schedLock, K_FOREVER);
+	connected = isConnected;
+	lastActivity = k_uptime_get();
+#ifndef CONFIG_MODEM_HL7800_LOW_POWER_MODE
+	/* The modem never sleeps, so the radio is counted as on while the
+	 * cloud connection (the traffic it is on for) is up.
+	 */
+	setAwake(isConnected, lastActivity);
+#endif
+	k_mutex_unlock(&schedLock);
+
+	if (isConnected) {
+		scheduleKeepAlive();
+	} else {
+		k_delayed_work_cancel(&keepAliveWork);
+	}
+}
+
+void connSchedulerOnActivity(void)
+{
+	k_mutex_lock(&schedLock, K_FOREVER);
+	lastActivity = k_uptime_get();
+	k_mutex_unlock(&schedLock);
+
+	if (connected) {
+		scheduleKeepAlive();
+	}
+}
+
+bool connSchedulerRadioAwake(void)
+{
+#ifdef CONFIG_MODEM_HL7800_LOW_POWER_MODE
+	return awake;
+#else
+	/* There is no wake-up to share */
+	return false;
+#endif
+}
+
+uint32_t connSchedulerKeepAliveIntervalS(void)
+{
+	return KEEP_ALIVE_INTERVAL_S;
+}
+
+uint32_t connSchedulerRadioOnMsLastHour(void)
+{
+	return lastHourMs;
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void keepAliveWorkHandler(struct k_work *item)
+{
+	ARG_UNUSED(item);
+
+	if (connected) {
+		sendKeepAlive(false);
+	}
+}
+
+static void piggybackWorkHandler(struct k_work *item)
+{
+	ARG_UNUSED(item);
+
+	if (connected) {
+		sendKeepAlive(true);
+	}
+}
+
+static void hourWorkHandler(struct k_work *item)
+{
+	uint64_t total;
+
+	ARG_UNUSED(item);
+
+	k_mutex_lock(&schedLock, K_FOREVER);
+	total = radioOnMs(k_uptime_get());
+	lastHourMs = (uint32_t)(total - awakeTotalAtHour);
+	awakeTotalAtHour = total;
+	metricsGaugeSet(&radioOnPerHour, lastHourMs);
+	k_mutex_unlock(&schedLock);
+
+	k_delayed_work_submit(&hourWork, K_MSEC(MS_PER_HOUR));
+}
+
+/* The cloud task sends an MQTT ping when it receives FMC_AWS_KEEP_ALIVE. */
+static void sendKeepAlive(bool piggyback)
+{
+	FwkMsg_t *pMsg = MsgPool_Take(sizeof(FwkMsg_t));
+
+	if (pMsg == NULL) {
+		CONN_SCHED_LOG_WRN("Unable to allocate keep-alive");
+		k_delayed_work_submit(&keepAliveWork, KEEP_ALIVE_RETRY_DELAY);
+		return;
+	}
+
+	memset(pMsg, 0, sizeof(FwkMsg_t));
+	pMsg->header.msgCode = FMC_AWS_KEEP_ALIVE;
+	pMsg->header.rxId = FWK_ID_CLOUD;
+	pMsg->header.txId = FWK_ID_RESERVED;
+	if (cloudQueuePut(pMsg, K_NO_WAIT) != 0) {
+		/* Message was freed; a full queue will generate traffic */
+		k_delayed_work_submit(&keepAliveWork, KEEP_ALIVE_RETRY_DELAY);
+		return;
+	}
+
+	metricsIncrement(&keepAlives);
+#ifdef CONFIG_MODEM_HL7800_LOW_POWER_MODE
+	if (piggyback) {
+		metricsIncrement(&keepAlivesPiggybacked);
+	}
+#else
+	ARG_UNUSED(piggyback);
+#endif
+	/* The ping counts as activity */
+	connSchedulerOnActivity();
+}
+
+static void scheduleKeepAlive(void)
+{
+	int64_t remaining;
+
+	k_mutex_lock(&schedLock, K_FOREVER);
+	remaining = KEEP_ALIVE_INTERVAL_MS - (k_uptime_get() - lastActivity);
+	k_mutex_unlock(&schedLock);
+
+	k_delayed_work_submit(&keepAliveWork, K_MSEC(MAX(remaining, 0)));
+}
+
+/* The caller must hold schedLock. */
+static void setAwake(bool isAwake, int64_t now)
+{
+	if (isAwake && !awake) {
+		awakeSince = now;
+	} else if (!isAwake && awake) {
+		awakeTotalMs += now - awakeSince;
+	}
+	awake = isAwake;
+}
+
+/* The caller must hold schedLock. */
+static uint64_t radioOnMs(int64_t now)
+{
+	return awakeTotalMs + (awake ? (now - awakeSince) : 0);
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+static int shell_connsched_status(const struct shell *shell, size_t argc,
+				  char **argv)
+{
+	int64_t now = k_uptime_get();
+	uint64_t thisHour;
+	int64_t idle;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	k_mutex_lock(&schedLock, K_FOREVER);
+	thisHour = radioOnMs(now) - awakeTotalAtHour;
+	idle = now - lastActivity;
+	k_mutex_unlock(&schedLock);
+
+	shell_print(shell, "Radio %s, on %u ms this hour, %u ms last hour",
+		    awake ? "awake" : "asleep", (uint32_t)thisHour,
+		    connSchedulerRadioOnMsLastHour());
+	shell_print(shell, "Cloud %s, idle %u s, keep-alive interval %u s",
+		    connected ? "connected" : "disconnected",
+		    (uint32_t)(idle / MSEC_PER_SEC), KEEP_ALIVE_INTERVAL_S);
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(connsched, NULL, "Print radio on time and keep-alive state",
+		   shell_connsched_status);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,445 @@
+/**
+ * @file crypto_backend.c
+ * @brief Streaming hash and AEAD operations with selectable backends.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(crypto_backend);
+
+#define CRYPTO_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define CRYPTO_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define CRYPTO_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define CRYPTO_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <devicetree.h>
+#include <shell/shell.h>
+
+#include "crypto_backend.h"
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static const struct crypto_backend *backends[CONFIG_CRYPTO_MAX_BACKENDS];
+static size_t backendCount;
+static const struct crypto_backend *defaultBackend;
+
+K_MUTEX_DEFINE(registerLock);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void cryptoInit(void)
+{
+	int rc = cryptoSwRegister();
+
+	if (rc != 0) {
+		CRYPTO_LOG_ERR("Unable to register software backend (%d)", rc);
+	}
+}
+
+int cryptoRegisterBackend(const struct crypto_backend *backend,
+			  size_t sha256_state_size, size_t gcm_state_size)
+{
+	int rc = 0;
+
+	if (sha256_state_size > CONFIG_CRYPTO_SHA256_CTX_SIZE ||
+	    gcm_state_size > CONFIG_CRYPTO_GCM_CTX_SIZE) {
+		CRYPTO_LOG_ERR("Backend %s needs %u/%u bytes of state",
+			       log_strdup(backend->name), sha256_state_size,
+			       gcm_state_size);
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&registerLock, K_FOREVER);
+	if (backendCount < ARRAY_SIZE(backends)) {
+		backends[backendCount++] = backend;
+		if (defaultBackend == NULL ||
+		    backend->priority > defaultBackend->priority) {
+			defaultBackend = backend;
+		}
+	} else {
+		rc = -ENOMEM;
+	}
+	k_mutex_unlock(&registerLock);
+
+	return rc;
+}
+
+const struct crypto_backend *cryptoGetBackend(const char *name)
+{
+	size_t i;
+
+	if (name == NULL) {
+		return defaultBackend;
+	}
+
+	for (i = 0; i < backendCount; i++) {
+		if (strcmp(backends[i]->name, name) == 0) {
+			return backends[i];
+		}
+	}
+	return NULL;
+}
+
+size_t cryptoBackendCount(void)
+{
+	return backendCount;
+}
+
+const struct crypto_backend *cryptoBackendAt(size_t index)
+{
+	return (index < backendCount) ? backends[index] : NULL;
+}
+
+int cryptoSha256Start(struct crypto_sha256 *ctx,
+		      const struct crypto_backend *backend)
+{
+	int rc;
+
+	ctx->backend = (backend != NULL) ? backend : defaultBackend;
+	if (ctx->backend == NULL) {
+		return -ENODEV;
+	}
+
+	rc = ctx->backend->sha256_start(ctx->state);
+	if (rc != 0) {
+		cryptoSha256Abort(ctx);
+	}
+	return rc;
+}
+
+int cryptoSha256Update(struct crypto_sha256 *ctx, const void *data,
+		       size_t len)
+{
+	return ctx->backend->sha256_update(ctx->state, data, len);
+}
+
+int cryptoSha256Finish(struct crypto_sha256 *ctx, uint8_t *digest)
+{
+	int rc = ctx->backend->sha256_finish(ctx->state, digest);
+
+	cryptoSha256Abort(ctx);
+	return rc;
+}
+
+int cryptoSha256Save(const struct crypto_sha256 *ctx, void *buf,
+		     size_t size)
+{
+	size_t n = ctx->backend->sha256_portable_size;
+
+	if (n == 0) {
+		return -ENOTSUP;
+	}
+	if (n > size) {
+		return -ENOMEM;
+	}
+	memcpy(buf, ctx->state, n);
+	return (int)n;
+}
+
+int cryptoSha256Restore(struct crypto_sha256 *ctx,
+			const struct crypto_backend *backend, const void *buf,
+			size_t size)
+{
+	if (backend == NULL || backend->sha256_portable_size == 0) {
+		return -ENOTSUP;
+	}
+	if (size != backend->sha256_portable_size) {
+		return -EINVAL;
+	}
+	ctx->backend = backend;
+	memcpy(ctx->state, buf, size);
+	return 0;
+}
+
+void cryptoSha256Abort(struct crypto_sha256 *ctx)
+{
+	if (ctx->backend != NULL) {
+		ctx->backend->sha256_free(ctx->state);
+		ctx->backend = NULL;
+	}
+}
+
+int cryptoGcmStart(struct crypto_gcm *ctx, const struct crypto_backend *backend,
+		   enum crypto_gcm_mode mode, const uint8_t *key,
+		   size_t key_len, const uint8_t *iv, size_t iv_len,
+		   const uint8_t *aad, size_t aad_len)
+{
+	int rc;
+
+	ctx->backend = (backend != NULL) ? backend : defaultBackend;
+	if (ctx->backend == NULL) {
+		return -ENODEV;
+	}
+
+	rc = ctx->backend->gcm_start(ctx->state, mode, key, key_len, iv, iv_len,
+				     aad, aad_len);
+	if (rc != 0) {
+		cryptoGcmAbort(ctx);
+	}
+	return rc;
+}
+
+int cryptoGcmUpdate(struct crypto_gcm *ctx, const void *in, void *out,
+		    size_t len)
+{
+	return ctx->backend->gcm_update(ctx->state, in, out, len);
+}
+
+int cryptoGcmFinish(struct crypto_gcm *ctx, uint8_t *tag, size_t tag_len)
+{
+	int rc = ctx->backend->gcm_finish(ctx->state, tag, tag_len);
+
+	cryptoGcmAbort(ctx);
+	return rc;
+}
+
+void cryptoGcmAbort(struct crypto_gcm *ctx)
+{
+	if (ctx->backend != NULL) {
+		ctx->backend->gcm_free(ctx->state);
+		ctx->backend = NULL;
+	}
+}
+
+bool cryptoTagEqual(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	uint8_t diff = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		diff |= a[i] ^ b[i];
+	}
+	return diff == 0;
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_CRYPTO_SHELL
+#define BENCH_CHUNK_SIZE 256
+
+/* k_cycle_get_32() may be a low frequency timer (RTC on nRF52) */
+#if DT_NODE_HAS_PROP(DT_PATH(cpus, cpu_0), clock_frequency)
+#define CPU_HZ DT_PROP(DT_PATH(cpus, cpu_0), clock_frequency)
+#else
+#define CPU_HZ sys_clock_hw_cycles_per_sec()
+#endif
+
+/* SHA-256("abc") */
+static const uint8_t SHA256_ABC[CRYPTO_SHA256_SIZE] = {
+	0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40,
+	0xde, 0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17,
+	0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+};
+
+/* GCM specification test case 2: zero key, IV and plaintext */
+static const uint8_t GCM_TC2_CIPHERTEXT[CRYPTO_GCM_BLOCK_SIZE] = {
+	0x03, 0x88, 0xda, 0xce, 0x60, 0xb6, 0xa3, 0x92,
+	0xf3, 0x28, 0xc2, 0xb9, 0x71, 0xb2, 0xfe, 0x78
+};
+static const uint8_t GCM_TC2_TAG[CRYPTO_GCM_BLOCK_SIZE] = {
+	0xab, 0x6e, 0x47, 0xd4, 0x2c, 0xec, 0x13, 0xbd,
+	0xf5, 0x3a, 0x67, 0xb2, 0x12, 0x57, 0xbd, 0xdf
+};
+
+static uint8_t benchBuffer[BENCH_CHUNK_SIZE];
+
+/* CPU cycles per byte (x100) */
+static uint32_t cyclesPerByte(uint32_t hwCycles, uint32_t size)
+{
+	uint64_t cpuCycles = ((uint64_t)hwCycles * CPU_HZ) /
+			     sys_clock_hw_cycles_per_sec();
+
+	return (uint32_t)((cpuCycles * 100) / size);
+}
+
+static bool selftest(const struct crypto_backend *backend)
+{
+	static const uint8_t zero[CRYPTO_GCM_BLOCK_SIZE] = { 0 };
+	struct crypto_sha256 sha;
+	struct crypto_sha256 restored;
+	struct crypto_gcm gcm;
+	uint8_t saved[CONFIG_CRYPTO_SHA256_CTX_SIZE];
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	uint8_t block[CRYPTO_GCM_BLOCK_SIZE];
+	uint8_t tag[CRYPTO_GCM_BLOCK_SIZE];
+	bool ok = true;
+	int n = 0;
+
+	/* Split to exercise streaming */
+	if (cryptoSha256Start(&sha, backend) != 0 ||
+	    cryptoSha256Update(&sha, "a", 1) != 0 ||
+	    cryptoSha256Update(&sha, "bc", 2) != 0 ||
+	    cryptoSha256Finish(&sha, digest) != 0 ||
+	    memcmp(digest, SHA256_ABC, sizeof(digest)) != 0) {
+		cryptoSha256Abort(&sha);
+		ok = false;
+	}
+
+	/* A saved state continues in another context */
+	if (backend->sha256_portable_size != 0) {
+		if (cryptoSha256Start(&sha, backend) != 0 ||
+		    cryptoSha256Update(&sha, "a", 1) != 0 ||
+		    (n = cryptoSha256Save(&sha, saved, sizeof(saved))) < 0 ||
+		    cryptoSha256Restore(&restored, backend, saved, n) != 0) {
+			ok = false;
+		} else if (cryptoSha256Update(&restored, "bc", 2) != 0 ||
+			   cryptoSha256Finish(&restored, digest) != 0 ||
+			   memcmp(digest, SHA256_ABC, sizeof(digest)) != 0) {
+			cryptoSha256Abort(&restored);
+			ok = false;
+		}
+		cryptoSha256Abort(&sha);
+	}
+
+	if (cryptoGcmStart(&gcm, backend, CRYPTO_GCM_ENCRYPT, zero,
+			   sizeof(zero), zero, 12, NULL, 0) != 0 ||
+	    cryptoGcmUpdate(&gcm, zero, block, sizeof(block)) != 0 ||
+	    cryptoGcmFinish(&gcm, tag, sizeof(tag)) != 0 ||
+	    memcmp(block, GCM_TC2_CIPHERTEXT, sizeof(block)) != 0 ||
+	    !cryptoTagEqual(tag, GCM_TC2_TAG, sizeof(tag))) {
+		cryptoGcmAbort(&gcm);
+		ok = false;
+	}
+
+	return ok;
+}
+
+static uint32_t benchSha256(const struct crypto_backend *backend,
+			    uint32_t size)
+{
+	struct crypto_sha256 sha;
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	uint32_t start;
+	uint32_t cycles;
+	uint32_t n;
+
+	start = k_cycle_get_32();
+	cryptoSha256Start(&sha, backend);
+	for (n = 0; n < size; n += BENCH_CHUNK_SIZE) {
+		cryptoSha256Update(&sha, benchBuffer,
+				   MIN(BENCH_CHUNK_SIZE, size - n));
+	}
+	cryptoSha256Finish(&sha, digest);
+	cycles = k_cycle_get_32() - start;
+
+	return cyclesPerByte(cycles, size);
+}
+
+static uint32_t benchGcm(const struct crypto_backend *backend, uint32_t size)
+{
+	static const uint8_t key[16] = { 0 };
+	static const uint8_t iv[12] = { 0 };
+	struct crypto_gcm gcm;
+	uint8_t tag[CRYPTO_GCM_BLOCK_SIZE];
+	uint32_t start;
+	uint32_t cycles;
+	uint32_t n;
+
+	start = k_cycle_get_32();
+	cryptoGcmStart(&gcm, backend, CRYPTO_GCM_ENCRYPT, key, sizeof(key), iv,
+		       sizeof(iv), NULL, 0);
+	for (n = 0; n < size; n += BENCH_CHUNK_SIZE) {
+		cryptoGcmUpdate(&gcm, benchBuffer, benchBuffer,
+				MIN(BENCH_CHUNK_SIZE, size - n));
+	}
+	cryptoGcmFinish(&gcm, tag, sizeof(tag));
+	cycles = k_cycle_get_32() - start;
+
+	return cyclesPerByte(cycles, size);
+}
+
+static int shell_crypto_list(const struct shell *shell, size_t argc,
+			     char **argv)
+{
+	const struct crypto_backend *b;
+	size_t i;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (i = 0; i < cryptoBackendCount(); i++) {
+		b = cryptoBackendAt(i);
+		shell_print(shell, "%s priority %d%s", b->name, b->priority,
+			    (b == cryptoGetBackend(NULL)) ? " (default)" : "");
+	}
+	return 0;
+}
+
+static int shell_crypto_selftest(const struct shell *shell, size_t argc,
+				 char **argv)
+{
+	const struct crypto_backend *b;
+	size_t i;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (i = 0; i < cryptoBackendCount(); i++) {
+		b = cryptoBackendAt(i);
+		if (selftest(b)) {
+			shell_print(shell, "%s: pass", b->name);
+		} else {
+			shell_error(shell, "%s: fail", b->name);
+		}
+	}
+	return 0;
+}
+
+static int shell_crypto_bench(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	const struct crypto_backend *b;
+	uint32_t size = 32768;
+	uint32_t sha;
+	uint32_t gcm;
+	size_t i;
+
+	if (argc > 1) {
+		size = strtoul(argv[1], NULL, 0);
+	}
+	if (size == 0) {
+		shell_error(shell, "Invalid size");
+		return -EINVAL;
+	}
+
+	memset(benchBuffer, 0xA5, sizeof(benchBuffer));
+	shell_print(shell, "%u bytes in %u byte chunks", size,
+		    BENCH_CHUNK_SIZE);
+	for (i = 0; i < cryptoBackendCount(); i++) {
+		b = cryptoBackendAt(i);
+		sha = benchSha256(b, size);
+		gcm = benchGcm(b, size);
+		shell_print(shell,
+			    "%s: sha256 %u.%02u cycles/byte, "
+			    "aes128-gcm %u.%02u cycles/byte",
+			    b->name, sha / 100, sha % 100, gcm / 100,
+			    gcm % 100);
+	}
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	crypto_cmds,
+	SHELL_CMD(list, NULL, "List the registered backends", shell_crypto_list),
+	SHELL_CMD(selftest, NULL, "Run known answer tests on each backend",
+		  shell_crypto_selftest),
+	SHELL_CMD_ARG(bench, NULL,
+		      "Measure the cycles per byte of each backend [size]",
+		      shell_crypto_bench, 1, 1),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(crypto, &crypto_cmds, "Crypto backend commands", NULL);
+#endif /* CONFIG_CRYPTO_SHELL */
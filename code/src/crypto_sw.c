@@ -0,0 +1,119 @@
+/**
+ * @file crypto_sw.c
+ * @brief Software (mbedTLS) crypto backend.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <errno.h>
+
+#include <mbedtls/sha256.h>
+#include <mbedtls/gcm.h>
+
+#include "crypto_backend.h"
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int sha256Start(void *state);
+static int sha256Update(void *state, const uint8_t *data, size_t len);
+static int sha256Finish(void *state, uint8_t *digest);
+static void sha256Free(void *state);
+
+static int gcmStart(void *state, enum crypto_gcm_mode mode, const uint8_t *key,
+		    size_t key_len, const uint8_t *iv, size_t iv_len,
+		    const uint8_t *aad, size_t aad_len);
+static int gcmUpdate(void *state, const uint8_t *in, uint8_t *out,
+		     size_t len);
+static int gcmFinish(void *state, uint8_t *tag, size_t tag_len);
+static void gcmFree(void *state);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static const struct crypto_backend swBackend = {
+	.name = "sw",
+	.priority = 0,
+	.sha256_start = sha256Start,
+	.sha256_update = sha256Update,
+	.sha256_finish = sha256Finish,
+	.sha256_free = sha256Free,
+	.sha256_portable_size = sizeof(mbedtls_sha256_context),
+	.gcm_start = gcmStart,
+	.gcm_update = gcmUpdate,
+	.gcm_finish = gcmFinish,
+	.gcm_free = gcmFree,
+};
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+int cryptoSwRegister(void)
+{
+	return cryptoRegisterBackend(&swBackend, sizeof(mbedtls_sha256_context),
+				     sizeof(mbedtls_gcm_context));
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int sha256Start(void *state)
+{
+	mbedtls_sha256_init(state);
+	return (mbedtls_sha256_starts_ret(state, 0) == 0) ? 0 : -EIO;
+}
+
+static int sha256Update(void *state, const uint8_t *data, size_t len)
+{
+	return (mbedtls_sha256_update_ret(state, data, len) == 0) ? 0 : -EIO;
+}
+
+static int sha256Finish(void *state, uint8_t *digest)
+{
+	return (mbedtls_sha256_finish_ret(state, digest) == 0) ? 0 : -EIO;
+}
+
+static void sha256Free(void *state)
+{
+	mbedtls_sha256_free(state);
+}
+
+static int gcmStart(void *state, enum crypto_gcm_mode mode, const uint8_t *key,
+		    size_t key_len, const uint8_t *iv, size_t iv_len,
+		    const uint8_t *aad, size_t aad_len)
+{
+	int rc;
+
+	mbedtls_gcm_init(state);
+	rc = mbedtls_gcm_setkey(state, MBEDTLS_CIPHER_ID_AES, key,
+				key_len * 8);
+	if (rc == 0) {
+		rc = mbedtls_gcm_starts(state,
+					(mode == CRYPTO_GCM_ENCRYPT) ?
+						MBEDTLS_GCM_ENCRYPT :
+						MBEDTLS_GCM_DECRYPT,
+					iv, iv_len, aad, aad_len);
+	}
+	return (rc == 0) ? 0 : -EINVAL;
+}
+
+static int gcmUpdate(void *state, const uint8_t *in, uint8_t *out, size_t len)
+{
+	return (mbedtls_gcm_update(state, len, in, out) == 0) ? 0 : -EINVAL;
+}
+
+static int gcmFinish(void *state, uint8_t *tag, size_t tag_len)
+{
+	return (mbedtls_gcm_finish(state, tag, tag_len) == 0) ? 0 : -EINVAL;
+}
+
+static void gcmFree(void *state)
+{
+	mbedtls_gcm_free(state);
+}
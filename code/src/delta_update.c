@@ -0,0 +1,570 @@
+/**
+ * @file delta_update.c
+ * @brief Apply a delta (patch) to the running app image.
+ *
+ * The patch is parsed with a state machine so it can arrive in parts of any
+ * size.  The format is described in tools/delta/mkdelta.py.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(delta_update);
+
+#define DELTA_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define DELTA_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define DELTA_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define DELTA_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <stdlib.h>
+#include <shell/shell.h>
+#include <sys/byteorder.h>
+#include <storage/flash_map.h>
+#include <dfu/flash_img.h>
+#include <dfu/mcuboot.h>
+
+#include "app_version.h"
+#include "crypto_backend.h"
+#include "delta_update.h"
+#ifdef CONFIG_COAP_BLOCK
+#include "coap_block.h"
+#endif
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define DELTA_MAGIC "P1DL"
+#define DELTA_FORMAT_VERSION 1
+#define DELTA_VERSION_SIZE 16
+
+/* Offsets in the header */
+#define HDR_MAGIC 0
+#define HDR_FORMAT 4
+#define HDR_SOURCE_VERSION 8
+#define HDR_SOURCE_SIZE (HDR_SOURCE_VERSION + DELTA_VERSION_SIZE)
+#define HDR_SOURCE_HASH (HDR_SOURCE_SIZE + 4)
+#define HDR_TARGET_SIZE (HDR_SOURCE_HASH + CRYPTO_SHA256_SIZE)
+#define HDR_TARGET_HASH (HDR_TARGET_SIZE + 4)
+#define HEADER_SIZE (HDR_TARGET_HASH + CRYPTO_SHA256_SIZE)
+
+#define OP_END 0
+#define OP_ADD 1
+#define OP_INSERT 2
+
+#define TOKEN_RUN BIT(7)
+#define TOKEN_LENGTH_MASK 0x7F
+
+enum state {
+	STATE_IDLE = 0,
+	STATE_HEADER,
+	STATE_OPCODE,
+	STATE_ARGS,
+	STATE_TOKEN,
+	STATE_DIFF,
+	STATE_INSERT,
+	STATE_DONE,
+	STATE_FAILED
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int consume(const uint8_t *data, size_t len, size_t *used);
+static int checkHeader(void);
+static int startRecord(void);
+static int hashSource(uint32_t size, uint8_t *digest);
+static int copySource(uint32_t len);
+static int applyDiff(const uint8_t *diff, size_t len);
+static int emit(const uint8_t *data, size_t len);
+static int finishTarget(void);
+static void closeAreas(void);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_MUTEX_DEFINE(deltaLock);
+
+static enum state state;
+static uint8_t header[HEADER_SIZE];
+static uint8_t args[8];
+static size_t collected;
+static size_t argsNeeded;
+static uint8_t opcode;
+
+static uint32_t sourceSize;
+static uint32_t targetSize;
+static uint32_t sourceOffset;
+static uint32_t recordRemaining;
+static uint32_t diffRemaining;
+static size_t patchOffset;
+
+static const struct flash_area *source;
+static struct flash_img_context img;
+static struct crypto_sha256 targetHash;
+static uint8_t readBuffer[CONFIG_DELTA_UPDATE_READ_BUFFER_SIZE];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+int deltaUpdateStart(void)
+{
+	int rc;
+
+	k_mutex_lock(&deltaLock, K_FOREVER);
+
+	if (state != STATE_IDLE && state != STATE_DONE &&
+	    state != STATE_FAILED) {
+		k_mutex_unlock(&deltaLock);
+		return -EBUSY;
+	}
+
+	rc = flash_area_open(FLASH_AREA_ID(image_0), &source);
+#ifndef CONFIG_IMG_ERASE_PROGRESSIVELY
+	if (rc == 0) {
+		rc = boot_erase_img_bank(FLASH_AREA_ID(image_1));
+	}
+#endif
+	if (rc == 0) {
+		rc = flash_img_init(&img);
+	}
+
+	if (rc == 0) {
+		state = STATE_HEADER;
+		collected = 0;
+		patchOffset = 0;
+	} else {
+		DELTA_LOG_ERR("Unable to prepare slots (%d)", rc);
+		closeAreas();
+		state = STATE_FAILED;
+	}
+
+	k_mutex_unlock(&deltaLock);
+	return rc;
+}
+
+int deltaUpdateWrite(const uint8_t *data, size_t len)
+{
+	size_t used;
+	int rc = 0;
+
+	k_mutex_lock(&deltaLock, K_FOREVER);
+
+	if (state == STATE_IDLE || state == STATE_FAILED) {
+		rc = -EINVAL;
+	}
+
+	while (rc == 0 && len > 0) {
+		rc = consume(data, len, &used);
+		data += used;
+		len -= used;
+		patchOffset += used;
+	}
+
+	if (rc != 0 && state != STATE_FAILED) {
+		DELTA_LOG_ERR("Patch failed at %u (%d)", (uint32_t)patchOffset,
+			      rc);
+		deltaUpdateAbort();
+	}
+
+	k_mutex_unlock(&deltaLock);
+	return rc;
+}
+
+int deltaUpdateFinish(void)
+{
+	int rc;
+
+	k_mutex_lock(&deltaLock, K_FOREVER);
+	if (state == STATE_DONE) {
+		rc = 0;
+	} else {
+		rc = (state == STATE_FAILED) ? -EBADMSG : -ENODATA;
+		deltaUpdateAbort();
+	}
+	k_mutex_unlock(&deltaLock);
+
+	return rc;
+}
+
+void deltaUpdateAbort(void)
+{
+	k_mutex_lock(&deltaLock, K_FOREVER);
+	if (state != STATE_IDLE && state != STATE_DONE) {
+		if (targetHash.backend != NULL) {
+			cryptoSha256Abort(&targetHash);
+		}
+		closeAreas();
+		state = STATE_FAILED;
+	}
+	k_mutex_unlock(&deltaLock);
+}
+
+size_t deltaUpdateOffset(void)
+{
+	return patchOffset;
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+/* Process the start of the data and set used to the number of bytes taken. */
+static int consume(const uint8_t *data, size_t len, size_t *used)
+{
+	size_t n = 0;
+	int rc = 0;
+
+	switch (state) {
+	case STATE_HEADER:
+		n = MIN(len, sizeof(header) - collected);
+		memcpy(&header[collected], data, n);
+		collected += n;
+		if (collected == sizeof(header)) {
+			rc = checkHeader();
+			state = STATE_OPCODE;
+		}
+		break;
+
+	case STATE_OPCODE:
+		n = 1;
+		opcode = data[0];
+		collected = 0;
+		if (opcode == OP_END) {
+			rc = finishTarget();
+		} else if (opcode == OP_ADD) {
+			argsNeeded = 8;
+			state = STATE_ARGS;
+		} else if (opcode == OP_INSERT) {
+			argsNeeded = 4;
+			state = STATE_ARGS;
+		} else {
+			rc = -EBADMSG;
+		}
+		break;
+
+	case STATE_ARGS:
+		n = MIN(len, argsNeeded - collected);
+		memcpy(&args[collected], data, n);
+		collected += n;
+		if (collected == argsNeeded) {
+			rc = startRecord();
+		}
+		break;
+
+	case STATE_TOKEN:
+		n = 1;
+		diffRemaining = data[0] & TOKEN_LENGTH_MASK;
+		if (data[0] & TOKEN_RUN) {
+			diffRemaining += 1;
+		}
+		if (diffRemaining == 0 || diffRemaining > recordRemaining) {
+			rc = -EBADMSG;
+		} else if (data[0] & TOKEN_RUN) {
+			rc = copySource(diffRemaining);
+			recordRemaining -= diffRemaining;
+			diffRemaining = 0;
+		} else {
+			state = STATE_DIFF;
+		}
+		break;
+
+	case STATE_DIFF:
+		n = MIN(len, diffRemaining);
+		rc = applyDiff(data, n);
+		diffRemaining -= n;
+		recordRemaining -= n;
+		if (diffRemaining == 0) {
+			state = STATE_TOKEN;
+		}
+		break;
+
+	case STATE_INSERT:
+		n = MIN(len, recordRemaining);
+		rc = emit(data, n);
+		recordRemaining -= n;
+		break;
+
+	default:
+		/* Data after the end */
+		rc = -EBADMSG;
+		break;
+	}
+
+	if (rc == 0 && recordRemaining == 0 &&
+	    (state == STATE_TOKEN || state == STATE_INSERT)) {
+		state = STATE_OPCODE;
+	}
+
+	*used = n;
+	return rc;
+}
+
+/* The source is checked before anything is written to the secondary slot. */
+static int checkHeader(void)
+{
+	char version[DELTA_VERSION_SIZE + 1] = { 0 };
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	int rc;
+
+	if (memcmp(&header[HDR_MAGIC], DELTA_MAGIC, 4) != 0 ||
+	    header[HDR_FORMAT] != DELTA_FORMAT_VERSION) {
+		return -EBADMSG;
+	}
+
+	memcpy(version, &header[HDR_SOURCE_VERSION], DELTA_VERSION_SIZE);
+	if (strcmp(version, APP_VERSION_STRING) != 0) {
+		DELTA_LOG_ERR("Patch is for %s (running %s)",
+			      log_strdup(version), APP_VERSION_STRING);
+		return -ENOENT;
+	}
+
+	sourceSize = sys_get_le32(&header[HDR_SOURCE_SIZE]);
+	targetSize = sys_get_le32(&header[HDR_TARGET_SIZE]);
+	if (sourceSize > source->fa_size) {
+		return -EBADMSG;
+	}
+
+	rc = hashSource(sourceSize, digest);
+	if (rc != 0) {
+		return rc;
+	}
+	if (memcmp(digest, &header[HDR_SOURCE_HASH], sizeof(digest)) != 0) {
+		DELTA_LOG_ERR("Running image doesn't match the patch");
+		return -ENOENT;
+	}
+
+	DELTA_LOG_INF("Applying patch from %s (%u -> %u bytes)",
+		      log_strdup(version), sourceSize, targetSize);
+	return cryptoSha256Start(&targetHash, NULL);
+}
+
+static int startRecord(void)
+{
+	if (opcode == OP_ADD) {
+		sourceOffset = sys_get_le32(&args[0]);
+		recordRemaining = sys_get_le32(&args[4]);
+		if (sourceOffset > sourceSize ||
+		    recordRemaining > sourceSize - sourceOffset) {
+			return -EBADMSG;
+		}
+		state = STATE_TOKEN;
+	} else {
+		recordRemaining = sys_get_le32(&args[0]);
+		state = STATE_INSERT;
+	}
+
+	if (recordRemaining > targetSize - flash_img_bytes_written(&img)) {
+		return -EBADMSG;
+	}
+	return 0;
+}
+
+static int hashSource(uint32_t size, uint8_t *digest)
+{
+	struct crypto_sha256 sha;
+	uint32_t offset;
+	size_t n;
+	int rc;
+
+	rc = cryptoSha256Start(&sha, NULL);
+	for (offset = 0; rc == 0 && offset < size; offset += n) {
+		n = MIN(sizeof(readBuffer), size - offset);
+		rc = flash_area_read(source, offset, readBuffer, n);
+		if (rc == 0) {
+			rc = cryptoSha256Update(&sha, readBuffer, n);
+		}
+	}
+
+	if (rc == 0) {
+		rc = cryptoSha256Finish(&sha, digest);
+	} else {
+		cryptoSha256Abort(&sha);
+	}
+	return rc;
+}
+
+static int copySource(uint32_t len)
+{
+	size_t n;
+	int rc = 0;
+
+	for (; rc == 0 && len > 0; len -= n) {
+		n = MIN(sizeof(readBuffer), len);
+		rc = flash_area_read(source, sourceOffset, readBuffer, n);
+		if (rc == 0) {
+			rc = emit(readBuffer, n);
+		}
+		sourceOffset += n;
+	}
+	return rc;
+}
+
+static int applyDiff(const uint8_t *diff, size_t len)
+{
+	size_t n;
+	size_t i;
+	int rc = 0;
+
+	for (; rc == 0 && len > 0; len -= n) {
+		n = MIN(sizeof(readBuffer), len);
+		rc = flash_area_read(source, sourceOffset, readBuffer, n);
+		for (i = 0; rc == 0 && i < n; i++) {
+			readBuffer[i] += diff[i];
+		}
+		if (rc == 0) {
+			rc = emit(readBuffer, n);
+		}
+		sourceOffset += n;
+		diff += n;
+	}
+	return rc;
+}
+
+static int emit(const uint8_t *data, size_t len)
+{
+	int rc;
+
+	if (len > targetSize - flash_img_bytes_written(&img)) {
+		return -EBADMSG;
+	}
+
+	rc = cryptoSha256Update(&targetHash, data, len);
+	if (rc == 0) {
+		rc = flash_img_buffered_write(&img, data, len, false);
+	}
+	return rc;
+}
+
+static int finishTarget(void)
+{
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	int rc;
+
+	if (flash_img_bytes_written(&img) != targetSize) {
+		return -EBADMSG;
+	}
+
+	rc = flash_img_buffered_write(&img, NULL, 0, true);
+	if (rc == 0) {
+		rc = cryptoSha256Finish(&targetHash, digest);
+	}
+	if (rc != 0) {
+		return rc;
+	}
+
+	if (!cryptoTagEqual(digest, &header[HDR_TARGET_HASH], sizeof(digest))) {
+		DELTA_LOG_ERR("New image doesn't match the patch");
+		return -EBADMSG;
+	}
+
+	closeAreas();
+	state = STATE_DONE;
+	DELTA_LOG_INF("New image verified (%u bytes)", targetSize);
+	return 0;
+}
+
+static void closeAreas(void)
+{
+	if (source != NULL) {
+		flash_area_close(source);
+		source = NULL;
+	}
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_DELTA_UPDATE_SHELL
+#ifdef CONFIG_COAP_BLOCK
+/* Blocks repeated after a lost connection are skipped.  The patch can't
+ * continue after a reset, so the saved offset doesn't need a flush.
+ */
+static int patchWrite(void *ctx, size_t offset, const uint8_t *data,
+		      size_t len, bool flush)
+{
+	size_t applied = deltaUpdateOffset();
+	size_t skip;
+
+	ARG_UNUSED(ctx);
+	ARG_UNUSED(flush);
+
+	if (offset > applied || offset + len <= applied) {
+		return (offset > applied) ? -EINVAL : 0;
+	}
+	skip = applied - offset;
+	return deltaUpdateWrite(data + skip, len - skip);
+}
+
+static int shell_delta_coap(const struct shell *shell, size_t argc,
+			    char **argv)
+{
+	struct coap_block_download d = { 0 };
+	struct coap_block_stats s;
+	int rc;
+
+	d.host = argv[1];
+	d.port = strtoul(argv[2], NULL, 0);
+	d.path = argv[3];
+	d.write = patchWrite;
+
+	/* The patch can't continue from an offset saved before a reset */
+	coapBlockForget();
+	rc = deltaUpdateStart();
+	if (rc == 0) {
+		rc = coapBlockDownload(&d, &s);
+	}
+	if (rc == 0) {
+		rc = deltaUpdateFinish();
+	} else {
+		deltaUpdateAbort();
+	}
+
+	if (rc == 0) {
+		shell_print(shell, "%u byte patch applied in %u ms",
+			    (uint32_t)s.size, s.duration_ms);
+	} else {
+		shell_error(shell, "Failed (%d)", rc);
+	}
+	return rc;
+}
+#endif
+
+static int shell_delta_test(const struct shell *shell, size_t argc,
+			    char **argv)
+{
+	int rc;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	if (state != STATE_DONE) {
+		shell_error(shell, "No verified image");
+		return -ENOENT;
+	}
+
+	rc = boot_request_upgrade(BOOT_UPGRADE_TEST);
+	if (rc == 0) {
+		shell_print(shell, "New image is booted at the next reset");
+	}
+	return rc;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	delta_cmds,
+#ifdef CONFIG_COAP_BLOCK
+	SHELL_CMD_ARG(coap, NULL,
+		      "Download and apply a patch <host> <port> <path>",
+		      shell_delta_coap, 4, 0),
+#endif
+	SHELL_CMD(test, NULL, "Boot the new image once at the next reset",
+		  shell_delta_test),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(delta, &delta_cmds, "Delta updates", NULL);
+#endif /* CONFIG_DELTA_UPDATE_SHELL */
@@ -0,0 +1,369 @@
+/**
+ * @file dns_cache.c
+ * @brief IPv4 address cache in front of the DNS resolver.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(dns_cache);
+
+#define DNS_CACHE_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define DNS_CACHE_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define DNS_CACHE_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define DNS_CACHE_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <shell/shell.h>
+#include <net/socket.h>
+
+#include "metrics.h"
+#ifdef CONFIG_APP_NV
+#include "app_nv.h"
+#endif
+#include "dns_cache.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+/* The part that is saved */
+struct dns_record {
+	char host[CONFIG_DNS_CACHE_HOST_SIZE];
+	struct in_addr addr;
+};
+
+struct dns_entry {
+	struct dns_record r;
+	/* An answer exists (it may have expired) */
+	bool valid;
+	bool prefetch;
+	int64_t expires;
+	int64_t used;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static struct dns_entry *find(const char *host);
+static struct dns_entry *allocate(const char *host);
+static bool fresh(const struct dns_entry *e, int64_t now);
+static int lookup(const char *host, int socktype, struct in_addr *addr);
+static void save(void);
+static void prefetchThread(void *arg1, void *arg2, void *arg3);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_THREAD_DEFINE(dns_cache_thread, CONFIG_DNS_CACHE_THREAD_STACK_SIZE,
+		prefetchThread, NULL, NULL, NULL,
+		CONFIG_DNS_CACHE_THREAD_PRIORITY, 0, 0);
+
+K_SEM_DEFINE(prefetchSem, 0, 1);
+K_MUTEX_DEFINE(dnsCacheLock);
+static struct dns_entry entries[CONFIG_DNS_CACHE_SIZE];
+
+METRIC_COUNTER_DEFINE(hits, "dns_cache_hits");
+METRIC_COUNTER_DEFINE(misses, "dns_cache_misses");
+METRIC_COUNTER_DEFINE(stale, "dns_cache_stale");
+METRIC_COUNTER_DEFINE(prefetches, "dns_cache_prefetches");
+METRIC_HISTOGRAM_DEFINE(lookupTime, "dns_lookup_ms", METRIC_LATENCY_MS_BOUNDS);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void dnsCacheInit(void)
+{
+#ifdef CONFIG_APP_NV
+	struct dns_record records[CONFIG_DNS_CACHE_SIZE];
+	int rc;
+	size_t i;
+
+	rc = appNvRead(APP_NV_ID_DNS_CACHE, records, sizeof(records));
+	if (rc <= 0) {
+		return;
+	}
+
+	k_mutex_lock(&dnsCacheLock, K_FOREVER);
+	for (i = 0; i < (rc / sizeof(records[0])); i++) {
+		records[i].host[sizeof(records[i].host) - 1] = '\0';
+		if (records[i].host[0] != '\0') {
+			/* Expired: only used when a lookup fails */
+			entries[i].r = records[i];
+			entries[i].valid = true;
+		}
+	}
+	k_mutex_unlock(&dnsCacheLock);
+#endif
+}
+
+int dnsCacheResolve(const char *host, int socktype, struct in_addr *addr)
+{
+	struct dns_entry *e;
+	struct in_addr answer;
+	bool changed = false;
+	int rc;
+
+	k_mutex_lock(&dnsCacheLock, K_FOREVER);
+	e = find(host);
+	if (e != NULL) {
+		e->used = k_uptime_get();
+		if (fresh(e, e->used)) {
+			*addr = e->r.addr;
+			k_mutex_unlock(&dnsCacheLock);
+			metricsIncrement(&hits);
+			return 0;
+		}
+	}
+	k_mutex_unlock(&dnsCacheLock);
+
+	metricsIncrement(&misses);
+	rc = lookup(host, socktype, &answer);
+
+	k_mutex_lock(&dnsCacheLock, K_FOREVER);
+	e = find(host);
+	if (rc == 0) {
+		if (e == NULL) {
+			e = allocate(host);
+		}
+		if (e != NULL) {
+			changed = !e->valid ||
+				  e->r.addr.s_addr != answer.s_addr;
+			e->r.addr = answer;
+			e->valid = true;
+			e->expires = k_uptime_get() +
+				     (CONFIG_DNS_CACHE_TTL_S * MSEC_PER_SEC);
+		}
+		*addr = answer;
+	} else if (e != NULL && e->valid) {
+		DNS_CACHE_LOG_WRN("Unable to resolve %s (%d); using the last "
+				  "answer",
+				  log_strdup(host), rc);
+		metricsIncrement(&stale);
+		*addr = e->r.addr;
+		rc = 0;
+	} else {
+		DNS_CACHE_LOG_ERR("Unable to resolve %s (%d)", log_strdup(host),
+				  rc);
+		rc = -EHOSTUNREACH;
+	}
+	if (changed) {
+		save();
+	}
+	k_mutex_unlock(&dnsCacheLock);
+
+	return rc;
+}
+
+int dnsCacheAddHost(const char *host)
+{
+	struct dns_entry *e;
+	int rc = 0;
+
+	if (strlen(host) >= CONFIG_DNS_CACHE_HOST_SIZE) {
+		return -ENAMETOOLONG;
+	}
+
+	k_mutex_lock(&dnsCacheLock, K_FOREVER);
+	e = find(host);
+	if (e == NULL) {
+		e = allocate(host);
+	}
+	if (e != NULL) {
+		e->prefetch = true;
+	} else {
+		rc = -ENOMEM;
+	}
+	k_mutex_unlock(&dnsCacheLock);
+
+	return rc;
+}
+
+void dnsCachePrefetch(void)
+{
+	k_sem_give(&prefetchSem);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+/* Called with the lock */
+static struct dns_entry *find(const char *host)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		if (entries[i].r.host[0] != '\0' &&
+		    strcmp(entries[i].r.host, host) == 0) {
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+/* Called with the lock.  Replaces the least recently used entry that isn't
+ * prefetched when the cache is full.
+ */
+static struct dns_entry *allocate(const char *host)
+{
+	struct dns_entry *e = NULL;
+	size_t i;
+
+	if (strlen(host) >= CONFIG_DNS_CACHE_HOST_SIZE) {
+		return NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		if (entries[i].r.host[0] == '\0') {
+			e = &entries[i];
+			break;
+		}
+		if (!entries[i].prefetch &&
+		    (e == NULL || entries[i].used < e->used)) {
+			e = &entries[i];
+		}
+	}
+
+	if (e != NULL) {
+		memset(e, 0, sizeof(*e));
+		strcpy(e->r.host, host);
+		e->used = k_uptime_get();
+	}
+	return e;
+}
+
+static bool fresh(const struct dns_entry *e, int64_t now)
+{
+	return e->valid && e->expires > now;
+}
+
+static int lookup(const char *host, int socktype, struct in_addr *addr)
+{
+	struct addrinfo hints = { .ai_family = AF_INET,
+				  .ai_socktype = socktype };
+	struct addrinfo *result;
+	int64_t start = k_uptime_get();
+	int rc;
+
+	rc = getaddrinfo(host, NULL, &hints, &result);
+	metricsHistogramRecord(&lookupTime, (uint32_t)k_uptime_delta(&start));
+	if (rc != 0) {
+		return rc;
+	}
+
+	*addr = net_sin(result->ai_addr)->sin_addr;
+	freeaddrinfo(result);
+	return 0;
+}
+
+/* Called with the lock */
+static void save(void)
+{
+#ifdef CONFIG_APP_NV
+	struct dns_record records[CONFIG_DNS_CACHE_SIZE];
+	size_t i;
+
+	memset(records, 0, sizeof(records));
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		if (entries[i].valid) {
+			records[i] = entries[i].r;
+		}
+	}
+	appNvWrite(APP_NV_ID_DNS_CACHE, records, sizeof(records));
+#endif
+}
+
+static void prefetchThread(void *arg1, void *arg2, void *arg3)
+{
+	char host[CONFIG_DNS_CACHE_HOST_SIZE];
+	struct in_addr addr;
+	size_t i;
+	bool due;
+
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	while (true) {
+		k_sem_take(&prefetchSem, K_FOREVER);
+
+		for (i = 0; i < ARRAY_SIZE(entries); i++) {
+			k_mutex_lock(&dnsCacheLock, K_FOREVER);
+			due = entries[i].prefetch &&
+			      !fresh(&entries[i], k_uptime_get());
+			strcpy(host, entries[i].r.host);
+			k_mutex_unlock(&dnsCacheLock);
+
+			if (due) {
+				metricsIncrement(&prefetches);
+				dnsCacheResolve(host, SOCK_STREAM, &addr);
+			}
+		}
+	}
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+static int shell_dnscache_list(const struct shell *shell, size_t argc,
+			       char **argv)
+{
+	char buf[NET_IPV4_ADDR_LEN];
+	int64_t now = k_uptime_get();
+	size_t i;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	k_mutex_lock(&dnsCacheLock, K_FOREVER);
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		if (entries[i].r.host[0] == '\0') {
+			continue;
+		}
+		shell_print(shell, "%s %s %s%s", entries[i].r.host,
+			    entries[i].valid ?
+				    net_addr_ntop(AF_INET, &entries[i].r.addr,
+						  buf, sizeof(buf)) :
+				    "-",
+			    fresh(&entries[i], now) ? "fresh" : "stale",
+			    entries[i].prefetch ? " prefetch" : "");
+	}
+	k_mutex_unlock(&dnsCacheLock);
+
+	return 0;
+}
+
+static int shell_dnscache_flush(const struct shell *shell, size_t argc,
+				char **argv)
+{
+	size_t i;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	k_mutex_lock(&dnsCacheLock, K_FOREVER);
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		entries[i].valid = false;
+	}
+	save();
+	k_mutex_unlock(&dnsCacheLock);
+
+	shell_print(shell, "Flushed");
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	dnscache_cmds,
+	SHELL_CMD(list, NULL, "Print the cached answers", shell_dnscache_list),
+	SHELL_CMD(flush, NULL, "Forget the answers (prefetched hosts are kept)",
+		  shell_dnscache_flush),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(dnscache, &dnscache_cmds, "DNS cache", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,306 @@
+/**
+ * @file fota_stage.c
+ * @brief Staging of firmware images with an incremental SHA-256.
+ *
+ * The checkpoint holds the offset and the intermediate hash state.  It is
+ * saved each time the image crosses a multiple of
+ * CONFIG_FOTA_STAGE_CHECKPOINT_SIZE, after the data up to that point is in
+ * flash, so the two always agree.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(fota_stage);
+
+#define FOTA_STAGE_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define FOTA_STAGE_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define FOTA_STAGE_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define FOTA_STAGE_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <shell/shell.h>
+
+#include "app_nv.h"
+#include "fota_stage.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define BACKEND_NAME_MAX_SIZE 8
+
+/* Saved in flash */
+struct checkpoint {
+	char name[CONFIG_FOTA_STAGE_NAME_MAX_SIZE];
+	char backend[BACKEND_NAME_MAX_SIZE];
+	uint32_t size;
+	uint32_t offset;
+	bool complete;
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	uint16_t state_len;
+	uint8_t state[CONFIG_CRYPTO_SHA256_CTX_SIZE];
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static bool resumable(const char *name, size_t size);
+static bool resume(const char *name, size_t size);
+static int saveCheckpoint(void);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_MUTEX_DEFINE(stageLock);
+
+static struct checkpoint cp;
+static struct crypto_sha256 sha;
+static bool opened;
+/* Bytes written so far.  cp.offset only changes when a checkpoint is saved
+ * so it always matches cp.state.
+ */
+static uint32_t position;
+static fota_stage_write_t writeFunction;
+static void *writeContext;
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void fotaStageInit(void)
+{
+	if (appNvRead(APP_NV_ID_FOTA_STAGE, &cp, sizeof(cp)) != sizeof(cp)) {
+		memset(&cp, 0, sizeof(cp));
+	}
+}
+
+int fotaStageOpen(const char *name, size_t size, fota_stage_write_t write,
+		  void *ctx, size_t *offset)
+{
+	int rc = 0;
+
+	k_mutex_lock(&stageLock, K_FOREVER);
+
+	if (opened) {
+		rc = -EBUSY;
+	} else if (strlen(name) >= sizeof(cp.name)) {
+		rc = -ENAMETOOLONG;
+	}
+
+	if (rc == 0 && !resume(name, size)) {
+		memset(&cp, 0, sizeof(cp));
+		strcpy(cp.name, name);
+		cp.size = size;
+		rc = cryptoSha256Start(&sha, NULL);
+		if (rc == 0) {
+			strncpy(cp.backend, sha.backend->name,
+				sizeof(cp.backend) - 1);
+		}
+	}
+
+	if (rc == 0) {
+		opened = true;
+		writeFunction = write;
+		writeContext = ctx;
+		position = cp.offset;
+		*offset = position;
+	}
+
+	k_mutex_unlock(&stageLock);
+	return rc;
+}
+
+/* The chunk is hashed after it is written, so a failed write leaves the hash
+ * matching the data in flash.
+ */
+int fotaStageWrite(const uint8_t *data, size_t len)
+{
+	uint32_t end;
+	bool checkpoint;
+	int rc;
+
+	k_mutex_lock(&stageLock, K_FOREVER);
+
+	end = position + len;
+	if (!opened || cp.complete) {
+		rc = -EINVAL;
+	} else if (end > cp.size) {
+		rc = -EFBIG;
+	} else {
+		checkpoint = (end / CONFIG_FOTA_STAGE_CHECKPOINT_SIZE) !=
+			     (position / CONFIG_FOTA_STAGE_CHECKPOINT_SIZE);
+		rc = writeFunction(writeContext, position, data, len,
+				   checkpoint || end == cp.size);
+		if (rc == 0) {
+			rc = cryptoSha256Update(&sha, data, len);
+		}
+		if (rc == 0) {
+			position = end;
+			if (end == cp.size) {
+				rc = cryptoSha256Finish(&sha, cp.digest);
+				cp.complete = (rc == 0);
+				cp.state_len = 0;
+				saveCheckpoint();
+			} else if (checkpoint) {
+				saveCheckpoint();
+			}
+		}
+	}
+
+	k_mutex_unlock(&stageLock);
+	return rc;
+}
+
+void fotaStageClose(bool forget)
+{
+	k_mutex_lock(&stageLock, K_FOREVER);
+
+	if (opened && !cp.complete) {
+		cryptoSha256Abort(&sha);
+	}
+	opened = false;
+
+	if (forget) {
+		memset(&cp, 0, sizeof(cp));
+		appNvDelete(APP_NV_ID_FOTA_STAGE);
+	}
+
+	k_mutex_unlock(&stageLock);
+}
+
+size_t fotaStageCheckpoint(const char *name, size_t size)
+{
+	size_t offset = 0;
+
+	k_mutex_lock(&stageLock, K_FOREVER);
+	if (resumable(name, size)) {
+		offset = cp.offset;
+	}
+	k_mutex_unlock(&stageLock);
+
+	return offset;
+}
+
+int fotaStageDigest(const char *name, uint8_t digest[CRYPTO_SHA256_SIZE])
+{
+	int rc = -ENOENT;
+
+	k_mutex_lock(&stageLock, K_FOREVER);
+	if (cp.complete && strcmp(name, cp.name) == 0) {
+		memcpy(digest, cp.digest, CRYPTO_SHA256_SIZE);
+		rc = 0;
+	}
+	k_mutex_unlock(&stageLock);
+
+	return rc;
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static bool resumable(const char *name, size_t size)
+{
+	return !cp.complete && cp.offset != 0 && cp.size == size &&
+	       strcmp(name, cp.name) == 0;
+}
+
+/* Continue the checkpoint if it is for the same image and the hash state can
+ * be restored (the backend may have changed with a firmware update).
+ */
+static bool resume(const char *name, size_t size)
+{
+	if (!resumable(name, size)) {
+		return false;
+	}
+
+	if (cryptoSha256Restore(&sha, cryptoGetBackend(cp.backend), cp.state,
+				cp.state_len) != 0) {
+		FOTA_STAGE_LOG_WRN("Unable to restore hash; restarting %s",
+				   log_strdup(name));
+		return false;
+	}
+
+	FOTA_STAGE_LOG_INF("Resuming %s at %u", log_strdup(name), cp.offset);
+	return true;
+}
+
+/* Without a portable hash state only the completed digest is saved.  If the
+ * state can't be saved there is nothing to continue from.
+ */
+static int saveCheckpoint(void)
+{
+	int n = 0;
+	int rc;
+
+	if (!cp.complete) {
+		n = cryptoSha256Save(&sha, cp.state, sizeof(cp.state));
+		if (n < 0) {
+			cp.offset = 0;
+			cp.state_len = 0;
+			return n;
+		}
+	}
+	cp.offset = position;
+	cp.state_len = n;
+
+	rc = appNvWrite(APP_NV_ID_FOTA_STAGE, &cp, sizeof(cp));
+	if (rc < 0) {
+		FOTA_STAGE_LOG_WRN("Unable to save checkpoint (%d)", rc);
+	}
+	return rc;
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_FOTA_STAGE_SHELL
+static int shell_fota_stage_status(const struct shell *shell, size_t argc,
+				   char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	k_mutex_lock(&stageLock, K_FOREVER);
+	if (cp.name[0] == '\0') {
+		shell_print(shell, "No image");
+	} else {
+		shell_print(shell, "%s %u/%u%s (%s)", cp.name,
+			    opened ? position : cp.offset, cp.size,
+			    opened ? " open" : "", cp.backend);
+		if (cp.complete) {
+			shell_hexdump(shell, cp.digest, sizeof(cp.digest));
+		}
+	}
+	k_mutex_unlock(&stageLock);
+	return 0;
+}
+
+static int shell_fota_stage_forget(const struct shell *shell, size_t argc,
+				   char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	if (opened) {
+		shell_error(shell, "Image is open");
+		return -EBUSY;
+	}
+	fotaStageClose(true);
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	fota_stage_cmds,
+	SHELL_CMD(status, NULL, "Print the staged image and digest",
+		  shell_fota_stage_status),
+	SHELL_CMD(forget, NULL, "Discard the checkpoint",
+		  shell_fota_stage_forget),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(fotastage, &fota_stage_cmds, "FOTA staging", NULL);
+#endif /* CONFIG_FOTA_STAGE_SHELL */
@@ -0,0 +1,328 @@
+/**
+ * @file led_compositor.c
+ * @brief Drives all LEDs and their blink patterns from one timer.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(led_compositor);
+
+#define LED_COMPOSITOR_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define LED_COMPOSITOR_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define LED_COMPOSITOR_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define LED_COMPOSITOR_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <device.h>
+#include <drivers/gpio.h>
+#include <shell/shell.h>
+
+#include "metrics.h"
+#include "led_compositor.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+enum led_mode { MODE_OFF = 0, MODE_ON, MODE_BLINK };
+
+struct led {
+	const struct device *dev;
+	uint32_t pin;
+	enum led_mode mode;
+	/* Output of a blinking LED */
+	bool lit;
+	uint32_t onMs;
+	uint32_t offMs;
+	uint32_t remaining;
+	/* Uptime of the next transition (a multiple of the tick) */
+	int64_t next;
+};
+
+#define TICK_MS CONFIG_LED_COMPOSITOR_TICK_MS
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static struct led *get(uint32_t index);
+static uint32_t roundUp(uint32_t ms);
+static void output(struct led *l, bool on);
+static void refresh(struct led *l);
+static void schedule(int64_t now);
+static void timerExpiry(struct k_timer *timer);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static struct k_spinlock lock;
+static struct k_timer timer;
+static struct led leds[CONFIG_LED_COMPOSITOR_COUNT];
+static bool enabled = IS_ENABLED(CONFIG_LED_COMPOSITOR_ENABLE);
+
+METRIC_COUNTER_DEFINE(wakeups, "led_wakeups");
+METRIC_COUNTER_DEFINE(transitions, "led_transitions");
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+int ledInit(const struct led_compositor_config *config, size_t count)
+{
+	struct led *l;
+	gpio_flags_t flags;
+	int rc = 0;
+	size_t i;
+
+	k_timer_init(&timer, timerExpiry, NULL);
+
+	for (i = 0; i < count; i++) {
+		l = get(config[i].index);
+		if (l == NULL) {
+			rc = -EINVAL;
+			continue;
+		}
+		l->dev = device_get_binding(config[i].dev_name);
+		if (l->dev == NULL) {
+			LED_COMPOSITOR_LOG_ERR("LED %u: no device %s",
+					       config[i].index,
+					       log_strdup(config[i].dev_name));
+			rc = -ENODEV;
+			continue;
+		}
+		l->pin = config[i].pin;
+		flags = GPIO_OUTPUT_INACTIVE |
+			((config[i].polarity == LED_POLARITY_ACTIVE_LOW) ?
+				 GPIO_ACTIVE_LOW :
+				 GPIO_ACTIVE_HIGH);
+		if (gpio_pin_configure(l->dev, l->pin, flags) < 0) {
+			l->dev = NULL;
+			rc = -EIO;
+		}
+	}
+
+	return rc;
+}
+
+void ledOn(uint32_t index)
+{
+	struct led *l = get(index);
+	k_spinlock_key_t key;
+
+	if (l != NULL) {
+		key = k_spin_lock(&lock);
+		l->mode = MODE_ON;
+		refresh(l);
+		k_spin_unlock(&lock, key);
+	}
+}
+
+void ledOff(uint32_t index)
+{
+	struct led *l = get(index);
+	k_spinlock_key_t key;
+
+	if (l != NULL) {
+		key = k_spin_lock(&lock);
+		l->mode = MODE_OFF;
+		refresh(l);
+		k_spin_unlock(&lock, key);
+	}
+}
+
+void ledBlink(uint32_t index, const struct led_pattern *pattern)
+{
+	struct led *l = get(index);
+	k_spinlock_key_t key;
+	int64_t now;
+
+	if (l == NULL || pattern == NULL || pattern->repeat_count == 0) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	now = k_uptime_get();
+	l->mode = MODE_BLINK;
+	l->onMs = roundUp(pattern->on_ms);
+	l->offMs = roundUp(pattern->off_ms);
+	l->remaining = pattern->repeat_count;
+	/* Start at the next tick, where other LEDs may change too */
+	l->lit = false;
+	l->next = ((now / TICK_MS) + 1) * TICK_MS;
+	refresh(l);
+	schedule(now);
+	k_spin_unlock(&lock, key);
+}
+
+void ledSetEnabled(bool enable)
+{
+	k_spinlock_key_t key;
+	int64_t now;
+	size_t i;
+
+	key = k_spin_lock(&lock);
+	now = k_uptime_get();
+	enabled = enable;
+	for (i = 0; i < ARRAY_SIZE(leds); i++) {
+		if (enable && leds[i].mode == MODE_BLINK) {
+			/* Continue the pattern from the next tick */
+			leds[i].lit = false;
+			leds[i].next = ((now / TICK_MS) + 1) * TICK_MS;
+		}
+		refresh(&leds[i]);
+	}
+	schedule(now);
+	k_spin_unlock(&lock, key);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static struct led *get(uint32_t index)
+{
+	return (index < ARRAY_SIZE(leds)) ? &leds[index] : NULL;
+}
+
+static uint32_t roundUp(uint32_t ms)
+{
+	return MAX(((ms + TICK_MS - 1) / TICK_MS) * TICK_MS, TICK_MS);
+}
+
+static void output(struct led *l, bool on)
+{
+	if (l->dev != NULL) {
+		gpio_pin_set(l->dev, l->pin, on ? 1 : 0);
+	}
+}
+
+/* Called with the lock */
+static void refresh(struct led *l)
+{
+	bool on = false;
+
+	if (enabled) {
+		on = (l->mode == MODE_ON) || (l->mode == MODE_BLINK && l->lit);
+	}
+	output(l, on);
+}
+
+/* Called with the lock.  Starts the timer for the earliest transition. */
+static void schedule(int64_t now)
+{
+	int64_t next = INT64_MAX;
+	size_t i;
+
+	if (enabled) {
+		for (i = 0; i < ARRAY_SIZE(leds); i++) {
+			if (leds[i].mode == MODE_BLINK) {
+				next = MIN(next, leds[i].next);
+			}
+		}
+	}
+
+	if (next == INT64_MAX) {
+		k_timer_stop(&timer);
+	} else {
+		k_timer_start(&timer, K_MSEC(MAX(next - now, 0)), K_NO_WAIT);
+	}
+}
+
+static void timerExpiry(struct k_timer *t)
+{
+	k_spinlock_key_t key;
+	struct led *l;
+	int64_t now;
+	size_t i;
+
+	ARG_UNUSED(t);
+
+	metricsIncrement(&wakeups);
+
+	key = k_spin_lock(&lock);
+	now = k_uptime_get();
+	for (i = 0; i < ARRAY_SIZE(leds); i++) {
+		l = &leds[i];
+		/* Late by less than a tick still counts as this tick */
+		while (l->mode == MODE_BLINK && l->next < now + TICK_MS) {
+			if (l->lit) {
+				l->lit = false;
+				l->next += l->offMs;
+				if (l->remaining != LED_REPEAT_FOREVER &&
+				    --l->remaining == 0) {
+					l->mode = MODE_OFF;
+				}
+			} else {
+				l->lit = true;
+				l->next += l->onMs;
+			}
+			metricsIncrement(&transitions);
+			refresh(l);
+		}
+	}
+	schedule(now);
+	k_spin_unlock(&lock, key);
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+static int shell_leds_enable(const struct shell *shell, size_t argc,
+			     char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	ledSetEnabled(true);
+	return 0;
+}
+
+static int shell_leds_disable(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	ledSetEnabled(false);
+	return 0;
+}
+
+static int shell_leds_status(const struct shell *shell, size_t argc,
+			     char **argv)
+{
+	static const char *const MODES[] = { "off", "on", "blink" };
+	size_t i;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(shell, "%s, %u wakeups, %u transitions",
+		    enabled ? "Enabled" : "Disabled",
+		    (uint32_t)atomic_get(&wakeups.value),
+		    (uint32_t)atomic_get(&transitions.value));
+	for (i = 0; i < ARRAY_SIZE(leds); i++) {
+		if (leds[i].mode == MODE_BLINK) {
+			shell_print(shell, "LED %u: blink %u/%u ms", i,
+				    leds[i].onMs, leds[i].offMs);
+		} else {
+			shell_print(shell, "LED %u: %s", i,
+				    MODES[leds[i].mode]);
+		}
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	leds_cmds,
+	SHELL_CMD(enable, NULL, "Show the LEDs", shell_leds_enable),
+	SHELL_CMD(disable, NULL, "Turn all LEDs off", shell_leds_disable),
+	SHELL_CMD(status, NULL, "Print the LEDs and the wakeup count",
+		  shell_leds_status),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(leds, &leds_cmds, "LED compositor", NULL);
+#endif /* CONFIG_SHELL */
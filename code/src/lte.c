@@ -15,6 +15,7 @@ LOG_MODULE_REGISTER(app_lte);
 #define LTE_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
 #define LTE_LOG_INF(...) LOG_INF(__VA_ARGS__)
 #define LTE_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+#define LTE_LOG_HOT(...) BINLOG_DBG(__VA_ARGS__)
 
 /******************************************************************************/
 /* Includes                                                                   */
@@ -27,10 +28,16 @@ LOG_MODULE_REGISTER(app_lte);
 #include <net/socket.h>
 
 #include <drivers/modem/hl7800.h>
-#include "ble_cellular_service.h"
+#include "cell_notify.h"
+#include "lte_reconnect.h"
 #include "fota.h"
 #include "led_configuration.h"
-#include "qrtc.h"
+#include "binlog.h"
+#include "metrics.h"
+#include "conn_scheduler.h"
+#ifdef CONFIG_LTE_POWER
+#include "lte_power.h"
+#endif
 
 #include "lte.h"
 
@@ -52,10 +59,38 @@ struct mgmt_events {
 	struct net_mgmt_event_callback cb;
 };
 
-static const struct led_blink_pattern NETWORK_SEARCH_LED_PATTERN = {
-	.on_time = CONFIG_DEFAULT_LED_ON_TIME_FOR_1_SECOND_BLINK,
-	.off_time = CONFIG_DEFAULT_LED_OFF_TIME_FOR_1_SECOND_BLINK,
-	.repeat_count = REPEAT_INDEFINITELY
+/* Copy of a modem event.  The driver's event data is only valid during the
+ * callback.
+ */
+struct modem_event {
+	uint8_t event;
+	union {
+		uint8_t code;
+		int value;
+		uint32_t count;
+		struct mdm_hl7800_apn *apn;
+		char string[CONFIG_LTE_EVENT_STRING_SIZE];
+	} data;
+};
+
+/* Bounded multi-producer, single consumer ring.  Each slot has a sequence
+ * number that tells producers and the consumer whose turn it is, so no lock
+ * is needed (the driver reports events from more than one thread).
+ */
+struct event_slot {
+	atomic_t sequence;
+	struct modem_event e;
+};
+
+#define EVENT_RING_MASK (CONFIG_LTE_EVENT_RING_SIZE - 1)
+
+BUILD_ASSERT((CONFIG_LTE_EVENT_RING_SIZE & EVENT_RING_MASK) == 0,
+	     "Event ring size must be a power of two");
+
+static const struct led_pattern NETWORK_SEARCH_LED_PATTERN = {
+	.on_ms = CONFIG_DEFAULT_LED_ON_TIME_FOR_1_SECOND_BLINK,
+	.off_ms = CONFIG_DEFAULT_LED_OFF_TIME_FOR_1_SECOND_BLINK,
+	.repeat_count = LED_REPEAT_FOREVER
 };
 
 /******************************************************************************/
@@ -71,8 +106,15 @@ static void iface_down_evt_handler(struct net_mgmt_event_callback *cb,
 static void setup_iface_events(void);
 
 static void modemEventCallback(enum mdm_hl7800_event event, void *event_data);
+static void copyModemEvent(struct modem_event *e, enum mdm_hl7800_event event,
+			   const void *event_data);
+static void modemEventWorkHandler(struct k_work *item);
+static void handleModemEvent(const struct modem_event *e);
 
-static void getLocalTimeFromModemWorkHandler(struct k_work *item);
+static void queryWorkHandler(struct k_work *item);
+static void runQueries(uint32_t queries, struct lte_query_result *result);
+static void signalQualityCallback(struct lte_query *query,
+				  const struct lte_query_result *result);
 
 /******************************************************************************/
 /* Local Data Definitions                                                     */
@@ -82,9 +124,36 @@ static struct net_if_config *cfg;
 static struct dns_resolve_context *dns;
 static struct lte_status lteStatus;
 static lte_event_function_t lteCallbackFunction = NULL;
-struct k_work localTimeWork;
-static struct tm localTime;
-static int32_t localOffset;
+
+K_THREAD_STACK_DEFINE(lteWorkQStack, CONFIG_LTE_WORKQ_STACK_SIZE);
+static struct k_work_q lteWorkQ;
+static struct k_work eventWork;
+static struct event_slot eventRing[CONFIG_LTE_EVENT_RING_SIZE];
+static atomic_t eventHead;
+static atomic_t eventTail;
+
+K_MUTEX_DEFINE(queryLock);
+static struct k_work queryWork;
+/* Requests that wait for the next batch */
+static sys_slist_t waiting;
+static uint32_t waitingQueries;
+/* Requests answered by the batch that is running */
+static sys_slist_t running;
+static uint32_t runningQueries;
+
+static struct lte_query signalQualityQuery = {
+	.queries = LTE_QUERY_SIGNAL_QUALITY,
+	.callback = signalQualityCallback
+};
+
+METRIC_COUNTER_DEFINE(modemEvents, "modem_events");
+METRIC_COUNTER_DEFINE(lteReadyEvents, "lte_ready");
+METRIC_COUNTER_DEFINE(lteDownEvents, "lte_down");
+METRIC_COUNTER_DEFINE(queryCommands, "lte_query_commands");
+METRIC_COUNTER_DEFINE(queryCoalesced, "lte_query_coalesced");
+METRIC_COUNTER_DEFINE(modemEventDrops, "modem_event_drops");
+/* The maximum is the ring high-water mark */
+METRIC_GAUGE_DEFINE(modemEventBacklog, "modem_event_backlog");
 
 static struct mgmt_events iface_events[] = {
 	{ .event = NET_EVENT_DNS_SERVER_ADD,
@@ -104,9 +173,26 @@ void lteRegisterEventCallback(lte_event_function_t callback)
 int lteInit(void)
 {
 	int rc = LTE_ERR_NONE;
+	size_t i;
+
+	cellNotifyInit();
+	lteReconnectInit(&lteWorkQ);
+#ifdef CONFIG_LTE_POWER
+	ltePowerInit();
+#endif
+
+	for (i = 0; i < ARRAY_SIZE(eventRing); i++) {
+		atomic_set(&eventRing[i].sequence, i);
+	}
+	k_work_q_start(&lteWorkQ, lteWorkQStack,
+		       K_THREAD_STACK_SIZEOF(lteWorkQStack),
+		       CONFIG_LTE_WORKQ_PRIORITY);
+	k_thread_name_set(&lteWorkQ.thread, "lte_workq");
+	k_work_init(&eventWork, modemEventWorkHandler);
+
 	mdm_hl7800_register_event_callback(modemEventCallback);
 	setup_iface_events();
-	k_work_init(&localTimeWork, getLocalTimeFromModemWorkHandler);
+	k_work_init(&queryWork, queryWorkHandler);
 
 	/* wait for network interface to be ready */
 	iface = net_if_get_default();
@@ -155,10 +241,46 @@ bool lteIsReady(void)
 
 struct lte_status *lteGetStatus(void)
 {
-	mdm_hl7800_get_signal_quality(&lteStatus.rssi, &lteStatus.sinr);
+	lteQuerySubmit(&signalQualityQuery);
 	return &lteStatus;
 }
 
+int lteQuerySubmit(struct lte_query *query)
+{
+	uint32_t coalesced;
+
+	if (query == NULL || query->callback == NULL || query->queries == 0 ||
+	    (query->queries & ~LTE_QUERY_ALL) != 0) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&queryLock, K_FOREVER);
+
+	if (query->pending) {
+		k_mutex_unlock(&queryLock);
+		return -EALREADY;
+	}
+	query->pending = true;
+
+	if ((query->queries & ~runningQueries) == 0) {
+		/* Everything it needs is being read */
+		sys_slist_append(&running, &query->node);
+		coalesced = query->queries;
+	} else {
+		coalesced = query->queries & waitingQueries;
+		sys_slist_append(&waiting, &query->node);
+		waitingQueries |= query->queries;
+		k_work_submit(&queryWork);
+	}
+
+	k_mutex_unlock(&queryLock);
+
+	if (coalesced != 0) {
+		metricsIncrement(&queryCoalesced);
+	}
+	return 0;
+}
+
 /******************************************************************************/
 /* Local Function Definitions                                                 */
 /******************************************************************************/
@@ -177,9 +299,10 @@ static void iface_ready_evt_handler(struct net_mgmt_event_callback *cb,
 	}
 
 	LTE_LOG_DBG("LTE is ready!");
-	led_turn_on(RED_LED3);
+	metricsIncrement(&lteReadyEvents);
+	lteReconnectOnUp();
+	ledOn(RED_LED3);
 	onLteEvent(LTE_EVT_READY);
-	k_work_submit(&localTimeWork);
 }
 
 static void iface_down_evt_handler(struct net_mgmt_event_callback *cb,
@@ -190,7 +313,9 @@ static void iface_down_evt_handler(struct net_mgmt_event_callback *cb,
 	}
 
 	LTE_LOG_DBG("LTE is down");
-	led_turn_off(RED_LED3);
+	metricsIncrement(&lteDownEvents);
+	lteReconnectOnDown();
+	ledOff(RED_LED3);
 	onLteEvent(LTE_EVT_DISCONNECTED);
 }
 
@@ -207,57 +332,165 @@ static void setup_iface_events(void)
 	}
 }
 
+/* Runs in the driver's context: copy the event into the ring and leave. */
 static void modemEventCallback(enum mdm_hl7800_event event, void *event_data)
 {
-	uint8_t code = ((struct mdm_hl7800_compound_event *)event_data)->code;
+	struct event_slot *slot;
+	atomic_val_t head;
+	int32_t diff;
+
+	head = atomic_get(&eventHead);
+	while (true) {
+		slot = &eventRing[head & EVENT_RING_MASK];
+		diff = (int32_t)(atomic_get(&slot->sequence) - head);
+		if (diff == 0) {
+			if (atomic_cas(&eventHead, head, head + 1)) {
+				break;
+			}
+			head = atomic_get(&eventHead);
+		} else if (diff < 0) {
+			/* Full */
+			metricsIncrement(&modemEventDrops);
+			return;
+		} else {
+			head = atomic_get(&eventHead);
+		}
+	}
+
+	copyModemEvent(&slot->e, event, event_data);
+	atomic_set(&slot->sequence, head + 1);
+	metricsGaugeSet(&modemEventBacklog,
+			(uint32_t)(head + 1 - atomic_get(&eventTail)));
+	k_work_submit_to_queue(&lteWorkQ, &eventWork);
+}
+
+static void copyModemEvent(struct modem_event *e, enum mdm_hl7800_event event,
+			   const void *event_data)
+{
+	e->event = (uint8_t)event;
+
 	switch (event) {
+	case HL7800_EVENT_APN_UPDATE:
+		/* Points to static data stored in the modem driver */
+		e->data.apn = (struct mdm_hl7800_apn *)event_data;
+		break;
+
+	case HL7800_EVENT_RSSI:
+	case HL7800_EVENT_SINR:
+		e->data.value = *((const int *)event_data);
+		break;
+
+	case HL7800_EVENT_RAT:
+	case HL7800_EVENT_FOTA_STATE:
+		e->data.code = *((const uint8_t *)event_data);
+		break;
+
+	case HL7800_EVENT_FOTA_COUNT:
+		e->data.count = *((const uint32_t *)event_data);
+		break;
+
+	case HL7800_EVENT_BANDS:
+	case HL7800_EVENT_ACTIVE_BANDS:
+	case HL7800_EVENT_REVISION:
+		strncpy(e->data.string, (const char *)event_data,
+			sizeof(e->data.string) - 1);
+		e->data.string[sizeof(e->data.string) - 1] = '\0';
+		break;
+
+	default:
+		e->data.code =
+			((const struct mdm_hl7800_compound_event *)event_data)
+				->code;
+		break;
+	}
+}
+
+static void modemEventWorkHandler(struct k_work *item)
+{
+	struct event_slot *slot;
+	struct modem_event e;
+	atomic_val_t tail;
+
+	ARG_UNUSED(item);
+
+	while (true) {
+		tail = atomic_get(&eventTail);
+		slot = &eventRing[tail & EVENT_RING_MASK];
+		if ((int32_t)(atomic_get(&slot->sequence) - (tail + 1)) != 0) {
+			/* Empty (or the next event is still being copied;
+			 * its producer submits the work again)
+			 */
+			break;
+		}
+		e = slot->e;
+		atomic_set(&slot->sequence, tail + CONFIG_LTE_EVENT_RING_SIZE);
+		atomic_set(&eventTail, tail + 1);
+		handleModemEvent(&e);
+	}
+}
+
+static void handleModemEvent(const struct modem_event *e)
+{
+	uint8_t code = e->data.code;
+
+	LTE_LOG_HOT("Modem event %d code %u", e->event, code);
+	metricsIncrement(&modemEvents);
+
+	switch (e->event) {
 	case HL7800_EVENT_NETWORK_STATE_CHANGE:
-		cell_svc_set_network_state(code);
+		cellNotifySetNetworkState(code);
+		lteReconnectOnNetworkState(code);
 
 		switch (code) {
 		case HL7800_HOME_NETWORK:
 		case HL7800_ROAMING:
-			led_turn_on(RED_LED3);
+			ledOn(RED_LED3);
 			break;
 
 		case HL7800_REGISTRATION_DENIED:
 		case HL7800_UNABLE_TO_CONFIGURE:
 		case HL7800_OUT_OF_COVERAGE:
-			led_turn_off(RED_LED3);
+			ledOff(RED_LED3);
 			break;
 
 		case HL7800_NOT_REGISTERED:
 		case HL7800_SEARCHING:
-			led_blink(RED_LED3, &NETWORK_SEARCH_LED_PATTERN);
+			ledBlink(RED_LED3, &NETWORK_SEARCH_LED_PATTERN);
 			break;
 
 		case HL7800_EMERGENCY:
 		default:
-			led_turn_off(RED_LED3);
+			ledOff(RED_LED3);
 			break;
 		}
 		break;
 
 	case HL7800_EVENT_APN_UPDATE:
-		/* event data points to static data stored in modem driver.
-		 * Store the pointer so we can access the APN elsewhere in our app.
+		/* Store the pointer so we can access the APN elsewhere in our
+		 * app.
 		 */
-		lte_apn_config = (struct mdm_hl7800_apn *)event_data;
-		cell_svc_set_apn(lte_apn_config);
+		lte_apn_config = e->data.apn;
+		cellNotifySetApn(lte_apn_config);
 		break;
 
 	case HL7800_EVENT_RSSI:
-		cell_svc_set_rssi(*((int *)event_data));
+		lteStatus.rssi = e->data.value;
+		cellNotifySetRssi(lteStatus.rssi);
 		break;
 
 	case HL7800_EVENT_SINR:
-		cell_svc_set_sinr(*((int *)event_data));
+		lteStatus.sinr = e->data.value;
+		cellNotifySetSinr(lteStatus.sinr);
 		break;
 
 	case HL7800_EVENT_STARTUP_STATE_CHANGE:
-		cell_svc_set_startup_state(code);
+		cellNotifySetStartupState(code);
 		switch (code) {
 		case HL7800_STARTUP_STATE_READY:
+#ifdef CONFIG_LTE_POWER
+			ltePowerOnReady();
+#endif
+			break;
 		case HL7800_STARTUP_STATE_WAITING_FOR_ACCESS_CODE:
 			break;
 		case HL7800_STARTUP_STATE_SIM_NOT_PRESENT:
@@ -266,41 +499,45 @@ static void modemEventCallback(enum mdm_hl7800_event event, void *event_data)
 		case HL7800_STARTUP_STATE_UNKNOWN:
 		case HL7800_STARTUP_STATE_INACTIVE_SIM:
 		default:
-			led_turn_off(RED_LED3);
+			ledOff(RED_LED3);
 			break;
 		}
 		break;
 
 	case HL7800_EVENT_SLEEP_STATE_CHANGE:
-		cell_svc_set_sleep_state(code);
+		cellNotifySetSleepState(code);
+		connSchedulerOnSleepState(code);
+#ifdef CONFIG_LTE_POWER
+		ltePowerOnSleepState(code);
+#endif
 		break;
 
 	case HL7800_EVENT_RAT:
-		cell_svc_set_rat(*((uint8_t *)event_data));
+		cellNotifySetRat(e->data.code);
 		break;
 
 	case HL7800_EVENT_BANDS:
-		cell_svc_set_bands((char *)event_data);
+		cellNotifySetBands(e->data.string);
 		break;
 
 	case HL7800_EVENT_ACTIVE_BANDS:
-		cell_svc_set_active_bands((char *)event_data);
+		cellNotifySetActiveBands(e->data.string);
 		break;
 
 	case HL7800_EVENT_FOTA_STATE:
 		if (IS_ENABLED(CONFIG_FOTA_SERVICE)) {
-			fota_state_handler(*((uint8_t *)event_data));
+			fota_state_handler(e->data.code);
 		}
 		break;
 
 	case HL7800_EVENT_FOTA_COUNT:
 		if (IS_ENABLED(CONFIG_FOTA_SERVICE)) {
-			fota_set_count(*((uint32_t *)event_data));
+			fota_set_count(e->data.count);
 		}
 		break;
 
 	case HL7800_EVENT_REVISION:
-		cell_svc_set_fw_ver((char *)event_data);
+		cellNotifySetFwVersion(e->data.string);
 #ifdef CONFIG_BLUEGRASS
 		/* Update shadow because modem version has changed. */
 		initShadow = true;
@@ -308,8 +545,8 @@ static void modemEventCallback(enum mdm_hl7800_event event, void *event_data)
 #ifdef CONFIG_COAP_FOTA
 		/* This is duplicated for backwards compatability. */
 		coap_fota_set_running_version(MODEM_IMAGE_TYPE,
-					      (char *)event_data,
-					      strlen((char *)event_data));
+					      (char *)e->data.string,
+					      strlen(e->data.string));
 #endif
 		break;
 
@@ -319,16 +556,68 @@ static void modemEventCallback(enum mdm_hl7800_event event, void *event_data)
 	}
 }
 
-static void getLocalTimeFromModemWorkHandler(struct k_work *item)
+/* Each batch reads everything requested so far once.  Requests submitted
+ * while it runs join it if it reads what they need.
+ */
+static void queryWorkHandler(struct k_work *item)
 {
+	struct lte_query_result result;
+	struct lte_query *query;
+	sys_snode_t *node;
+
 	ARG_UNUSED(item);
 
-	if (!Qrtc_EpochWasSet()) {
-		int32_t status =
-			mdm_hl7800_get_local_time(&localTime, &localOffset);
-		if (status == 0) {
-			LOG_INF("Epoch set to %u",
-				Qrtc_SetEpochFromTm(&localTime, localOffset));
+	k_mutex_lock(&queryLock, K_FOREVER);
+	sys_slist_merge_slist(&running, &waiting);
+	runningQueries = waitingQueries;
+	waitingQueries = 0;
+	k_mutex_unlock(&queryLock);
+
+	if (runningQueries == 0) {
+		return;
+	}
+
+	runQueries(runningQueries, &result);
+
+	k_mutex_lock(&queryLock, K_FOREVER);
+	runningQueries = 0;
+	while ((node = sys_slist_get(&running)) != NULL) {
+		query = CONTAINER_OF(node, struct lte_query, node);
+		query->pending = false;
+		/* The lock is recursive, so callbacks can submit again */
+		query->callback(query, &result);
+	}
+	k_mutex_unlock(&queryLock);
+}
+
+static void runQueries(uint32_t queries, struct lte_query_result *result)
+{
+	memset(result, 0, sizeof(*result));
+
+	if (queries & LTE_QUERY_SIGNAL_QUALITY) {
+		metricsIncrement(&queryCommands);
+		if (mdm_hl7800_get_signal_quality(&result->rssi,
+						  &result->sinr) == 0) {
+			lteStatus.rssi = result->rssi;
+			lteStatus.sinr = result->sinr;
+		} else {
+			result->failed |= LTE_QUERY_SIGNAL_QUALITY;
 		}
 	}
+
+	if (queries & LTE_QUERY_LOCAL_TIME) {
+		metricsIncrement(&queryCommands);
+		if (mdm_hl7800_get_local_time(&result->local_time,
+					      &result->local_offset) != 0) {
+			result->failed |= LTE_QUERY_LOCAL_TIME;
+		}
+	}
+}
+
+/* runQueries() already updated lteStatus */
+static void signalQualityCallback(struct lte_query *query,
+				  const struct lte_query_result *result)
+{
+	ARG_UNUSED(query);
+	ARG_UNUSED(result);
 }
@@ -0,0 +1,408 @@
+/**
+ * @file lte_power.c
+ * @brief PSM and eDRX settings derived from the reporting interval.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(lte_power);
+
+#define LTE_POWER_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define LTE_POWER_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define LTE_POWER_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define LTE_POWER_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <stdlib.h>
+#include <shell/shell.h>
+#include <drivers/modem/hl7800.h>
+
+#include "conn_scheduler.h"
+#include "metrics.h"
+#include "lte_power.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+struct timer_unit {
+	uint8_t code;
+	uint32_t seconds;
+};
+
+struct settings {
+	bool psm;
+	uint32_t t3412;
+	uint32_t t3324;
+	uint8_t t3412Code;
+	uint8_t t3324Code;
+	uint8_t edrxCode;
+};
+
+#define TIMER_VALUE_MAX 31
+#define TIMER_UNIT_SHIFT 5
+#define EDRX_DISABLED UINT8_MAX
+
+/* Access technology for AT+CEDRXS: 4 = LTE-M (WB-S1), 5 = NB-IoT (NB-S1) */
+#ifdef CONFIG_MODEM_HL7800_RAT_M1
+#define EDRX_ACT_TYPE 4
+#else
+#define EDRX_ACT_TYPE 5
+#endif
+
+#define MS_PER_DAY (24 * 60 * 60 * MSEC_PER_SEC)
+#define MS_PER_HOUR (60 * 60 * MSEC_PER_SEC)
+#define AT_CMD_SIZE 48
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void derive(uint32_t reportInterval, struct settings *s);
+static uint8_t encodeTimer(const struct timer_unit *units, size_t count,
+			   uint32_t seconds, uint32_t *actual);
+static uint8_t edrxCode(uint32_t maxMs);
+static void formatBits(char *out, uint8_t value, int bits);
+static void applyWorkHandler(struct k_work *item);
+static int apply(const struct settings *s);
+static void account(int64_t now);
+static uint32_t chargePerDay(void);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+/* 3GPP TS 24.008 GPRS timer 3 (T3412 extended), shortest unit first */
+static const struct timer_unit T3412_UNITS[] = {
+	{ 3, 2 },     { 4, 30 },    { 5, 60 },
+	{ 0, 600 },   { 1, 3600 },  { 2, 36000 },
+	{ 6, 1152000 }
+};
+
+/* GPRS timer 2 (T3324) */
+static const struct timer_unit T3324_UNITS[] = { { 0, 2 },
+						 { 1, 60 },
+						 { 2, 360 } };
+
+/* eDRX cycle lengths (ms) by code, TS 24.008 table 10.5.5.32 */
+static const uint32_t EDRX_CYCLES_MS[] = {
+	5120,	10240,	20480,	40960,	 61440,	  81920,  102400,
+	122880, 143360, 163840, 327680, 655360, 1310720, 2621440
+};
+
+K_MUTEX_DEFINE(powerLock);
+static struct k_work applyWork;
+static bool ready;
+static uint32_t reportInterval = CONFIG_LTE_POWER_REPORT_INTERVAL_S;
+static struct settings requested;
+static struct settings applied;
+static bool appliedValid;
+
+static bool awake;
+static int64_t stateSince;
+static int64_t accountedUntil;
+static int64_t accountingStart;
+/* Charge in uA x ms */
+static uint64_t charge;
+static uint64_t awakeMs;
+
+METRIC_GAUGE_DEFINE(t3412Gauge, "lte_power_t3412_s");
+METRIC_GAUGE_DEFINE(t3324Gauge, "lte_power_t3324_s");
+METRIC_GAUGE_DEFINE(edrxGauge, "lte_power_edrx_ms");
+/* Length of the last awake and sleep periods show the granted timers */
+METRIC_GAUGE_DEFINE(awakePeriod, "lte_power_awake_ms");
+METRIC_GAUGE_DEFINE(sleepPeriod, "lte_power_sleep_ms");
+METRIC_GAUGE_DEFINE(chargeGauge, "lte_power_uah_per_day");
+METRIC_COUNTER_DEFINE(applyFailures, "lte_power_apply_failures");
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void ltePowerInit(void)
+{
+	k_work_init(&applyWork, applyWorkHandler);
+
+	/* The modem is awake until it reports otherwise */
+	awake = true;
+	stateSince = k_uptime_get();
+	accountedUntil = stateSince;
+	accountingStart = stateSince;
+
+	derive(reportInterval, &requested);
+}
+
+void ltePowerOnReady(void)
+{
+	k_mutex_lock(&powerLock, K_FOREVER);
+	ready = true;
+	k_mutex_unlock(&powerLock);
+	k_work_submit(&applyWork);
+}
+
+void ltePowerOnSleepState(uint8_t state)
+{
+	int64_t now = k_uptime_get();
+	bool isAwake = (state == HL7800_SLEEP_STATE_AWAKE);
+
+	k_mutex_lock(&powerLock, K_FOREVER);
+	if (isAwake != awake) {
+		account(now);
+		metricsGaugeSet(awake ? &awakePeriod : &sleepPeriod,
+				(uint32_t)(now - stateSince));
+		awake = isAwake;
+		stateSince = now;
+		metricsGaugeSet(&chargeGauge, chargePerDay());
+	}
+	if (state == HL7800_SLEEP_STATE_UNINITIALIZED) {
+		/* The modem was reset and lost its settings */
+		ready = false;
+		appliedValid = false;
+	}
+	k_mutex_unlock(&powerLock);
+}
+
+void ltePowerSetReportInterval(uint32_t seconds)
+{
+	bool submit;
+
+	k_mutex_lock(&powerLock, K_FOREVER);
+	reportInterval = seconds;
+	derive(reportInterval, &requested);
+	submit = ready;
+	k_mutex_unlock(&powerLock);
+
+	if (submit) {
+		k_work_submit(&applyWork);
+	}
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void derive(uint32_t interval, struct settings *s)
+{
+	uint32_t quiet = MAX(interval, connSchedulerKeepAliveIntervalS());
+
+	memset(s, 0, sizeof(*s));
+	s->psm = (interval >= CONFIG_LTE_POWER_PSM_MIN_INTERVAL_S);
+	if (s->psm) {
+		/* A TAU shouldn't wake the modem between transmissions */
+		s->t3412Code =
+			encodeTimer(T3412_UNITS, ARRAY_SIZE(T3412_UNITS),
+				    quiet + CONFIG_LTE_POWER_TAU_MARGIN_S,
+				    &s->t3412);
+		s->t3324Code = encodeTimer(T3324_UNITS, ARRAY_SIZE(T3324_UNITS),
+					   CONFIG_LTE_POWER_ACTIVE_TIME_S,
+					   &s->t3324);
+		s->edrxCode = EDRX_DISABLED;
+	} else {
+		s->edrxCode = edrxCode(MIN(
+			(uint64_t)interval * MSEC_PER_SEC,
+			(uint64_t)CONFIG_LTE_POWER_MAX_DOWNLINK_LATENCY_MS));
+	}
+}
+
+/* Smallest timer value that is at least the requested time */
+static uint8_t encodeTimer(const struct timer_unit *units, size_t count,
+			   uint32_t seconds, uint32_t *actual)
+{
+	uint32_t value;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		value = (seconds + units[i].seconds - 1) / units[i].seconds;
+		if (value <= TIMER_VALUE_MAX) {
+			*actual = value * units[i].seconds;
+			return (units[i].code << TIMER_UNIT_SHIFT) | value;
+		}
+	}
+
+	/* Largest value */
+	*actual = TIMER_VALUE_MAX * units[count - 1].seconds;
+	return (units[count - 1].code << TIMER_UNIT_SHIFT) | TIMER_VALUE_MAX;
+}
+
+/* Longest cycle that isn't longer than maxMs */
+static uint8_t edrxCode(uint32_t maxMs)
+{
+	uint8_t code = EDRX_DISABLED;
+	uint8_t i;
+
+	for (i = 0; i < ARRAY_SIZE(EDRX_CYCLES_MS); i++) {
+		if (EDRX_CYCLES_MS[i] <= maxMs) {
+			code = i;
+		}
+	}
+	return code;
+}
+
+static void formatBits(char *out, uint8_t value, int bits)
+{
+	int i;
+
+	for (i = 0; i < bits; i++) {
+		out[i] = (value & BIT(bits - 1 - i)) ? '1' : '0';
+	}
+	out[bits] = '\0';
+}
+
+static void applyWorkHandler(struct k_work *item)
+{
+	struct settings s;
+	bool changed;
+	int rc;
+
+	ARG_UNUSED(item);
+
+	k_mutex_lock(&powerLock, K_FOREVER);
+	s = requested;
+	changed = !appliedValid || memcmp(&s, &applied, sizeof(s)) != 0;
+	k_mutex_unlock(&powerLock);
+
+	if (!changed) {
+		return;
+	}
+
+	rc = apply(&s);
+
+	k_mutex_lock(&powerLock, K_FOREVER);
+	if (rc == 0) {
+		applied = s;
+		appliedValid = true;
+		metricsGaugeSet(&t3412Gauge, s.psm ? s.t3412 : 0);
+		metricsGaugeSet(&t3324Gauge, s.psm ? s.t3324 : 0);
+		metricsGaugeSet(&edrxGauge, (s.edrxCode == EDRX_DISABLED) ?
+						    0 :
+						    EDRX_CYCLES_MS[s.edrxCode]);
+	} else {
+		metricsIncrement(&applyFailures);
+	}
+	k_mutex_unlock(&powerLock);
+}
+
+static int apply(const struct settings *s)
+{
+	char cmd[AT_CMD_SIZE];
+	char t3412[9];
+	char t3324[9];
+	char edrx[5];
+	int rc;
+
+	if (s->psm) {
+		formatBits(t3412, s->t3412Code, 8);
+		formatBits(t3324, s->t3324Code, 8);
+		snprintk(cmd, sizeof(cmd), "AT+CPSMS=1,,,\"%s\",\"%s\"", t3412,
+			 t3324);
+	} else {
+		snprintk(cmd, sizeof(cmd), "AT+CPSMS=0");
+	}
+	rc = mdm_hl7800_send_at_cmd((const uint8_t *)cmd);
+
+	if (rc == 0 && s->edrxCode != EDRX_DISABLED) {
+		formatBits(edrx, s->edrxCode, 4);
+		snprintk(cmd, sizeof(cmd), "AT+CEDRXS=1,%d,\"%s\"",
+			 EDRX_ACT_TYPE, edrx);
+		rc = mdm_hl7800_send_at_cmd((const uint8_t *)cmd);
+	} else if (rc == 0) {
+		snprintk(cmd, sizeof(cmd), "AT+CEDRXS=0");
+		rc = mdm_hl7800_send_at_cmd((const uint8_t *)cmd);
+	}
+
+	if (rc == 0) {
+		LTE_POWER_LOG_INF("PSM %s (TAU %u s, active %u s), eDRX %u ms",
+				  s->psm ? "on" : "off", s->t3412, s->t3324,
+				  (s->edrxCode == EDRX_DISABLED) ?
+					  0 :
+					  EDRX_CYCLES_MS[s->edrxCode]);
+	} else {
+		LTE_POWER_LOG_ERR("Unable to set power mode (%d)", rc);
+	}
+	return rc;
+}
+
+/* Called with the lock */
+static void account(int64_t now)
+{
+	uint32_t current;
+	int64_t elapsed = now - accountedUntil;
+
+	if (awake) {
+		current = CONFIG_LTE_POWER_AWAKE_CURRENT_UA;
+		awakeMs += elapsed;
+	} else if (appliedValid && applied.psm) {
+		current = CONFIG_LTE_POWER_PSM_CURRENT_UA;
+	} else {
+		current = CONFIG_LTE_POWER_SLEEP_CURRENT_UA;
+	}
+	charge += (uint64_t)current * elapsed;
+	accountedUntil = now;
+}
+
+/* Average current so far, projected over a day */
+static uint32_t chargePerDay(void)
+{
+	uint64_t elapsed = k_uptime_get() - accountingStart;
+
+	if (elapsed == 0) {
+		return 0;
+	}
+	return (uint32_t)((charge / elapsed) * MS_PER_DAY / MS_PER_HOUR);
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+static int shell_ltepower_status(const struct shell *shell, size_t argc,
+				 char **argv)
+{
+	int64_t now = k_uptime_get();
+	uint32_t elapsed;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	k_mutex_lock(&powerLock, K_FOREVER);
+	account(now);
+	elapsed = MAX((uint32_t)(now - accountingStart), 1);
+	shell_print(shell, "Report interval %u s, requested PSM %s",
+		    reportInterval, requested.psm ? "on" : "off");
+	if (requested.psm) {
+		shell_print(shell, "T3412 %u s, T3324 %u s", requested.t3412,
+			    requested.t3324);
+	} else if (requested.edrxCode != EDRX_DISABLED) {
+		shell_print(shell, "eDRX %u ms",
+			    EDRX_CYCLES_MS[requested.edrxCode]);
+	}
+	shell_print(shell, "Applied: %s", appliedValid ? "yes" : "no");
+	shell_print(shell, "Awake %u%% of %u s, estimate %u uAh/day",
+		    (uint32_t)((awakeMs * 100) / elapsed),
+		    elapsed / MSEC_PER_SEC, chargePerDay());
+	k_mutex_unlock(&powerLock);
+
+	return 0;
+}
+
+static int shell_ltepower_interval(const struct shell *shell, size_t argc,
+				   char **argv)
+{
+	ARG_UNUSED(argc);
+
+	ltePowerSetReportInterval(strtoul(argv[1], NULL, 0));
+	return shell_ltepower_status(shell, 1, argv);
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	ltepower_cmds,
+	SHELL_CMD(status, NULL, "Print power settings and energy estimate",
+		  shell_ltepower_status),
+	SHELL_CMD_ARG(interval, NULL, "Set the reporting interval <seconds>",
+		      shell_ltepower_interval, 2, 0),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(ltepower, &ltepower_cmds, "LTE power settings", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,217 @@
+/**
+ * @file lte_reconnect.c
+ * @brief Recovery of the LTE data connection after it goes down.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(lte_reconnect);
+
+#define LTE_RECONNECT_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define LTE_RECONNECT_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define LTE_RECONNECT_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define LTE_RECONNECT_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <random/rand32.h>
+#include <drivers/modem/hl7800.h>
+
+#include "metrics.h"
+#include "lte_reconnect.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+enum recovery_path {
+	PATH_NONE = 0,
+	/* PDP context re-activated while registered */
+	PATH_QUICK,
+	/* The modem registered again */
+	PATH_REGISTER,
+	/* The modem was reset */
+	PATH_RESET
+};
+
+#define PDP_ACTIVATE_CMD "AT+CGACT=1,1"
+
+#define RECOVER_MS_BOUNDS                                                      \
+	1000, 2500, 5000, 10000, 30000, 60000, 120000, 300000, 600000
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static bool isRegistered(uint8_t state);
+static void schedule(uint32_t delayMs);
+static void attemptWorkHandler(struct k_work *item);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_MUTEX_DEFINE(reconnectLock);
+static struct k_work_q *attemptWorkQ;
+static struct k_delayed_work attemptWork;
+static bool down;
+static bool registered;
+static int64_t downSince;
+static uint32_t attempts;
+static enum recovery_path path;
+
+METRIC_HISTOGRAM_DEFINE(recoverTime, "lte_recover_ms", RECOVER_MS_BOUNDS);
+METRIC_COUNTER_DEFINE(quickRecoveries, "lte_recover_quick");
+METRIC_COUNTER_DEFINE(registerRecoveries, "lte_recover_register");
+METRIC_COUNTER_DEFINE(resetRecoveries, "lte_recover_reset");
+METRIC_COUNTER_DEFINE(pdpAttempts, "lte_reconnect_pdp_attempts");
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void lteReconnectInit(struct k_work_q *workQ)
+{
+	attemptWorkQ = workQ;
+	k_delayed_work_init(&attemptWork, attemptWorkHandler);
+}
+
+void lteReconnectOnNetworkState(uint8_t state)
+{
+	bool wasRegistered;
+
+	k_mutex_lock(&reconnectLock, K_FOREVER);
+	wasRegistered = registered;
+	registered = isRegistered(state);
+	if (registered && !wasRegistered) {
+		if (down) {
+			if (path == PATH_NONE) {
+				path = PATH_REGISTER;
+			}
+			/* The modem brings the context up itself after a
+			 * registration; check soon in case it doesn't.
+			 */
+			attempts = 0;
+			schedule(lteReconnectBackoffMs(
+				0, CONFIG_LTE_RECONNECT_MIN_MS,
+				CONFIG_LTE_RECONNECT_MAX_MS));
+		}
+	}
+	k_mutex_unlock(&reconnectLock);
+}
+
+void lteReconnectOnDown(void)
+{
+	k_mutex_lock(&reconnectLock, K_FOREVER);
+	if (!down) {
+		down = true;
+		downSince = k_uptime_get();
+		attempts = 0;
+		path = PATH_NONE;
+		LTE_RECONNECT_LOG_INF("Connection lost (%s)",
+				      registered ? "registered" :
+						   "not registered");
+		schedule(lteReconnectBackoffMs(0, CONFIG_LTE_RECONNECT_MIN_MS,
+					       CONFIG_LTE_RECONNECT_MAX_MS));
+	}
+	k_mutex_unlock(&reconnectLock);
+}
+
+void lteReconnectOnUp(void)
+{
+	uint32_t elapsed;
+
+	k_mutex_lock(&reconnectLock, K_FOREVER);
+	if (down) {
+		down = false;
+		k_delayed_work_cancel(&attemptWork);
+		elapsed = (uint32_t)(k_uptime_get() - downSince);
+		metricsHistogramRecord(&recoverTime, elapsed);
+		switch (path) {
+		case PATH_RESET:
+			metricsIncrement(&resetRecoveries);
+			break;
+		case PATH_REGISTER:
+			metricsIncrement(&registerRecoveries);
+			break;
+		default:
+			/* Up again without a new registration */
+			metricsIncrement(&quickRecoveries);
+			break;
+		}
+		LTE_RECONNECT_LOG_INF("Recovered in %u ms after %u attempts",
+				      elapsed, attempts);
+	}
+	k_mutex_unlock(&reconnectLock);
+}
+
+uint32_t lteReconnectBackoffMs(uint32_t attempt, uint32_t minMs,
+			       uint32_t maxMs)
+{
+	uint32_t delay = minMs;
+
+	while (attempt-- > 0 && delay < maxMs) {
+		delay *= 2;
+	}
+	delay = MIN(delay, maxMs);
+
+	return (delay / 2) + (sys_rand32_get() % ((delay / 2) + 1));
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static bool isRegistered(uint8_t state)
+{
+	return (state == HL7800_HOME_NETWORK || state == HL7800_ROAMING);
+}
+
+/* Called with the lock */
+static void schedule(uint32_t delayMs)
+{
+	k_delayed_work_submit_to_queue(attemptWorkQ, &attemptWork,
+				       K_MSEC(delayMs));
+}
+
+static void attemptWorkHandler(struct k_work *item)
+{
+	bool quick = false;
+	bool reset = false;
+	int rc;
+
+	ARG_UNUSED(item);
+
+	k_mutex_lock(&reconnectLock, K_FOREVER);
+	if (!down) {
+		k_mutex_unlock(&reconnectLock);
+		return;
+	}
+	attempts++;
+	if (registered) {
+		quick = true;
+	} else if (path != PATH_RESET &&
+		   k_uptime_get() - downSince >=
+			   CONFIG_LTE_RECONNECT_RESET_AFTER_S * MSEC_PER_SEC) {
+		reset = true;
+		path = PATH_RESET;
+	}
+	/* Not registered: the modem is searching; wait for it */
+	schedule(lteReconnectBackoffMs(attempts, CONFIG_LTE_RECONNECT_MIN_MS,
+				       CONFIG_LTE_RECONNECT_MAX_MS));
+	k_mutex_unlock(&reconnectLock);
+
+	if (quick) {
+		metricsIncrement(&pdpAttempts);
+		rc = mdm_hl7800_send_at_cmd((const uint8_t *)PDP_ACTIVATE_CMD);
+		LTE_RECONNECT_LOG_DBG("PDP context activation (%d)", rc);
+	} else if (reset) {
+		LTE_RECONNECT_LOG_WRN("No registration after %u s; reset modem",
+				      CONFIG_LTE_RECONNECT_RESET_AFTER_S);
+		rc = mdm_hl7800_reset();
+		if (rc < 0) {
+			LTE_RECONNECT_LOG_ERR("Modem reset (%d)", rc);
+		}
+	}
+}
@@ -15,6 +15,7 @@ LOG_MODULE_REGISTER(main);
 #define MAIN_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
 #define MAIN_LOG_INF(...) LOG_INF(__VA_ARGS__)
 #define MAIN_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+#define MAIN_LOG_HOT(...) BINLOG_DBG(__VA_ARGS__)
 
 /******************************************************************************/
 /* Includes                                                                   */
@@ -36,6 +37,34 @@ LOG_MODULE_REGISTER(main);
 #include "laird_utility_macros.h"
 #include "string_util.h"
 #include "app_version.h"
+#include "binlog.h"
+#include "metrics.h"
+#include "msg_pool.h"
+#include "conn_scheduler.h"
+#include "dns_cache.h"
+#include "time_service.h"
+#include "startup.h"
+#ifdef CONFIG_TLS_SESSION
+#include "tls_session.h"
+#endif
+#ifdef CONFIG_CRYPTO_BACKEND
+#include "crypto_backend.h"
+#endif
+#ifdef CONFIG_CLOUD
+#include "cloud.h"
+#endif
+#ifdef CONFIG_APP_NV
+#include "app_nv.h"
+#endif
+#ifdef CONFIG_FOTA_STAGE
+#include "fota_stage.h"
+#endif
+#ifdef CONFIG_UPLOAD_MGMT
+#include "upload_mgmt.h"
+#endif
+#ifdef CONFIG_THREAD_PROFILER
+#include "thread_profiler.h"
+#endif
 
 #ifdef CONFIG_MCUMGR
 #include "mcumgr_wrapper.h"
@@ -73,8 +102,7 @@ static bool appReady = false;
 static app_state_function_t appState;
 struct lte_status *lteInfo;
 
-K_MSGQ_DEFINE(cloudQ, FWK_QUEUE_ENTRY_SIZE, CONFIG_CLOUD_QUEUE_SIZE,
-	      FWK_QUEUE_ALIGNMENT);
+METRIC_COUNTER_DEFINE(fwkAssertions, "fwk_assertions");
 
 /******************************************************************************/
 /* Local Function Prototypes                                                  */
@@ -86,6 +114,7 @@ static void appStateLteConnected(void);
 static void appSetNextState(app_state_function_t next);
 static const char *getAppStateString(app_state_function_t state);
 
+static void disInit(void);
 static void lteEvent(enum lte_event event);
 static void softwareReset(uint32_t DelayMs);
 
@@ -102,8 +131,17 @@ void main(void)
 
 	configure_leds();
 
+	metricsInit();
+#ifdef CONFIG_APP_NV
+	appNvInit();
+#endif
+	dnsCacheInit();
+
 	Framework_Initialize();
+	MsgPool_Initialize();
+	connSchedulerInit();
 
+	/* Start the attach before anything it doesn't need */
 	lteRegisterEventCallback(lteEvent);
 	rc = lteInit();
 	if (rc < 0) {
@@ -112,11 +150,30 @@ void main(void)
 	}
 	lteInfo = lteGetStatus();
 
-	dis_initialize(APP_VERSION_STRING);
+#ifdef CONFIG_TLS_SESSION
+	tlsSessionInit();
+#endif
+#ifdef CONFIG_CRYPTO_BACKEND
+	cryptoInit();
+#endif
+#ifdef CONFIG_CLOUD
+	cloudInit();
+#endif
+#ifdef CONFIG_FOTA_STAGE
+	fotaStageInit();
+#endif
+#ifdef CONFIG_UPLOAD_MGMT
+	uploadMgmtInit();
+#endif
+#ifdef CONFIG_THREAD_PROFILER
+	threadProfilerInit();
+#endif
 
+	startupDefer("dis", disInit);
 #ifdef CONFIG_MCUMGR
-	mcumgr_wrapper_register_subsystems();
+	startupDefer("mcumgr", mcumgr_wrapper_register_subsystems);
 #endif
+	startupRunDeferred();
 
 	appReady = true;
 	printk("\n!!!!!!!! App is ready! !!!!!!!!\n");
@@ -137,6 +194,9 @@ exit:
 EXTERNED void Framework_AssertionHandler(char *file, int line)
 {
 	static atomic_t busy = ATOMIC_INIT(0);
+
+	metricsIncrement(&fwkAssertions);
+
 	/* prevent recursion (buffer alloc fail, ...) */
 	if (!busy) {
 		atomic_set(&busy, 1);
@@ -160,11 +220,22 @@ EXTERNED void Framework_AssertionHandler(char *file, int line)
 /* Local Function Definitions                                                 */
 /******************************************************************************/
 
+static void disInit(void)
+{
+	dis_initialize(APP_VERSION_STRING);
+}
+
 static void lteEvent(enum lte_event event)
 {
 	switch (event) {
 	case LTE_EVT_READY:
+		startupMark(STARTUP_LTE_READY);
 		k_sem_give(&lte_ready_sem);
+		dnsCachePrefetch();
+		timeServiceOnLteReady();
+#ifdef CONFIG_CLOUD
+		cloudOnLteReady();
+#endif
 		break;
 	case LTE_EVT_DISCONNECTED:
 		k_sem_reset(&lte_ready_sem);
@@ -184,8 +255,8 @@ static const char *getAppStateString(app_state_function_t state)
 
 static void appSetNextState(app_state_function_t next)
 {
-	MAIN_LOG_DBG("%s->%s", getAppStateString(appState),
-		     getAppStateString(next));
+	MAIN_LOG_HOT("%s->%s", BINLOG_STR(getAppStateString(appState)),
+		     BINLOG_STR(getAppStateString(next)));
 	appState = next;
 }
 
@@ -202,7 +273,8 @@ static void appStateWaitForLte(void)
 	}
 	appSetNextState(appStateLteConnected);
 }
- // For an implementation set the above "appSetNextState" function call to the needed state.
+ // For an implementation set the above "appSetNextState" function call to the
+ // needed state.
 
 static void appStateLteConnected(void)
 {
@@ -220,13 +292,13 @@ static void softwareReset(uint32_t DelayMs)
 
 static void configure_leds(void)
 {
-	struct led_configuration c[] = {
-		{ BLUE_LED1, LED1_DEV, LED1, LED_ACTIVE_HIGH },
-		{ GREEN_LED2, LED2_DEV, LED2, LED_ACTIVE_HIGH },
-		{ RED_LED3, LED3_DEV, LED3, LED_ACTIVE_HIGH },
-		{ GREEN_LED4, LED4_DEV, LED4, LED_ACTIVE_HIGH }
+	struct led_compositor_config c[] = {
+		{ BLUE_LED1, LED1_DEV, LED1, LED_POLARITY_ACTIVE_HIGH },
+		{ GREEN_LED2, LED2_DEV, LED2, LED_POLARITY_ACTIVE_HIGH },
+		{ RED_LED3, LED3_DEV, LED3, LED_POLARITY_ACTIVE_HIGH },
+		{ GREEN_LED4, LED4_DEV, LED4, LED_POLARITY_ACTIVE_HIGH }
 	};
-	led_init(c, ARRAY_SIZE(c));
+	ledInit(c, ARRAY_SIZE(c));
 }
 
 /******************************************************************************/
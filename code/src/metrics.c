@@ -0,0 +1,397 @@
+/**
+ * @file metrics.c
+ * @brief Runtime metrics with shell and mcumgr export.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(metrics);
+
+#define METRICS_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define METRICS_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define METRICS_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define METRICS_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <sys/byteorder.h>
+#include <shell/shell.h>
+
+#ifdef CONFIG_METRICS_MCUMGR
+#include "mgmt/mgmt.h"
+#include "cborattr/cborattr.h"
+#include <tinycbor/cbor.h>
+#endif
+
+#include "metrics.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define MAX_NAME_LENGTH UINT8_MAX
+
+#define METRIC_COUNT ((size_t)(_metric_list_end - _metric_list_start))
+
+enum metrics_mgmt_id {
+	METRICS_MGMT_ID_READ = 0,
+	METRICS_MGMT_ID_RESET,
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void updateMax(atomic_t *max, uint32_t value);
+static size_t encodedSize(const struct metric *m);
+static size_t encodeMetric(const struct metric *m, uint8_t *p);
+
+#ifdef CONFIG_METRICS_MCUMGR
+static int metrics_mgmt_read(struct mgmt_ctxt *ctxt);
+static int metrics_mgmt_reset(struct mgmt_ctxt *ctxt);
+#endif
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+/* Bounds of the metric section (metrics.ld) */
+extern struct metric _metric_list_start[];
+extern struct metric _metric_list_end[];
+
+#ifdef CONFIG_METRICS_MCUMGR
+static uint8_t mgmtBuffer[CONFIG_METRICS_MCUMGR_CHUNK_SIZE];
+
+static const struct mgmt_handler metrics_mgmt_handlers[] = {
+	[METRICS_MGMT_ID_READ] = { .mh_read = metrics_mgmt_read,
+				   .mh_write = NULL },
+	[METRICS_MGMT_ID_RESET] = { .mh_read = NULL,
+				    .mh_write = metrics_mgmt_reset },
+};
+
+static struct mgmt_group metrics_mgmt_group = {
+	.mg_handlers = metrics_mgmt_handlers,
+	.mg_handlers_count = ARRAY_SIZE(metrics_mgmt_handlers),
+	.mg_group_id = CONFIG_METRICS_MCUMGR_GROUP_ID,
+};
+#endif
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void metricsInit(void)
+{
+#ifdef CONFIG_METRICS_MCUMGR
+	mgmt_register_group(&metrics_mgmt_group);
+#endif
+}
+
+void metricsGaugeSet(struct metric *m, uint32_t value)
+{
+	atomic_set(&m->value, (atomic_val_t)value);
+	updateMax(&m->max, value);
+}
+
+void metricsGaugeAdd(struct metric *m, int32_t delta)
+{
+	atomic_val_t value = atomic_add(&m->value, delta) + delta;
+
+	updateMax(&m->max, (uint32_t)value);
+}
+
+void metricsHistogramRecord(struct metric *m, uint32_t value)
+{
+	size_t i;
+
+	for (i = 0; i < m->bound_count; i++) {
+		if (value <= m->bounds[i]) {
+			break;
+		}
+	}
+	atomic_inc(&m->buckets[i]);
+	atomic_inc(&m->value);
+	atomic_add(&m->sum, (atomic_val_t)value);
+	updateMax(&m->max, value);
+}
+
+void metricsForEach(metrics_visitor_t visitor, void *context)
+{
+	struct metric *m;
+
+	for (m = _metric_list_start; m < _metric_list_end; m++) {
+		if (m->name != NULL) {
+			visitor(m, context);
+		}
+	}
+}
+
+void metricsReset(void)
+{
+	struct metric *m;
+	size_t j;
+
+	for (m = _metric_list_start; m < _metric_list_end; m++) {
+		atomic_clear(&m->value);
+		atomic_clear(&m->max);
+		atomic_clear(&m->sum);
+		if (m->type == METRIC_TYPE_HISTOGRAM) {
+			for (j = 0; j <= m->bound_count; j++) {
+				atomic_clear(&m->buckets[j]);
+			}
+		}
+	}
+}
+
+size_t metricsEncode(uint8_t *buf, size_t size, size_t start, size_t *next)
+{
+	size_t length = 0;
+	size_t i;
+
+	for (i = start; i < METRIC_COUNT; i++) {
+		if (_metric_list_start[i].name == NULL) {
+			continue;
+		}
+		if (length + encodedSize(&_metric_list_start[i]) > size) {
+			break;
+		}
+		length += encodeMetric(&_metric_list_start[i], buf + length);
+	}
+
+	if (next != NULL) {
+		*next = i;
+	}
+	return length;
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void updateMax(atomic_t *max, uint32_t value)
+{
+	atomic_val_t old;
+
+	do {
+		old = atomic_get(max);
+	} while ((uint32_t)old < value &&
+		 !atomic_cas(max, old, (atomic_val_t)value));
+}
+
+static size_t encodedSize(const struct metric *m)
+{
+	size_t size = 2 + MIN(strlen(m->name), MAX_NAME_LENGTH);
+
+	switch (m->type) {
+	case METRIC_TYPE_COUNTER:
+		return size + 4;
+	case METRIC_TYPE_GAUGE:
+		return size + 8;
+	case METRIC_TYPE_HISTOGRAM:
+		return size + 13 + (m->bound_count * 8) + 4;
+	default:
+		return size;
+	}
+}
+
+static size_t encodeMetric(const struct metric *m, uint8_t *p)
+{
+	uint8_t *start = p;
+	size_t nameLength = MIN(strlen(m->name), MAX_NAME_LENGTH);
+	size_t i;
+
+	*p++ = m->type;
+	*p++ = (uint8_t)nameLength;
+	memcpy(p, m->name, nameLength);
+	p += nameLength;
+
+	sys_put_le32((uint32_t)atomic_get(&m->value), p);
+	p += 4;
+
+	if (m->type == METRIC_TYPE_GAUGE) {
+		sys_put_le32((uint32_t)atomic_get(&m->max), p);
+		p += 4;
+	} else if (m->type == METRIC_TYPE_HISTOGRAM) {
+		sys_put_le32((uint32_t)atomic_get(&m->sum), p);
+		p += 4;
+		sys_put_le32((uint32_t)atomic_get(&m->max), p);
+		p += 4;
+		*p++ = m->bound_count;
+		for (i = 0; i < m->bound_count; i++) {
+			sys_put_le32(m->bounds[i], p);
+			p += 4;
+		}
+		for (i = 0; i <= m->bound_count; i++) {
+			sys_put_le32((uint32_t)atomic_get(&m->buckets[i]), p);
+			p += 4;
+		}
+	}
+
+	return p - start;
+}
+
+/******************************************************************************/
+/* mcumgr                                                                     */
+/******************************************************************************/
+#ifdef CONFIG_METRICS_MCUMGR
+/* Request {"off": first metric index}
+ * Response {"off": next index (or 0 when done), "data": encoded metrics}
+ */
+static int metrics_mgmt_read(struct mgmt_ctxt *ctxt)
+{
+	unsigned long long off = 0;
+	size_t next;
+	size_t length;
+	CborError err = 0;
+
+	const struct cbor_attr_t attrs[] = {
+		{ .attribute = "off",
+		  .type = CborAttrUnsignedIntegerType,
+		  .addr.uinteger = &off,
+		  .nodefault = true },
+		{ .attribute = NULL }
+	};
+
+	if (cbor_read_object(&ctxt->it, attrs) != 0) {
+		return MGMT_ERR_EINVAL;
+	}
+
+	length = metricsEncode(mgmtBuffer, sizeof(mgmtBuffer), (size_t)off,
+			       &next);
+	if (next < METRIC_COUNT && length == 0) {
+		/* A single metric doesn't fit in the buffer */
+		return MGMT_ERR_ENOMEM;
+	}
+	if (next >= METRIC_COUNT) {
+		next = 0;
+	}
+
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "rc");
+	err |= cbor_encode_int(&ctxt->encoder, MGMT_ERR_EOK);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "off");
+	err |= cbor_encode_uint(&ctxt->encoder, next);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "data");
+	err |= cbor_encode_byte_string(&ctxt->encoder, mgmtBuffer, length);
+
+	return (err != 0) ? MGMT_ERR_ENOMEM : MGMT_ERR_EOK;
+}
+
+static int metrics_mgmt_reset(struct mgmt_ctxt *ctxt)
+{
+	CborError err = 0;
+
+	metricsReset();
+
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "rc");
+	err |= cbor_encode_int(&ctxt->encoder, MGMT_ERR_EOK);
+
+	return (err != 0) ? MGMT_ERR_ENOMEM : MGMT_ERR_EOK;
+}
+#endif /* CONFIG_METRICS_MCUMGR */
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_METRICS_SHELL
+static void shellPrintMetric(const struct metric *m, void *context)
+{
+	const struct shell *shell = (const struct shell *)context;
+	uint32_t count;
+	size_t i;
+
+	switch (m->type) {
+	case METRIC_TYPE_COUNTER:
+		shell_print(shell, "%s: %u", m->name,
+			    (uint32_t)atomic_get(&m->value));
+		break;
+
+	case METRIC_TYPE_GAUGE:
+		shell_print(shell, "%s: %u (max %u)", m->name,
+			    (uint32_t)atomic_get(&m->value),
+			    (uint32_t)atomic_get(&m->max));
+		break;
+
+	case METRIC_TYPE_HISTOGRAM:
+		count = (uint32_t)atomic_get(&m->value);
+		shell_print(shell, "%s: count %u avg %u max %u", m->name,
+			    count,
+			    (count > 0) ? (uint32_t)atomic_get(&m->sum) / count :
+					  0,
+			    (uint32_t)atomic_get(&m->max));
+		for (i = 0; i <= m->bound_count; i++) {
+			if (atomic_get(&m->buckets[i]) == 0) {
+				continue;
+			}
+			if (i < m->bound_count) {
+				shell_print(shell, "  <= %u: %u", m->bounds[i],
+					    (uint32_t)atomic_get(
+						    &m->buckets[i]));
+			} else {
+				shell_print(shell, "  > %u: %u",
+					    m->bounds[i - 1],
+					    (uint32_t)atomic_get(
+						    &m->buckets[i]));
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+static int shell_metrics_show(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	metricsForEach(shellPrintMetric, (void *)shell);
+	return 0;
+}
+
+static int shell_metrics_dump(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	uint8_t buf[128];
+	size_t start = 0;
+	size_t next;
+	size_t length;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	do {
+		length = metricsEncode(buf, sizeof(buf), start, &next);
+		if (length == 0) {
+			break;
+		}
+		shell_hexdump(shell, buf, length);
+		start = next;
+	} while (next < METRIC_COUNT);
+
+	return 0;
+}
+
+static int shell_metrics_reset(const struct shell *shell, size_t argc,
+			       char **argv)
+{
+	ARG_UNUSED(shell);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	metricsReset();
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	metrics_cmds,
+	SHELL_CMD(show, NULL, "Print metrics", shell_metrics_show),
+	SHELL_CMD(dump, NULL, "Print metrics in binary form",
+		  shell_metrics_dump),
+	SHELL_CMD(reset, NULL, "Clear metrics", shell_metrics_reset),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(metrics, &metrics_cmds, "Metrics commands", NULL);
+#endif /* CONFIG_METRICS_SHELL */
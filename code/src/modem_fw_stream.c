@@ -0,0 +1,576 @@
+/**
+ * @file modem_fw_stream.c
+ * @brief Stream a modem firmware image to the modem while it downloads.
+ *
+ * The sender thread waits for the modem to request CRC mode ('C') and then
+ * sends 1024 byte XMODEM packets as the ring buffer fills.  A packet is only
+ * removed from the ring buffer once it is complete, and it is kept in the
+ * packet buffer until the modem acknowledges it.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(modem_fw_stream);
+
+#define MFW_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define MFW_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define MFW_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define MFW_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <stdlib.h>
+#include <shell/shell.h>
+#include <sys/ring_buffer.h>
+
+#include "crypto_backend.h"
+#include "metrics.h"
+#include "modem_fw_stream.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define XMODEM_STX 0x02
+#define XMODEM_EOT 0x04
+#define XMODEM_ACK 0x06
+#define XMODEM_NAK 0x15
+#define XMODEM_CAN 0x18
+#define XMODEM_CRC_MODE 'C'
+#define XMODEM_PAD 0x1A
+
+#define XMODEM_BLOCK_SIZE 1024
+#define XMODEM_HEADER_SIZE 3
+#define XMODEM_PACKET_SIZE (XMODEM_HEADER_SIZE + XMODEM_BLOCK_SIZE + 2)
+#define XMODEM_MAX_RETRIES 10
+
+#define START_TIMEOUT_MS (60 * MSEC_PER_SEC)
+#define ACK_TIMEOUT K_SECONDS(10)
+#define STALL_TIMEOUT K_SECONDS(CONFIG_MODEM_FW_STREAM_STALL_TIMEOUT_S)
+
+BUILD_ASSERT(CONFIG_MODEM_FW_STREAM_RING_SIZE > XMODEM_BLOCK_SIZE,
+	     "Ring buffer must hold more than one packet");
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void streamThread(void *arg1, void *arg2, void *arg3);
+static int transfer(void);
+static int waitForReceiver(void);
+static int takeBlock(size_t len);
+static int sendPacket(uint8_t block, size_t len);
+static int sendEnd(void);
+static void cancel(void);
+static void drainInput(void);
+static void stop(int rc);
+static void cancelStream(void);
+static void releaseHash(void);
+static uint16_t crc16Xmodem(const uint8_t *data, size_t len);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_THREAD_DEFINE(modem_fw_stream, CONFIG_MODEM_FW_STREAM_THREAD_STACK_SIZE,
+		streamThread, NULL, NULL, NULL,
+		CONFIG_MODEM_FW_STREAM_THREAD_PRIORITY, 0, 0);
+
+K_SEM_DEFINE(mfwStartSem, 0, 1);
+K_SEM_DEFINE(mfwDataSem, 0, 1);
+K_SEM_DEFINE(mfwSpaceSem, 0, 1);
+K_SEM_DEFINE(mfwDoneSem, 0, 1);
+
+RING_BUF_DECLARE(ring, CONFIG_MODEM_FW_STREAM_RING_SIZE);
+K_MUTEX_DEFINE(ringLock);
+
+static const struct modem_fw_port *port;
+static atomic_t active;
+static atomic_t cancelled;
+static int result;
+
+/* Written by the producer.  Only the producer uses the hash, so it is never
+ * released while an update is running.
+ */
+static size_t imageSize;
+static size_t received;
+static bool verified;
+static bool checkHash;
+static uint8_t expected[CRYPTO_SHA256_SIZE];
+static struct crypto_sha256 sha;
+static bool hashing;
+
+/* Used by the sender thread */
+static size_t sent;
+static uint8_t packet[XMODEM_PACKET_SIZE];
+
+/* The gauge maximum is the ring buffer high-water mark */
+METRIC_GAUGE_DEFINE(ringFill, "mfw_ring_fill");
+METRIC_COUNTER_DEFINE(retransmits, "mfw_retransmits");
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void modemFwStreamSetPort(const struct modem_fw_port *p)
+{
+	port = p;
+}
+
+int modemFwStreamStart(size_t size, const uint8_t *sha256)
+{
+	int rc;
+
+	if (port == NULL) {
+		return -ENODEV;
+	}
+	if (!atomic_cas(&active, 0, 1)) {
+		return -EBUSY;
+	}
+
+	/* Left by a transfer the sender stopped */
+	releaseHash();
+	rc = cryptoSha256Start(&sha, NULL);
+	if (rc != 0) {
+		atomic_clear(&active);
+		return rc;
+	}
+	hashing = true;
+
+	/* Discard data left by a cancelled transfer */
+	k_mutex_lock(&ringLock, K_FOREVER);
+	while (ring_buf_get(&ring, packet, sizeof(packet)) > 0) {
+	}
+	k_mutex_unlock(&ringLock);
+
+	imageSize = size;
+	received = 0;
+	verified = false;
+	checkHash = (sha256 != NULL);
+	if (checkHash) {
+		memcpy(expected, sha256, sizeof(expected));
+	}
+	result = 0;
+	atomic_clear(&cancelled);
+	k_sem_reset(&mfwDataSem);
+	k_sem_reset(&mfwSpaceSem);
+	k_sem_reset(&mfwDoneSem);
+
+	k_sem_give(&mfwStartSem);
+	return 0;
+}
+
+int modemFwStreamWrite(const uint8_t *data, size_t len, k_timeout_t timeout)
+{
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	uint32_t n;
+	int rc;
+
+	if (!atomic_get(&active)) {
+		return (result != 0) ? result : -EINVAL;
+	}
+	if (len > imageSize - received) {
+		modemFwStreamAbort();
+		return -EFBIG;
+	}
+
+	rc = cryptoSha256Update(&sha, data, len);
+	while (rc == 0 && len > 0) {
+		k_mutex_lock(&ringLock, K_FOREVER);
+		n = ring_buf_put(&ring, data, len);
+		metricsGaugeSet(&ringFill, ring_buf_size_get(&ring));
+		k_mutex_unlock(&ringLock);
+
+		if (n > 0) {
+			data += n;
+			len -= n;
+			received += n;
+			k_sem_give(&mfwDataSem);
+		} else if (atomic_get(&cancelled) || !atomic_get(&active)) {
+			rc = (result != 0) ? result : -ECANCELED;
+		} else if (k_sem_take(&mfwSpaceSem, timeout) != 0) {
+			rc = -EAGAIN;
+		}
+	}
+
+	if (rc == 0 && received == imageSize) {
+		hashing = false;
+		rc = cryptoSha256Finish(&sha, digest);
+		if (rc == 0 && checkHash &&
+		    !cryptoTagEqual(digest, expected, sizeof(digest))) {
+			MFW_LOG_ERR("Image doesn't match its SHA-256");
+			rc = -EBADMSG;
+		}
+		if (rc == 0) {
+			verified = true;
+			k_sem_give(&mfwDataSem);
+		}
+	}
+
+	if (rc != 0) {
+		modemFwStreamAbort();
+	}
+	return rc;
+}
+
+int modemFwStreamFinish(k_timeout_t timeout)
+{
+	if (k_sem_take(&mfwDoneSem, timeout) != 0) {
+		return -EAGAIN;
+	}
+	return result;
+}
+
+void modemFwStreamAbort(void)
+{
+	releaseHash();
+	cancelStream();
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void streamThread(void *arg1, void *arg2, void *arg3)
+{
+	int rc;
+
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	while (true) {
+		k_sem_take(&mfwStartSem, K_FOREVER);
+
+		rc = transfer();
+		if (rc != 0) {
+			cancel();
+			MFW_LOG_ERR("Transfer stopped at %u (%d)", (uint32_t)sent,
+				    rc);
+		} else {
+			MFW_LOG_INF("Transferred %u bytes", (uint32_t)sent);
+		}
+		port->finish(rc == 0);
+		stop(rc);
+	}
+}
+
+static int transfer(void)
+{
+	uint8_t block = 1;
+	size_t len;
+	int rc;
+
+	sent = 0;
+	rc = port->start(imageSize);
+	if (rc == 0) {
+		rc = waitForReceiver();
+	}
+
+	while (rc == 0 && sent < imageSize) {
+		len = MIN(XMODEM_BLOCK_SIZE, imageSize - sent);
+		rc = takeBlock(len);
+		if (rc == 0) {
+			rc = sendPacket(block++, len);
+		}
+		if (rc == 0) {
+			sent += len;
+		}
+	}
+
+	if (rc == 0) {
+		rc = sendEnd();
+	}
+	return rc;
+}
+
+static int waitForReceiver(void)
+{
+	int64_t deadline = k_uptime_get() + START_TIMEOUT_MS;
+	uint8_t c;
+	int rc;
+
+	do {
+		rc = port->receive(&c, K_SECONDS(1));
+		if (rc == 0 && c == XMODEM_CRC_MODE) {
+			return 0;
+		}
+		if (atomic_get(&cancelled)) {
+			return -ECANCELED;
+		}
+	} while (k_uptime_get() < deadline);
+
+	return -ETIMEDOUT;
+}
+
+/* Wait until the next block is in the ring buffer.  The last block is only
+ * sent after the whole image is verified.
+ */
+static int takeBlock(size_t len)
+{
+	bool last = (sent + len == imageSize);
+	uint32_t available;
+
+	while (true) {
+		if (atomic_get(&cancelled)) {
+			return -ECANCELED;
+		}
+
+		k_mutex_lock(&ringLock, K_FOREVER);
+		available = ring_buf_size_get(&ring);
+		if (available >= len && (!last || verified)) {
+			ring_buf_get(&ring, &packet[XMODEM_HEADER_SIZE], len);
+			metricsGaugeSet(&ringFill, ring_buf_size_get(&ring));
+			k_mutex_unlock(&ringLock);
+			k_sem_give(&mfwSpaceSem);
+			return 0;
+		}
+		k_mutex_unlock(&ringLock);
+
+		if (k_sem_take(&mfwDataSem, STALL_TIMEOUT) != 0) {
+			MFW_LOG_ERR("Download stalled");
+			return -ETIMEDOUT;
+		}
+	}
+}
+
+static int sendPacket(uint8_t block, size_t len)
+{
+	uint16_t crc;
+	uint8_t response;
+	int retries;
+	int rc;
+
+	memset(&packet[XMODEM_HEADER_SIZE + len], XMODEM_PAD,
+	       XMODEM_BLOCK_SIZE - len);
+	packet[0] = XMODEM_STX;
+	packet[1] = block;
+	packet[2] = ~block;
+	crc = crc16Xmodem(&packet[XMODEM_HEADER_SIZE], XMODEM_BLOCK_SIZE);
+	packet[XMODEM_PACKET_SIZE - 2] = crc >> 8;
+	packet[XMODEM_PACKET_SIZE - 1] = crc & 0xFF;
+
+	for (retries = 0; retries < XMODEM_MAX_RETRIES; retries++) {
+		/* NAKs sent while the modem waited for this packet are stale */
+		drainInput();
+		rc = port->send(packet, sizeof(packet));
+		if (rc != 0) {
+			return rc;
+		}
+
+		rc = port->receive(&response, ACK_TIMEOUT);
+		if (rc == 0 && response == XMODEM_ACK) {
+			return 0;
+		}
+		if (rc == 0 && response == XMODEM_CAN) {
+			return -ECONNABORTED;
+		}
+		if (atomic_get(&cancelled)) {
+			return -ECANCELED;
+		}
+		metricsIncrement(&retransmits);
+	}
+
+	return -EIO;
+}
+
+static int sendEnd(void)
+{
+	const uint8_t eot = XMODEM_EOT;
+	uint8_t response;
+	int retries;
+	int rc;
+
+	for (retries = 0; retries < XMODEM_MAX_RETRIES; retries++) {
+		rc = port->send(&eot, 1);
+		if (rc != 0) {
+			return rc;
+		}
+		rc = port->receive(&response, ACK_TIMEOUT);
+		if (rc == 0 && response == XMODEM_ACK) {
+			return 0;
+		}
+	}
+	return -EIO;
+}
+
+static void cancel(void)
+{
+	static const uint8_t can[] = { XMODEM_CAN, XMODEM_CAN, XMODEM_CAN };
+
+	port->send(can, sizeof(can));
+}
+
+static void drainInput(void)
+{
+	uint8_t c;
+
+	while (port->receive(&c, K_NO_WAIT) == 0) {
+	}
+}
+
+static void stop(int rc)
+{
+	if (rc != 0) {
+		/* Wake a waiting producer */
+		cancelStream();
+	}
+	result = rc;
+	atomic_clear(&active);
+	k_sem_give(&mfwSpaceSem);
+	k_sem_give(&mfwDoneSem);
+}
+
+/* Called by either side; the sender must not touch the hash */
+static void cancelStream(void)
+{
+	if (atomic_get(&active) && !atomic_set(&cancelled, 1)) {
+		k_sem_give(&mfwDataSem);
+		k_sem_give(&mfwSpaceSem);
+	}
+}
+
+/* Called by the producer */
+static void releaseHash(void)
+{
+	if (hashing) {
+		hashing = false;
+		cryptoSha256Abort(&sha);
+	}
+}
+
+/* CRC-16/XMODEM (polynomial 0x1021, initial value 0) */
+static uint16_t crc16Xmodem(const uint8_t *data, size_t len)
+{
+	uint16_t crc = 0;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= (uint16_t)data[i] << 8;
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_MODEM_FW_STREAM_SHELL
+/* Simulated modem that acknowledges each packet after the time the UART
+ * would take to send it.
+ */
+static uint8_t simPending;
+static int64_t simReadyAt;
+
+static int simStart(size_t size)
+{
+	ARG_UNUSED(size);
+
+	simPending = XMODEM_CRC_MODE;
+	simReadyAt = k_uptime_get();
+	return 0;
+}
+
+static int simSend(const uint8_t *data, size_t len)
+{
+	simReadyAt = k_uptime_get() +
+		     ((int64_t)len * 10 * MSEC_PER_SEC) /
+			     CONFIG_MODEM_FW_STREAM_UART_BAUD;
+	if (data[0] == XMODEM_STX || data[0] == XMODEM_EOT) {
+		simPending = XMODEM_ACK;
+	}
+	return 0;
+}
+
+static int simReceive(uint8_t *byte, k_timeout_t timeout)
+{
+	if (simPending == 0) {
+		if (!K_TIMEOUT_EQ(timeout, K_NO_WAIT)) {
+			k_sleep(timeout);
+		}
+		return -EAGAIN;
+	}
+	if (K_TIMEOUT_EQ(timeout, K_NO_WAIT) && k_uptime_get() < simReadyAt) {
+		return -EAGAIN;
+	}
+	k_sleep(K_MSEC(MAX(simReadyAt - k_uptime_get(), 0)));
+	*byte = simPending;
+	simPending = 0;
+	return 0;
+}
+
+static void simFinish(bool ok)
+{
+	ARG_UNUSED(ok);
+}
+
+static const struct modem_fw_port simPort = {
+	.start = simStart,
+	.send = simSend,
+	.receive = simReceive,
+	.finish = simFinish,
+};
+
+/* Compare the streamed time with downloading and then transferring. */
+static int shell_mfw_test(const struct shell *shell, size_t argc,
+			  char **argv)
+{
+	static uint8_t chunk[512];
+	const struct modem_fw_port *saved = port;
+	uint32_t size = strtoul(argv[1], NULL, 0);
+	uint32_t rate = strtoul(argv[2], NULL, 0);
+	uint32_t downloadMs;
+	uint32_t uartMs;
+	int64_t start;
+	uint32_t n;
+	uint32_t i;
+	int rc;
+
+	if (size == 0 || rate == 0) {
+		shell_error(shell, "Invalid size or rate");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < sizeof(chunk); i++) {
+		chunk[i] = (uint8_t)i;
+	}
+
+	modemFwStreamSetPort(&simPort);
+	start = k_uptime_get();
+	rc = modemFwStreamStart(size, NULL);
+	for (i = 0; rc == 0 && i < size; i += n) {
+		n = MIN(sizeof(chunk), size - i);
+		/* Simulated download rate */
+		k_sleep(K_MSEC((n * MSEC_PER_SEC) / rate));
+		rc = modemFwStreamWrite(chunk, n, STALL_TIMEOUT);
+	}
+	if (rc == 0) {
+		rc = modemFwStreamFinish(K_FOREVER);
+	}
+	modemFwStreamSetPort(saved);
+
+	downloadMs = ((uint64_t)size * MSEC_PER_SEC) / rate;
+	uartMs = ((uint64_t)ROUND_UP(size, XMODEM_BLOCK_SIZE) * 10 *
+		  MSEC_PER_SEC) /
+		 CONFIG_MODEM_FW_STREAM_UART_BAUD;
+	shell_print(shell,
+		    "%d: %u ms streamed, %u ms staged (download %u + UART %u), "
+		    "ring high water %u",
+		    rc, (uint32_t)(k_uptime_get() - start), downloadMs + uartMs,
+		    downloadMs, uartMs, (uint32_t)atomic_get(&ringFill.max));
+	return rc;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	mfw_cmds,
+	SHELL_CMD_ARG(test, NULL,
+		      "Stream to a simulated modem <size> <download bytes/s>",
+		      shell_mfw_test, 3, 0),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(mfw, &mfw_cmds, "Modem firmware streaming", NULL);
+#endif /* CONFIG_MODEM_FW_STREAM_SHELL */
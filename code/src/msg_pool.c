@@ -0,0 +1,372 @@
+/**
+ * @file msg_pool.c
+ * @brief Size class allocator for framework messages.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(msg_pool);
+
+#define MSG_POOL_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define MSG_POOL_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define MSG_POOL_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define MSG_POOL_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <shell/shell.h>
+
+#include "FrameworkIncludes.h"
+#include "metrics.h"
+#include "msg_pool.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define SMALL_BLOCK_SIZE ROUND_UP(CONFIG_MSG_POOL_SMALL_BLOCK_SIZE, 4)
+#define SENSOR_BLOCK_SIZE ROUND_UP(sizeof(BL654SensorMsg_t), 4)
+#define ADV_BLOCK_SIZE ROUND_UP(sizeof(AdvMsg_t), 4)
+
+BUILD_ASSERT(SMALL_BLOCK_SIZE >= sizeof(FwkMsg_t),
+	     "Small block must hold a control message");
+
+#define NUMBER_OF_SLABS MSG_POOL_CLASS_JSON
+
+struct slab_class {
+	struct k_mem_slab slab;
+	uint8_t *buffer;
+	size_t block_size;
+	uint32_t block_count;
+	struct metric *used;
+	struct metric *failures;
+	atomic_t allocations;
+#ifdef CONFIG_MSG_TRACE
+	/* Uptime (ms) at which each block was taken */
+	uint32_t *created;
+#endif
+};
+
+/* Prefix of each arena allocation; keeps the payload 8-byte aligned. */
+struct arena_header {
+	uint32_t size;
+	uint32_t created;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void *takeFromSlab(struct slab_class *c);
+static void *takeFromArena(size_t size);
+static bool inRange(const void *p, const uint8_t *buffer, size_t size);
+static struct slab_class *slabOf(const void *p);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static uint8_t smallBuffer[SMALL_BLOCK_SIZE * CONFIG_MSG_POOL_SMALL_COUNT]
+	__aligned(4);
+static uint8_t sensorBuffer[SENSOR_BLOCK_SIZE * CONFIG_MSG_POOL_SENSOR_COUNT]
+	__aligned(4);
+static uint8_t advBuffer[ADV_BLOCK_SIZE * CONFIG_MSG_POOL_ADV_COUNT]
+	__aligned(4);
+static uint8_t jsonArenaBuffer[CONFIG_MSG_POOL_JSON_ARENA_SIZE] __aligned(8);
+
+#ifdef CONFIG_MSG_TRACE
+static uint32_t smallCreated[CONFIG_MSG_POOL_SMALL_COUNT];
+static uint32_t sensorCreated[CONFIG_MSG_POOL_SENSOR_COUNT];
+static uint32_t advCreated[CONFIG_MSG_POOL_ADV_COUNT];
+#define CREATED(_a) .created = (_a),
+#else
+#define CREATED(_a)
+#endif
+
+static struct k_heap jsonArena;
+static atomic_t jsonArenaAllocations;
+
+/* Slab indices sorted by block size (smallest first) */
+static uint8_t order[NUMBER_OF_SLABS];
+static size_t largestBlockSize;
+
+METRIC_GAUGE_DEFINE(smallUsed, "pool_small_used");
+METRIC_COUNTER_DEFINE(smallFailures, "pool_small_fail");
+METRIC_GAUGE_DEFINE(sensorUsed, "pool_sensor_used");
+METRIC_COUNTER_DEFINE(sensorFailures, "pool_sensor_fail");
+METRIC_GAUGE_DEFINE(advUsed, "pool_adv_used");
+METRIC_COUNTER_DEFINE(advFailures, "pool_adv_fail");
+METRIC_GAUGE_DEFINE(jsonUsed, "pool_json_used");
+METRIC_COUNTER_DEFINE(jsonFailures, "pool_json_fail");
+
+static struct slab_class slabs[NUMBER_OF_SLABS] = {
+	[MSG_POOL_CLASS_SMALL] = { .buffer = smallBuffer,
+				   .block_size = SMALL_BLOCK_SIZE,
+				   .block_count = CONFIG_MSG_POOL_SMALL_COUNT,
+				   .used = &smallUsed,
+				   .failures = &smallFailures,
+				   CREATED(smallCreated) },
+	[MSG_POOL_CLASS_SENSOR] = { .buffer = sensorBuffer,
+				    .block_size = SENSOR_BLOCK_SIZE,
+				    .block_count = CONFIG_MSG_POOL_SENSOR_COUNT,
+				    .used = &sensorUsed,
+				    .failures = &sensorFailures,
+				    CREATED(sensorCreated) },
+	[MSG_POOL_CLASS_ADV] = { .buffer = advBuffer,
+				 .block_size = ADV_BLOCK_SIZE,
+				 .block_count = CONFIG_MSG_POOL_ADV_COUNT,
+				 .used = &advUsed,
+				 .failures = &advFailures,
+				 CREATED(advCreated) },
+};
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void MsgPool_Initialize(void)
+{
+	uint8_t tmp;
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < NUMBER_OF_SLABS; i++) {
+		k_mem_slab_init(&slabs[i].slab, slabs[i].buffer,
+				slabs[i].block_size, slabs[i].block_count);
+
+		/* The size of the control class is configurable so its
+		 * position relative to the message classes isn't fixed.
+		 */
+		order[i] = i;
+		for (j = i; j > 0 && slabs[order[j - 1]].block_size >
+					     slabs[order[j]].block_size;
+		     j--) {
+			tmp = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = tmp;
+		}
+		largestBlockSize = MAX(largestBlockSize, slabs[i].block_size);
+	}
+
+	k_heap_init(&jsonArena, jsonArenaBuffer, sizeof(jsonArenaBuffer));
+}
+
+void *MsgPool_Take(size_t size)
+{
+	struct slab_class *bestFit = NULL;
+	struct slab_class *c;
+	void *p = NULL;
+	size_t i;
+
+	/* If the best fitting slab is full, try the next class up */
+	for (i = 0; i < NUMBER_OF_SLABS && p == NULL; i++) {
+		c = &slabs[order[i]];
+		if (size > c->block_size) {
+			continue;
+		}
+		if (bestFit == NULL) {
+			bestFit = c;
+		}
+		p = takeFromSlab(c);
+	}
+
+	if (p == NULL && size > largestBlockSize) {
+		p = takeFromArena(size);
+	} else if (p == NULL) {
+		/* Only failed requests are counted, against the class that
+		 * should have served them.
+		 */
+		metricsIncrement(bestFit->failures);
+	}
+
+	if (p == NULL) {
+		MSG_POOL_LOG_WRN("Unable to allocate %u bytes", size);
+	}
+
+#ifdef CONFIG_MSG_TRACE
+	/* Blocks are reused, so a trace that the producer doesn't stamp must
+	 * not keep the times of the previous message.
+	 */
+	if (p != NULL) {
+		memset(p, 0, size);
+	}
+#endif
+
+	return p;
+}
+
+void MsgPool_Free(void *pBuffer)
+{
+	struct arena_header *header;
+	struct slab_class *c;
+
+	if (pBuffer == NULL) {
+		return;
+	}
+
+	c = slabOf(pBuffer);
+	if (c != NULL) {
+		k_mem_slab_free(&c->slab, &pBuffer);
+		metricsGaugeSet(c->used, k_mem_slab_num_used_get(&c->slab));
+		return;
+	}
+
+	if (inRange(pBuffer, jsonArenaBuffer, sizeof(jsonArenaBuffer))) {
+		header = (struct arena_header *)pBuffer - 1;
+		metricsGaugeAdd(&jsonUsed, -(int32_t)header->size);
+		k_heap_free(&jsonArena, header);
+		return;
+	}
+
+	/* Not from this pool (freeing it here would corrupt its owner) */
+	FRAMEWORK_ASSERT(false);
+}
+
+bool MsgPool_IsLow(enum msg_pool_class c, uint32_t threshold)
+{
+	struct msg_pool_stats stats;
+
+	MsgPool_GetStats(c, &stats);
+	if (stats.capacity == 0) {
+		return true;
+	}
+	return ((stats.capacity - stats.used) * 100) <
+	       (stats.capacity * threshold);
+}
+
+void MsgPool_GetStats(enum msg_pool_class c, struct msg_pool_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (c < NUMBER_OF_SLABS) {
+		stats->used = k_mem_slab_num_used_get(&slabs[c].slab);
+		stats->high_water = (uint32_t)atomic_get(&slabs[c].used->max);
+		stats->capacity = slabs[c].block_count;
+		stats->allocations =
+			(uint32_t)atomic_get(&slabs[c].allocations);
+		stats->failures =
+			(uint32_t)atomic_get(&slabs[c].failures->value);
+	} else if (c == MSG_POOL_CLASS_JSON) {
+		stats->used = (uint32_t)atomic_get(&jsonUsed.value);
+		stats->high_water = (uint32_t)atomic_get(&jsonUsed.max);
+		stats->capacity = sizeof(jsonArenaBuffer);
+		stats->allocations =
+			(uint32_t)atomic_get(&jsonArenaAllocations);
+		stats->failures = (uint32_t)atomic_get(&jsonFailures.value);
+	}
+}
+
+#ifdef CONFIG_MSG_TRACE
+int MsgPool_GetCreated(const void *pBuffer, uint32_t *created)
+{
+	const struct arena_header *header;
+	struct slab_class *c = slabOf(pBuffer);
+
+	if (c != NULL) {
+		*created = c->created[((const uint8_t *)pBuffer - c->buffer) /
+				      c->block_size];
+		return 0;
+	}
+
+	if (inRange(pBuffer, jsonArenaBuffer, sizeof(jsonArenaBuffer))) {
+		header = (const struct arena_header *)pBuffer - 1;
+		*created = header->created;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+#endif
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void *takeFromSlab(struct slab_class *c)
+{
+	void *p = NULL;
+
+	if (k_mem_slab_alloc(&c->slab, &p, K_NO_WAIT) != 0) {
+		return NULL;
+	}
+
+#ifdef CONFIG_MSG_TRACE
+	c->created[((uint8_t *)p - c->buffer) / c->block_size] =
+		k_uptime_get_32();
+#endif
+	atomic_inc(&c->allocations);
+	metricsGaugeSet(c->used, k_mem_slab_num_used_get(&c->slab));
+	return p;
+}
+
+static void *takeFromArena(size_t size)
+{
+	size_t total = size + sizeof(struct arena_header);
+	struct arena_header *header;
+
+	header = k_heap_alloc(&jsonArena, total, K_NO_WAIT);
+	if (header == NULL) {
+		metricsIncrement(&jsonFailures);
+		return NULL;
+	}
+
+	header->size = total;
+#ifdef CONFIG_MSG_TRACE
+	header->created = k_uptime_get_32();
+#endif
+	atomic_inc(&jsonArenaAllocations);
+	metricsGaugeAdd(&jsonUsed, (int32_t)total);
+	return header + 1;
+}
+
+static bool inRange(const void *p, const uint8_t *buffer, size_t size)
+{
+	return ((const uint8_t *)p >= buffer) &&
+	       ((const uint8_t *)p < (buffer + size));
+}
+
+static struct slab_class *slabOf(const void *p)
+{
+	struct slab_class *c;
+	size_t i;
+
+	for (i = 0; i < NUMBER_OF_SLABS; i++) {
+		c = &slabs[i];
+		if (inRange(p, c->buffer, c->block_size * c->block_count)) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+static int shell_msgpool_stats(const struct shell *shell, size_t argc,
+			       char **argv)
+{
+	static const char *const names[MSG_POOL_CLASS_COUNT] = {
+		"small", "sensor", "adv", "json"
+	};
+	struct msg_pool_stats s;
+	size_t i;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (i = 0; i < MSG_POOL_CLASS_COUNT; i++) {
+		MsgPool_GetStats(i, &s);
+		shell_print(shell,
+			    "%-6s used %u/%u high water %u allocs %u fails %u",
+			    names[i], s.used, s.capacity, s.high_water,
+			    s.allocations, s.failures);
+	}
+	return 0;
+}
+
+SHELL_CMD_REGISTER(msgpool, NULL, "Message pool statistics",
+		   shell_msgpool_stats);
+#endif
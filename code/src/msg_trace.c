@@ -0,0 +1,232 @@
+/**
+ * @file msg_trace.c
+ * @brief Latency tracing of framework messages.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(msg_trace);
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <shell/shell.h>
+
+#include "FrameworkIncludes.h"
+#include "metrics.h"
+#include "msg_pool.h"
+#include "msg_trace.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define NUMBER_OF_TRACED_CODES                                                 \
+	(NUMBER_OF_FRAMEWORK_MSG_CODES - FMC_APPLICATION_SPECIFIC_START)
+
+#define MAX_NAME_SIZE sizeof("msg_latency_255")
+
+struct slowest {
+	uint32_t latency;
+	struct msg_trace trace;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void registerHistogram(size_t index);
+static struct msg_trace *getTrace(FwkMsg_t *pMsg);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static const uint32_t bounds[] = { METRIC_LATENCY_MS_BOUNDS };
+static atomic_t buckets[NUMBER_OF_TRACED_CODES][ARRAY_SIZE(bounds) + 1];
+METRIC_ARRAY_DEFINE(histograms, NUMBER_OF_TRACED_CODES);
+static char names[NUMBER_OF_TRACED_CODES][MAX_NAME_SIZE];
+static ATOMIC_DEFINE(registered, NUMBER_OF_TRACED_CODES);
+
+static struct slowest slowest[NUMBER_OF_TRACED_CODES];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void msgTraceCreate(struct msg_trace *trace)
+{
+	trace->created = k_uptime_get_32();
+	trace->hop_count = 0;
+}
+
+void msgTraceHop(struct msg_trace *trace, FwkId_t id)
+{
+	uint32_t offset;
+
+	if (trace->hop_count >= CONFIG_MSG_TRACE_MAX_HOPS) {
+		return;
+	}
+
+	offset = k_uptime_get_32() - trace->created;
+	trace->hop_id[trace->hop_count] = id;
+	trace->hop_offset[trace->hop_count] = MIN(offset, UINT16_MAX);
+	trace->hop_count += 1;
+}
+
+void msgTraceTransmit(struct msg_trace *trace, FwkMsgCode_t code)
+{
+	uint32_t latency = k_uptime_get_32() - trace->created;
+	size_t index;
+	unsigned int key;
+
+	if (code < FMC_APPLICATION_SPECIFIC_START ||
+	    code >= NUMBER_OF_FRAMEWORK_MSG_CODES) {
+		return;
+	}
+	index = code - FMC_APPLICATION_SPECIFIC_START;
+
+	if (!atomic_test_and_set_bit(registered, index)) {
+		registerHistogram(index);
+	}
+	metricsHistogramRecord(&histograms[index], latency);
+
+	key = irq_lock();
+	if (latency >= slowest[index].latency) {
+		slowest[index].latency = latency;
+		memcpy(&slowest[index].trace, trace, sizeof(struct msg_trace));
+	}
+	irq_unlock(key);
+}
+
+void msgTraceHopMsg(FwkMsg_t *pMsg, FwkId_t id)
+{
+	struct msg_trace *trace = getTrace(pMsg);
+
+	if (trace != NULL) {
+		msgTraceHop(trace, id);
+	}
+}
+
+void msgTraceTransmitMsg(FwkMsg_t *pMsg)
+{
+	struct msg_trace *trace = getTrace(pMsg);
+
+	if (trace != NULL) {
+		msgTraceTransmit(trace, pMsg->header.msgCode);
+	}
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+/* Codes whose message types contain MSG_TRACE_FIELD.  A trace that the
+ * producer didn't stamp starts when the message was taken from the pool
+ * (which clears it, so an unstamped trace is zero).
+ */
+static struct msg_trace *getTrace(FwkMsg_t *pMsg)
+{
+	struct msg_trace *trace;
+
+	switch (pMsg->header.msgCode) {
+	case FMC_ADV:
+		trace = &((AdvMsg_t *)pMsg)->trace;
+		break;
+	case FMC_BL654_SENSOR_EVENT:
+		trace = &((BL654SensorMsg_t *)pMsg)->trace;
+		break;
+	case FMC_SENSOR_PUBLISH:
+	case FMC_GATEWAY_OUT:
+	case FMC_SENSOR_SHADOW_INIT:
+		trace = &((JsonMsg_t *)pMsg)->trace;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (trace->created == 0 &&
+	    MsgPool_GetCreated(pMsg, &trace->created) != 0) {
+		/* Not stamped and not from the pool */
+		return NULL;
+	}
+	return trace;
+}
+
+static void registerHistogram(size_t index)
+{
+	struct metric *m = &histograms[index];
+
+	snprintk(names[index], MAX_NAME_SIZE, "msg_latency_%u",
+		 (uint32_t)(index + FMC_APPLICATION_SPECIFIC_START));
+	m->type = METRIC_TYPE_HISTOGRAM;
+	m->bound_count = ARRAY_SIZE(bounds);
+	m->bounds = bounds;
+	m->buckets = buckets[index];
+	/* Exporters skip the entry until it has a name */
+	compiler_barrier();
+	m->name = names[index];
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+static int shell_msgtrace_slowest(const struct shell *shell, size_t argc,
+				  char **argv)
+{
+	struct slowest s;
+	unsigned int key;
+	size_t i;
+	size_t j;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (i = 0; i < NUMBER_OF_TRACED_CODES; i++) {
+		key = irq_lock();
+		memcpy(&s, &slowest[i], sizeof(s));
+		irq_unlock(key);
+
+		if (!atomic_test_bit(registered, i)) {
+			continue;
+		}
+
+		shell_print(shell, "code %u: %u ms",
+			    (uint32_t)(i + FMC_APPLICATION_SPECIFIC_START),
+			    s.latency);
+		for (j = 0; j < s.trace.hop_count; j++) {
+			shell_print(shell, "  id %u at +%u ms", s.trace.hop_id[j],
+				    s.trace.hop_offset[j]);
+		}
+	}
+
+	return 0;
+}
+
+static int shell_msgtrace_reset(const struct shell *shell, size_t argc,
+				char **argv)
+{
+	unsigned int key;
+
+	ARG_UNUSED(shell);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	key = irq_lock();
+	memset(slowest, 0, sizeof(slowest));
+	irq_unlock(key);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	msgtrace_cmds,
+	SHELL_CMD(slowest, NULL,
+		  "Print the slowest message of each code with its hops",
+		  shell_msgtrace_slowest),
+	SHELL_CMD(reset, NULL, "Clear the slowest messages",
+		  shell_msgtrace_reset),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(msgtrace, &msgtrace_cmds, "Message trace commands", NULL);
+#endif /* CONFIG_SHELL */
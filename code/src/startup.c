@@ -0,0 +1,162 @@
+/**
+ * @file startup.c
+ * @brief Boot milestones and initialization deferred off the LTE path.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(startup);
+
+#define STARTUP_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define STARTUP_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define STARTUP_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define STARTUP_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <shell/shell.h>
+
+#include "metrics.h"
+#include "startup.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+struct deferred_task {
+	const char *name;
+	startup_task_t task;
+	uint32_t durationMs;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void startupThread(void *arg1, void *arg2, void *arg3);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_THREAD_DEFINE(startup_thread, CONFIG_STARTUP_THREAD_STACK_SIZE,
+		startupThread, NULL, NULL, NULL,
+		CONFIG_STARTUP_THREAD_PRIORITY, 0, 0);
+
+K_SEM_DEFINE(startupGoSem, 0, 1);
+K_SEM_DEFINE(startupLteSem, 0, 1);
+
+static struct deferred_task tasks[CONFIG_STARTUP_MAX_DEFERRED];
+static size_t taskCount;
+static ATOMIC_DEFINE(reached, STARTUP_MILESTONE_COUNT);
+
+METRIC_GAUGE_DEFINE(lteReady, "boot_lte_ready_ms");
+METRIC_GAUGE_DEFINE(firstSensor, "boot_first_sensor_ms");
+METRIC_GAUGE_DEFINE(deferredDone, "boot_deferred_done_ms");
+
+static struct metric *const MILESTONES[STARTUP_MILESTONE_COUNT] = {
+	[STARTUP_LTE_READY] = &lteReady,
+	[STARTUP_FIRST_SENSOR_SAMPLE] = &firstSensor,
+	[STARTUP_DEFERRED_DONE] = &deferredDone,
+};
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void startupMark(enum startup_milestone milestone)
+{
+	uint32_t now = k_uptime_get_32();
+
+	if (milestone >= STARTUP_MILESTONE_COUNT ||
+	    atomic_test_and_set_bit(reached, milestone)) {
+		return;
+	}
+
+	metricsGaugeSet(MILESTONES[milestone], now);
+	STARTUP_LOG_INF("%s at %u ms", MILESTONES[milestone]->name, now);
+	if (milestone == STARTUP_LTE_READY) {
+		k_sem_give(&startupLteSem);
+	}
+}
+
+int startupDefer(const char *name, startup_task_t task)
+{
+	if (taskCount >= ARRAY_SIZE(tasks)) {
+		return -ENOMEM;
+	}
+
+	tasks[taskCount].name = name;
+	tasks[taskCount].task = task;
+	taskCount++;
+	return 0;
+}
+
+void startupRunDeferred(void)
+{
+	k_sem_give(&startupGoSem);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void startupThread(void *arg1, void *arg2, void *arg3)
+{
+	int64_t start;
+	size_t i;
+
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	k_sem_take(&startupGoSem, K_FOREVER);
+
+	/* Leave the CPU and the flash to the attach */
+	if (k_sem_take(&startupLteSem,
+		       K_MSEC(CONFIG_STARTUP_DEFER_TIMEOUT_MS)) != 0) {
+		STARTUP_LOG_WRN("LTE not ready; starting deferred tasks");
+	}
+
+	for (i = 0; i < taskCount; i++) {
+		start = k_uptime_get();
+		tasks[i].task();
+		tasks[i].durationMs = (uint32_t)k_uptime_delta(&start);
+		STARTUP_LOG_DBG("%s took %u ms", tasks[i].name,
+				tasks[i].durationMs);
+	}
+
+	startupMark(STARTUP_DEFERRED_DONE);
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+static int shell_startup(const struct shell *shell, size_t argc, char **argv)
+{
+	size_t i;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (i = 0; i < ARRAY_SIZE(MILESTONES); i++) {
+		if (atomic_test_bit(reached, i)) {
+			shell_print(shell, "%s: %u", MILESTONES[i]->name,
+				    (uint32_t)atomic_get(&MILESTONES[i]->value));
+		} else {
+			shell_print(shell, "%s: -", MILESTONES[i]->name);
+		}
+	}
+	for (i = 0; i < taskCount; i++) {
+		shell_print(shell, "  %s: %u ms", tasks[i].name,
+			    tasks[i].durationMs);
+	}
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(startup, NULL, "Boot milestones and deferred tasks",
+		   shell_startup);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,435 @@
+/**
+ * @file thread_profiler.c
+ * @brief Sampling CPU profiler and stack usage of all threads.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(thread_profiler);
+
+#define PROFILER_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define PROFILER_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define PROFILER_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define PROFILER_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <shell/shell.h>
+
+#ifdef CONFIG_THREAD_PROFILER_MGMT
+#include "mgmt/mgmt.h"
+#include <tinycbor/cbor.h>
+#endif
+
+#include "metrics.h"
+#include "thread_profiler.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define MAX_THREADS CONFIG_THREAD_PROFILER_MAX_THREADS
+#define WINDOWS CONFIG_THREAD_PROFILER_WINDOWS
+#define SAMPLE_MS CONFIG_THREAD_PROFILER_SAMPLE_MS
+#define NAME_SIZE 16
+
+/* Samples of threads that didn't get a slot */
+#define OTHER MAX_THREADS
+
+/* The shortest delay between samples is half the period */
+BUILD_ASSERT(((CONFIG_THREAD_PROFILER_WINDOW_S * 1000 * 2) / SAMPLE_MS) <=
+		     UINT16_MAX,
+	     "Window has too many samples");
+
+struct slot {
+	k_tid_t thread;
+	bool idle;
+};
+
+struct window {
+	uint16_t total;
+	uint16_t count[MAX_THREADS + 1];
+};
+
+struct thread_stat {
+	const char *name;
+	/* CPU in the last window and over the ring (per mille) */
+	uint16_t lastPm;
+	uint16_t avgPm;
+	size_t stackSize;
+	size_t stackUsed;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static size_t slotOf(k_tid_t thread);
+static uint32_t nextDelayMs(void);
+static void sample(struct k_timer *timer);
+static void endWindow(struct k_timer *timer);
+static void addThread(const struct k_thread *thread, void *user_data);
+static size_t collect(void);
+static uint16_t perMille(uint32_t count, uint32_t total);
+
+#ifdef CONFIG_THREAD_PROFILER_MGMT
+static int thread_profiler_mgmt_stat(struct mgmt_ctxt *ctxt);
+#endif
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+static struct k_spinlock lock;
+static struct k_timer sampleTimer;
+static struct k_timer windowTimer;
+static bool running;
+static uint32_t seed = 1;
+
+/* Protected by lock */
+static struct slot slots[MAX_THREADS];
+static struct window current;
+static struct window ring[WINDOWS];
+static size_t head;
+static size_t filled;
+
+/* Protected by statsLock */
+K_MUTEX_DEFINE(statsLock);
+static k_tid_t threads[MAX_THREADS];
+static size_t threadCount;
+static struct thread_stat stats[MAX_THREADS + 1];
+static struct window last;
+static uint32_t sum[MAX_THREADS + 1];
+static uint32_t sumTotal;
+
+/* CPU used by all threads but idle in the last window */
+METRIC_GAUGE_DEFINE(cpuLoad, "cpu_load_pct");
+
+#ifdef CONFIG_THREAD_PROFILER_MGMT
+enum thread_profiler_mgmt_id {
+	THREAD_PROFILER_MGMT_ID_STAT = 0,
+};
+
+static const struct mgmt_handler thread_profiler_mgmt_handlers[] = {
+	[THREAD_PROFILER_MGMT_ID_STAT] = { .mh_read =
+						   thread_profiler_mgmt_stat,
+					   .mh_write = NULL },
+};
+
+static struct mgmt_group thread_profiler_mgmt_group = {
+	.mg_handlers = thread_profiler_mgmt_handlers,
+	.mg_handlers_count = ARRAY_SIZE(thread_profiler_mgmt_handlers),
+	.mg_group_id = CONFIG_THREAD_PROFILER_MGMT_GROUP_ID,
+};
+#endif
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void threadProfilerInit(void)
+{
+	k_timer_init(&sampleTimer, sample, NULL);
+	k_timer_init(&windowTimer, endWindow, NULL);
+#ifdef CONFIG_THREAD_PROFILER_MGMT
+	mgmt_register_group(&thread_profiler_mgmt_group);
+#endif
+#ifdef CONFIG_THREAD_PROFILER_AUTOSTART
+	threadProfilerStart();
+#endif
+}
+
+void threadProfilerStart(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	memset(slots, 0, sizeof(slots));
+	memset(&current, 0, sizeof(current));
+	memset(ring, 0, sizeof(ring));
+	head = 0;
+	filled = 0;
+	seed = k_cycle_get_32() | 1;
+	running = true;
+	k_timer_start(&sampleTimer, K_MSEC(nextDelayMs()), K_NO_WAIT);
+	k_timer_start(&windowTimer, K_SECONDS(CONFIG_THREAD_PROFILER_WINDOW_S),
+		      K_SECONDS(CONFIG_THREAD_PROFILER_WINDOW_S));
+	k_spin_unlock(&lock, key);
+}
+
+void threadProfilerStop(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	running = false;
+	k_timer_stop(&sampleTimer);
+	k_timer_stop(&windowTimer);
+	k_spin_unlock(&lock, key);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+/* Called with the lock */
+static size_t slotOf(k_tid_t thread)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_THREADS; i++) {
+		if (slots[i].thread == thread) {
+			return i;
+		}
+		if (slots[i].thread == NULL) {
+			slots[i].thread = thread;
+			slots[i].idle =
+				(k_thread_priority_get(thread) == K_IDLE_PRIO);
+			return i;
+		}
+	}
+	return OTHER;
+}
+
+/* Uniform in [SAMPLE_MS / 2, SAMPLE_MS * 3 / 2) */
+static uint32_t nextDelayMs(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return MAX(SAMPLE_MS / 2 + (seed % SAMPLE_MS), 1);
+}
+
+/* Timer interrupt: the current thread is the one that was interrupted. */
+static void sample(struct k_timer *timer)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (running) {
+		current.count[slotOf(k_current_get())] += 1;
+		current.total += 1;
+		k_timer_start(timer, K_MSEC(nextDelayMs()), K_NO_WAIT);
+	}
+	k_spin_unlock(&lock, key);
+}
+
+static void endWindow(struct k_timer *timer)
+{
+	k_spinlock_key_t key;
+	uint32_t idle = 0;
+	size_t i;
+
+	ARG_UNUSED(timer);
+
+	key = k_spin_lock(&lock);
+	for (i = 0; i < MAX_THREADS; i++) {
+		if (slots[i].idle) {
+			idle += current.count[i];
+		}
+	}
+	if (current.total != 0) {
+		metricsGaugeSet(&cpuLoad,
+				100 - ((idle * 100) / current.total));
+	}
+	ring[head] = current;
+	head = (head + 1) % WINDOWS;
+	filled = MIN(filled + 1, WINDOWS);
+	memset(&current, 0, sizeof(current));
+	k_spin_unlock(&lock, key);
+}
+
+static void addThread(const struct k_thread *thread, void *user_data)
+{
+	ARG_UNUSED(user_data);
+
+	if (threadCount < ARRAY_SIZE(threads)) {
+		threads[threadCount++] = (k_tid_t)thread;
+	}
+}
+
+static uint16_t perMille(uint32_t count, uint32_t total)
+{
+	return (total == 0) ? 0 : (uint16_t)((count * 1000) / total);
+}
+
+/* Fills stats with one entry per thread.  Called with statsLock.
+ *
+ * The thread list is copied first because k_thread_foreach() holds a lock
+ * while it runs; the stacks are scanned after it is released.
+ */
+static size_t collect(void)
+{
+	k_spinlock_key_t key;
+	struct thread_stat *s;
+	size_t unused;
+	size_t count = 0;
+	size_t i;
+	size_t j;
+
+	threadCount = 0;
+	k_thread_foreach(addThread, NULL);
+
+	memset(&last, 0, sizeof(last));
+	memset(sum, 0, sizeof(sum));
+	sumTotal = 0;
+	key = k_spin_lock(&lock);
+	if (filled != 0) {
+		last = ring[(head + WINDOWS - 1) % WINDOWS];
+	}
+	for (i = 0; i < filled; i++) {
+		for (j = 0; j < ARRAY_SIZE(sum); j++) {
+			sum[j] += ring[i].count[j];
+		}
+		sumTotal += ring[i].total;
+	}
+	for (i = 0; i < threadCount; i++) {
+		s = &stats[count++];
+		memset(s, 0, sizeof(*s));
+		for (j = 0; j < MAX_THREADS; j++) {
+			if (slots[j].thread == threads[i]) {
+				s->lastPm = perMille(last.count[j], last.total);
+				s->avgPm = perMille(sum[j], sumTotal);
+				break;
+			}
+		}
+	}
+	k_spin_unlock(&lock, key);
+
+	for (i = 0; i < threadCount; i++) {
+		s = &stats[i];
+		s->name = k_thread_name_get(threads[i]);
+		if (s->name == NULL || s->name[0] == '\0') {
+			s->name = "?";
+		}
+		s->stackSize = threads[i]->stack_info.size;
+		if (k_thread_stack_space_get(threads[i], &unused) == 0) {
+			s->stackUsed = s->stackSize - unused;
+		}
+	}
+
+	if (sum[OTHER] != 0) {
+		s = &stats[count++];
+		memset(s, 0, sizeof(*s));
+		s->name = "other";
+		s->lastPm = perMille(last.count[OTHER], last.total);
+		s->avgPm = perMille(sum[OTHER], sumTotal);
+	}
+
+	return count;
+}
+
+/******************************************************************************/
+/* mcumgr                                                                     */
+/******************************************************************************/
+#ifdef CONFIG_THREAD_PROFILER_MGMT
+static int thread_profiler_mgmt_stat(struct mgmt_ctxt *ctxt)
+{
+	CborEncoder list;
+	CborEncoder entry;
+	CborError err = 0;
+	size_t count;
+	size_t i;
+
+	k_mutex_lock(&statsLock, K_FOREVER);
+	count = collect();
+
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "rc");
+	err |= cbor_encode_int(&ctxt->encoder, MGMT_ERR_EOK);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "run");
+	err |= cbor_encode_boolean(&ctxt->encoder, running);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "win");
+	err |= cbor_encode_uint(&ctxt->encoder,
+				CONFIG_THREAD_PROFILER_WINDOW_S);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "n");
+	err |= cbor_encode_uint(&ctxt->encoder, filled);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "load");
+	err |= cbor_encode_uint(&ctxt->encoder,
+				(uint32_t)atomic_get(&cpuLoad.value) * 10);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "threads");
+	err |= cbor_encoder_create_array(&ctxt->encoder, &list, count);
+	for (i = 0; i < count && err == 0; i++) {
+		err |= cbor_encoder_create_map(&list, &entry, 5);
+		err |= cbor_encode_text_stringz(&entry, "name");
+		err |= cbor_encode_text_stringz(&entry, stats[i].name);
+		err |= cbor_encode_text_stringz(&entry, "last");
+		err |= cbor_encode_uint(&entry, stats[i].lastPm);
+		err |= cbor_encode_text_stringz(&entry, "avg");
+		err |= cbor_encode_uint(&entry, stats[i].avgPm);
+		err |= cbor_encode_text_stringz(&entry, "size");
+		err |= cbor_encode_uint(&entry, stats[i].stackSize);
+		err |= cbor_encode_text_stringz(&entry, "used");
+		err |= cbor_encode_uint(&entry, stats[i].stackUsed);
+		err |= cbor_encoder_close_container(&list, &entry);
+	}
+	err |= cbor_encoder_close_container(&ctxt->encoder, &list);
+	k_mutex_unlock(&statsLock);
+
+	return (err != 0) ? MGMT_ERR_ENOMEM : MGMT_ERR_EOK;
+}
+#endif
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+static int shell_profiler_start(const struct shell *shell, size_t argc,
+				char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	threadProfilerStart();
+	shell_print(shell, "Sampling every ~%u ms, %u windows of %u s",
+		    SAMPLE_MS, WINDOWS, CONFIG_THREAD_PROFILER_WINDOW_S);
+	return 0;
+}
+
+static int shell_profiler_stop(const struct shell *shell, size_t argc,
+			       char **argv)
+{
+	ARG_UNUSED(shell);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	threadProfilerStop();
+	return 0;
+}
+
+static int shell_profiler_show(const struct shell *shell, size_t argc,
+			       char **argv)
+{
+	const struct thread_stat *s;
+	size_t count;
+	size_t i;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	k_mutex_lock(&statsLock, K_FOREVER);
+	count = collect();
+	shell_print(shell, "%s, %u of %u windows of %u s",
+		    running ? "Running" : "Stopped", filled, WINDOWS,
+		    CONFIG_THREAD_PROFILER_WINDOW_S);
+	shell_print(shell, "%-16s %6s %6s %11s", "thread", "last%", "avg%",
+		    "stack");
+	for (i = 0; i < count; i++) {
+		s = &stats[i];
+		shell_print(shell, "%-16s %4u.%u %4u.%u %5u/%-5u", s->name,
+			    s->lastPm / 10, s->lastPm % 10, s->avgPm / 10,
+			    s->avgPm % 10, s->stackUsed, s->stackSize);
+	}
+	k_mutex_unlock(&statsLock);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	profiler_cmds,
+	SHELL_CMD(start, NULL, "Clear the windows and start sampling",
+		  shell_profiler_start),
+	SHELL_CMD(stop, NULL, "Stop sampling", shell_profiler_stop),
+	SHELL_CMD(show, NULL, "CPU and stack usage of each thread",
+		  shell_profiler_show),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(profiler, &profiler_cmds, "Thread profiler", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,407 @@
+/**
+ * @file time_service.c
+ * @brief Wall clock time from network time, corrected for clock drift.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(time_service);
+
+#define TIME_SERVICE_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define TIME_SERVICE_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define TIME_SERVICE_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define TIME_SERVICE_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <stdlib.h>
+#include <shell/shell.h>
+#ifdef CONFIG_TIME_SERVICE_SNTP
+#include <net/sntp.h>
+#endif
+
+#include "qrtc.h"
+#include "lte.h"
+#include "lte_reconnect.h"
+#include "metrics.h"
+#include "time_service.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define PPB 1000000000LL
+
+#define CORRECTION_MS_BOUNDS 10, 100, 500, 1000, 2000, 5000, 10000
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void timeThread(void *arg1, void *arg2, void *arg3);
+static int readNetworkTime(int64_t *uptimeMs, uint64_t *epochMs,
+			   bool *precise);
+static int readModemTime(int64_t *uptimeMs, uint64_t *epochMs);
+#ifdef CONFIG_TIME_SERVICE_SNTP
+static int readSntpTime(int64_t *uptimeMs, uint64_t *epochMs);
+#endif
+static void localTimeCallback(struct lte_query *query,
+			      const struct lte_query_result *result);
+static void update(int64_t uptimeMs, uint64_t epochMs, bool precise);
+static void measureDrift(int64_t uptimeMs, uint64_t epochMs);
+static uint64_t toEpochMs(int64_t uptimeMs);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_THREAD_DEFINE(time_service_thread, CONFIG_TIME_SERVICE_THREAD_STACK_SIZE,
+		timeThread, NULL, NULL, NULL,
+		CONFIG_TIME_SERVICE_THREAD_PRIORITY, 0, 0);
+
+K_SEM_DEFINE(timeSyncSem, 0, 1);
+K_SEM_DEFINE(localTimeSem, 0, 1);
+K_MUTEX_DEFINE(timeLock);
+
+/* The model: the time at the anchor plus the elapsed local time corrected
+ * by the drift.
+ */
+static bool synced;
+static int64_t anchorUptime;
+static uint64_t anchorEpoch;
+/* The anchor is an SNTP time */
+static bool anchorPrecise;
+/* The drift is measured from a separate reference, which is kept when the
+ * anchor moves so the baseline keeps growing.
+ */
+static int64_t driftUptime;
+static uint64_t driftEpoch;
+static bool driftPrecise;
+static int32_t driftPpb;
+static int64_t lastSync;
+static int64_t nextSync;
+
+static struct lte_query localTimeQuery = { .queries = LTE_QUERY_LOCAL_TIME,
+					   .callback = localTimeCallback };
+static struct lte_query_result localTime;
+static int64_t localTimeUptime;
+
+METRIC_COUNTER_DEFINE(syncs, "time_syncs");
+METRIC_COUNTER_DEFINE(syncFailures, "time_sync_failures");
+METRIC_GAUGE_DEFINE(driftGauge, "time_drift_ppm_abs");
+METRIC_HISTOGRAM_DEFINE(correction, "time_correction_ms",
+			CORRECTION_MS_BOUNDS);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void timeServiceOnLteReady(void)
+{
+	/* The thread checks whether a sync is due */
+	k_sem_give(&timeSyncSem);
+}
+
+void timeServiceSync(void)
+{
+	k_mutex_lock(&timeLock, K_FOREVER);
+	nextSync = 0;
+	k_mutex_unlock(&timeLock);
+	k_sem_give(&timeSyncSem);
+}
+
+bool timeServiceIsSynced(void)
+{
+	return synced;
+}
+
+int timeServiceToEpochMs(int64_t uptimeMs, uint64_t *epochMs)
+{
+	int rc = -EAGAIN;
+
+	k_mutex_lock(&timeLock, K_FOREVER);
+	if (synced) {
+		*epochMs = toEpochMs(uptimeMs);
+		rc = 0;
+	}
+	k_mutex_unlock(&timeLock);
+
+	return rc;
+}
+
+int timeServiceEpochMs(uint64_t *epochMs)
+{
+	return timeServiceToEpochMs(timeServiceUptimeMs(), epochMs);
+}
+
+int32_t timeServiceDriftPpb(void)
+{
+	return driftPpb;
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void timeThread(void *arg1, void *arg2, void *arg3)
+{
+	k_timeout_t wait = K_FOREVER;
+	uint32_t failures = 0;
+	uint64_t epochMs;
+	int64_t uptimeMs;
+	bool precise;
+	int64_t due;
+	int rc;
+
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	while (true) {
+		k_sem_take(&timeSyncSem, wait);
+
+		if (!lteIsReady()) {
+			/* Woken again when LTE is ready */
+			wait = K_FOREVER;
+			continue;
+		}
+
+		k_mutex_lock(&timeLock, K_FOREVER);
+		due = nextSync - k_uptime_get();
+		k_mutex_unlock(&timeLock);
+		if (due > 0) {
+			wait = K_MSEC(due);
+			continue;
+		}
+
+		rc = readNetworkTime(&uptimeMs, &epochMs, &precise);
+		if (rc == 0) {
+			metricsIncrement(&syncs);
+			update(uptimeMs, epochMs, precise);
+			failures = 0;
+			due = CONFIG_TIME_SERVICE_SYNC_INTERVAL_S * MSEC_PER_SEC;
+		} else {
+			metricsIncrement(&syncFailures);
+			due = lteReconnectBackoffMs(
+				failures++,
+				CONFIG_TIME_SERVICE_RETRY_MIN_S * MSEC_PER_SEC,
+				CONFIG_TIME_SERVICE_SYNC_INTERVAL_S *
+					MSEC_PER_SEC);
+			TIME_SERVICE_LOG_WRN("Sync failed (%d); retry in %u s",
+					     rc, (uint32_t)(due / MSEC_PER_SEC));
+		}
+
+		k_mutex_lock(&timeLock, K_FOREVER);
+		nextSync = k_uptime_get() + due;
+		k_mutex_unlock(&timeLock);
+		wait = K_MSEC(due);
+	}
+}
+
+static int readNetworkTime(int64_t *uptimeMs, uint64_t *epochMs,
+			   bool *precise)
+{
+#ifdef CONFIG_TIME_SERVICE_SNTP
+	/* Millisecond resolution; the modem's clock has seconds */
+	if (readSntpTime(uptimeMs, epochMs) == 0) {
+		*precise = true;
+		return 0;
+	}
+#endif
+	*precise = false;
+	return readModemTime(uptimeMs, epochMs);
+}
+
+static int readModemTime(int64_t *uptimeMs, uint64_t *epochMs)
+{
+	int rc;
+
+	k_sem_reset(&localTimeSem);
+	rc = lteQuerySubmit(&localTimeQuery);
+	if (rc != 0 && rc != -EALREADY) {
+		return rc;
+	}
+	if (k_sem_take(&localTimeSem,
+		       K_SECONDS(CONFIG_TIME_SERVICE_QUERY_TIMEOUT_S)) != 0) {
+		return -ETIMEDOUT;
+	}
+	if (localTime.failed & LTE_QUERY_LOCAL_TIME) {
+		return -EIO;
+	}
+
+	*uptimeMs = localTimeUptime;
+	*epochMs = (uint64_t)Qrtc_SetEpochFromTm(&localTime.local_time,
+						 localTime.local_offset) *
+		   MSEC_PER_SEC;
+	return 0;
+}
+
+#ifdef CONFIG_TIME_SERVICE_SNTP
+static int readSntpTime(int64_t *uptimeMs, uint64_t *epochMs)
+{
+	struct sntp_time t;
+	int64_t start = k_uptime_get();
+	int rc;
+
+	rc = sntp_simple(CONFIG_TIME_SERVICE_SNTP_SERVER,
+			 CONFIG_TIME_SERVICE_QUERY_TIMEOUT_S * MSEC_PER_SEC,
+			 &t);
+	if (rc < 0) {
+		TIME_SERVICE_LOG_DBG("SNTP (%d)", rc);
+		return rc;
+	}
+
+	/* The server's time is from about the middle of the exchange */
+	*uptimeMs = (start + k_uptime_get()) / 2;
+	*epochMs = (t.seconds * MSEC_PER_SEC) +
+		   (((uint64_t)t.fraction * MSEC_PER_SEC) >> 32);
+	Qrtc_SetEpoch((uint32_t)t.seconds);
+	return 0;
+}
+#endif
+
+/* Runs on the system work queue */
+static void localTimeCallback(struct lte_query *query,
+			      const struct lte_query_result *result)
+{
+	ARG_UNUSED(query);
+
+	localTime = *result;
+	localTimeUptime = k_uptime_get();
+	k_sem_give(&localTimeSem);
+}
+
+/* Without an SNTP anchor each sync sets the offset; the modem's time doesn't
+ * replace an SNTP anchor unless the time stepped.  The drift is measured
+ * between samples of the same kind.  The modem's time has a resolution of a
+ * second, so it needs a much longer baseline than SNTP for that not to
+ * swamp the drift.  An SNTP sample restarts a measurement that used the
+ * modem's time.
+ */
+static void update(int64_t uptimeMs, uint64_t epochMs, bool precise)
+{
+	int64_t error = 0;
+	bool stepped = false;
+
+	k_mutex_lock(&timeLock, K_FOREVER);
+
+	if (synced) {
+		error = (int64_t)(epochMs - toEpochMs(uptimeMs));
+		metricsHistogramRecord(&correction, (uint32_t)llabs(error));
+		stepped = llabs(error) > CONFIG_TIME_SERVICE_STEP_MS;
+	}
+
+	if (stepped) {
+		TIME_SERVICE_LOG_WRN("Time stepped by %lld ms", error);
+	}
+
+	if (!synced || stepped || (precise && !driftPrecise)) {
+		/* Start measuring the drift again.  The estimate so far is
+		 * kept unless the time stepped.
+		 */
+		driftUptime = uptimeMs;
+		driftEpoch = epochMs;
+		driftPrecise = precise;
+		if (!synced || stepped) {
+			driftPpb = 0;
+		}
+	} else if (precise == driftPrecise) {
+		measureDrift(uptimeMs, epochMs);
+	}
+
+	if (!synced || stepped || !anchorPrecise) {
+		anchorUptime = uptimeMs;
+		anchorEpoch = epochMs;
+		anchorPrecise = precise;
+		synced = true;
+	}
+	lastSync = uptimeMs;
+
+	k_mutex_unlock(&timeLock);
+
+	TIME_SERVICE_LOG_INF("Synced (correction %lld ms, drift %d ppb)", error,
+			     driftPpb);
+}
+
+/* Called with the lock */
+static void measureDrift(int64_t uptimeMs, uint64_t epochMs)
+{
+	int64_t baseline = uptimeMs - driftUptime;
+	int64_t minimum =
+		CONFIG_TIME_SERVICE_MODEM_DRIFT_BASELINE_S * (int64_t)MSEC_PER_SEC;
+
+#ifdef CONFIG_TIME_SERVICE_SNTP
+	if (driftPrecise) {
+		minimum = CONFIG_TIME_SERVICE_DRIFT_BASELINE_S *
+			  (int64_t)MSEC_PER_SEC;
+	}
+#endif
+	if (baseline < minimum) {
+		return;
+	}
+
+	driftPpb = (int32_t)((((int64_t)(epochMs - driftEpoch) - baseline) *
+			      PPB) /
+			     baseline);
+	metricsGaugeSet(&driftGauge, (uint32_t)(abs(driftPpb) / 1000));
+}
+
+/* Called with the lock */
+static uint64_t toEpochMs(int64_t uptimeMs)
+{
+	int64_t elapsed = uptimeMs - anchorUptime;
+
+	return anchorEpoch + elapsed + ((elapsed * driftPpb) / PPB);
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_SHELL
+static int shell_timesvc_status(const struct shell *shell, size_t argc,
+				char **argv)
+{
+	uint64_t now;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	if (timeServiceEpochMs(&now) != 0) {
+		shell_print(shell, "Not synced");
+		return 0;
+	}
+
+	k_mutex_lock(&timeLock, K_FOREVER);
+	shell_print(shell, "Epoch %llu.%03u", now / MSEC_PER_SEC,
+		    (uint32_t)(now % MSEC_PER_SEC));
+	shell_print(shell, "Drift %d ppb, measuring over %lld s (%s)",
+		    driftPpb, (k_uptime_get() - driftUptime) / MSEC_PER_SEC,
+		    driftPrecise ? "SNTP" : "modem");
+	shell_print(shell, "Last sync %lld s ago, next in %lld s",
+		    (k_uptime_get() - lastSync) / MSEC_PER_SEC,
+		    MAX(nextSync - k_uptime_get(), 0) / MSEC_PER_SEC);
+	k_mutex_unlock(&timeLock);
+
+	return 0;
+}
+
+static int shell_timesvc_sync(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	timeServiceSync();
+	shell_print(shell, "Sync requested");
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	timesvc_cmds,
+	SHELL_CMD(status, NULL, "Print the time and the drift estimate",
+		  shell_timesvc_status),
+	SHELL_CMD(sync, NULL, "Sync now", shell_timesvc_sync),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(timesvc, &timesvc_cmds, "Time service", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,437 @@
+/**
+ * @file tls_session.c
+ * @brief Application managed TLS connections with session resumption.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(tls_session);
+
+#define TLS_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define TLS_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define TLS_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define TLS_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <net/socket.h>
+#include <random/rand32.h>
+#include <sys/crc.h>
+
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/platform.h>
+
+#include "metrics.h"
+#include "tls_session.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define SESSION_MAGIC 0x544C5353 /* TLSS */
+
+#define METRIC_HANDSHAKE_BYTES_BOUNDS 512, 1024, 2048, 4096, 8192, 16384
+
+/* The parts of mbedtls_ssl_session needed to resume.  The peer certificate
+ * isn't kept; the server doesn't send it during an abbreviated handshake.
+ */
+struct cached_session {
+	uint32_t magic;
+	uint32_t crc; /* of everything after this field */
+	char host[CONFIG_TLS_SESSION_HOST_MAX_SIZE];
+	int32_t ciphersuite;
+	uint32_t verify_result;
+	uint8_t id_len;
+	uint8_t id[32];
+	uint8_t master[48];
+	uint16_t ticket_len;
+	uint32_t ticket_lifetime;
+	uint8_t ticket[CONFIG_TLS_SESSION_MAX_TICKET_SIZE];
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int entropyCallback(void *ctx, unsigned char *buf, size_t len);
+static int bioSend(void *ctx, const unsigned char *buf, size_t len);
+static int bioRecv(void *ctx, unsigned char *buf, size_t len);
+
+static int loadCredentials(struct tls_conn *c,
+			   const struct tls_session_config *cfg);
+static int configureMaxFragLen(struct tls_conn *c);
+static bool cacheValid(const char *hostname);
+static uint32_t cacheCrc(void);
+static void offerCachedSession(struct tls_conn *c);
+static void saveSession(struct tls_conn *c, const char *hostname);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+#ifdef CONFIG_TLS_SESSION_RETAIN
+/* Not cleared at startup so the session survives a soft reset. */
+static __noinit struct cached_session cache;
+#else
+static struct cached_session cache;
+#endif
+
+K_MUTEX_DEFINE(cacheLock);
+
+METRIC_HISTOGRAM_DEFINE(fullTime, "tls_full_handshake_ms",
+			METRIC_LATENCY_MS_BOUNDS);
+METRIC_HISTOGRAM_DEFINE(resumedTime, "tls_resumed_handshake_ms",
+			METRIC_LATENCY_MS_BOUNDS);
+METRIC_HISTOGRAM_DEFINE(fullBytes, "tls_full_handshake_bytes",
+			METRIC_HANDSHAKE_BYTES_BOUNDS);
+METRIC_HISTOGRAM_DEFINE(resumedBytes, "tls_resumed_handshake_bytes",
+			METRIC_HANDSHAKE_BYTES_BOUNDS);
+METRIC_COUNTER_DEFINE(handshakeFailures, "tls_handshake_failures");
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void tlsSessionInit(void)
+{
+	if (cache.magic != SESSION_MAGIC || cache.crc != cacheCrc()) {
+		memset(&cache, 0, sizeof(cache));
+	} else {
+		TLS_LOG_INF("Retained TLS session for %s",
+			    log_strdup(cache.host));
+	}
+}
+
+int tlsSessionOpen(struct tls_conn *c, int sock,
+		   const struct tls_session_config *cfg)
+{
+	static const char pers[] = "tls_session";
+	int64_t start;
+	int rc;
+
+	memset(c, 0, sizeof(*c));
+	c->sock = sock;
+	mbedtls_ssl_init(&c->ssl);
+	mbedtls_ssl_config_init(&c->conf);
+	mbedtls_ctr_drbg_init(&c->drbg);
+	mbedtls_x509_crt_init(&c->ca);
+	mbedtls_x509_crt_init(&c->cert);
+	mbedtls_pk_init(&c->key);
+
+	rc = mbedtls_ctr_drbg_seed(&c->drbg, entropyCallback, NULL,
+				   (const unsigned char *)pers, sizeof(pers));
+	if (rc == 0) {
+		rc = loadCredentials(c, cfg);
+		if (rc != 0) {
+			tlsSessionClose(c);
+			return TLS_SESSION_ERR_CREDENTIALS;
+		}
+		rc = mbedtls_ssl_config_defaults(&c->conf, MBEDTLS_SSL_IS_CLIENT,
+						 MBEDTLS_SSL_TRANSPORT_STREAM,
+						 MBEDTLS_SSL_PRESET_DEFAULT);
+	}
+	if (rc == 0) {
+		mbedtls_ssl_conf_authmode(&c->conf,
+					  MBEDTLS_SSL_VERIFY_REQUIRED);
+		mbedtls_ssl_conf_ca_chain(&c->conf, &c->ca, NULL);
+		mbedtls_ssl_conf_rng(&c->conf, mbedtls_ctr_drbg_random,
+				     &c->drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+		mbedtls_ssl_conf_session_tickets(
+			&c->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+		rc = mbedtls_ssl_conf_own_cert(&c->conf, &c->cert, &c->key);
+	}
+	if (rc == 0) {
+		rc = configureMaxFragLen(c);
+	}
+	if (rc == 0) {
+		rc = mbedtls_ssl_setup(&c->ssl, &c->conf);
+	}
+	if (rc == 0) {
+		rc = mbedtls_ssl_set_hostname(&c->ssl, cfg->hostname);
+	}
+	if (rc != 0) {
+		TLS_LOG_ERR("TLS setup (-0x%04x)", -rc);
+		tlsSessionClose(c);
+		return TLS_SESSION_ERR_SETUP;
+	}
+
+	mbedtls_ssl_set_bio(&c->ssl, c, bioSend, bioRecv, NULL);
+
+	if (cacheValid(cfg->hostname)) {
+		offerCachedSession(c);
+	}
+
+	start = k_uptime_get();
+	do {
+		rc = mbedtls_ssl_handshake(&c->ssl);
+	} while (rc == MBEDTLS_ERR_SSL_WANT_READ ||
+		 rc == MBEDTLS_ERR_SSL_WANT_WRITE);
+	c->handshake_ms = (uint32_t)k_uptime_delta(&start);
+
+	if (rc != 0) {
+		TLS_LOG_ERR("TLS handshake (-0x%04x)", -rc);
+		metricsIncrement(&handshakeFailures);
+		/* A stale session shouldn't cause repeated failures. */
+		tlsSessionForget();
+		tlsSessionClose(c);
+		return TLS_SESSION_ERR_HANDSHAKE;
+	}
+
+	saveSession(c, cfg->hostname);
+
+	if (c->resumed) {
+		metricsHistogramRecord(&resumedTime, c->handshake_ms);
+		metricsHistogramRecord(&resumedBytes,
+				       c->tx_bytes + c->rx_bytes);
+	} else {
+		metricsHistogramRecord(&fullTime, c->handshake_ms);
+		metricsHistogramRecord(&fullBytes, c->tx_bytes + c->rx_bytes);
+	}
+	TLS_LOG_INF("%s handshake %u ms tx %u rx %u",
+		    c->resumed ? "Resumed" : "Full", c->handshake_ms,
+		    c->tx_bytes, c->rx_bytes);
+
+	return TLS_SESSION_ERR_NONE;
+}
+
+ssize_t tlsSessionSend(struct tls_conn *c, const void *data, size_t len)
+{
+	int rc;
+
+	do {
+		rc = mbedtls_ssl_write(&c->ssl, data, len);
+	} while (rc == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+	return (rc < 0) ? -EIO : rc;
+}
+
+ssize_t tlsSessionRecv(struct tls_conn *c, void *data, size_t len)
+{
+	int rc;
+
+	do {
+		rc = mbedtls_ssl_read(&c->ssl, data, len);
+	} while (rc == MBEDTLS_ERR_SSL_WANT_READ);
+
+	if (rc == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+		return 0;
+	}
+	return (rc < 0) ? -EIO : rc;
+}
+
+bool tlsSessionReadable(struct tls_conn *c)
+{
+	struct pollfd fds = { .fd = c->sock, .events = POLLIN };
+
+	if (mbedtls_ssl_get_bytes_avail(&c->ssl) > 0 ||
+	    mbedtls_ssl_check_pending(&c->ssl)) {
+		return true;
+	}
+	return (poll(&fds, 1, 0) > 0) && (fds.revents & POLLIN);
+}
+
+void tlsSessionClose(struct tls_conn *c)
+{
+	mbedtls_ssl_close_notify(&c->ssl);
+	mbedtls_ssl_free(&c->ssl);
+	mbedtls_ssl_config_free(&c->conf);
+	mbedtls_ctr_drbg_free(&c->drbg);
+	mbedtls_x509_crt_free(&c->ca);
+	mbedtls_x509_crt_free(&c->cert);
+	mbedtls_pk_free(&c->key);
+}
+
+void tlsSessionForget(void)
+{
+	k_mutex_lock(&cacheLock, K_FOREVER);
+	memset(&cache, 0, sizeof(cache));
+	k_mutex_unlock(&cacheLock);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int entropyCallback(void *ctx, unsigned char *buf, size_t len)
+{
+	ARG_UNUSED(ctx);
+
+	return (sys_csrand_get(buf, len) == 0) ?
+		       0 :
+		       MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+}
+
+static int bioSend(void *ctx, const unsigned char *buf, size_t len)
+{
+	struct tls_conn *c = (struct tls_conn *)ctx;
+	ssize_t n = send(c->sock, buf, len, 0);
+
+	if (n < 0) {
+		return (errno == EAGAIN) ? MBEDTLS_ERR_SSL_WANT_WRITE :
+					   MBEDTLS_ERR_NET_SEND_FAILED;
+	}
+	if (c->ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+		c->tx_bytes += n;
+	}
+	return (int)n;
+}
+
+static int bioRecv(void *ctx, unsigned char *buf, size_t len)
+{
+	struct tls_conn *c = (struct tls_conn *)ctx;
+	ssize_t n = recv(c->sock, buf, len, 0);
+
+	if (n < 0) {
+		return (errno == EAGAIN) ? MBEDTLS_ERR_SSL_WANT_READ :
+					   MBEDTLS_ERR_NET_RECV_FAILED;
+	}
+	if (n == 0) {
+		return MBEDTLS_ERR_NET_CONN_RESET;
+	}
+	if (c->ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+		c->rx_bytes += n;
+	}
+	return (int)n;
+}
+
+static int loadCredentials(struct tls_conn *c,
+			   const struct tls_session_config *cfg)
+{
+	int rc;
+
+	rc = mbedtls_x509_crt_parse(&c->ca, cfg->ca, cfg->ca_len);
+	if (rc == 0) {
+		rc = mbedtls_x509_crt_parse(&c->cert, cfg->cert, cfg->cert_len);
+	}
+	if (rc == 0) {
+		rc = mbedtls_pk_parse_key(&c->key, cfg->key, cfg->key_len,
+					  NULL, 0);
+	}
+	if (rc != 0) {
+		TLS_LOG_ERR("Unable to parse credentials (-0x%04x)", -rc);
+	}
+	return rc;
+}
+
+static int configureMaxFragLen(struct tls_conn *c)
+{
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+	switch (CONFIG_TLS_SESSION_MAX_FRAG_LEN) {
+	case 0:
+		return 0;
+	case 512:
+		return mbedtls_ssl_conf_max_frag_len(&c->conf,
+						     MBEDTLS_SSL_MAX_FRAG_LEN_512);
+	case 1024:
+		return mbedtls_ssl_conf_max_frag_len(
+			&c->conf, MBEDTLS_SSL_MAX_FRAG_LEN_1024);
+	case 2048:
+		return mbedtls_ssl_conf_max_frag_len(
+			&c->conf, MBEDTLS_SSL_MAX_FRAG_LEN_2048);
+	case 4096:
+		return mbedtls_ssl_conf_max_frag_len(
+			&c->conf, MBEDTLS_SSL_MAX_FRAG_LEN_4096);
+	default:
+		TLS_LOG_ERR("Invalid max fragment length");
+		return -EINVAL;
+	}
+#else
+	ARG_UNUSED(c);
+	return 0;
+#endif
+}
+
+static bool cacheValid(const char *hostname)
+{
+	bool valid;
+
+	k_mutex_lock(&cacheLock, K_FOREVER);
+	valid = (cache.magic == SESSION_MAGIC) &&
+		(strncmp(cache.host, hostname, sizeof(cache.host)) == 0);
+	k_mutex_unlock(&cacheLock);
+
+	return valid;
+}
+
+static uint32_t cacheCrc(void)
+{
+	const uint8_t *start = (const uint8_t *)&cache.crc + sizeof(cache.crc);
+
+	return crc32_ieee(start, sizeof(cache) - (start - (uint8_t *)&cache));
+}
+
+static void offerCachedSession(struct tls_conn *c)
+{
+	mbedtls_ssl_session session;
+
+	mbedtls_ssl_session_init(&session);
+
+	k_mutex_lock(&cacheLock, K_FOREVER);
+	session.ciphersuite = cache.ciphersuite;
+	session.verify_result = cache.verify_result;
+	session.id_len = cache.id_len;
+	memcpy(session.id, cache.id, sizeof(session.id));
+	memcpy(session.master, cache.master, sizeof(session.master));
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	if (cache.ticket_len > 0) {
+		session.ticket = mbedtls_calloc(1, cache.ticket_len);
+		if (session.ticket != NULL) {
+			memcpy(session.ticket, cache.ticket, cache.ticket_len);
+			session.ticket_len = cache.ticket_len;
+			session.ticket_lifetime = cache.ticket_lifetime;
+		}
+	}
+#endif
+	k_mutex_unlock(&cacheLock);
+
+	/* mbedTLS makes a copy */
+	if (mbedtls_ssl_set_session(&c->ssl, &session) != 0) {
+		TLS_LOG_WRN("Unable to offer cached session");
+	}
+	mbedtls_ssl_session_free(&session);
+}
+
+static void saveSession(struct tls_conn *c, const char *hostname)
+{
+	mbedtls_ssl_session session;
+
+	mbedtls_ssl_session_init(&session);
+	if (mbedtls_ssl_get_session(&c->ssl, &session) != 0) {
+		mbedtls_ssl_session_free(&session);
+		return;
+	}
+
+	k_mutex_lock(&cacheLock, K_FOREVER);
+
+	/* The server echoes the offered session ID when it resumes. */
+	c->resumed = (cache.magic == SESSION_MAGIC) && (cache.id_len > 0) &&
+		     (cache.id_len == session.id_len) &&
+		     (memcmp(cache.id, session.id, session.id_len) == 0) &&
+		     (strncmp(cache.host, hostname, sizeof(cache.host)) == 0);
+
+	memset(&cache, 0, sizeof(cache));
+	strncpy(cache.host, hostname, sizeof(cache.host) - 1);
+	cache.ciphersuite = session.ciphersuite;
+	cache.verify_result = session.verify_result;
+	cache.id_len = MIN(session.id_len, sizeof(cache.id));
+	memcpy(cache.id, session.id, cache.id_len);
+	memcpy(cache.master, session.master, sizeof(cache.master));
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	if (session.ticket != NULL &&
+	    session.ticket_len <= sizeof(cache.ticket)) {
+		memcpy(cache.ticket, session.ticket, session.ticket_len);
+		cache.ticket_len = session.ticket_len;
+		cache.ticket_lifetime = session.ticket_lifetime;
+	}
+#endif
+	cache.magic = SESSION_MAGIC;
+	cache.crc = cacheCrc();
+
+	k_mutex_unlock(&cacheLock);
+
+	mbedtls_ssl_session_free(&session);
+}
@@ -0,0 +1,794 @@
+/**
+ * @file upload_mgmt.c
+ * @brief Pipelined uploads over mcumgr (SMP).
+ *
+ * Requests are handled in the mcumgr work queue.  Each chunk is parsed into
+ * a buffer from a slab and queued for the writer thread, which owns the
+ * upload target (flash, delta or modem).  The handler never blocks: when all
+ * buffers are waiting to be written the request is refused with
+ * MGMT_ERR_EBUSY and the client retries it.
+ *
+ * Copyright (c) 2020 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <logging/log.h>
+#define LOG_LEVEL LOG_LEVEL_DBG
+LOG_MODULE_REGISTER(upload_mgmt);
+
+#define UPLOAD_LOG_ERR(...) LOG_ERR(__VA_ARGS__)
+#define UPLOAD_LOG_WRN(...) LOG_WRN(__VA_ARGS__)
+#define UPLOAD_LOG_INF(...) LOG_INF(__VA_ARGS__)
+#define UPLOAD_LOG_DBG(...) LOG_DBG(__VA_ARGS__)
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <shell/shell.h>
+#include <storage/flash_map.h>
+#include <dfu/flash_img.h>
+#include <dfu/mcuboot.h>
+#ifdef CONFIG_IMG_ERASE_PROGRESSIVELY
+#include <drivers/flash.h>
+#endif
+
+#include "mgmt/mgmt.h"
+#include "cborattr/cborattr.h"
+#include <tinycbor/cbor.h>
+
+#include "crypto_backend.h"
+#include "metrics.h"
+#include "upload_mgmt.h"
+#ifdef CONFIG_FOTA_STAGE
+#include "fota_stage.h"
+#endif
+#ifdef CONFIG_DELTA_UPDATE
+#include "delta_update.h"
+#endif
+#ifdef CONFIG_MODEM_FW_STREAM
+#include "modem_fw_stream.h"
+#endif
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+enum upload_mgmt_id {
+	UPLOAD_MGMT_ID_WRITE = 0,
+	UPLOAD_MGMT_ID_STATE,
+};
+
+struct chunk {
+	uint32_t session;
+	uint32_t offset;
+	uint32_t size;
+	uint16_t len;
+	uint8_t target;
+	uint8_t data[CONFIG_UPLOAD_MGMT_CHUNK_SIZE];
+};
+
+struct target_ops {
+	/* Offset an upload of the same image would continue from (optional) */
+	size_t (*resume)(size_t size, const uint8_t *sha256);
+	int (*open)(size_t offset, size_t size, const uint8_t *sha256);
+	int (*write)(const uint8_t *data, size_t len);
+	int (*finish)(void);
+	void (*abort)(void);
+};
+
+/* Added to mcumgr after the version in this Zephyr; same value */
+#ifndef MGMT_ERR_EBUSY
+#define MGMT_ERR_EBUSY 10
+#endif
+
+/* Index of "data" in the attributes of a write */
+#define ATTR_DATA 3
+
+#ifdef CONFIG_FOTA_STAGE
+/* Name of the image target in fota_stage.h.  The start of the SHA-256 is
+ * added when the client sends it so only the same image is continued.
+ */
+#define STAGE_NAME "upload_mgmt"
+#define STAGE_NAME_SHA_BYTES 8
+#define STAGE_NAME_SIZE (sizeof("upload_") + (2 * STAGE_NAME_SHA_BYTES))
+#define IMAGE_RESUME imageResume
+#else
+#define IMAGE_RESUME NULL
+#endif
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int submit(struct chunk *c, uint32_t target, uint32_t offset,
+		  uint32_t size, const uint8_t *sha256);
+static void releaseChunk(struct chunk *c);
+static void writerThread(void *arg1, void *arg2, void *arg3);
+static int writeChunk(const struct chunk *c);
+
+static int imageOpen(size_t offset, size_t size, const uint8_t *sha256);
+static int imageWrite(const uint8_t *data, size_t len);
+static int imageFinish(void);
+static void imageAbort(void);
+#ifdef CONFIG_FOTA_STAGE
+static size_t imageResume(size_t size, const uint8_t *sha256);
+static int imageSeek(size_t offset);
+static void stageName(char *name, const uint8_t *sha256);
+static int stageWrite(void *ctx, size_t offset, const uint8_t *data,
+		      size_t len, bool flush);
+#endif
+
+#ifdef CONFIG_DELTA_UPDATE
+static int deltaOpen(size_t offset, size_t size, const uint8_t *sha256);
+#endif
+#ifdef CONFIG_MODEM_FW_STREAM
+static int modemOpen(size_t offset, size_t size, const uint8_t *sha256);
+static int modemWrite(const uint8_t *data, size_t len);
+static int modemFinish(void);
+#endif
+
+static int upload_mgmt_write(struct mgmt_ctxt *ctxt);
+static int upload_mgmt_state(struct mgmt_ctxt *ctxt);
+
+/******************************************************************************/
+/* Local Data Definitions                                                     */
+/******************************************************************************/
+K_THREAD_DEFINE(upload_writer, CONFIG_UPLOAD_MGMT_THREAD_STACK_SIZE,
+		writerThread, NULL, NULL, NULL,
+		CONFIG_UPLOAD_MGMT_THREAD_PRIORITY, 0, 0);
+
+K_MEM_SLAB_DEFINE(chunkSlab, sizeof(struct chunk),
+		  CONFIG_UPLOAD_MGMT_CHUNK_COUNT, 4);
+K_MSGQ_DEFINE(chunkQ, sizeof(struct chunk *), CONFIG_UPLOAD_MGMT_CHUNK_COUNT,
+	      4);
+K_MUTEX_DEFINE(uploadLock);
+
+static const struct target_ops targets[UPLOAD_TARGET_COUNT] = {
+	[UPLOAD_TARGET_IMAGE] = { .resume = IMAGE_RESUME,
+				  .open = imageOpen,
+				  .write = imageWrite,
+				  .finish = imageFinish,
+				  .abort = imageAbort },
+#ifdef CONFIG_DELTA_UPDATE
+	[UPLOAD_TARGET_DELTA] = { .open = deltaOpen,
+				  .write = deltaUpdateWrite,
+				  .finish = deltaUpdateFinish,
+				  .abort = deltaUpdateAbort },
+#endif
+#ifdef CONFIG_MODEM_FW_STREAM
+	[UPLOAD_TARGET_MODEM] = { .open = modemOpen,
+				  .write = modemWrite,
+				  .finish = modemFinish,
+				  .abort = modemFwStreamAbort },
+#endif
+};
+
+/* Receive side (protected by uploadLock) */
+static bool active;
+static uint8_t target;
+static uint32_t size;
+static uint32_t received;
+static bool hasSha;
+static uint8_t sha[CRYPTO_SHA256_SIZE];
+
+/* Written by the writer thread */
+static atomic_t session;
+static atomic_t written;
+static atomic_t writeError;
+static atomic_t complete;
+
+/* Used by the writer thread */
+static uint32_t writerSession;
+static const struct target_ops *current;
+static struct flash_img_context img;
+#ifndef CONFIG_FOTA_STAGE
+static struct crypto_sha256 imageHash;
+#endif
+static uint8_t imageSha[CRYPTO_SHA256_SIZE];
+static bool imageHasSha;
+
+static const struct mgmt_handler upload_mgmt_handlers[] = {
+	[UPLOAD_MGMT_ID_WRITE] = { .mh_read = NULL,
+				   .mh_write = upload_mgmt_write },
+	[UPLOAD_MGMT_ID_STATE] = { .mh_read = upload_mgmt_state,
+				   .mh_write = NULL },
+};
+
+static struct mgmt_group upload_mgmt_group = {
+	.mg_handlers = upload_mgmt_handlers,
+	.mg_handlers_count = ARRAY_SIZE(upload_mgmt_handlers),
+	.mg_group_id = CONFIG_UPLOAD_MGMT_GROUP_ID,
+};
+
+/* The maximum is the number of chunks that were waiting for flash */
+METRIC_GAUGE_DEFINE(queueDepth, "upload_queue_depth");
+METRIC_COUNTER_DEFINE(rewinds, "upload_rewinds");
+METRIC_COUNTER_DEFINE(busy, "upload_busy");
+METRIC_HISTOGRAM_DEFINE(writeTime, "upload_write_ms", 1, 2, 5, 10, 20, 50,
+			100);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void uploadMgmtInit(void)
+{
+	mgmt_register_group(&upload_mgmt_group);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+/* Queue a chunk that was allocated from the slab.  The chunk is released if
+ * it isn't queued.
+ *
+ * Returns an mcumgr error.
+ */
+static int submit(struct chunk *c, uint32_t tgt, uint32_t offset,
+		  uint32_t imageSize, const uint8_t *sha256)
+{
+	int rc = MGMT_ERR_EOK;
+
+	k_mutex_lock(&uploadLock, K_FOREVER);
+
+	if (offset == 0) {
+		if (tgt >= UPLOAD_TARGET_COUNT || targets[tgt].open == NULL) {
+			rc = MGMT_ERR_ENOTSUP;
+		} else if (imageSize == 0 || c->len > imageSize) {
+			rc = MGMT_ERR_EINVAL;
+		} else {
+			/* Chunks of the previous upload that are still queued
+			 * are discarded by the writer.
+			 */
+			atomic_inc(&session);
+			atomic_clear(&written);
+			atomic_clear(&writeError);
+			atomic_clear(&complete);
+			active = true;
+			target = (uint8_t)tgt;
+			size = imageSize;
+			received = 0;
+			if (targets[tgt].resume != NULL) {
+				received = targets[tgt].resume(size, sha256);
+			}
+			hasSha = (sha256 != NULL);
+			if (hasSha) {
+				memcpy(sha, sha256, sizeof(sha));
+			}
+			UPLOAD_LOG_INF("Upload of %u bytes to target %u from %u",
+				       size, target, received);
+		}
+	} else if (!active) {
+		rc = MGMT_ERR_EBADSTATE;
+	}
+
+	if (rc == MGMT_ERR_EOK && atomic_get(&writeError) != 0) {
+		rc = MGMT_ERR_EBADSTATE;
+	}
+
+	if (rc == MGMT_ERR_EOK && offset != received) {
+		/* Lost or repeated request; the client continues from the
+		 * offset in the response.
+		 */
+		metricsIncrement(&rewinds);
+		releaseChunk(c);
+		c = NULL;
+	} else if (rc == MGMT_ERR_EOK && c->len > size - received) {
+		rc = MGMT_ERR_EINVAL;
+	}
+
+	if (rc == MGMT_ERR_EOK && c != NULL) {
+		c->session = (uint32_t)atomic_get(&session);
+		c->target = target;
+		c->offset = offset;
+		c->size = size;
+		/* The queue has room for every chunk in the slab */
+		k_msgq_put(&chunkQ, &c, K_FOREVER);
+		metricsGaugeSet(&queueDepth, k_msgq_num_used_get(&chunkQ));
+		received += c->len;
+	} else if (c != NULL) {
+		releaseChunk(c);
+	}
+
+	k_mutex_unlock(&uploadLock);
+	return rc;
+}
+
+static void releaseChunk(struct chunk *c)
+{
+	k_mem_slab_free(&chunkSlab, (void **)&c);
+}
+
+static void writerThread(void *arg1, void *arg2, void *arg3)
+{
+	struct chunk *c;
+	int rc;
+
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	while (true) {
+		k_msgq_get(&chunkQ, &c, K_FOREVER);
+		metricsGaugeSet(&queueDepth, k_msgq_num_used_get(&chunkQ));
+
+		if (c->session != (uint32_t)atomic_get(&session)) {
+			/* A newer upload was started */
+			releaseChunk(c);
+			continue;
+		}
+
+		rc = writeChunk(c);
+		if (rc != 0 && atomic_get(&writeError) == 0) {
+			UPLOAD_LOG_ERR("Write at %u failed (%d)", c->offset, rc);
+			atomic_set(&writeError, rc);
+			if (current != NULL) {
+				current->abort();
+				current = NULL;
+			}
+		}
+		releaseChunk(c);
+	}
+}
+
+static int writeChunk(const struct chunk *c)
+{
+	int64_t start = k_uptime_get();
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	bool check;
+	int rc = 0;
+
+	if (c->session != writerSession) {
+		if (current != NULL) {
+			current->abort();
+			current = NULL;
+		}
+		writerSession = c->session;
+		k_mutex_lock(&uploadLock, K_FOREVER);
+		check = hasSha;
+		memcpy(digest, sha, sizeof(digest));
+		k_mutex_unlock(&uploadLock);
+		/* Opening may erase a slot, so it isn't done with the lock.
+		 * The first chunk is where the upload starts (or continues).
+		 */
+		rc = targets[c->target].open(c->offset, c->size,
+					     check ? digest : NULL);
+		if (rc != 0) {
+			return rc;
+		}
+		current = &targets[c->target];
+	}
+
+	if (current == NULL) {
+		/* The upload already failed */
+		return 0;
+	}
+
+	rc = current->write(c->data, c->len);
+	if (rc == 0 && c->offset + c->len == c->size) {
+		rc = current->finish();
+		current = NULL;
+		if (rc == 0) {
+			atomic_set(&complete, 1);
+			UPLOAD_LOG_INF("Upload complete");
+		}
+	}
+	if (rc == 0 && c->session == (uint32_t)atomic_get(&session)) {
+		atomic_add(&written, c->len);
+	}
+
+	metricsHistogramRecord(&writeTime, (uint32_t)(k_uptime_get() - start));
+	return rc;
+}
+
+static int imageOpen(size_t offset, size_t imageSize, const uint8_t *sha256)
+{
+	int rc = 0;
+#ifdef CONFIG_FOTA_STAGE
+	char name[STAGE_NAME_SIZE];
+	size_t staged = 0;
+#endif
+
+#ifndef CONFIG_IMG_ERASE_PROGRESSIVELY
+	/* A continued upload keeps what is already in the slot */
+	if (offset == 0) {
+		rc = boot_erase_img_bank(FLASH_AREA_ID(image_1));
+	}
+#endif
+	if (rc == 0) {
+		rc = flash_img_init(&img);
+	}
+
+	imageHasSha = (sha256 != NULL);
+	if (imageHasSha) {
+		memcpy(imageSha, sha256, sizeof(imageSha));
+	}
+
+#ifdef CONFIG_FOTA_STAGE
+	stageName(name, sha256);
+	if (rc == 0) {
+		rc = fotaStageOpen(name, imageSize, stageWrite, NULL, &staged);
+	}
+	if (rc == 0 && staged != offset && offset == 0) {
+		/* Restarted although there is a checkpoint */
+		fotaStageClose(true);
+		rc = fotaStageOpen(name, imageSize, stageWrite, NULL, &staged);
+	} else if (rc == 0 && staged != offset) {
+		/* The checkpoint changed after the client was told to
+		 * continue from it (or the hash state couldn't be restored).
+		 * The client has to start again.
+		 */
+		UPLOAD_LOG_ERR("Unable to continue at %u (%u)", offset,
+			       staged);
+		fotaStageClose(false);
+		rc = -ESTALE;
+	}
+	if (rc == 0 && offset != 0) {
+		rc = imageSeek(offset);
+	}
+#else
+	ARG_UNUSED(offset);
+	ARG_UNUSED(imageSize);
+
+	if (rc == 0 && imageHasSha) {
+		rc = cryptoSha256Start(&imageHash, NULL);
+	}
+#endif
+	return rc;
+}
+
+#ifdef CONFIG_FOTA_STAGE
+/* The stage hashes each chunk and flushes at its checkpoints */
+static int imageWrite(const uint8_t *data, size_t len)
+{
+	return fotaStageWrite(data, len);
+}
+
+static int imageFinish(void)
+{
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	char name[STAGE_NAME_SIZE];
+	int rc;
+
+	/* The last chunk was flushed by the stage */
+	stageName(name, imageHasSha ? imageSha : NULL);
+	rc = fotaStageDigest(name, digest);
+	fotaStageClose(false);
+	if (rc == 0 && imageHasSha &&
+	    !cryptoTagEqual(digest, imageSha, sizeof(digest))) {
+		UPLOAD_LOG_ERR("Image doesn't match its SHA-256");
+		rc = -EBADMSG;
+	}
+	imageHasSha = false;
+	return rc;
+}
+
+/* The checkpoint is kept so another upload of the same image continues
+ * from it.
+ */
+static void imageAbort(void)
+{
+	imageHasSha = false;
+	fotaStageClose(false);
+}
+
+static size_t imageResume(size_t imageSize, const uint8_t *sha256)
+{
+	char name[STAGE_NAME_SIZE];
+
+	if (sha256 == NULL) {
+		return 0;
+	}
+	stageName(name, sha256);
+	return fotaStageCheckpoint(name, imageSize);
+}
+
+/* flash_img can't seek, so its stream is positioned at offset.  The part of
+ * the block before offset is read back into the buffer so writes stay
+ * aligned (it is written again with the same data), and with progressive
+ * erase the page holding the last byte is marked as already erased.
+ */
+static int imageSeek(size_t offset)
+{
+	size_t aligned = ROUND_DOWN(offset, sizeof(img.buf));
+	int rc;
+#ifdef CONFIG_IMG_ERASE_PROGRESSIVELY
+	struct flash_pages_info page;
+#endif
+
+	rc = flash_area_read(img.flash_area, aligned, img.buf,
+			     offset - aligned);
+	if (rc == 0) {
+		img.stream.bytes_written = aligned;
+		img.stream.buf_bytes = offset - aligned;
+	}
+#ifdef CONFIG_IMG_ERASE_PROGRESSIVELY
+	if (rc == 0) {
+		rc = flash_get_page_info_by_offs(img.stream.fdev,
+						 img.stream.offset + offset - 1,
+						 &page);
+	}
+	if (rc == 0) {
+		img.stream.last_erased_page_start_offset = page.start_offset;
+	}
+#endif
+	return rc;
+}
+
+static void stageName(char *name, const uint8_t *sha256)
+{
+	if (sha256 == NULL) {
+		strcpy(name, STAGE_NAME);
+		return;
+	}
+	strcpy(name, "upload_");
+	bin2hex(sha256, STAGE_NAME_SHA_BYTES, name + strlen(name),
+		STAGE_NAME_SIZE - strlen(name));
+}
+
+static int stageWrite(void *ctx, size_t offset, const uint8_t *data,
+		      size_t len, bool flush)
+{
+	ARG_UNUSED(ctx);
+	ARG_UNUSED(offset);
+
+	return flash_img_buffered_write(&img, data, len, flush);
+}
+#else
+static int imageWrite(const uint8_t *data, size_t len)
+{
+	int rc = 0;
+
+	if (imageHasSha) {
+		rc = cryptoSha256Update(&imageHash, data, len);
+	}
+	if (rc == 0) {
+		rc = flash_img_buffered_write(&img, data, len, false);
+	}
+	return rc;
+}
+
+static int imageFinish(void)
+{
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	int rc;
+
+	rc = flash_img_buffered_write(&img, NULL, 0, true);
+	if (rc == 0 && imageHasSha) {
+		imageHasSha = false;
+		rc = cryptoSha256Finish(&imageHash, digest);
+		if (rc == 0 &&
+		    !cryptoTagEqual(digest, imageSha, sizeof(digest))) {
+			UPLOAD_LOG_ERR("Image doesn't match its SHA-256");
+			rc = -EBADMSG;
+		}
+	}
+	return rc;
+}
+
+static void imageAbort(void)
+{
+	if (imageHasSha) {
+		imageHasSha = false;
+		cryptoSha256Abort(&imageHash);
+	}
+}
+#endif
+
+#ifdef CONFIG_DELTA_UPDATE
+/* The patch contains the size and SHA-256 of the new image */
+static int deltaOpen(size_t offset, size_t imageSize, const uint8_t *sha256)
+{
+	ARG_UNUSED(offset);
+	ARG_UNUSED(imageSize);
+	ARG_UNUSED(sha256);
+
+	return deltaUpdateStart();
+}
+#endif
+
+#ifdef CONFIG_MODEM_FW_STREAM
+static int modemOpen(size_t offset, size_t imageSize, const uint8_t *sha256)
+{
+	ARG_UNUSED(offset);
+
+	return modemFwStreamStart(imageSize, sha256);
+}
+
+static int modemWrite(const uint8_t *data, size_t len)
+{
+	return modemFwStreamWrite(
+		data, len, K_SECONDS(CONFIG_MODEM_FW_STREAM_STALL_TIMEOUT_S));
+}
+
+static int modemFinish(void)
+{
+	return modemFwStreamFinish(K_FOREVER);
+}
+#endif
+
+/******************************************************************************/
+/* mcumgr                                                                     */
+/******************************************************************************/
+static int upload_mgmt_write(struct mgmt_ctxt *ctxt)
+{
+	unsigned long long tgt = UPLOAD_TARGET_IMAGE;
+	unsigned long long off = ULLONG_MAX;
+	unsigned long long len = 0;
+	uint8_t digest[CRYPTO_SHA256_SIZE];
+	size_t digestLen = 0;
+	size_t dataLen = 0;
+	struct chunk *c;
+	CborError err = 0;
+	int rc;
+	/* The data is parsed straight into the chunk once it is allocated */
+	struct cbor_attr_t attrs[] = {
+		{ .attribute = "tgt",
+		  .type = CborAttrUnsignedIntegerType,
+		  .addr.uinteger = &tgt,
+		  .nodefault = true },
+		{ .attribute = "off",
+		  .type = CborAttrUnsignedIntegerType,
+		  .addr.uinteger = &off,
+		  .nodefault = true },
+		{ .attribute = "len",
+		  .type = CborAttrUnsignedIntegerType,
+		  .addr.uinteger = &len,
+		  .nodefault = true },
+		{ .attribute = "data",
+		  .type = CborAttrByteStringType,
+		  .addr.bytestring.data = NULL,
+		  .addr.bytestring.len = &dataLen,
+		  .len = sizeof(c->data) },
+		{ .attribute = "sha",
+		  .type = CborAttrByteStringType,
+		  .addr.bytestring.data = digest,
+		  .addr.bytestring.len = &digestLen,
+		  .len = sizeof(digest) },
+		{ .attribute = NULL }
+	};
+
+	/* Blocking here would hold up the mcumgr work queue.  The client
+	 * backs off and resends from the offset it last saw acknowledged.
+	 */
+	if (k_mem_slab_alloc(&chunkSlab, (void **)&c, K_NO_WAIT) != 0) {
+		metricsIncrement(&busy);
+		return MGMT_ERR_EBUSY;
+	}
+	attrs[ATTR_DATA].addr.bytestring.data = c->data;
+
+	if (cbor_read_object(&ctxt->it, attrs) != 0 || off > UINT32_MAX ||
+	    len > UINT32_MAX || dataLen == 0 ||
+	    (digestLen != 0 && digestLen != sizeof(digest))) {
+		releaseChunk(c);
+		return MGMT_ERR_EINVAL;
+	}
+
+	c->len = (uint16_t)dataLen;
+	rc = submit(c, (uint32_t)MIN(tgt, UINT32_MAX), (uint32_t)off,
+		    (uint32_t)len, (digestLen != 0) ? digest : NULL);
+	if (rc != MGMT_ERR_EOK) {
+		return rc;
+	}
+
+	k_mutex_lock(&uploadLock, K_FOREVER);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "rc");
+	err |= cbor_encode_int(&ctxt->encoder, MGMT_ERR_EOK);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "off");
+	err |= cbor_encode_uint(&ctxt->encoder, received);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "done");
+	err |= cbor_encode_uint(&ctxt->encoder, atomic_get(&written));
+	k_mutex_unlock(&uploadLock);
+
+	return (err != 0) ? MGMT_ERR_ENOMEM : MGMT_ERR_EOK;
+}
+
+static int upload_mgmt_state(struct mgmt_ctxt *ctxt)
+{
+	CborError err = 0;
+
+	k_mutex_lock(&uploadLock, K_FOREVER);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "rc");
+	err |= cbor_encode_int(&ctxt->encoder, MGMT_ERR_EOK);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "tgt");
+	err |= cbor_encode_uint(&ctxt->encoder, target);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "len");
+	err |= cbor_encode_uint(&ctxt->encoder, size);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "off");
+	err |= cbor_encode_uint(&ctxt->encoder, received);
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "done");
+	err |= cbor_encode_uint(&ctxt->encoder, atomic_get(&written));
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "err");
+	err |= cbor_encode_int(&ctxt->encoder, atomic_get(&writeError));
+	err |= cbor_encode_text_stringz(&ctxt->encoder, "ok");
+	err |= cbor_encode_boolean(&ctxt->encoder, atomic_get(&complete) != 0);
+	k_mutex_unlock(&uploadLock);
+
+	return (err != 0) ? MGMT_ERR_ENOMEM : MGMT_ERR_EOK;
+}
+
+/******************************************************************************/
+/* Shell                                                                      */
+/******************************************************************************/
+#ifdef CONFIG_UPLOAD_MGMT_SHELL
+/* Upload to the secondary slot through the same queue as the mcumgr handler
+ * over a simulated link.  A response takes rtt ms to reach the client, which
+ * keeps up to window requests in flight.  Window 0 is the behavior of the
+ * image upload command: the response is only sent after the chunk is in
+ * flash.
+ */
+static int shell_upload_bench(const struct shell *shell, size_t argc,
+			      char **argv)
+{
+	static int64_t sentAt[CONFIG_UPLOAD_MGMT_CHUNK_COUNT * 4];
+	uint32_t imageSize = strtoul(argv[1], NULL, 0);
+	uint32_t rtt = strtoul(argv[2], NULL, 0);
+	uint32_t window = strtoul(argv[3], NULL, 0);
+	uint32_t offset = 0;
+	uint32_t request = 0;
+	uint32_t elapsed;
+	int64_t start;
+	int64_t wait;
+	struct chunk *c;
+	int rc = 0;
+
+	if (imageSize == 0 || window > ARRAY_SIZE(sentAt)) {
+		shell_error(shell, "Invalid size or window (max %u)",
+			    (uint32_t)ARRAY_SIZE(sentAt));
+		return -EINVAL;
+	}
+
+	start = k_uptime_get();
+	while (rc == 0 && offset < imageSize) {
+		if (window > 0 && request >= window) {
+			/* Wait for the oldest response */
+			wait = sentAt[request % window] + rtt -
+			       k_uptime_get();
+			k_sleep(K_MSEC(MAX(wait, 0)));
+		}
+
+		/* The writer frees a chunk even when the upload fails */
+		k_mem_slab_alloc(&chunkSlab, (void **)&c, K_FOREVER);
+		c->len = MIN(sizeof(c->data), imageSize - offset);
+		memset(c->data, (uint8_t)request, c->len);
+		if (submit(c, UPLOAD_TARGET_IMAGE, offset, imageSize, NULL) !=
+		    MGMT_ERR_EOK) {
+			rc = -EIO;
+			break;
+		}
+		offset += c->len;
+
+		if (window == 0 || offset == imageSize) {
+			while (atomic_get(&written) < offset &&
+			       atomic_get(&writeError) == 0) {
+				k_sleep(K_MSEC(1));
+			}
+			rc = atomic_get(&writeError);
+		}
+		if (window == 0) {
+			k_sleep(K_MSEC(rtt));
+		} else {
+			sentAt[request % window] = k_uptime_get();
+		}
+		request++;
+	}
+
+	elapsed = MAX((uint32_t)(k_uptime_get() - start), 1);
+	shell_print(shell,
+		    "%d: %u bytes in %u ms (%u kB/s), queue high water %u", rc,
+		    offset, elapsed, offset / elapsed,
+		    (uint32_t)atomic_get(&queueDepth.max));
+	return rc;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+	upload_cmds,
+	SHELL_CMD_ARG(bench, NULL,
+		      "Upload to slot 1 over a simulated link "
+		      "<size> <rtt ms> <window (0 = write before response)>",
+		      shell_upload_bench, 4, 0),
+	SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(upload, &upload_cmds, "Pipelined upload", NULL);
+#endif /* CONFIG_UPLOAD_MGMT_SHELL */
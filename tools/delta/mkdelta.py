@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+"""Create a delta (patch) between two signed app images.
+
+The patch is applied on the device by delta_update.c, which reads the
+running image from the primary slot and writes the new image to the
+secondary slot.  The format is:
+
+    header (96 bytes, little endian)
+        magic            4   b"P1DL"
+        format version   1
+        reserved         3
+        source version  16   APP_VERSION_STRING of the running image
+        source size      4
+        source sha256   32   of the first <source size> bytes of slot 0
+        target size      4
+        target sha256   32
+    records
+        0x01 ADD     u32 source offset, u32 length, then tokens until
+                     <length> bytes are produced.  A token byte with bit 7
+                     set copies ((b & 0x7f) + 1) source bytes unchanged.
+                     Otherwise b (1..127) difference bytes follow; each is
+                     added (mod 256) to the next source byte.
+        0x02 INSERT  u32 length, then <length> bytes of the new image
+        0x00 END
+
+Matching follows bsdiff: a region of the new image is paired with a
+similar region of the old one and only the byte differences are stored.
+Code that moved keeps most bytes and only changes addresses, so the
+differences are mostly zero and encode as runs.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"P1DL"
+FORMAT_VERSION = 1
+HEADER = struct.Struct("<4sB3x16sI32sI32s")
+
+OP_END = 0
+OP_ADD = 1
+OP_INSERT = 2
+
+KEY_SIZE = 8
+MAX_CANDIDATES = 16
+MIN_MATCH = 24
+CHUNK = 32
+# Stop extending a match after this many bytes without improvement
+GIVE_UP = 256
+MAX_LITERAL = 127
+MAX_RUN = 128
+
+
+def build_index(source):
+    index = {}
+    for i in range(len(source) - KEY_SIZE + 1):
+        entries = index.setdefault(source[i:i + KEY_SIZE], [])
+        if len(entries) < MAX_CANDIDATES:
+            entries.append(i)
+    return index
+
+
+def extend(source, target, s, t):
+    """Length and number of equal bytes of the best approximate match.
+
+    The match maximises 2 * equal - length, as in bsdiff.
+    """
+    i = equal = 0
+    best = best_equal = best_score = 0
+    limit = min(len(source) - s, len(target) - t)
+    while i < limit and i - best < GIVE_UP:
+        n = min(CHUNK, limit - i)
+        if source[s + i:s + i + n] == target[t + i:t + i + n]:
+            i += n
+            equal += n
+        else:
+            for _ in range(n):
+                if source[s + i] == target[t + i]:
+                    equal += 1
+                i += 1
+        score = 2 * equal - i
+        if score > best_score:
+            best, best_equal, best_score = i, equal, score
+    return best, best_equal
+
+
+def encode_add(source, target, s, t, length):
+    out = bytearray()
+    diff = bytes((target[t + i] - source[s + i]) & 0xFF
+                 for i in range(length))
+    i = 0
+    while i < length:
+        run = 0
+        while i + run < length and diff[i + run] == 0 and run < MAX_RUN:
+            run += 1
+        if run > 1 or (run == 1 and i + 1 == length):
+            out.append(0x80 | (run - 1))
+            i += run
+            continue
+        start = i
+        while i < length and i - start < MAX_LITERAL:
+            # A single zero between differences is cheaper as a literal
+            if diff[i] == 0 and (i + 1 == length or diff[i + 1] == 0):
+                break
+            i += 1
+        out.append(i - start)
+        out += diff[start:i]
+    return out
+
+
+def make_delta(source, target, version):
+    index = build_index(source)
+    records = bytearray()
+    literal = bytearray()
+    # Offset between the previous match in the source and in the target
+    shift = 0
+    t = 0
+
+    def flush_literal():
+        if literal:
+            records.extend(struct.pack("<BI", OP_INSERT, len(literal)))
+            records.extend(literal)
+            literal.clear()
+
+    while t < len(target):
+        candidates = []
+        if 0 <= t + shift < len(source):
+            candidates.append(t + shift)
+        candidates += index.get(bytes(target[t:t + KEY_SIZE]), [])
+
+        best = (0, 0, 0)
+        for s in candidates:
+            length, equal = extend(source, target, s, t)
+            if equal > best[2]:
+                best = (s, length, equal)
+
+        s, length, equal = best
+        if equal >= MIN_MATCH:
+            flush_literal()
+            records.extend(struct.pack("<BII", OP_ADD, s, length))
+            records.extend(encode_add(source, target, s, t, length))
+            shift = s - t
+            t += length
+        else:
+            literal.append(target[t])
+            t += 1
+
+    flush_literal()
+    records.append(OP_END)
+
+    header = HEADER.pack(MAGIC, FORMAT_VERSION, version.encode(),
+                         len(source), hashlib.sha256(source).digest(),
+                         len(target), hashlib.sha256(target).digest())
+    return header + records
+
+
+def apply_delta(source, patch):
+    """Reference implementation used to check the patch."""
+    (magic, fmt, _, source_size, source_hash, target_size,
+     target_hash) = HEADER.unpack_from(patch)
+    if magic != MAGIC or fmt != FORMAT_VERSION:
+        raise ValueError("not a delta")
+    if hashlib.sha256(source[:source_size]).digest() != source_hash:
+        raise ValueError("source doesn't match")
+
+    out = bytearray()
+    p = HEADER.size
+    while patch[p] != OP_END:
+        op = patch[p]
+        if op == OP_ADD:
+            s, length = struct.unpack_from("<II", patch, p + 1)
+            p += 9
+            end = len(out) + length
+            while len(out) < end:
+                b = patch[p]
+                p += 1
+                if b & 0x80:
+                    n = (b & 0x7F) + 1
+                    out += source[s:s + n]
+                else:
+                    n = b
+                    out += bytes((source[s + i] + patch[p + i]) & 0xFF
+                                 for i in range(n))
+                    p += n
+                s += n
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<I", patch, p + 1)
+            p += 5
+            out += patch[p:p + length]
+            p += length
+        else:
+            raise ValueError("unknown record %d" % op)
+
+    if len(out) != target_size or hashlib.sha256(out).digest() != target_hash:
+        raise ValueError("target doesn't match")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="signed image running on the device")
+    parser.add_argument("target", help="new signed image")
+    parser.add_argument("output", help="patch file")
+    parser.add_argument("--source-version", required=True,
+                        help="APP_VERSION_STRING of the source image")
+    args = parser.parse_args()
+
+    if len(args.source_version.encode()) >= 16:
+        parser.error("version must be shorter than 16 bytes")
+
+    with open(args.source, "rb") as f:
+        source = f.read()
+    with open(args.target, "rb") as f:
+        target = f.read()
+
+    patch = make_delta(source, target, args.source_version)
+    if apply_delta(source, patch) != target:
+        sys.exit("patch check failed")
+
+    with open(args.output, "wb") as f:
+        f.write(patch)
+    print("%s: %d bytes (%.1f%% of %d)" %
+          (args.output, len(patch), 100.0 * len(patch) / len(target),
+           len(target)))
+
+
+if __name__ == "__main__":
+    main()
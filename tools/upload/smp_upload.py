@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""Upload an image with the pipelined mcumgr upload group (upload_mgmt.c).
+
+Several write requests are kept in flight.  Each response carries the next
+offset the device expects; when it differs from what was sent (a lost or
+rejected request), sending continues from that offset.  --window 1 sends
+one request per round trip like the mcumgr CLI, for comparison.
+
+Uses the SMP console transport (CONFIG_MCUMGR_SMP_SHELL).  Requires pyserial
+and cbor2.
+"""
+
+import argparse
+import base64
+import hashlib
+import struct
+import sys
+import time
+
+import cbor2
+import serial
+
+OP_READ = 0
+OP_WRITE = 2
+SMP_HEADER = struct.Struct(">BBHHBB")
+
+CMD_WRITE = 0
+CMD_STATE = 1
+
+TARGETS = {"image": 0, "delta": 1, "modem": 2}
+
+# Every buffer on the device is waiting for flash
+MGMT_ERR_EBUSY = 10
+BUSY_BACKOFF_MIN = 0.02
+BUSY_BACKOFF_MAX = 1.0
+
+FRAME_START = b"\x06\x09"
+FRAME_CONTINUE = b"\x04\x14"
+LINE_SIZE = 124
+
+
+def crc16(data):
+    """CRC-16/XMODEM used by the SMP console transport."""
+    crc = 0
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+class SmpSerial:
+    def __init__(self, port, baud, group, timeout):
+        self.port = serial.Serial(port, baud, timeout=timeout)
+        self.group = group
+        self.seq = 0
+
+    def send(self, op, command, body):
+        payload = cbor2.dumps(body)
+        seq = self.seq
+        self.seq = (self.seq + 1) & 0xFF
+        packet = SMP_HEADER.pack(op, 0, len(payload), self.group, seq,
+                                 command) + payload
+        packet += struct.pack(">H", crc16(packet))
+        encoded = base64.b64encode(struct.pack(">H", len(packet)) + packet)
+        for i in range(0, len(encoded), LINE_SIZE):
+            start = FRAME_START if i == 0 else FRAME_CONTINUE
+            self.port.write(start + encoded[i:i + LINE_SIZE] + b"\n")
+        return seq
+
+    def receive(self):
+        """Next response as (seq, body), or None on timeout."""
+        data = b""
+        while True:
+            line = self.port.readline()
+            if not line:
+                return None
+            line = line.rstrip(b"\r\n")
+            if line.startswith(FRAME_START):
+                data = line[2:]
+            elif line.startswith(FRAME_CONTINUE) and data:
+                data += line[2:]
+            else:
+                # Console output between frames
+                continue
+            try:
+                raw = base64.b64decode(data)
+            except ValueError:
+                continue
+            if len(raw) < 2 or len(raw) - 2 < struct.unpack(">H", raw[:2])[0]:
+                continue
+            packet = raw[2:-2]
+            data = b""
+            if crc16(packet) != struct.unpack(">H", raw[-2:])[0]:
+                continue
+            _, _, _, group, seq, _ = SMP_HEADER.unpack_from(packet)
+            if group != self.group:
+                continue
+            return seq, cbor2.loads(packet[SMP_HEADER.size:])
+
+
+def upload(smp, image, target, chunk, window):
+    sha = hashlib.sha256(image).digest()
+    in_flight = {}
+    offset = 0
+    acked = 0
+    backoff = BUSY_BACKOFF_MIN
+    start = time.monotonic()
+
+    def request(off):
+        body = {"tgt": target, "off": off,
+                "data": image[off:off + chunk]}
+        if off == 0:
+            body["len"] = len(image)
+            body["sha"] = sha
+        end = off + len(body["data"])
+        in_flight[smp.send(OP_WRITE, CMD_WRITE, body)] = end
+        return end
+
+    # The first request starts the upload and is sent on its own
+    offset = request(0)
+    while acked < len(image):
+        while (offset < len(image) and len(in_flight) < window and
+               acked > 0):
+            offset = request(offset)
+
+        response = smp.receive()
+        if response is None:
+            # Lost requests or responses; continue from the last offset
+            # the device reported
+            in_flight.clear()
+            offset = request(acked) if acked > 0 else request(0)
+            continue
+
+        seq, body = response
+        if seq not in in_flight:
+            continue
+        end = in_flight.pop(seq)
+        if body.get("rc", 0) == MGMT_ERR_EBUSY:
+            # Not queued; the requests sent after it are dropped as
+            # out of order
+            time.sleep(backoff)
+            backoff = min(backoff * 2, BUSY_BACKOFF_MAX)
+            in_flight.clear()
+            offset = request(acked) if acked > 0 else request(0)
+            continue
+        if body.get("rc", 0) != 0:
+            sys.exit("device error %d" % body["rc"])
+        backoff = BUSY_BACKOFF_MIN
+        acked = max(acked, body["off"])
+        if body["off"] != end:
+            # The request was dropped and so are the ones sent after it.
+            # A larger offset continues an interrupted upload.
+            in_flight.clear()
+            offset = body["off"]
+        print("\r%d / %d" % (acked, len(image)), end="", flush=True)
+
+    # Wait until the device has written (and checked) the whole image
+    while True:
+        smp.send(OP_READ, CMD_STATE, {})
+        response = smp.receive()
+        if response is None:
+            continue
+        _, body = response
+        if body.get("err", 0) != 0:
+            sys.exit("\nwrite failed (%d)" % body["err"])
+        if body.get("ok"):
+            break
+        time.sleep(0.1)
+
+    elapsed = time.monotonic() - start
+    print("\n%d bytes in %.1f s (%.1f KB/s, window %d)" %
+          (len(image), elapsed, len(image) / elapsed / 1024, window))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("port", help="serial port of the console")
+    parser.add_argument("file", help="image to upload")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--target", choices=TARGETS, default="image")
+    parser.add_argument("--group", type=int, default=65,
+                        help="CONFIG_UPLOAD_MGMT_GROUP_ID")
+    parser.add_argument("--chunk", type=int, default=1024,
+                        help="at most CONFIG_UPLOAD_MGMT_CHUNK_SIZE")
+    parser.add_argument("--window", type=int, default=4,
+                        help="requests in flight (1 = one per round trip)")
+    parser.add_argument("--timeout", type=float, default=5.0)
+    args = parser.parse_args()
+
+    with open(args.file, "rb") as f:
+        image = f.read()
+
+    smp = SmpSerial(args.port, args.baud, args.group, args.timeout)
+    upload(smp, image, TARGETS[args.target], args.chunk,
+           max(args.window, 1))
+
+
+if __name__ == "__main__":
+    main()